@@ -0,0 +1,517 @@
+#include "CPUSimulation.h"
+#include <math.h>
+#include <algorithm>
+
+// Constants used for hashing, they must be the same as the ones in the shaders
+#define HASH_K1 15823u
+#define HASH_K2 9737333u
+
+// How many key ranges/particle chunks are used per thread by the parallel counting sort
+#define SORT_PARTITIONS_PER_THREAD 8
+
+static const Int2 NEIGHBOUR_OFFSETS[9] = {
+    { -1, 1 },
+    { 0, 1 },
+    { 1, 1 },
+    { -1, 0 },
+    { 0, 0 },
+    { 1, 0 },
+    { -1, -1 },
+    { 0, -1 },
+    { 1, -1 }
+};
+
+static Int2 GetCell2D(Float2 position, float radius) {
+    return { (int)floorf(position.x / radius), (int)floorf(position.y / radius) };
+}
+
+static unsigned int HashCell2D(Int2 cell) {
+    return (unsigned int)cell.x * HASH_K1 + (unsigned int)cell.y * HASH_K2;
+}
+
+// Positions outside the dense grid are clamped to the border cells, the same as the shaders
+static Int2 GetGridCell(const GeneralSettings& settings, Float2 position) {
+    int x = (int)floorf((position.x - settings.grid_origin.x) / settings.grid_cell_size);
+    int y = (int)floorf((position.y - settings.grid_origin.y) / settings.grid_cell_size);
+    x = std::min(std::max(x, 0), (int)settings.grid_width - 1);
+    y = std::min(std::max(y, 0), (int)settings.grid_height - 1);
+    return { x, y };
+}
+
+static bool IsGridCellInside(const GeneralSettings& settings, Int2 cell) {
+    return cell.x >= 0 && cell.y >= 0 && cell.x < (int)settings.grid_width && cell.y < (int)settings.grid_height;
+}
+
+static unsigned int GridCellKey(const GeneralSettings& settings, Int2 cell) {
+    return (unsigned int)cell.y * settings.grid_width + (unsigned int)cell.x;
+}
+
+static float SmoothingKernelPoly6(const GeneralSettings& settings, float dst, float radius) {
+    if (dst < radius) {
+        float v = radius * radius - dst * dst;
+        return v * v * v * settings.poly6_scaling_factor;
+    }
+    return 0.0f;
+}
+
+static float SpikyKernelPow3(const GeneralSettings& settings, float dst, float radius) {
+    if (dst < radius) {
+        float v = radius - dst;
+        return v * v * v * settings.spiky_pow3_scaling_factor;
+    }
+    return 0.0f;
+}
+
+static float SpikyKernelPow2(const GeneralSettings& settings, float dst, float radius) {
+    if (dst < radius) {
+        float v = radius - dst;
+        return v * v * settings.spiky_pow2_scaling_factor;
+    }
+    return 0.0f;
+}
+
+static float DerivativeSpikyPow3(const GeneralSettings& settings, float dst, float radius) {
+    if (dst <= radius) {
+        float v = radius - dst;
+        return -v * v * settings.spiky_pow3_derivative_scaling_factor;
+    }
+    return 0.0f;
+}
+
+static float DerivativeSpikyPow2(const GeneralSettings& settings, float dst, float radius) {
+    if (dst <= radius) {
+        float v = radius - dst;
+        return -v * settings.spiky_pow2_derivative_scaling_factor;
+    }
+    return 0.0f;
+}
+
+static float PressureFromDensity(const GeneralSettings& settings, float density) {
+    return (density - settings.target_density) * settings.pressure_multiplier;
+}
+
+static float NearPressureFromDensity(const GeneralSettings& settings, float near_density) {
+    return settings.near_pressure_multiplier * near_density;
+}
+
+static float Length(Float2 value) {
+    return sqrtf(Dot(value, value));
+}
+
+static Float2 NDCToUV(Float2 ndc) {
+    return (ndc + 1.0f) * 0.5f;
+}
+
+static Float2 UVToNDC(Float2 uv) {
+    return uv * 2.0f - 1.0f;
+}
+
+// The same lookup as the one in the calculate_viscosity_update_pos shader, texels outside the map are not colliding
+static bool IsColliding(const CPUCollisionParameters& parameters, Float2 uv) {
+    size_t reduced_width = (parameters.window_width + 7) / 8;
+    float texel_x = floorf(uv.x * (float)reduced_width);
+    float texel_y = floorf(uv.y * (float)parameters.window_height);
+    if (texel_x < 0.0f || texel_y < 0.0f || texel_x >= (float)reduced_width || texel_y >= (float)parameters.window_height) {
+        return false;
+    }
+
+    unsigned char collision_value = parameters.collision_map[(size_t)texel_y * reduced_width + (size_t)texel_x];
+    unsigned int bit_index = (unsigned int)(uv.x * parameters.window_width) & 7;
+    return (collision_value & (1 << bit_index)) != 0;
+}
+
+void CPUSimulation::Initialize(size_t thread_count)
+{
+    thread_pool.Initialize(thread_count);
+}
+
+void CPUSimulation::AppendParticles(size_t count, const Float2* add_positions, const Float2* add_velocities)
+{
+    positions.insert(positions.end(), add_positions, add_positions + count);
+    predicted_positions.insert(predicted_positions.end(), add_positions, add_positions + count);
+    if (add_velocities != nullptr) {
+        velocities.insert(velocities.end(), add_velocities, add_velocities + count);
+    }
+    else {
+        velocities.resize(velocities.size() + count, Float2(0.0f));
+    }
+    densities.resize(densities.size() + count, Float2(0.0f));
+}
+
+void CPUSimulation::SetParticleCount(size_t particle_count)
+{
+    positions.resize(particle_count);
+    predicted_positions.resize(particle_count);
+    velocities.resize(particle_count);
+    densities.resize(particle_count);
+}
+
+void CPUSimulation::SetParticleData(
+    size_t particle_count,
+    const Float2* _positions,
+    const Float2* _predicted_positions,
+    const Float2* _velocities,
+    const Float2* _densities
+)
+{
+    auto assign = [particle_count](std::vector<Float2>& values, const Float2* data) {
+        if (data != nullptr) {
+            values.assign(data, data + particle_count);
+        }
+        else {
+            values.assign(particle_count, Float2(0.0f));
+        }
+    };
+
+    assign(positions, _positions);
+    assign(predicted_positions, _predicted_positions != nullptr ? _predicted_positions : _positions);
+    assign(velocities, _velocities);
+    assign(densities, _densities);
+}
+
+void CPUSimulation::Step(const GeneralSettings& settings, const CPUCollisionParameters& collision_parameters)
+{
+    if (positions.size() == 0) {
+        return;
+    }
+
+    // The same order as the GPU dispatches
+    CalculateExternalForces(settings);
+    UpdateSpatialHash(settings);
+    CalculateDensities(settings);
+    CalculatePressure(settings);
+    CalculateViscosityUpdatePositions(settings, collision_parameters);
+}
+
+void CPUSimulation::Trim(size_t particle_count)
+{
+    if (particle_count < positions.size()) {
+        SetParticleCount(particle_count);
+    }
+}
+
+void CPUSimulation::CalculateExternalForces(const GeneralSettings& settings)
+{
+    thread_pool.ParallelFor(positions.size(), [&](size_t start, size_t end) {
+        const float prediction_factor = 1 / 20.0f;
+        float sqr_input_radius = settings.interaction_input_radius * settings.interaction_input_radius;
+
+        for (size_t index = start; index < end; index++) {
+            Float2 position = positions[index];
+            Float2 velocity = velocities[index];
+
+            // Gravity
+            Float2 acceleration = { 0.0f, settings.gravity };
+
+            // Input interactions modify gravity
+            if (settings.interaction_input_strength != 0.0f) {
+                Float2 input_point_offset = settings.interaction_input_point - position;
+                float sqr_dst = Dot(input_point_offset, input_point_offset);
+                if (sqr_dst < sqr_input_radius) {
+                    float dst = sqrtf(sqr_dst);
+                    float edge_t = dst / settings.interaction_input_radius;
+                    float centre_t = 1.0f - edge_t;
+                    Float2 dir_to_centre = input_point_offset / dst;
+
+                    float gravity_weight = 1.0f - (centre_t * saturate(settings.interaction_input_strength / 10000.0f));
+                    acceleration = acceleration * gravity_weight + dir_to_centre * centre_t * settings.interaction_input_strength;
+                    acceleration -= velocity * centre_t;
+                }
+            }
+
+            velocity -= acceleration * settings.delta_time;
+            velocities[index] = velocity;
+            predicted_positions[index] = position + velocity * prediction_factor;
+        }
+    });
+}
+
+void CPUSimulation::UpdateSpatialHash(const GeneralSettings& settings)
+{
+    size_t particle_count = positions.size();
+    bool dense_grid = settings.neighbour_search_mode == NeighbourSearchMode::DenseGrid;
+    unsigned int table_size = settings.hash_table_size != 0 ? settings.hash_table_size : (unsigned int)particle_count;
+    if (dense_grid) {
+        table_size = settings.grid_width * settings.grid_height;
+    }
+    spatial_indices.resize(particle_count);
+    sorted_spatial_indices.resize(particle_count);
+    spatial_offsets.resize((size_t)table_size + 1);
+
+    thread_pool.ParallelFor(particle_count, [&](size_t start, size_t end) {
+        for (size_t index = start; index < end; index++) {
+            if (dense_grid) {
+                // The cell index is the key, there are no collisions
+                unsigned int key = GridCellKey(settings, GetGridCell(settings, predicted_positions[index]));
+                spatial_indices[index] = { (unsigned int)index, key, key };
+            }
+            else {
+                Int2 cell = GetCell2D(predicted_positions[index], settings.smoothing_radius);
+                unsigned int hash = HashCell2D(cell);
+                spatial_indices[index] = { (unsigned int)index, hash, GetHashTableKey(settings, hash, (unsigned int)particle_count) };
+            }
+        }
+    });
+
+    // Stable parallel counting sort by key. The key space is split into ranges and the particles into
+    // Chunks. Each chunk counts its entries per key range, the entries are scattered into their range
+    // And then each range is sorted on its own. Since it is stable, the order is deterministic
+    size_t partition_count = std::min(thread_pool.GetThreadCount() * SORT_PARTITIONS_PER_THREAD, particle_count);
+    size_t chunk_size = (particle_count + partition_count - 1) / partition_count;
+    auto get_key_range = [=](unsigned int key) {
+        return (size_t)(((unsigned long long)key * partition_count) / table_size);
+    };
+    auto get_key_range_start = [=](size_t range) {
+        return (unsigned int)(((unsigned long long)range * table_size + partition_count - 1) / partition_count);
+    };
+
+    // The counts are laid out as [chunk][range]
+    key_counts.assign(partition_count * partition_count, 0);
+    thread_pool.ParallelFor(partition_count, [&](size_t start, size_t end) {
+        for (size_t chunk = start; chunk < end; chunk++) {
+            unsigned int* chunk_counts = key_counts.data() + chunk * partition_count;
+            size_t chunk_end = std::min((chunk + 1) * chunk_size, particle_count);
+            for (size_t index = chunk * chunk_size; index < chunk_end; index++) {
+                chunk_counts[get_key_range(spatial_indices[index].key)]++;
+            }
+        }
+    });
+
+    // Exclusive scan in range major order, such that each chunk knows where to write its entries
+    std::vector<unsigned int> range_starts(partition_count + 1);
+    unsigned int total = 0;
+    for (size_t range = 0; range < partition_count; range++) {
+        range_starts[range] = total;
+        for (size_t chunk = 0; chunk < partition_count; chunk++) {
+            unsigned int count = key_counts[chunk * partition_count + range];
+            key_counts[chunk * partition_count + range] = total;
+            total += count;
+        }
+    }
+    range_starts[partition_count] = total;
+
+    thread_pool.ParallelFor(partition_count, [&](size_t start, size_t end) {
+        for (size_t chunk = start; chunk < end; chunk++) {
+            unsigned int* chunk_offsets = key_counts.data() + chunk * partition_count;
+            size_t chunk_end = std::min((chunk + 1) * chunk_size, particle_count);
+            for (size_t index = chunk * chunk_size; index < chunk_end; index++) {
+                const SpatialIndex& entry = spatial_indices[index];
+                sorted_spatial_indices[chunk_offsets[get_key_range(entry.key)]++] = entry;
+            }
+        }
+    });
+
+    // Sort each range by the exact key and write the start of each key in that range. The last
+    // Entry is the end of the last key, such that the entries of each key are exactly in [start, next start)
+    spatial_offsets[table_size] = (unsigned int)particle_count;
+    thread_pool.ParallelFor(partition_count, [&](size_t start, size_t end) {
+        std::vector<unsigned int> local_counts;
+        for (size_t range = start; range < end; range++) {
+            unsigned int key_start = get_key_range_start(range);
+            unsigned int key_end = get_key_range_start(range + 1);
+            unsigned int entry_start = range_starts[range];
+            unsigned int entry_end = range_starts[range + 1];
+
+            local_counts.assign(key_end - key_start, 0);
+            for (unsigned int index = entry_start; index < entry_end; index++) {
+                local_counts[sorted_spatial_indices[index].key - key_start]++;
+            }
+
+            unsigned int offset = entry_start;
+            for (unsigned int key = key_start; key < key_end; key++) {
+                unsigned int count = local_counts[key - key_start];
+                spatial_offsets[key] = offset;
+                local_counts[key - key_start] = offset;
+                offset += count;
+            }
+
+            for (unsigned int index = entry_start; index < entry_end; index++) {
+                const SpatialIndex& entry = sorted_spatial_indices[index];
+                spatial_indices[local_counts[entry.key - key_start]++] = entry;
+            }
+        }
+    });
+}
+
+template<typename Functor>
+void CPUSimulation::ForEachNeighbour(const GeneralSettings& settings, Float2 position, Functor&& functor) const
+{
+    float sqr_radius = settings.smoothing_radius * settings.smoothing_radius;
+    auto visit_range = [&](unsigned int key, bool check_hash, unsigned int hash) {
+        // The offsets give the exact range of each key
+        unsigned int range_end = spatial_offsets[key + 1];
+        for (unsigned int current_index = spatial_offsets[key]; current_index < range_end; current_index++) {
+            const SpatialIndex& index_data = spatial_indices[current_index];
+            // Skip if hash does not match
+            if (check_hash && index_data.hash != hash) {
+                continue;
+            }
+
+            unsigned int neighbour_index = index_data.index;
+            Float2 offset_to_neighbour = predicted_positions[neighbour_index] - position;
+            float sqr_dst_to_neighbour = Dot(offset_to_neighbour, offset_to_neighbour);
+            // Skip if not within radius
+            if (sqr_dst_to_neighbour > sqr_radius) {
+                continue;
+            }
+
+            functor(neighbour_index, offset_to_neighbour, sqrtf(sqr_dst_to_neighbour));
+        }
+    };
+
+    if (settings.neighbour_search_mode == NeighbourSearchMode::DenseGrid) {
+        Int2 origin_cell = GetGridCell(settings, position);
+        for (size_t offset_index = 0; offset_index < std::size(NEIGHBOUR_OFFSETS); offset_index++) {
+            Int2 cell = origin_cell + NEIGHBOUR_OFFSETS[offset_index];
+            if (IsGridCellInside(settings, cell)) {
+                visit_range(GridCellKey(settings, cell), false, 0);
+            }
+        }
+    }
+    else {
+        Int2 origin_cell = GetCell2D(position, settings.smoothing_radius);
+        unsigned int particle_count = (unsigned int)positions.size();
+        for (size_t offset_index = 0; offset_index < std::size(NEIGHBOUR_OFFSETS); offset_index++) {
+            unsigned int hash = HashCell2D(origin_cell + NEIGHBOUR_OFFSETS[offset_index]);
+            visit_range(GetHashTableKey(settings, hash, particle_count), true, hash);
+        }
+    }
+}
+
+void CPUSimulation::CalculateDensities(const GeneralSettings& settings)
+{
+    thread_pool.ParallelFor(positions.size(), [&](size_t start, size_t end) {
+        float radius = settings.smoothing_radius;
+        for (size_t index = start; index < end; index++) {
+            float density = 0.0f;
+            float near_density = 0.0f;
+            ForEachNeighbour(settings, predicted_positions[index], [&](unsigned int neighbour_index, Float2 offset, float dst) {
+                density += SpikyKernelPow2(settings, dst, radius);
+                near_density += SpikyKernelPow3(settings, dst, radius);
+            });
+            densities[index] = { density, near_density };
+        }
+    });
+}
+
+void CPUSimulation::CalculatePressure(const GeneralSettings& settings)
+{
+    thread_pool.ParallelFor(positions.size(), [&](size_t start, size_t end) {
+        float radius = settings.smoothing_radius;
+        for (size_t index = start; index < end; index++) {
+            float density = densities[index].x;
+            float pressure = PressureFromDensity(settings, density);
+            float near_pressure = NearPressureFromDensity(settings, densities[index].y);
+            Float2 pressure_force = { 0.0f, 0.0f };
+
+            ForEachNeighbour(settings, predicted_positions[index], [&](unsigned int neighbour_index, Float2 offset_to_neighbour, float dst) {
+                // Skip if looking at self
+                if (neighbour_index == index) {
+                    return;
+                }
+
+                Float2 dir_to_neighbour = dst > 0.0f ? offset_to_neighbour / dst : Float2(0.0f, 1.0f);
+                float neighbour_density = densities[neighbour_index].x;
+                float neighbour_near_density = densities[neighbour_index].y;
+                float neighbour_pressure = PressureFromDensity(settings, neighbour_density);
+                float neighbour_near_pressure = NearPressureFromDensity(settings, neighbour_near_density);
+
+                float shared_pressure = (pressure + neighbour_pressure) * 0.5f;
+                float shared_near_pressure = (near_pressure + neighbour_near_pressure) * 0.5f;
+
+                pressure_force += dir_to_neighbour * DerivativeSpikyPow2(settings, dst, radius) * shared_pressure / neighbour_density;
+                pressure_force += dir_to_neighbour * DerivativeSpikyPow3(settings, dst, radius) * shared_near_pressure / neighbour_near_density;
+            });
+
+            Float2 acceleration = pressure_force / density;
+            velocities[index] -= acceleration * settings.delta_time;
+        }
+    });
+}
+
+void CPUSimulation::CalculateViscosityUpdatePositions(const GeneralSettings& settings, const CPUCollisionParameters& collision_parameters)
+{
+    previous_velocities = velocities;
+
+    thread_pool.ParallelFor(positions.size(), [&](size_t start, size_t end) {
+        float radius = settings.smoothing_radius;
+        float aspect_ratio = (float)collision_parameters.window_width / (float)collision_parameters.window_height;
+        Float2 obstacle_size = settings.obstacle_size;
+        Float2 obstacle_centre = settings.obstacle_centre;
+
+        for (size_t index = start; index < end; index++) {
+            // Viscosity
+            Float2 current_velocity = previous_velocities[index];
+            Float2 viscosity_force = { 0.0f, 0.0f };
+            ForEachNeighbour(settings, predicted_positions[index], [&](unsigned int neighbour_index, Float2 offset, float dst) {
+                // Skip if looking at self
+                if (neighbour_index == index) {
+                    return;
+                }
+                viscosity_force += (previous_velocities[neighbour_index] - current_velocity) * SmoothingKernelPoly6(settings, dst, radius);
+            });
+            Float2 vel = current_velocity - viscosity_force * settings.viscosity_strength * settings.delta_time;
+
+            // Update the position and handle the collisions
+            Float2 pos = positions[index] + vel * settings.delta_time;
+            Float2 original_position = pos - vel * settings.delta_time;
+            Float2 original_ndc_position = original_position / POSITION_FACTOR;
+            original_ndc_position.x /= aspect_ratio;
+            Float2 ndc_position = pos / POSITION_FACTOR;
+            ndc_position.x /= aspect_ratio;
+
+            // Keep particle inside bounds
+            if (ndc_position.x < -1.0f) {
+                pos.x = -0.9999f * POSITION_FACTOR * aspect_ratio;
+                vel.x *= -1.0f * settings.collision_damping;
+            }
+            if (ndc_position.x > 1.0f) {
+                pos.x = 0.9999f * POSITION_FACTOR * aspect_ratio;
+                vel.x *= -1.0f * settings.collision_damping;
+            }
+            if (ndc_position.y < -1.0f) {
+                pos.y = -0.9999f * POSITION_FACTOR;
+                vel.y *= -1.0f * settings.collision_damping;
+            }
+            if (ndc_position.y > 1.0f) {
+                pos.y = 0.9999f * POSITION_FACTOR;
+                vel.y *= -1.0f * settings.collision_damping;
+            }
+
+            // Collide particle against the test obstacle
+            Float2 particle_obstacle_distance = obstacle_centre - pos;
+            Float2 absolute_distance = Abs(particle_obstacle_distance);
+            if (absolute_distance.x < obstacle_size.x && absolute_distance.y < obstacle_size.y) {
+                Float2 absolute_percentages = absolute_distance / obstacle_size;
+                if (absolute_percentages.x > absolute_percentages.y) {
+                    pos.x = -1.001f * obstacle_size.x * sign(particle_obstacle_distance.x) + obstacle_centre.x;
+                    vel.x *= -1.0f * settings.collision_damping;
+                    vel.y *= settings.collision_damping;
+                }
+                else {
+                    pos.y = -1.001f * obstacle_size.y * sign(particle_obstacle_distance.y) + obstacle_centre.y;
+                    vel.y *= -1.0f * settings.collision_damping;
+                    vel.x *= settings.collision_damping;
+                }
+            }
+
+            // The painted obstacles. The compute shader samples only the start position
+            // (its uv step is never applied), this mirrors that such that both backends agree
+            if (collision_parameters.collision_map != nullptr) {
+                Float2 original_uv_position = NDCToUV(original_ndc_position);
+                if (IsColliding(collision_parameters, original_uv_position)) {
+                    Float2 ndc = UVToNDC(original_uv_position);
+                    float velocity_length = Length(vel);
+                    Float2 velocity_direction = velocity_length > 0.0f ? vel / velocity_length : Float2(0.0f, 0.0f);
+                    // Push back the particle in the reverse of the velocity such that
+                    // It will get out of the collision
+                    pos = ndc * POSITION_FACTOR * Float2(aspect_ratio, 1.0f) - velocity_direction * 0.001f * POSITION_FACTOR;
+                    vel = vel * -settings.collision_damping;
+                }
+            }
+
+            positions[index] = pos * Float2(collision_parameters.aspect_ratio_change, 1.0f);
+            velocities[index] = vel;
+        }
+    });
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <vector>
+#include "ThreadPool.h"
+#include "../GPU/GeneralSettings.h"
+
+// The window information needed by the collision stage
+struct CPUCollisionParameters {
+    size_t window_width;
+    size_t window_height;
+    float aspect_ratio_change;
+    // The bitmap with a bit for each pixel, the same as the one uploaded to the GPU
+    const unsigned char* collision_map;
+};
+
+// Runs the same stages as the compute shaders (external forces, spatial hashing,
+// Density, pressure, viscosity and collisions), with the particle range split across all cores
+class CPUSimulation {
+public:
+    // If the thread count is 0, it will use all the cores
+    void Initialize(size_t thread_count = 0);
+
+    // Adds new particles at the end. The velocities can be nullptr, in which case they are 0.0f
+    void AppendParticles(size_t count, const Float2* positions, const Float2* velocities);
+
+    inline size_t GetParticleCount() const {
+        return positions.size();
+    }
+
+    inline const Float2* GetPositions() const {
+        return positions.data();
+    }
+
+    inline const Float2* GetPredictedPositions() const {
+        return predicted_positions.data();
+    }
+
+    inline const Float2* GetVelocities() const {
+        return velocities.data();
+    }
+
+    inline const Float2* GetDensities() const {
+        return densities.data();
+    }
+
+    inline size_t GetThreadCount() const {
+        return thread_pool.GetThreadCount();
+    }
+
+    // Changes the particle count without preserving the contents
+    void SetParticleCount(size_t particle_count);
+
+    // Any of the pointers can be nullptr. Predicted positions default to the positions,
+    // The rest default to 0.0f
+    void SetParticleData(
+        size_t particle_count,
+        const Float2* positions,
+        const Float2* predicted_positions,
+        const Float2* velocities,
+        const Float2* densities
+    );
+
+    // Executes one simulation step. The settings need to have the delta time and the
+    // Kernel scaling factors already set
+    void Step(const GeneralSettings& settings, const CPUCollisionParameters& collision_parameters);
+
+    // Trims the particle count, keeping the first entries
+    void Trim(size_t particle_count);
+
+private:
+    struct SpatialIndex {
+        unsigned int index;
+        unsigned int hash;
+        unsigned int key;
+    };
+
+    void CalculateExternalForces(const GeneralSettings& settings);
+
+    void UpdateSpatialHash(const GeneralSettings& settings);
+
+    void CalculateDensities(const GeneralSettings& settings);
+
+    void CalculatePressure(const GeneralSettings& settings);
+
+    void CalculateViscosityUpdatePositions(const GeneralSettings& settings, const CPUCollisionParameters& collision_parameters);
+
+    // Calls the functor for each neighbour that is inside the smoothing radius, including the particle itself
+    template<typename Functor>
+    void ForEachNeighbour(const GeneralSettings& settings, Float2 position, Functor&& functor) const;
+
+    std::vector<Float2> positions;
+    std::vector<Float2> predicted_positions;
+    std::vector<Float2> velocities;
+    std::vector<Float2> densities;
+    // The velocities at the start of the viscosity pass, such that each particle
+    // Sees the same neighbour velocities irrespective of the thread scheduling
+    std::vector<Float2> previous_velocities;
+
+    std::vector<SpatialIndex> spatial_indices;
+    std::vector<SpatialIndex> sorted_spatial_indices;
+    // The start of the entries of each key, with an additional entry for the end of the last key
+    std::vector<unsigned int> spatial_offsets;
+    std::vector<unsigned int> key_counts;
+
+    ThreadPool thread_pool;
+};
@@ -0,0 +1,104 @@
+#include "ThreadPool.h"
+#include "../GPU/Trace.h"
+#include <algorithm>
+
+// How many batches each thread receives on average. More batches give a better
+// Load balance when some regions of the domain are denser than others
+#define BATCHES_PER_THREAD 8
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    work_condition.notify_all();
+    for (size_t index = 0; index < workers.size(); index++) {
+        workers[index].join();
+    }
+}
+
+void ThreadPool::Initialize(size_t thread_count)
+{
+    if (thread_count == 0) {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    workers.reserve(thread_count - 1);
+    for (size_t index = 0; index < thread_count - 1; index++) {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t start, size_t end)>& functor)
+{
+    if (count == 0) {
+        return;
+    }
+
+    size_t batch_count = GetThreadCount() * BATCHES_PER_THREAD;
+    size_t batch_size = std::max((count + batch_count - 1) / batch_count, (size_t)1);
+    // For small ranges it is not worth waking up the workers
+    if (workers.size() == 0 || count <= batch_size) {
+        functor(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        current_functor = &functor;
+        current_count = count;
+        current_batch_size = batch_size;
+        next_batch.store(0, std::memory_order_relaxed);
+        active_workers = workers.size();
+        generation++;
+    }
+    work_condition.notify_all();
+
+    RunBatches();
+
+    // Wait for the workers to finish their last batches
+    std::unique_lock<std::mutex> lock(mutex);
+    finish_condition.wait(lock, [this]() { return active_workers == 0; });
+    current_functor = nullptr;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    Trace::SetThreadName("CPU worker");
+    size_t last_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_condition.wait(lock, [&]() { return stop || generation != last_generation; });
+            if (stop) {
+                return;
+            }
+            last_generation = generation;
+        }
+
+        {
+            TraceScope trace_scope("Batches");
+            RunBatches();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active_workers--;
+        }
+        finish_condition.notify_one();
+    }
+}
+
+void ThreadPool::RunBatches()
+{
+    while (true) {
+        size_t batch_index = next_batch.fetch_add(1, std::memory_order_relaxed);
+        size_t start = batch_index * current_batch_size;
+        if (start >= current_count) {
+            return;
+        }
+        size_t end = std::min(start + current_batch_size, current_count);
+        (*current_functor)(start, end);
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Persistent worker threads that execute parallel for loops. The calling thread
+// Participates as well, such that a pool with N threads uses N - 1 workers
+class ThreadPool {
+public:
+    ThreadPool() = default;
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator = (const ThreadPool& other) = delete;
+    ~ThreadPool();
+
+    // If the thread count is 0, it will use the hardware concurrency
+    void Initialize(size_t thread_count = 0);
+
+    inline size_t GetThreadCount() const {
+        return workers.size() + 1;
+    }
+
+    // Splits the [0, count) range into batches and calls the functor with [start, end) ranges
+    // Until all batches are done. It returns once the entire range has been processed
+    void ParallelFor(size_t count, const std::function<void(size_t start, size_t end)>& functor);
+
+private:
+    void WorkerLoop();
+
+    void RunBatches();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_condition;
+    std::condition_variable finish_condition;
+
+    // The data of the current parallel for
+    const std::function<void(size_t, size_t)>* current_functor = nullptr;
+    size_t current_count = 0;
+    size_t current_batch_size = 0;
+    std::atomic<size_t> next_batch{ 0 };
+    size_t generation = 0;
+    size_t active_workers = 0;
+    bool stop = false;
+};
@@ -1,5 +1,6 @@
 #include "Buffers.h"
 #include "glad.h"
+#include "GPUUploadRing.h"
 #include <string.h>
 
 StructuredBuffer::StructuredBuffer(size_t element_byte_size, size_t element_count)
@@ -16,25 +17,90 @@ StructuredBuffer::StructuredBuffer(size_t element_byte_size, size_t element_coun
     glBufferData(GL_SHADER_STORAGE_BUFFER, element_byte_size * element_count, data, GL_DYNAMIC_DRAW);
 }
 
-void StructuredBuffer::Bind(unsigned int index) const
+void StructuredBuffer::Bind(unsigned int index, GPUAccess access) const
 {
+    GPUBarriers::SetStorageBinding(index, id, access);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, id);
 }
 
+void StructuredBuffer::BindDispatchArguments() const
+{
+    GPUBarriers::SetDispatchArgumentsBinding(id);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, id);
+}
+
+void StructuredBuffer::ClearData() const
+{
+    GPUBarriers::PrepareBufferOperation(id);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, id);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+}
+
+void StructuredBuffer::CopyData(const StructuredBuffer& source, size_t byte_size) const
+{
+    GPUBarriers::PrepareBufferOperation(source.id);
+    GPUBarriers::PrepareBufferOperation(id);
+    glBindBuffer(GL_COPY_READ_BUFFER, source.id);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, byte_size);
+}
+
 void StructuredBuffer::RetrieveData(size_t element_byte_size, size_t element_count, void* buffer) const
 {
+    GPUBarriers::PrepareBufferOperation(id);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, id);
     glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, element_byte_size * element_count, buffer);
 }
 
+void StructuredBuffer::Release()
+{
+    GPUBarriers::ForgetBuffer(id);
+    glDeleteBuffers(1, &id);
+    id = 0;
+}
+
 void StructuredBuffer::SetNewDataSize(size_t element_byte_size, size_t element_count) const
 {
+    // The storage is replaced, the writes to the previous one don't need to be waited for
+    GPUBarriers::ForgetBuffer(id);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, id);
     glBufferData(GL_SHADER_STORAGE_BUFFER, element_byte_size * element_count, nullptr, GL_DYNAMIC_DRAW);
 }
 
 void StructuredBuffer::SetNewData(size_t element_byte_size, size_t element_count, const void* data) const
 {
+    GPUBarriers::ForgetBuffer(id);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, id);
     glBufferData(GL_SHADER_STORAGE_BUFFER, element_byte_size * element_count, data, GL_DYNAMIC_DRAW);
 }
+
+void StructuredBuffer::UpdateData(size_t element_byte_size, size_t element_count, const void* data, size_t element_offset) const
+{
+    // The small uploads go through the upload ring, such that they don't wait for the GPU to finish
+    // With the buffer, nor make the driver copy the data
+    if (GPUUploadRing::UploadToBuffer(id, element_byte_size * element_offset, data, element_byte_size * element_count)) {
+        return;
+    }
+    GPUBarriers::PrepareBufferOperation(id);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, id);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, element_byte_size * element_offset, element_byte_size * element_count, data);
+}
+
+void StructuredBuffer::SetNewReadbackStorage(size_t byte_size) const
+{
+    GPUBarriers::ForgetBuffer(id);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    glBufferData(GL_COPY_WRITE_BUFFER, byte_size, nullptr, GL_STREAM_READ);
+}
+
+const void* StructuredBuffer::MapForReading(size_t byte_size) const
+{
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    return glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, byte_size, GL_MAP_READ_BIT);
+}
+
+void StructuredBuffer::Unmap() const
+{
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+}
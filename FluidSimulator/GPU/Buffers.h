@@ -1,4 +1,5 @@
 #pragma once
+#include "GPUBarriers.h"
 
 class StructuredBuffer {
 public:
@@ -6,15 +7,39 @@ public:
     StructuredBuffer(size_t element_byte_size, size_t element_count);
     StructuredBuffer(size_t element_byte_size, size_t element_count, const void* data);
 
-    void Bind(unsigned int index) const;
+    // The access can restrict the one of the shader, for the dispatches that don't read or write the buffer
+    void Bind(unsigned int index, GPUAccess access = GPUAccess::ReadWrite) const;
+
+    // The indirect dispatches read their group counts from this buffer
+    void BindDispatchArguments() const;
+
+    // Sets all the bytes of the buffer to 0
+    void ClearData() const;
+
+    // Copies the first bytes of the source buffer into this buffer, entirely on the GPU
+    void CopyData(const StructuredBuffer& source, size_t byte_size) const;
 
     // Retrieves data from this buffer from GPU to CPU
     void RetrieveData(size_t element_byte_size, size_t element_count, void* buffer) const;
 
+    // Deletes the GPU buffer
+    void Release();
+
     void SetNewDataSize(size_t element_byte_size, size_t element_count) const;
 
     void SetNewData(size_t element_byte_size, size_t element_count, const void* data) const;
 
+    // Overwrites a part of the existing storage, without reallocating it
+    void UpdateData(size_t element_byte_size, size_t element_count, const void* data, size_t element_offset = 0) const;
+
+    // Storage that is written by the GPU copies and read by the CPU, for the readbacks
+    void SetNewReadbackStorage(size_t byte_size) const;
+
+    // The writes to the buffer must have finished, otherwise the map waits for them
+    const void* MapForReading(size_t byte_size) const;
+
+    void Unmap() const;
+
 private:
     unsigned int id;
 };
@@ -1,54 +1,30 @@
 #include "ComputeShader.h"
 #include "glad.h"
-#include <fstream>
-#include <iostream>
-
-#define MAX_SHADER_SIZE 1024 * 1024
-
-static void CheckCompileErrors(unsigned int id, bool is_program_type)
-{
-    int success;
-    char info_log[1024];
-    if (!is_program_type)
-    {
-        glGetShaderiv(id, GL_COMPILE_STATUS, &success);
-        if (!success)
-        {
-            glGetShaderInfoLog(id, sizeof(info_log), NULL, info_log);
-            std::cout << "Shader compilation error\n" << info_log << "\n-------------------------------------------------------\n";
-            abort();
-        }
-    }
-    else
-    {
-        glGetProgramiv(id, GL_LINK_STATUS, &success);
-        if (!success)
-        {
-            glGetProgramInfoLog(id, sizeof(info_log), NULL, info_log);
-            std::cout << "Program link error\n" << info_log << "\n -------------------------------------------------------\n";
-            abort();
-        }
-    }
-}
-
-ComputeShader::ComputeShader(const char* path, unsigned int _group_size_x, unsigned int _group_size_y, unsigned int _group_size_z) {
-    char* file_allocation = (char*)malloc(sizeof(char) * MAX_SHADER_SIZE);
-    std::ifstream file_stream(path);
-    file_stream.read(file_allocation, MAX_SHADER_SIZE);
-
-    size_t read_count = file_stream.gcount();
-    if (read_count != -1) {
-        unsigned int shader_id = glCreateShader(GL_COMPUTE_SHADER);
-        int shader_size = read_count;
-        glShaderSource(shader_id, 1, &file_allocation, &shader_size);
-        glCompileShader(shader_id);
-        CheckCompileErrors(shader_id, false);
-
-        program_id = glCreateProgram();
-        glAttachShader(program_id, shader_id);
-        glLinkProgram(program_id);
-        CheckCompileErrors(program_id, true);
-        glDeleteShader(shader_id);
+#include <stdlib.h>
+#include <math.h>
+#include <tuple>
+
+ComputeShader::ComputeShader(
+    const char* path,
+    unsigned int _group_size_x,
+    unsigned int _group_size_y,
+    unsigned int _group_size_z,
+    const std::vector<ShaderDefine>& defines
+) {
+    std::vector<ShaderDefine> shader_defines = {
+        { "LOCAL_SIZE_X", std::to_string(_group_size_x) },
+        { "LOCAL_SIZE_Y", std::to_string(_group_size_y) },
+        { "LOCAL_SIZE_Z", std::to_string(_group_size_z) }
+    };
+    shader_defines.insert(shader_defines.end(), defines.begin(), defines.end());
+
+    ShaderStage stage;
+    stage.type = GL_COMPUTE_SHADER;
+    if (PreprocessShader(path, shader_defines, stage.source)) {
+        // The blocks of the branches that were compiled out are removed by the resolve, once it is linked
+        ParseStorageBindings(stage.source.text.c_str(), stage.source.text.size(), storage_bindings);
+        build = ShaderCache::BeginProgram({ stage });
+        program_id = build->program_id;
     }
     else {
         abort();
@@ -60,13 +36,20 @@ ComputeShader::ComputeShader(const char* path, unsigned int _group_size_x, unsig
 
 void ComputeShader::BindUniformBlock(size_t index, unsigned int bind_index)
 {
-    if (uniform_blocks[index].dirty) {
-        glBindBuffer(GL_UNIFORM_BUFFER, uniform_blocks[index].ID);
-        glBufferData(GL_UNIFORM_BUFFER, uniform_blocks[index].byte_size, uniform_blocks[index].embedded_data, GL_DYNAMIC_DRAW);
-        //glMemoryBarrier(GL_UNIFORM_BARRIER_BIT);
-        uniform_blocks[index].dirty = false;
+    UniformBlock& uniform_block = uniform_blocks[index];
+    // The ring region of a block that didn't change for a couple of frames is reused, in which case
+    // The same data is written again
+    if (uniform_block.dirty || !GPUUploadRing::IsValid(uniform_block.range)) {
+        GPUUploadRing::Write(uniform_block.embedded_data, uniform_block.byte_size, GPUUploadRing::GetUniformAlignment(), uniform_block.range);
+        uniform_block.dirty = false;
     }
-    glBindBufferBase(GL_UNIFORM_BUFFER, bind_index != -1 ? bind_index : index, uniform_blocks[index].ID);
+    glBindBufferRange(
+        GL_UNIFORM_BUFFER,
+        bind_index != -1 ? bind_index : index,
+        uniform_block.range.buffer,
+        uniform_block.range.offset,
+        uniform_block.byte_size
+    );
 }
 
 void ComputeShader::BindAllUniformBlocks()
@@ -78,12 +61,24 @@ void ComputeShader::BindAllUniformBlocks()
 
 void ComputeShader::Bind(bool bind_uniform_blocks)
 {
+    WaitForCompile();
     glUseProgram(program_id);
     if (bind_uniform_blocks) {
         BindAllUniformBlocks();
     }
 }
 
+void ComputeShader::WaitForCompile()
+{
+    if (build != nullptr) {
+        if (!ShaderCache::FinishProgram(*build)) {
+            abort();
+        }
+        ResolveStorageBindings(program_id, storage_bindings);
+        build.reset();
+    }
+}
+
 void ComputeShader::BindAndDispatch(unsigned int dimension_x, unsigned int dimension_y, unsigned int dimension_z, bool bind_uniform_blocks) {
     Bind(bind_uniform_blocks);
     Dispatch(dimension_x, dimension_y, dimension_z);
@@ -93,9 +88,14 @@ void ComputeShader::Dispatch(unsigned int dimension_x, unsigned int dimension_y,
     int group_count_x = ceilf(dimension_x / (float)group_size_x);
     int group_count_y = ceilf(dimension_y / (float)group_size_y);
     int group_count_z = ceilf(dimension_z / (float)group_size_z);
+    // Only the barriers for the previous commands that this one depends on are issued
+    GPUBarriers::PrepareCommand(storage_bindings);
     glDispatchCompute(group_count_x, group_count_y, group_count_z);
-    // This will ensure that the compute shader has finished before other commands are issued
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+}
+
+void ComputeShader::DispatchIndirect(size_t byte_offset) const {
+    GPUBarriers::PrepareIndirectDispatch(storage_bindings);
+    glDispatchComputeIndirect((GLintptr)byte_offset);
 }
 
 void ComputeShader::CreateUniformBlock(const char* name, size_t byte_size)
@@ -105,14 +105,11 @@ void ComputeShader::CreateUniformBlock(const char* name, size_t byte_size)
         abort();
     }
     uniform_block.name = name;
-    uniform_block.dirty = false;
+    // The data is written into the upload ring when the block is first bound
+    uniform_block.dirty = true;
     uniform_block.byte_size = byte_size;
+    uniform_block.range = { 0, 0, 0 };
     uniform_blocks.push_back(std::move(uniform_block));
-    size_t last_index = uniform_blocks.size() - 1;
-
-    glGenBuffers(1, &uniform_blocks[last_index].ID);
-    glBindBuffer(GL_UNIFORM_BUFFER, uniform_blocks[last_index].ID);
-    glBufferData(GL_UNIFORM_BUFFER, byte_size, uniform_blocks[last_index].embedded_data, GL_DYNAMIC_DRAW);
 }
 
 size_t ComputeShader::GetUniformBlockIndex(const char* name) const
@@ -165,3 +162,23 @@ void ComputeShader::SetFloat(const char* name, float value) const
 void ComputeShader::SetTexture(const char* name, unsigned int slot) const {
     glUniform1i(glGetUniformLocation(program_id, name), slot);
 }
+
+ComputeShader* ComputeShaderVariants::Get(
+    const char* path,
+    unsigned int group_size_x,
+    unsigned int group_size_y,
+    unsigned int group_size_z,
+    const std::vector<ShaderDefine>& defines
+) {
+    std::string key = std::string(path) + "|" + std::to_string(group_size_x) + "," + std::to_string(group_size_y)
+        + "," + std::to_string(group_size_z) + "|" + GetShaderDefinesKey(defines);
+    auto iterator = variants.find(key);
+    if (iterator == variants.end()) {
+        iterator = variants.emplace(
+            std::piecewise_construct,
+            std::forward_as_tuple(key),
+            std::forward_as_tuple(path, group_size_x, group_size_y, group_size_z, defines)
+        ).first;
+    }
+    return &iterator->second;
+}
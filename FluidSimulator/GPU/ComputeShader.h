@@ -1,11 +1,17 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include "GPUBarriers.h"
+#include "GPUUploadRing.h"
+#include "ShaderPreprocessor.h"
+#include "ShaderCache.h"
 
 struct UniformBlock {
     std::string name;
     size_t embedded_data[128];
-    unsigned int ID;
+    // Where the data was last written in the upload ring
+    GPUUploadRange range;
     unsigned int attribute_location;
     unsigned int byte_size;
     bool dirty;
@@ -14,7 +20,15 @@ struct UniformBlock {
 class ComputeShader {
 public:
     ComputeShader() : program_id(-1) {}
-    ComputeShader(const char* path, unsigned int group_size_x, unsigned int group_size_y, unsigned int group_size_z);
+    // The group size is given to the shader as LOCAL_SIZE_X, LOCAL_SIZE_Y and LOCAL_SIZE_Z, before the defines.
+    // The compile is only started, it is waited for when the shader is first bound
+    ComputeShader(
+        const char* path,
+        unsigned int group_size_x,
+        unsigned int group_size_y,
+        unsigned int group_size_z,
+        const std::vector<ShaderDefine>& defines = {}
+    );
 
     // If the bind index is left at -1, it will assume that it will be bound at the same index as in the array
     void BindUniformBlock(size_t index, unsigned int bind_index = -1);
@@ -23,10 +37,16 @@ public:
 
     void Bind(bool bind_uniform_blocks = true);
 
+    // Waits for the compile of the program, it aborts if it failed
+    void WaitForCompile();
+
     void BindAndDispatch(unsigned int dimension_x, unsigned int dimension_y, unsigned int dimension_z, bool bind_uniform_blocks = true);
 
     void Dispatch(unsigned int dimension_x, unsigned int dimension_y, unsigned int dimension_z) const;
 
+    // The group counts are read on the GPU from the bound dispatch arguments buffer, at this byte offset
+    void DispatchIndirect(size_t byte_offset) const;
+
     void CreateUniformBlock(const char* name, size_t byte_size);
 
     size_t GetUniformBlockIndex(const char* name) const;
@@ -56,8 +76,31 @@ public:
 
 private:
     std::vector<UniformBlock> uniform_blocks;
+    // The storage blocks that the program uses, with the access of their qualifiers
+    std::vector<GPUStorageBinding> storage_bindings;
+    // While the program is compiled
+    std::shared_ptr<ShaderProgramBuild> build;
     unsigned int program_id;
     unsigned int group_size_x;
     unsigned int group_size_y;
     unsigned int group_size_z;
 };
+
+// Compiles each combination of a shader, its group size and its defines once, the first time it is needed
+class ComputeShaderVariants {
+public:
+    ComputeShader* Get(
+        const char* path,
+        unsigned int group_size_x,
+        unsigned int group_size_y,
+        unsigned int group_size_z,
+        const std::vector<ShaderDefine>& defines
+    );
+
+    inline size_t GetCount() const {
+        return variants.size();
+    }
+
+private:
+    std::unordered_map<std::string, ComputeShader> variants;
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include <stddef.h>
 
 enum class DataType {
     Float,
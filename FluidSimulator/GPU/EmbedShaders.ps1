@@ -0,0 +1,29 @@
+# Writes the shader files of a directory as the string table that EmbeddedShaders.cpp includes. It runs
+# Before each build of the projects, and the output is written only when a shader changed, such that
+# It doesn't cause a rebuild each time
+param(
+    [Parameter(Mandatory = $true)][string]$ShaderDirectory,
+    [Parameter(Mandatory = $true)][string]$OutputFile
+)
+
+$extensions = @(".comp", ".vert", ".frag", ".glsl")
+$builder = New-Object System.Text.StringBuilder
+[void]$builder.AppendLine("// Generated by EmbedShaders.ps1 from the files in GPU\Shaders, don't edit it")
+[void]$builder.AppendLine("static const EmbeddedShader EMBEDDED_SHADER_FILES[] = {")
+$files = Get-ChildItem -Path $ShaderDirectory -File | Where-Object { $extensions -contains $_.Extension } | Sort-Object Name
+foreach ($file in $files) {
+    [void]$builder.AppendLine("    { `"$($file.Name)`", `"`"")
+    # A literal for each line, MSVC limits the size of a single string literal
+    foreach ($line in [System.IO.File]::ReadAllLines($file.FullName)) {
+        $escaped = $line.Replace('\', '\\').Replace('"', '\"')
+        [void]$builder.AppendLine("        `"$escaped\n`"")
+    }
+    [void]$builder.AppendLine("    },")
+}
+[void]$builder.AppendLine("    { nullptr, nullptr }")
+[void]$builder.AppendLine("};")
+
+$text = $builder.ToString()
+if (!(Test-Path $OutputFile) -or [System.IO.File]::ReadAllText($OutputFile) -cne $text) {
+    [System.IO.File]::WriteAllText($OutputFile, $text)
+}
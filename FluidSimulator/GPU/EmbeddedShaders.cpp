@@ -0,0 +1,43 @@
+#include "EmbeddedShaders.h"
+#include <string.h>
+
+struct EmbeddedShader {
+    const char* name;
+    const char* text;
+};
+
+#ifdef USE_EMBEDDED_SHADERS
+// Generated before each build by EmbedShaders.ps1, from the files of the Shaders directory
+#include "EmbeddedShaders.inl"
+#else
+// The shaders are read from SHADER_BASE_LOCATION
+static const EmbeddedShader EMBEDDED_SHADER_FILES[] = {
+    { nullptr, nullptr }
+};
+#endif
+
+const char* GetEmbeddedShader(const char* path)
+{
+    const char* name = path;
+    for (const char* character = path; *character != '\0'; character++) {
+        if (*character == '/' || *character == '\\') {
+            name = character + 1;
+        }
+    }
+
+    for (size_t index = 0; EMBEDDED_SHADER_FILES[index].name != nullptr; index++) {
+        if (strcmp(EMBEDDED_SHADER_FILES[index].name, name) == 0) {
+            return EMBEDDED_SHADER_FILES[index].text;
+        }
+    }
+    return nullptr;
+}
+
+size_t GetEmbeddedShaderCount()
+{
+    size_t count = 0;
+    while (EMBEDDED_SHADER_FILES[count].name != nullptr) {
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include <stddef.h>
+
+// Returns the text of the embedded shader with the file name of the path, the directory is ignored.
+// Returns nullptr if the shaders were not embedded into this build, or the file is not one of them
+const char* GetEmbeddedShader(const char* path);
+
+size_t GetEmbeddedShaderCount();
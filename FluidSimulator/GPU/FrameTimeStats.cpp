@@ -0,0 +1,114 @@
+#include "FrameTimeStats.h"
+#include <algorithm>
+
+static float GetPercentile(const std::vector<float>& sorted_values, float percentile) {
+    size_t index = (size_t)(percentile * (float)(sorted_values.size() - 1) + 0.5f);
+    return sorted_values[std::min(index, sorted_values.size() - 1)];
+}
+
+FrameTimeSeries::FrameTimeSeries()
+{
+    history.resize(FRAME_TIME_HISTORY_SIZE);
+    history_count = 0;
+    history_next = 0;
+    total_count = 0;
+    run_max = 0.0f;
+}
+
+void FrameTimeSeries::Add(float milliseconds)
+{
+    history[history_next] = milliseconds;
+    history_next = (history_next + 1) % FRAME_TIME_HISTORY_SIZE;
+    history_count = std::min(history_count + 1, (size_t)FRAME_TIME_HISTORY_SIZE);
+    total_count++;
+    run_max = std::max(run_max, milliseconds);
+}
+
+FrameTimeStatistics FrameTimeSeries::GetStatistics() const
+{
+    FrameTimeStatistics statistics = {};
+    statistics.run_max = run_max;
+    statistics.total_count = total_count;
+    statistics.sample_count = history_count;
+    if (history_count == 0) {
+        return statistics;
+    }
+
+    std::vector<float> sorted_values = GetHistory();
+    std::sort(sorted_values.begin(), sorted_values.end());
+    float sum = 0.0f;
+    for (size_t index = 0; index < sorted_values.size(); index++) {
+        sum += sorted_values[index];
+    }
+    statistics.average = sum / (float)sorted_values.size();
+    statistics.p50 = GetPercentile(sorted_values, 0.50f);
+    statistics.p95 = GetPercentile(sorted_values, 0.95f);
+    statistics.p99 = GetPercentile(sorted_values, 0.99f);
+    statistics.max = sorted_values.back();
+    return statistics;
+}
+
+std::vector<float> FrameTimeSeries::GetHistory() const
+{
+    std::vector<float> values(history_count);
+    // Before the buffer is full, the oldest time is at the start
+    size_t oldest_index = (history_next + FRAME_TIME_HISTORY_SIZE - history_count) % FRAME_TIME_HISTORY_SIZE;
+    for (size_t index = 0; index < history_count; index++) {
+        values[index] = history[(oldest_index + index) % FRAME_TIME_HISTORY_SIZE];
+    }
+    return values;
+}
+
+std::vector<float> FrameTimeSeries::GetHistogram(float bucket_width, size_t bucket_count) const
+{
+    std::vector<float> counts(bucket_count, 0.0f);
+    for (size_t index = 0; index < history_count; index++) {
+        size_t bucket = (size_t)(history[index] / bucket_width);
+        counts[std::min(bucket, bucket_count - 1)] += 1.0f;
+    }
+    return counts;
+}
+
+void FrameTimeSeries::WriteJSON(FILE* file, const char* indentation) const
+{
+    FrameTimeStatistics statistics = GetStatistics();
+    fprintf(file, "{\n");
+    fprintf(file, "%s  \"average_ms\": %.4f,\n", indentation, statistics.average);
+    fprintf(file, "%s  \"p50_ms\": %.4f,\n", indentation, statistics.p50);
+    fprintf(file, "%s  \"p95_ms\": %.4f,\n", indentation, statistics.p95);
+    fprintf(file, "%s  \"p99_ms\": %.4f,\n", indentation, statistics.p99);
+    fprintf(file, "%s  \"max_ms\": %.4f,\n", indentation, statistics.max);
+    fprintf(file, "%s  \"run_max_ms\": %.4f,\n", indentation, statistics.run_max);
+    fprintf(file, "%s  \"samples\": %zu,\n", indentation, statistics.sample_count);
+    fprintf(file, "%s  \"total\": %zu,\n", indentation, statistics.total_count);
+    fprintf(file, "%s  \"histogram_bucket_ms\": %g,\n", indentation, FRAME_TIME_HISTOGRAM_BUCKET_MS);
+    // Only up to the last bucket that is not empty
+    std::vector<float> counts = GetHistogram(FRAME_TIME_HISTOGRAM_BUCKET_MS, FRAME_TIME_HISTOGRAM_BUCKET_COUNT);
+    size_t bucket_count = counts.size();
+    while (bucket_count > 0 && counts[bucket_count - 1] == 0.0f) {
+        bucket_count--;
+    }
+    fprintf(file, "%s  \"histogram\": [", indentation);
+    for (size_t index = 0; index < bucket_count; index++) {
+        fprintf(file, "%s%zu", index > 0 ? ", " : "", (size_t)counts[index]);
+    }
+    fprintf(file, "]\n%s}", indentation);
+}
+
+bool FrameTimeStats::WriteJSON(const char* path) const
+{
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"frame\": ");
+    frame_times.WriteJSON(file, "  ");
+    fprintf(file, ",\n  \"step\": ");
+    step_times.WriteJSON(file, "  ");
+    fprintf(file, "\n}\n");
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
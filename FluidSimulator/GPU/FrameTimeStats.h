@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include <stdio.h>
+
+#define FRAME_TIMES_FILE "frame_times.json"
+// How many of the last times are used for the percentiles and the histogram
+#define FRAME_TIME_HISTORY_SIZE 1024
+// The histogram written to the JSON files has fixed buckets, such that the files of different builds
+// Can be compared. The last bucket also counts the larger times
+#define FRAME_TIME_HISTOGRAM_BUCKET_MS 0.5f
+#define FRAME_TIME_HISTOGRAM_BUCKET_COUNT 128
+
+// All the times are in milliseconds
+struct FrameTimeStatistics {
+    float average;
+    float p50;
+    float p95;
+    float p99;
+    // The largest time in the window
+    float max;
+    // The largest time since the start, it can be older than the window
+    float run_max;
+    // How many times are in the window
+    size_t sample_count;
+    size_t total_count;
+};
+
+// A rolling window of CPU times, such that the spikes that the averages hide can be seen
+class FrameTimeSeries {
+public:
+    FrameTimeSeries();
+
+    void Add(float milliseconds);
+
+    FrameTimeStatistics GetStatistics() const;
+
+    // The times of the window from the oldest to the newest
+    std::vector<float> GetHistory() const;
+
+    // Counts the times of the window in buckets of this width, the last bucket also counts the larger times.
+    // The counts are floats, such that they can be plotted directly
+    std::vector<float> GetHistogram(float bucket_width, size_t bucket_count) const;
+
+    // Writes the statistics and the histogram as a JSON object, without a new line after it
+    void WriteJSON(FILE* file, const char* indentation) const;
+
+private:
+    // Circular buffer with the last times
+    std::vector<float> history;
+    size_t history_count;
+    size_t history_next;
+    size_t total_count;
+    float run_max;
+};
+
+struct FrameTimeStats {
+    // From the start of a frame to the start of the next one
+    FrameTimeSeries frame_times;
+    // The simulation part of the frame, the spawning, the uploads and the dispatches, without waiting for the GPU
+    FrameTimeSeries step_times;
+
+    // Returns false if the file can't be written
+    bool WriteJSON(const char* path) const;
+};
@@ -0,0 +1,277 @@
+#include "GPUBarriers.h"
+#include "glad.h"
+#include <unordered_map>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+
+// Enough for the bindings used by the shaders, the guaranteed minimum is 8
+#define MAX_STORAGE_BINDINGS 16
+#define MAX_TEXTURE_UNITS 16
+
+// The buffers and the textures have separate names
+#define TEXTURE_RESOURCE_FLAG (1ull << 32)
+
+struct ResourceState {
+    // The index of the last command that wrote or read the resource in a shader, 0 if none did
+    size_t last_write;
+    size_t last_read;
+};
+
+struct ResourceBinding {
+    unsigned long long resource;
+    GPUAccess access;
+};
+
+static const GLbitfield ACCESS_TYPE_BARRIER_BITS[(size_t)GPUAccessType::Count] = {
+    GL_SHADER_STORAGE_BARRIER_BIT,
+    GL_TEXTURE_FETCH_BARRIER_BIT,
+    GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT,
+    GL_BUFFER_UPDATE_BARRIER_BIT,
+    GL_COMMAND_BARRIER_BIT
+};
+
+static std::unordered_map<unsigned long long, ResourceState> resource_states;
+static ResourceBinding storage_bindings[MAX_STORAGE_BINDINGS];
+static unsigned long long texture_bindings[MAX_TEXTURE_UNITS];
+static std::vector<GPUStorageBinding> draw_storage_bindings;
+static unsigned int dispatch_arguments_buffer = 0;
+// The index of the last command issued before the last barrier of each access type
+static size_t barrier_command[(size_t)GPUAccessType::Count];
+static size_t command_index = 0;
+static bool full_barriers = false;
+static GPUBarrierStatistics statistics = { 0, 0 };
+
+static bool HasAccess(GPUAccess access, GPUAccess flag) {
+    return ((unsigned char)access & (unsigned char)flag) != 0;
+}
+
+// Returns the bit that is needed before the resource is accessed in this way
+static GLbitfield GetBarrierBit(unsigned long long resource, GPUAccessType type, bool is_shader_write) {
+    auto iterator = resource_states.find(resource);
+    if (iterator == resource_states.end()) {
+        return 0;
+    }
+
+    size_t last_barrier = barrier_command[(size_t)type];
+    // The writes must also wait for the previous reads, the barrier orders the commands as well
+    bool has_hazard = iterator->second.last_write > last_barrier || (is_shader_write && iterator->second.last_read > last_barrier);
+    return has_hazard ? ACCESS_TYPE_BARRIER_BITS[(size_t)type] : 0;
+}
+
+static void IssueBarrier(GLbitfield barrier_bits) {
+    if (barrier_bits == 0) {
+        return;
+    }
+
+    glMemoryBarrier(barrier_bits);
+    statistics.barrier_count++;
+    // The barrier covers all the commands issued until now
+    for (size_t index = 0; index < (size_t)GPUAccessType::Count; index++) {
+        if (barrier_bits & ACCESS_TYPE_BARRIER_BITS[index]) {
+            barrier_command[index] = command_index;
+        }
+    }
+}
+
+void GPUBarriers::SetStorageBinding(unsigned int index, unsigned int buffer, GPUAccess access)
+{
+    if (index < MAX_STORAGE_BINDINGS) {
+        storage_bindings[index].resource = buffer;
+        storage_bindings[index].access = access;
+    }
+}
+
+void GPUBarriers::SetTextureBinding(unsigned int unit, unsigned int texture)
+{
+    if (unit < MAX_TEXTURE_UNITS) {
+        texture_bindings[unit] = TEXTURE_RESOURCE_FLAG | texture;
+    }
+}
+
+void GPUBarriers::SetDispatchArgumentsBinding(unsigned int buffer)
+{
+    dispatch_arguments_buffer = buffer;
+}
+
+void GPUBarriers::SetDrawStorageBindings(const std::vector<GPUStorageBinding>& bindings)
+{
+    draw_storage_bindings = bindings;
+}
+
+void GPUBarriers::PrepareCommand(const std::vector<GPUStorageBinding>& program_bindings, unsigned int vertex_buffer, unsigned int arguments_buffer)
+{
+    // The accesses of the storage buffers, as declared by both the program and the binding
+    ResourceBinding accesses[MAX_STORAGE_BINDINGS];
+    size_t access_count = 0;
+    for (size_t index = 0; index < program_bindings.size(); index++) {
+        unsigned int binding_index = program_bindings[index].index;
+        if (binding_index >= MAX_STORAGE_BINDINGS || storage_bindings[binding_index].resource == 0) {
+            continue;
+        }
+        unsigned char access = (unsigned char)program_bindings[index].access & (unsigned char)storage_bindings[binding_index].access;
+        if (access != 0) {
+            accesses[access_count].resource = storage_bindings[binding_index].resource;
+            accesses[access_count].access = (GPUAccess)access;
+            access_count++;
+        }
+    }
+
+    GLbitfield barrier_bits = 0;
+    if (full_barriers) {
+        barrier_bits = GL_ALL_BARRIER_BITS;
+    }
+    else {
+        for (size_t index = 0; index < access_count; index++) {
+            barrier_bits |= GetBarrierBit(accesses[index].resource, GPUAccessType::ShaderStorage, HasAccess(accesses[index].access, GPUAccess::Write));
+        }
+        for (size_t index = 0; index < MAX_TEXTURE_UNITS; index++) {
+            if (texture_bindings[index] != 0) {
+                barrier_bits |= GetBarrierBit(texture_bindings[index], GPUAccessType::TextureFetch, false);
+            }
+        }
+        if (vertex_buffer != 0) {
+            barrier_bits |= GetBarrierBit(vertex_buffer, GPUAccessType::VertexAttribute, false);
+        }
+        if (arguments_buffer != 0) {
+            barrier_bits |= GetBarrierBit(arguments_buffer, GPUAccessType::DispatchArguments, false);
+        }
+    }
+    IssueBarrier(barrier_bits);
+
+    command_index++;
+    statistics.command_count++;
+    for (size_t index = 0; index < access_count; index++) {
+        ResourceState& state = resource_states[accesses[index].resource];
+        if (HasAccess(accesses[index].access, GPUAccess::Read)) {
+            state.last_read = command_index;
+        }
+        if (HasAccess(accesses[index].access, GPUAccess::Write)) {
+            state.last_write = command_index;
+        }
+    }
+}
+
+void GPUBarriers::PrepareDraw(unsigned int vertex_buffer)
+{
+    PrepareCommand(draw_storage_bindings, vertex_buffer);
+}
+
+void GPUBarriers::PrepareIndirectDispatch(const std::vector<GPUStorageBinding>& program_bindings)
+{
+    PrepareCommand(program_bindings, 0, dispatch_arguments_buffer);
+}
+
+void GPUBarriers::PrepareBufferOperation(unsigned int buffer)
+{
+    IssueBarrier(GetBarrierBit(buffer, GPUAccessType::BufferUpdate, false));
+}
+
+void GPUBarriers::ForgetBuffer(unsigned int buffer)
+{
+    resource_states.erase(buffer);
+}
+
+void GPUBarriers::SetFullBarriers(bool enabled)
+{
+    full_barriers = enabled;
+}
+
+bool* GPUBarriers::GetFullBarriersPtr()
+{
+    return &full_barriers;
+}
+
+GPUBarrierStatistics GPUBarriers::GetStatistics()
+{
+    return statistics;
+}
+
+void GPUBarriers::ResetStatistics()
+{
+    statistics.command_count = 0;
+    statistics.barrier_count = 0;
+}
+
+static bool IsIdentifierCharacter(char character) {
+    return (character >= 'a' && character <= 'z') || (character >= 'A' && character <= 'Z') || (character >= '0' && character <= '9') || character == '_';
+}
+
+// Returns true if the word appears as a whole token in the line
+static bool HasToken(const char* line_start, const char* line_end, const char* token) {
+    size_t token_size = strlen(token);
+    for (const char* position = line_start; position + token_size <= line_end; position++) {
+        if (memcmp(position, token, token_size) == 0) {
+            bool is_start = position == line_start || !IsIdentifierCharacter(position[-1]);
+            bool is_end = position + token_size == line_end || !IsIdentifierCharacter(position[token_size]);
+            if (is_start && is_end) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void ParseStorageBindings(const char* source, size_t source_size, std::vector<GPUStorageBinding>& bindings)
+{
+    const char* source_end = source + source_size;
+    const char* line_start = source;
+    while (line_start < source_end) {
+        const char* line_end = (const char*)memchr(line_start, '\n', source_end - line_start);
+        if (line_end == nullptr) {
+            line_end = source_end;
+        }
+
+        if (HasToken(line_start, line_end, "layout") && HasToken(line_start, line_end, "buffer")) {
+            std::string line(line_start, line_end);
+            size_t binding_position = line.find("binding");
+            size_t equal_position = binding_position != std::string::npos ? line.find('=', binding_position) : std::string::npos;
+            if (equal_position != std::string::npos) {
+                unsigned int index = strtoul(line.c_str() + equal_position + 1, nullptr, 10);
+                GPUAccess access = GPUAccess::ReadWrite;
+                if (HasToken(line_start, line_end, "readonly")) {
+                    access = GPUAccess::Read;
+                }
+                else if (HasToken(line_start, line_end, "writeonly")) {
+                    access = GPUAccess::Write;
+                }
+
+                bool exists = false;
+                for (size_t binding = 0; binding < bindings.size(); binding++) {
+                    if (bindings[binding].index == index) {
+                        bindings[binding].access = (GPUAccess)((unsigned char)bindings[binding].access | (unsigned char)access);
+                        exists = true;
+                        break;
+                    }
+                }
+                if (!exists) {
+                    bindings.push_back({ index, access });
+                }
+            }
+        }
+        line_start = line_end + 1;
+    }
+}
+
+void ResolveStorageBindings(unsigned int program_id, std::vector<GPUStorageBinding>& bindings)
+{
+    int block_count = 0;
+    glGetProgramInterfaceiv(program_id, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &block_count);
+    std::vector<GPUStorageBinding> active_bindings;
+    for (int index = 0; index < block_count; index++) {
+        GLenum property = GL_BUFFER_BINDING;
+        int binding_index = 0;
+        glGetProgramResourceiv(program_id, GL_SHADER_STORAGE_BLOCK, index, 1, &property, 1, nullptr, &binding_index);
+
+        // The blocks whose declaration was not recognized can do anything
+        GPUStorageBinding active_binding = { (unsigned int)binding_index, GPUAccess::ReadWrite };
+        for (size_t parsed_index = 0; parsed_index < bindings.size(); parsed_index++) {
+            if (bindings[parsed_index].index == active_binding.index) {
+                active_binding.access = bindings[parsed_index].access;
+                break;
+            }
+        }
+        active_bindings.push_back(active_binding);
+    }
+    bindings = active_bindings;
+}
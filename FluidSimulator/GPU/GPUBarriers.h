@@ -0,0 +1,85 @@
+#pragma once
+#include <vector>
+#include <stddef.h>
+
+enum class GPUAccess : unsigned char {
+    Read = 1,
+    Write = 2,
+    ReadWrite = 3
+};
+
+// The ways in which a command can read a resource. After a shader write, each of them needs
+// Its own barrier bit before it sees the new data
+enum class GPUAccessType : unsigned char {
+    ShaderStorage,
+    TextureFetch,
+    VertexAttribute,
+    // The buffer commands, like the clears, the copies and the readbacks
+    BufferUpdate,
+    // The group counts of the indirect dispatches
+    DispatchArguments,
+    Count
+};
+
+// A storage block of a program, with the access of its qualifiers
+struct GPUStorageBinding {
+    unsigned int index;
+    GPUAccess access;
+};
+
+struct GPUBarrierStatistics {
+    // The dispatches and the draws
+    size_t command_count;
+    size_t barrier_count;
+};
+
+// Keeps track of the resources written by the dispatches and the draws, such that a barrier is issued
+// Only before a command or a buffer operation that depends on such a write, and only with the bits of
+// The way in which it accesses the resource. The storage buffers of a command are the ones bound at the
+// Indices its program uses, with the access of their readonly/writeonly qualifiers. The uniform blocks
+// And the textures are only written from the CPU, which doesn't need barriers
+struct GPUBarriers {
+    // The access is combined with the one of the program, such that a dispatch that doesn't write
+    // A buffer that the shader can write (for example, based on a uniform) can declare it
+    static void SetStorageBinding(unsigned int index, unsigned int buffer, GPUAccess access);
+
+    static void SetTextureBinding(unsigned int unit, unsigned int texture);
+
+    // The buffer that the next indirect dispatches read their group counts from
+    static void SetDispatchArgumentsBinding(unsigned int buffer);
+
+    // The storage bindings used by the next draws
+    static void SetDrawStorageBindings(const std::vector<GPUStorageBinding>& bindings);
+
+    // Must be called right before a dispatch, the vertex buffer is used only for the draws and the
+    // Arguments buffer only for the indirect dispatches
+    static void PrepareCommand(const std::vector<GPUStorageBinding>& storage_bindings, unsigned int vertex_buffer = 0, unsigned int arguments_buffer = 0);
+
+    static void PrepareIndirectDispatch(const std::vector<GPUStorageBinding>& storage_bindings);
+
+    static void PrepareDraw(unsigned int vertex_buffer);
+
+    // Must be called right before a clear, copy, update or readback of the buffer
+    static void PrepareBufferOperation(unsigned int buffer);
+
+    // The buffer storage was reallocated or deleted, its previous writes don't matter anymore
+    static void ForgetBuffer(unsigned int buffer);
+
+    // When enabled, each command is preceded by a barrier with all the bits, which
+    // Can be used to tell if a wrong result comes from a missing barrier
+    static void SetFullBarriers(bool enabled);
+
+    static bool* GetFullBarriersPtr();
+
+    static GPUBarrierStatistics GetStatistics();
+
+    static void ResetStatistics();
+};
+
+// Adds the storage blocks declared in the source. The layout and the qualifiers of a block
+// Must be on the same line. A block declared in multiple stages combines the accesses
+void ParseStorageBindings(const char* source, size_t source_size, std::vector<GPUStorageBinding>& bindings);
+
+// Replaces the parsed storage blocks with the ones that the linked program uses. The blocks that
+// Were not parsed are considered to be read and written
+void ResolveStorageBindings(unsigned int program_id, std::vector<GPUStorageBinding>& bindings);
@@ -0,0 +1,219 @@
+#include "GPUProfiler.h"
+#include "glad.h"
+#include "Trace.h"
+#include <algorithm>
+#include <string.h>
+
+static float GetPercentile(const std::vector<float>& sorted_values, float percentile) {
+    size_t index = (size_t)(percentile * (float)(sorted_values.size() - 1) + 0.5f);
+    return sorted_values[std::min(index, sorted_values.size() - 1)];
+}
+
+GPUProfiler::~GPUProfiler()
+{
+    CloseCSV();
+}
+
+void GPUProfiler::Initialize()
+{
+    for (size_t index = 0; index < GPU_PROFILER_FRAME_LATENCY; index++) {
+        frames[index].used_query_count = 0;
+        frames[index].frame_index = 0;
+        frames[index].has_results = false;
+    }
+    frame_counter = 0;
+    dropped_frame_count = 0;
+    enabled = false;
+    frame_active = false;
+}
+
+void GPUProfiler::BeginFrame()
+{
+    FrameQueries& frame = frames[frame_counter % GPU_PROFILER_FRAME_LATENCY];
+    if (frame.has_results) {
+        // The timestamps are written in order, if the last one is available all of them are
+        int available = 0;
+        glGetQueryObjectiv(frame.queries[frame.used_query_count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            ResolveFrame(frame);
+        }
+        else {
+            dropped_frame_count++;
+        }
+    }
+
+    frame.used_query_count = 0;
+    frame.scopes.clear();
+    frame.frame_index = frame_counter;
+    frame.has_results = false;
+    open_scopes.clear();
+    // The scopes are also timed for the GPU track of a trace
+    frame_active = enabled || Trace::IsRecording();
+}
+
+void GPUProfiler::EndFrame()
+{
+    if (frame_active) {
+        // Close the scopes that were left open, such that all the queries have results
+        while (open_scopes.size() > 0) {
+            EndScope();
+        }
+        FrameQueries& frame = frames[frame_counter % GPU_PROFILER_FRAME_LATENCY];
+        frame.has_results = frame.scopes.size() > 0;
+    }
+    frame_active = false;
+    frame_counter++;
+}
+
+void GPUProfiler::BeginScope(const char* name)
+{
+    if (!frame_active) {
+        return;
+    }
+
+    FrameQueries& frame = frames[frame_counter % GPU_PROFILER_FRAME_LATENCY];
+    PendingScope pending;
+    pending.scope_index = FindScope(name, open_scopes.size());
+    pending.begin_query = AllocateQuery(frame);
+    pending.end_query = 0;
+    glQueryCounter(pending.begin_query, GL_TIMESTAMP);
+
+    open_scopes.push_back(frame.scopes.size());
+    frame.scopes.push_back(pending);
+}
+
+void GPUProfiler::EndScope()
+{
+    if (!frame_active || open_scopes.size() == 0) {
+        return;
+    }
+
+    FrameQueries& frame = frames[frame_counter % GPU_PROFILER_FRAME_LATENCY];
+    PendingScope& pending = frame.scopes[open_scopes.back()];
+    open_scopes.pop_back();
+    pending.end_query = AllocateQuery(frame);
+    glQueryCounter(pending.end_query, GL_TIMESTAMP);
+}
+
+std::vector<GPUProfilerScopeStatistics> GPUProfiler::GetStatistics() const
+{
+    std::vector<GPUProfilerScopeStatistics> statistics;
+    std::vector<float> sorted_values;
+    for (size_t index = 0; index < scopes.size(); index++) {
+        const Scope& scope = scopes[index];
+        if (scope.history_count == 0) {
+            continue;
+        }
+
+        sorted_values.assign(scope.history.begin(), scope.history.begin() + scope.history_count);
+        std::sort(sorted_values.begin(), sorted_values.end());
+        float sum = 0.0f;
+        for (size_t value_index = 0; value_index < sorted_values.size(); value_index++) {
+            sum += sorted_values[value_index];
+        }
+
+        GPUProfilerScopeStatistics scope_statistics;
+        scope_statistics.name = scope.name;
+        scope_statistics.depth = scope.depth;
+        size_t last_index = (scope.history_next + GPU_PROFILER_HISTORY_SIZE - 1) % GPU_PROFILER_HISTORY_SIZE;
+        scope_statistics.last = scope.history[last_index];
+        scope_statistics.average = sum / (float)sorted_values.size();
+        scope_statistics.p50 = GetPercentile(sorted_values, 0.50f);
+        scope_statistics.p95 = GetPercentile(sorted_values, 0.95f);
+        scope_statistics.p99 = GetPercentile(sorted_values, 0.99f);
+        scope_statistics.sample_count = scope.history_count;
+        statistics.push_back(scope_statistics);
+    }
+    return statistics;
+}
+
+void GPUProfiler::ResolvePendingFrames()
+{
+    // The slot of the next frame has the oldest results
+    for (size_t index = 0; index < GPU_PROFILER_FRAME_LATENCY; index++) {
+        FrameQueries& frame = frames[(frame_counter + index) % GPU_PROFILER_FRAME_LATENCY];
+        if (frame.has_results) {
+            ResolveFrame(frame);
+            frame.has_results = false;
+        }
+    }
+}
+
+void GPUProfiler::ResetStatistics()
+{
+    for (size_t index = 0; index < scopes.size(); index++) {
+        scopes[index].history_count = 0;
+        scopes[index].history_next = 0;
+    }
+}
+
+bool GPUProfiler::OpenCSV(const char* path)
+{
+    CloseCSV();
+    csv_file = fopen(path, "w");
+    if (csv_file == nullptr) {
+        return false;
+    }
+    fprintf(csv_file, "frame,scope,depth,milliseconds\n");
+    return true;
+}
+
+void GPUProfiler::CloseCSV()
+{
+    if (csv_file != nullptr) {
+        fclose(csv_file);
+        csv_file = nullptr;
+    }
+}
+
+size_t GPUProfiler::FindScope(const char* name, unsigned int depth)
+{
+    for (size_t index = 0; index < scopes.size(); index++) {
+        if (scopes[index].depth == depth && strcmp(scopes[index].name, name) == 0) {
+            return index;
+        }
+    }
+
+    Scope scope;
+    scope.name = name;
+    scope.depth = depth;
+    scope.history.resize(GPU_PROFILER_HISTORY_SIZE);
+    scope.history_count = 0;
+    scope.history_next = 0;
+    scopes.push_back(scope);
+    return scopes.size() - 1;
+}
+
+unsigned int GPUProfiler::AllocateQuery(FrameQueries& frame)
+{
+    if (frame.used_query_count == frame.queries.size()) {
+        unsigned int query;
+        glGenQueries(1, &query);
+        frame.queries.push_back(query);
+    }
+    return frame.queries[frame.used_query_count++];
+}
+
+void GPUProfiler::ResolveFrame(FrameQueries& frame)
+{
+    for (size_t index = 0; index < frame.scopes.size(); index++) {
+        const PendingScope& pending = frame.scopes[index];
+        GLuint64 begin_time = 0;
+        GLuint64 end_time = 0;
+        glGetQueryObjectui64v(pending.begin_query, GL_QUERY_RESULT, &begin_time);
+        glGetQueryObjectui64v(pending.end_query, GL_QUERY_RESULT, &end_time);
+        float milliseconds = end_time > begin_time ? (float)((double)(end_time - begin_time) / 1'000'000.0) : 0.0f;
+
+        Scope& scope = scopes[pending.scope_index];
+        scope.history[scope.history_next] = milliseconds;
+        scope.history_next = (scope.history_next + 1) % GPU_PROFILER_HISTORY_SIZE;
+        scope.history_count = std::min(scope.history_count + 1, (size_t)GPU_PROFILER_HISTORY_SIZE);
+
+        if (Trace::IsRecording()) {
+            Trace::AddGPUEvent(scope.name, begin_time, end_time);
+        }
+        if (csv_file != nullptr) {
+            fprintf(csv_file, "%zu,%s,%u,%.4f\n", frame.frame_index, scope.name, scope.depth, milliseconds);
+        }
+    }
+}
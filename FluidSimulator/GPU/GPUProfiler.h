@@ -0,0 +1,137 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <stdio.h>
+
+// How many frames the queries are kept in flight before they are read. The results of a frame
+// Are read when its slot is reused, such that the read doesn't wait for the GPU
+#define GPU_PROFILER_FRAME_LATENCY 3
+// How many frames are used for the rolling averages and percentiles
+#define GPU_PROFILER_HISTORY_SIZE 256
+
+// All the times are in milliseconds
+struct GPUProfilerScopeStatistics {
+    const char* name;
+    // The nesting level of the scope, 0 for the top level ones
+    unsigned int depth;
+    float last;
+    float average;
+    float p50;
+    float p95;
+    float p99;
+    // How many frames are in the history
+    size_t sample_count;
+};
+
+// Measures the GPU time of the scopes with timestamp queries. The scopes can be nested, such that
+// The individual dispatches can be timed inside a larger pass
+class GPUProfiler {
+public:
+    GPUProfiler() = default;
+    GPUProfiler(const GPUProfiler& other) = delete;
+    GPUProfiler& operator = (const GPUProfiler& other) = delete;
+    ~GPUProfiler();
+
+    void Initialize();
+
+    // It reads the results of the frame that was issued GPU_PROFILER_FRAME_LATENCY frames ago, if the
+    // GPU has finished it. Otherwise, that frame is dropped, it never waits
+    void BeginFrame();
+
+    void EndFrame();
+
+    // The name must be a string literal, or outlive the profiler. Scopes outside a frame are ignored
+    void BeginScope(const char* name);
+
+    void EndScope();
+
+    // The scopes in the order in which they were first seen
+    std::vector<GPUProfilerScopeStatistics> GetStatistics() const;
+
+    // Waits for the frames whose results were not read yet. It must be called outside a frame
+    void ResolvePendingFrames();
+
+    // Clears the history of the scopes, such that the statistics include only the next frames
+    void ResetStatistics();
+
+    inline size_t GetDroppedFrameCount() const {
+        return dropped_frame_count;
+    }
+
+    inline bool IsEnabled() const {
+        return enabled;
+    }
+
+    // Takes effect at the next frame
+    inline void SetEnabled(bool _enabled) {
+        enabled = _enabled;
+    }
+
+    inline bool IsWritingCSV() const {
+        return csv_file != nullptr;
+    }
+
+    // Each resolved frame writes a line for each scope, with the frame index, the scope name, the depth
+    // And the time. Returns false if the file could not be opened
+    bool OpenCSV(const char* path);
+
+    void CloseCSV();
+
+private:
+    struct Scope {
+        const char* name;
+        unsigned int depth;
+        // Circular buffer with the last times
+        std::vector<float> history;
+        size_t history_count;
+        size_t history_next;
+    };
+
+    struct PendingScope {
+        size_t scope_index;
+        unsigned int begin_query;
+        unsigned int end_query;
+    };
+
+    struct FrameQueries {
+        // The query objects are reused between frames
+        std::vector<unsigned int> queries;
+        size_t used_query_count;
+        std::vector<PendingScope> scopes;
+        size_t frame_index;
+        bool has_results;
+    };
+
+    size_t FindScope(const char* name, unsigned int depth);
+
+    unsigned int AllocateQuery(FrameQueries& frame);
+
+    void ResolveFrame(FrameQueries& frame);
+
+    FrameQueries frames[GPU_PROFILER_FRAME_LATENCY];
+    std::vector<Scope> scopes;
+    // The indices inside the pending scopes of the current frame
+    std::vector<size_t> open_scopes;
+    size_t frame_counter;
+    size_t dropped_frame_count;
+    bool enabled;
+    bool frame_active;
+    FILE* csv_file = nullptr;
+};
+
+// Times the GPU commands issued during its lifetime. The profiler can be nullptr
+struct GPUProfilerScope {
+    GPUProfilerScope(GPUProfiler* _profiler, const char* name) : profiler(_profiler) {
+        if (profiler != nullptr) {
+            profiler->BeginScope(name);
+        }
+    }
+
+    ~GPUProfilerScope() {
+        if (profiler != nullptr) {
+            profiler->EndScope();
+        }
+    }
+
+    GPUProfiler* profiler;
+};
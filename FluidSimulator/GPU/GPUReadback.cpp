@@ -0,0 +1,136 @@
+#include "GPUReadback.h"
+#include "glad.h"
+#include <string.h>
+
+void GPUReadback::Initialize()
+{
+    // The staging buffers are allocated the first time they are used
+    for (size_t index = 0; index < GPU_READBACK_RING_SIZE; index++) {
+        slots[index].staging = StructuredBuffer(sizeof(unsigned int), 1);
+        slots[index].capacity = 0;
+        slots[index].byte_size = 0;
+        slots[index].fence = nullptr;
+        slots[index].ticket = INVALID_READBACK_TICKET;
+        slots[index].cancelled = false;
+    }
+    oldest_slot = 0;
+    in_flight_count = 0;
+    next_ticket = INVALID_READBACK_TICKET + 1;
+}
+
+ReadbackTicket GPUReadback::Request(const StructuredBuffer& buffer, size_t byte_size)
+{
+    return Request(buffer, byte_size, nullptr);
+}
+
+ReadbackTicket GPUReadback::Request(const StructuredBuffer& buffer, size_t byte_size, ReadbackCallback callback)
+{
+    if (in_flight_count == GPU_READBACK_RING_SIZE) {
+        CompleteOldest(true);
+    }
+
+    Slot& slot = slots[(oldest_slot + in_flight_count) % GPU_READBACK_RING_SIZE];
+    if (slot.capacity < byte_size) {
+        // Grow with a margin, such that the requests that grow slowly don't reallocate each time
+        slot.capacity = byte_size + byte_size / 4;
+        slot.staging.SetNewReadbackStorage(slot.capacity);
+    }
+    if (byte_size > 0) {
+        slot.staging.CopyData(buffer, byte_size);
+    }
+    slot.byte_size = byte_size;
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // Make sure that the copy is submitted, such that the fence eventually signals
+    glFlush();
+    slot.ticket = next_ticket++;
+    slot.callback = std::move(callback);
+    slot.cancelled = false;
+    in_flight_count++;
+    return slot.ticket;
+}
+
+void GPUReadback::Update()
+{
+    // The fences signal in order, the first one that hasn't signaled ends the search
+    while (in_flight_count > 0) {
+        GLenum status = glClientWaitSync((GLsync)slots[oldest_slot].fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+        CompleteOldest(false);
+    }
+}
+
+bool GPUReadback::TryRead(ReadbackTicket ticket, void* data)
+{
+    Update();
+    auto iterator = finished_data.find(ticket);
+    if (iterator == finished_data.end()) {
+        return false;
+    }
+    memcpy(data, iterator->second.data(), iterator->second.size());
+    finished_data.erase(iterator);
+    return true;
+}
+
+void GPUReadback::Wait(ReadbackTicket ticket)
+{
+    while (in_flight_count > 0 && slots[oldest_slot].ticket <= ticket) {
+        CompleteOldest(true);
+    }
+}
+
+void GPUReadback::Cancel(ReadbackTicket ticket)
+{
+    finished_data.erase(ticket);
+    for (size_t index = 0; index < in_flight_count; index++) {
+        Slot& slot = slots[(oldest_slot + index) % GPU_READBACK_RING_SIZE];
+        if (slot.ticket == ticket) {
+            slot.callback = nullptr;
+            slot.cancelled = true;
+        }
+    }
+}
+
+bool GPUReadback::IsPending(ReadbackTicket ticket) const
+{
+    if (finished_data.find(ticket) != finished_data.end()) {
+        return true;
+    }
+    for (size_t index = 0; index < in_flight_count; index++) {
+        const Slot& slot = slots[(oldest_slot + index) % GPU_READBACK_RING_SIZE];
+        if (slot.ticket == ticket) {
+            return !slot.cancelled;
+        }
+    }
+    return false;
+}
+
+void GPUReadback::CompleteOldest(bool wait)
+{
+    Slot& slot = slots[oldest_slot];
+    if (wait) {
+        glClientWaitSync((GLsync)slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    }
+    glDeleteSync((GLsync)slot.fence);
+    slot.fence = nullptr;
+
+    if (!slot.cancelled) {
+        // The copy has finished, the map doesn't wait
+        const void* data = slot.byte_size > 0 ? slot.staging.MapForReading(slot.byte_size) : nullptr;
+        if (slot.callback) {
+            ReadbackCallback callback = std::move(slot.callback);
+            slot.callback = nullptr;
+            callback(data, slot.byte_size);
+        }
+        else {
+            const unsigned char* bytes = (const unsigned char*)data;
+            finished_data[slot.ticket].assign(bytes, bytes + slot.byte_size);
+        }
+        if (data != nullptr) {
+            slot.staging.Unmap();
+        }
+    }
+    oldest_slot = (oldest_slot + 1) % GPU_READBACK_RING_SIZE;
+    in_flight_count--;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "Buffers.h"
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+// How many copies can be in flight. When all of them are, a new request waits for the oldest one
+#define GPU_READBACK_RING_SIZE 16
+
+// Identifies a request, the tickets increase with each request
+typedef unsigned long long ReadbackTicket;
+#define INVALID_READBACK_TICKET 0
+
+// The data is valid only during the call
+typedef std::function<void(const void* data, size_t byte_size)> ReadbackCallback;
+
+// Reads the buffers back without stalling the pipeline. A request copies the bytes on the GPU into
+// A staging buffer of the ring and inserts a fence after the copy. The staging buffer is mapped
+// Only once its fence has signaled, which happens one or more frames later, such that neither the
+// Copy nor the map waits for the GPU
+class GPUReadback {
+public:
+    GPUReadback() = default;
+    GPUReadback(const GPUReadback& other) = delete;
+    GPUReadback& operator = (const GPUReadback& other) = delete;
+
+    void Initialize();
+
+    // The data is taken with TryRead
+    ReadbackTicket Request(const StructuredBuffer& buffer, size_t byte_size);
+
+    // The callback is called from Update, or from Wait, once the copy has finished. It must not make requests
+    ReadbackTicket Request(const StructuredBuffer& buffer, size_t byte_size, ReadbackCallback callback);
+
+    // Completes the requests whose copies have finished, in the order of the requests. It never waits
+    void Update();
+
+    // Returns true and copies the data if the request has finished, the ticket can't be read again. It never waits
+    bool TryRead(ReadbackTicket ticket, void* data);
+
+    // Waits for the request and the ones before it. The callbacks are called, and TryRead succeeds afterwards
+    void Wait(ReadbackTicket ticket);
+
+    // The data of the request is not needed anymore
+    void Cancel(ReadbackTicket ticket);
+
+    // If the request was not read, or its callback was not called yet
+    bool IsPending(ReadbackTicket ticket) const;
+
+    // The requests whose copies have not finished yet
+    inline size_t GetInFlightCount() const {
+        return in_flight_count;
+    }
+
+private:
+    struct Slot {
+        StructuredBuffer staging;
+        size_t capacity;
+        size_t byte_size;
+        void* fence;
+        ReadbackTicket ticket;
+        ReadbackCallback callback;
+        // The copy still finishes, but nothing is done with it
+        bool cancelled;
+    };
+
+    // Maps the staging buffer, and gives the data to the callback or keeps it for TryRead
+    void CompleteOldest(bool wait);
+
+    Slot slots[GPU_READBACK_RING_SIZE];
+    // The slots are used in the order of the requests
+    size_t oldest_slot;
+    size_t in_flight_count;
+    ReadbackTicket next_ticket;
+    // The finished requests without a callback, until they are read
+    std::unordered_map<ReadbackTicket, std::vector<unsigned char>> finished_data;
+};
@@ -1,6 +1,28 @@
 #include "GPUSort.h"
 #include "ShaderLocation.h"
+#include "Trace.h"
 #include <cmath>
+#include <algorithm>
+#include <string.h>
+
+#define SORT_DEFAULT_GROUP_SIZE 128
+#define SORT_DEFAULT_INCREMENTAL_THRESHOLD 0.125f
+// The smallest network of the changed entries, such that a frame with few changes
+// Does not make the next one fall back
+#define SORT_MIN_INCREMENTAL_CAPACITY 256
+// The same as in sort_incremental_split.comp. The incremental state has the changed count, and then the
+// Group counts of the dispatches of the fallback counting sort: over the entries, over the keys and for
+// Each level of the prefix sum
+#define SORT_FALLBACK_ENTRY_ARGUMENTS 0
+#define SORT_FALLBACK_KEY_ARGUMENTS 1
+#define SORT_FALLBACK_SCAN_ARGUMENTS 2
+#define SORT_FALLBACK_MAX_SCAN_LEVELS 8
+#define SORT_INCREMENTAL_STATE_SIZE (1 + (SORT_FALLBACK_SCAN_ARGUMENTS + SORT_FALLBACK_MAX_SCAN_LEVELS) * 3)
+// The same as in sort_bucket_order.comp. The key ranges with more entries than the limit are sorted by
+// A workgroup each. The large buckets have the group counts of that dispatch and the count of the
+// Buckets, and then their keys
+#define SORT_SERIAL_BUCKET_LIMIT 64
+#define SORT_LARGE_BUCKET_KEYS 4
 
 struct Settings {
     unsigned int num_entries;
@@ -9,6 +31,18 @@ struct Settings {
     unsigned int step_index;
 };
 
+// The full layout, the buffers that are sized with it hold the compact entries as well
+struct SpatialIndex {
+    unsigned int index;
+    unsigned int hash;
+    unsigned int key;
+};
+
+// The byte offset of the group counts of a dispatch of the fallback counting sort
+static size_t GetFallbackArgumentsOffset(size_t dispatch_index) {
+    return sizeof(unsigned int) * (1 + dispatch_index * 3);
+}
+
 static size_t NextPowerOfTwo(size_t value) {
     size_t power = 1;
     while (power < value) {
@@ -17,20 +51,130 @@ static size_t NextPowerOfTwo(size_t value) {
     return power;
 }
 
+static const char* SORT_MODE_NAMES[] = {
+    "bitonic",
+    "counting",
+    "incremental"
+};
+
+const char* GetGPUSortModeName(GPUSortMode mode)
+{
+    return SORT_MODE_NAMES[(size_t)mode];
+}
+
+GPUSortMode GetGPUSortModeFromName(const char* name)
+{
+    for (size_t index = 0; index < std::size(SORT_MODE_NAMES); index++) {
+        if (strcmp(name, SORT_MODE_NAMES[index]) == 0) {
+            return (GPUSortMode)index;
+        }
+    }
+    return GPUSortMode::Bitonic;
+}
+
 void GPUSort::Initialize()
 {
-    sort_compute = ComputeShader(SHADER_LOCATION(sort.comp), 128, 1, 1);
-    sort_compute.CreateUniformBlock("Settings", sizeof(Settings));
-    offsets_compute = ComputeShader(SHADER_LOCATION(sort_calculate_offsets.comp), 128, 1, 1);
+    group_size = SORT_DEFAULT_GROUP_SIZE;
+    compact_entries = false;
+    SelectShaders();
+
+    mode = GPUSortMode::Bitonic;
+    profiler = nullptr;
+    counting_capacity = 0;
+    key_counts = StructuredBuffer(sizeof(unsigned int), 1);
+    key_starts = StructuredBuffer(sizeof(unsigned int), 1);
+    scratch_entries = StructuredBuffer(sizeof(SpatialIndex), 1);
+    large_buckets = StructuredBuffer(sizeof(unsigned int), SORT_LARGE_BUCKET_KEYS);
+
+    incremental_threshold = SORT_DEFAULT_INCREMENTAL_THRESHOLD;
+    incremental_capacity = 0;
+    previous_count = 0;
+    previous_entries = StructuredBuffer(sizeof(SpatialIndex), 1);
+    changed_entries = StructuredBuffer(sizeof(SpatialIndex), 1);
+    changed_offsets = StructuredBuffer(sizeof(unsigned int), 1);
+    incremental_state = StructuredBuffer(sizeof(unsigned int), SORT_INCREMENTAL_STATE_SIZE);
+    readback = nullptr;
+    incremental_ticket = INVALID_READBACK_TICKET;
+    incremental_stats = {};
+}
+
+void GPUSort::SetGroupSize(unsigned int _group_size)
+{
+    if (group_size == _group_size) {
+        return;
+    }
+    group_size = _group_size;
+    SelectShaders();
+    // The shaders of the other mode are not bound, they are finished here such that they are saved as well
+    ShaderCache::FinishPrograms();
+    // The prefix sum has a different number of blocks, the buffers for its levels are sized again
+    counting_capacity = 0;
+}
+
+void GPUSort::SetCompactEntries(bool _compact_entries)
+{
+    if (compact_entries == _compact_entries) {
+        return;
+    }
+    compact_entries = _compact_entries;
+    // The previous entries have the other layout
+    previous_count = 0;
+    SelectShaders();
+    ShaderCache::FinishPrograms();
+}
+
+void GPUSort::Execute(
+    StructuredBuffer spatial_indices_buffer,
+    StructuredBuffer offset_buffer,
+    size_t entry_count,
+    size_t key_count,
+    GPUSortOffsets offsets_type
+) {
+    if (entry_count == 0) {
+        return;
+    }
+
+    TraceScope trace_scope("Sort");
+    GPUProfilerScope sort_scope(profiler, "Sort");
+    if (mode == GPUSortMode::Incremental) {
+        ExecuteIncremental(spatial_indices_buffer, offset_buffer, entry_count, key_count, offsets_type);
+        return;
+    }
+
+    // The other modes don't keep the order, it would be stale when the incremental mode is selected again
+    previous_count = 0;
+    if (mode == GPUSortMode::Counting) {
+        ExecuteCounting(spatial_indices_buffer, offset_buffer, entry_count, key_count, offsets_type);
+    }
+    else {
+        ExecuteBitonic(spatial_indices_buffer, offset_buffer, entry_count, key_count, offsets_type);
+    }
+}
+
+void GPUSort::ExecuteBitonic(
+    StructuredBuffer spatial_indices_buffer,
+    StructuredBuffer offset_buffer,
+    size_t entry_count,
+    size_t key_count,
+    GPUSortOffsets offsets_type
+) {
+    {
+        GPUProfilerScope network_scope(profiler, "Bitonic network");
+        ExecuteNetwork(spatial_indices_buffer, entry_count);
+    }
+
+    // Now the offset calculation part comes
+    GPUProfilerScope offsets_scope(profiler, "Offsets");
+    CalculateOffsets(spatial_indices_buffer, offset_buffer, entry_count, key_count, offsets_type);
 }
 
-void GPUSort::Execute(StructuredBuffer spatial_indices_buffer, StructuredBuffer offset_buffer, size_t entry_count) {
+void GPUSort::ExecuteNetwork(StructuredBuffer spatial_indices_buffer, size_t entry_count) {
     // Launch each step of the sorting algorithm (once the previous step is complete)
     // Number of steps = [log2(n) * (log2(n) + 1)] / 2
     // where n = nearest power of 2 that is greater or equal to the number of inputs
     int stage_count = (int)std::log2f(NextPowerOfTwo(entry_count));
 
-    sort_compute.Bind();
+    sort_compute->Bind();
     spatial_indices_buffer.Bind(0);
     for (int stage_index = 0; stage_index < stage_count; stage_index++)
     {
@@ -38,19 +182,380 @@ void GPUSort::Execute(StructuredBuffer spatial_indices_buffer, StructuredBuffer
         {
             int group_width = 1 << (stage_index - step_index);
             int group_height = 2 * group_width - 1;
-            Settings settings;
-            settings.group_width = group_width;
-            settings.group_height = group_height;
-            settings.num_entries = entry_count;
-            settings.step_index = step_index;
-            sort_compute.SetUniformBlock("Settings", &settings);
-            sort_compute.BindUniformBlock(0);
+            SetSettings(entry_count, group_width, group_height, step_index);
             // Run the sorting step on the GPU
-            sort_compute.Dispatch(NextPowerOfTwo(entry_count) / 2, 1, 1);
+            sort_compute->Dispatch(NextPowerOfTwo(entry_count) / 2, 1, 1);
         }
     }
+}
 
-    // Now the offset calculation part comes
+void GPUSort::CalculateOffsets(
+    StructuredBuffer spatial_indices_buffer,
+    StructuredBuffer offset_buffer,
+    size_t entry_count,
+    size_t key_count,
+    GPUSortOffsets offsets_type
+) {
+    if (offsets_type == GPUSortOffsets::KeyRanges) {
+        // The ranges are the same as the ones of the counting sort
+        ReserveCountingBuffers(entry_count, key_count);
+        CalculateKeyStarts(spatial_indices_buffer, offset_buffer, entry_count, key_count);
+    }
+    else {
+        // The settings and the entries are set again, such that it doesn't depend on the network before it
+        SetSettings(entry_count, 0, 0, 0);
+        spatial_indices_buffer.Bind(0);
+        offset_buffer.Bind(1);
+        offsets_compute->BindAndDispatch(entry_count, 1, 1, false);
+    }
+}
+
+void GPUSort::ExecuteIncremental(
+    StructuredBuffer spatial_indices_buffer,
+    StructuredBuffer offset_buffer,
+    size_t entry_count,
+    size_t key_count,
+    GPUSortOffsets offsets_type
+) {
+    ReserveIncrementalBuffers(entry_count);
+    size_t entry_size = GetEntrySize();
+    // Particles were removed, the previous indices can be out of range
+    if (previous_count > entry_count) {
+        previous_count = 0;
+    }
+    // Without a previous order, all the entries are sorted
+    if (previous_count == 0) {
+        ExecuteBitonic(spatial_indices_buffer, offset_buffer, entry_count, key_count, offsets_type);
+        previous_entries.CopyData(spatial_indices_buffer, entry_size * entry_count);
+        previous_count = entry_count;
+        return;
+    }
+
+    ReserveCountingBuffers(entry_count, key_count);
+    size_t capacity = GetIncrementalCapacity(entry_count);
+    SetSettings(entry_count, 0, 0, 0);
+
+    // Put the new entries in the previous order and flag the ones whose key changed. The entries
+    // Of the particles that were added are all flagged
+    {
+        GPUProfilerScope mark_scope(profiler, "Mark changes");
+        spatial_indices_buffer.Bind(0);
+        previous_entries.Bind(1);
+        scratch_entries.Bind(2);
+        changed_offsets.Bind(7);
+        incremental_mark_compute->Bind(false);
+        incremental_mark_compute->SetUInt("previous_count", previous_count);
+        incremental_mark_compute->Dispatch(entry_count, 1, 1);
+    }
+
+    // The flags become the offsets of the changed entries, and their count is after the last one
+    {
+        GPUProfilerScope scan_scope(profiler, "Prefix sum");
+        ExclusiveScan(changed_offsets, entry_count + 1);
+    }
+
+    {
+        GPUProfilerScope changed_scope(profiler, "Changed network");
+        scratch_entries.Bind(2);
+        key_starts.Bind(3);
+        key_counts.Bind(4);
+        changed_entries.Bind(5);
+        incremental_state.Bind(6);
+        changed_offsets.Bind(7);
+        incremental_split_compute->Bind(false);
+        incremental_split_compute->SetUInt("changed_capacity", capacity);
+        incremental_split_compute->SetUInt("key_count", key_count);
+        // The fallback counts of all the keys are cleared by it
+        incremental_split_compute->Dispatch(std::max(std::max(entry_count, capacity), key_count + 1), 1, 1);
+
+        // When the changed entries don't fit, the network runs over stale entries that the merge doesn't read
+        ExecuteNetwork(changed_entries, capacity);
+    }
+
+    {
+        GPUProfilerScope merge_scope(profiler, "Merge");
+        SetSettings(entry_count, 0, 0, 0);
+        spatial_indices_buffer.Bind(0);
+        previous_entries.Bind(1);
+        scratch_entries.Bind(2);
+        changed_entries.Bind(5);
+        changed_offsets.Bind(7);
+        incremental_merge_compute->Bind(false);
+        incremental_merge_compute->SetUInt("previous_count", previous_count);
+        incremental_merge_compute->SetUInt("changed_capacity", capacity);
+        incremental_merge_compute->Dispatch(entry_count, 1, 1);
+    }
+
+    // The merge has left the entries as they were, these dispatches have groups only when it did
+    {
+        GPUProfilerScope fallback_scope(profiler, "Fallback");
+        ExecuteIncrementalFallback(spatial_indices_buffer, offset_buffer, entry_count, key_count);
+    }
+
+    {
+        GPUProfilerScope offsets_scope(profiler, "Offsets");
+        CalculateOffsets(spatial_indices_buffer, offset_buffer, entry_count, key_count, offsets_type);
+    }
+
+    if (readback != nullptr && !readback->IsPending(incremental_ticket)) {
+        incremental_ticket = readback->Request(incremental_state, sizeof(unsigned int), [this, entry_count, capacity](const void* data, size_t byte_size) {
+            incremental_stats.entry_count = entry_count;
+            incremental_stats.changed_count = *(const unsigned int*)data;
+            incremental_stats.capacity = capacity;
+            incremental_stats.fell_back = incremental_stats.changed_count > capacity;
+        });
+    }
+
+    previous_entries.CopyData(spatial_indices_buffer, entry_size * entry_count);
+    previous_count = entry_count;
+}
+
+void GPUSort::ExecuteIncrementalFallback(StructuredBuffer spatial_indices_buffer, StructuredBuffer offset_buffer, size_t entry_count, size_t key_count)
+{
+    incremental_state.BindDispatchArguments();
+    SetSettings(entry_count, 0, 0, 0);
+
+    // The split pass has cleared both, the starts are counted into as well instead of copying the counts
+    spatial_indices_buffer.Bind(0);
+    count_compute->Bind(false);
+    key_counts.Bind(4);
+    count_compute->DispatchIndirect(GetFallbackArgumentsOffset(SORT_FALLBACK_ENTRY_ARGUMENTS));
+    key_starts.Bind(4);
+    count_compute->DispatchIndirect(GetFallbackArgumentsOffset(SORT_FALLBACK_ENTRY_ARGUMENTS));
+    ExclusiveScan(key_starts, key_count + 1, 0, true);
+
+    spatial_indices_buffer.Bind(0);
     offset_buffer.Bind(1);
-    offsets_compute.BindAndDispatch(entry_count, 1, 1, false);
+    scratch_entries.Bind(2);
+    key_starts.Bind(3);
+    key_counts.Bind(4);
+    scatter_compute->Bind(false);
+    scatter_compute->DispatchIndirect(GetFallbackArgumentsOffset(SORT_FALLBACK_ENTRY_ARGUMENTS));
+    // The offsets are calculated afterwards, for both paths
+    OrderBuckets(key_count, false, true);
+}
+
+void GPUSort::ResetIncrementalOrder()
+{
+    previous_count = 0;
+    incremental_stats = {};
+    if (readback != nullptr && readback->IsPending(incremental_ticket)) {
+        readback->Cancel(incremental_ticket);
+    }
+    incremental_ticket = INVALID_READBACK_TICKET;
+}
+
+void GPUSort::WaitForIncrementalStats()
+{
+    if (readback != nullptr && readback->IsPending(incremental_ticket)) {
+        readback->Wait(incremental_ticket);
+    }
+}
+
+void GPUSort::SetIncrementalOrder(StructuredBuffer spatial_indices_buffer, size_t entry_count)
+{
+    // Only an order that is kept is replaced, its buffer is large enough
+    if (previous_count != entry_count) {
+        return;
+    }
+    previous_entries.CopyData(spatial_indices_buffer, GetEntrySize() * entry_count);
+}
+
+size_t GPUSort::GetIncrementalCapacity(size_t entry_count) const
+{
+    size_t max_capacity = NextPowerOfTwo((size_t)std::ceil(incremental_threshold * (float)entry_count));
+    max_capacity = std::min(std::max(max_capacity, (size_t)1), NextPowerOfTwo(entry_count));
+    // A count of other entries says little about these ones
+    if (readback == nullptr || incremental_stats.entry_count != entry_count) {
+        return max_capacity;
+    }
+    // The changes are usually similar from one frame to the next, the margin absorbs the
+    // Difference between the frame that was read back and this one
+    size_t capacity = NextPowerOfTwo(incremental_stats.changed_count * 2);
+    capacity = std::max(capacity, (size_t)SORT_MIN_INCREMENTAL_CAPACITY);
+    return std::min(capacity, max_capacity);
+}
+
+void GPUSort::ExecuteCounting(
+    StructuredBuffer spatial_indices_buffer,
+    StructuredBuffer offset_buffer,
+    size_t entry_count,
+    size_t key_count,
+    GPUSortOffsets offsets_type
+) {
+    ReserveCountingBuffers(entry_count, key_count);
+    SetSettings(entry_count, 0, 0, 0);
+
+    // When the caller wants the key ranges, they can be written directly into its buffer
+    StructuredBuffer starts_buffer = offsets_type == GPUSortOffsets::KeyRanges ? offset_buffer : key_starts;
+    CalculateKeyStarts(spatial_indices_buffer, starts_buffer, entry_count, key_count);
+
+    // Move the entries into their key range, and then order each range
+    spatial_indices_buffer.Bind(0);
+    offset_buffer.Bind(1);
+    scratch_entries.Bind(2);
+    starts_buffer.Bind(3);
+    key_counts.Bind(4);
+    {
+        GPUProfilerScope scatter_scope(profiler, "Scatter");
+        scatter_compute->BindAndDispatch(entry_count, 1, 1, false);
+    }
+    GPUProfilerScope bucket_order_scope(profiler, "Bucket order");
+    OrderBuckets(key_count, offsets_type == GPUSortOffsets::FirstEntry, false);
+}
+
+void GPUSort::OrderBuckets(size_t key_count, bool write_offsets, bool indirect)
+{
+    // No large buckets yet, and a single group in the other dimensions
+    const unsigned int large_bucket_header[SORT_LARGE_BUCKET_KEYS] = { 0, 1, 1, 0 };
+    large_buckets.UpdateData(sizeof(unsigned int), SORT_LARGE_BUCKET_KEYS, large_bucket_header);
+
+    large_buckets.Bind(5);
+    bucket_order_compute->Bind(false);
+    bucket_order_compute->SetUInt("key_count", key_count);
+    bucket_order_compute->SetBool("write_offsets", write_offsets);
+    if (indirect) {
+        bucket_order_compute->DispatchIndirect(GetFallbackArgumentsOffset(SORT_FALLBACK_KEY_ARGUMENTS));
+    }
+    else {
+        bucket_order_compute->Dispatch(key_count, 1, 1);
+    }
+
+    // The dispatch has as many groups as the bucket order found large buckets, usually none
+    large_buckets.BindDispatchArguments();
+    bucket_network_compute->Bind(false);
+    bucket_network_compute->DispatchIndirect(0);
+}
+
+void GPUSort::CalculateKeyStarts(StructuredBuffer spatial_indices_buffer, StructuredBuffer key_starts_buffer, size_t entry_count, size_t key_count) {
+    SetSettings(entry_count, 0, 0, 0);
+
+    // Count the entries of each key
+    {
+        GPUProfilerScope count_scope(profiler, "Key counts");
+        key_counts.ClearData();
+        spatial_indices_buffer.Bind(0);
+        key_counts.Bind(4);
+        count_compute->BindAndDispatch(entry_count, 1, 1, false);
+    }
+
+    // The start of each key range is the exclusive prefix sum of the counts. It has an
+    // Additional entry, such that the end of the last key can be read as well
+    GPUProfilerScope scan_scope(profiler, "Prefix sum");
+    key_starts_buffer.CopyData(key_counts, sizeof(unsigned int) * (key_count + 1));
+    ExclusiveScan(key_starts_buffer, key_count + 1);
+}
+
+void GPUSort::ExclusiveScan(StructuredBuffer values, size_t value_count, size_t level, bool indirect) {
+    size_t block_count = GetScanBlockCount(value_count);
+    size_t arguments_offset = GetFallbackArgumentsOffset(SORT_FALLBACK_SCAN_ARGUMENTS + level);
+
+    values.Bind(0);
+    scan_block_sums[level].Bind(1);
+    scan_compute->Bind(false);
+    scan_compute->SetUInt("value_count", value_count);
+    // Each thread handles 2 values
+    if (indirect) {
+        scan_compute->DispatchIndirect(arguments_offset);
+    }
+    else {
+        scan_compute->Dispatch(block_count * group_size, 1, 1);
+    }
+
+    if (block_count > 1) {
+        ExclusiveScan(scan_block_sums[level], block_count, level + 1, indirect);
+
+        values.Bind(0);
+        scan_block_sums[level].Bind(1);
+        scan_add_compute->Bind(false);
+        scan_add_compute->SetUInt("value_count", value_count);
+        if (indirect) {
+            scan_add_compute->DispatchIndirect(arguments_offset);
+        }
+        else {
+            scan_add_compute->Dispatch(block_count * group_size, 1, 1);
+        }
+    }
+}
+
+size_t GPUSort::GetScanBlockCount(size_t value_count) const
+{
+    // Each thread of the prefix sum handles 2 values
+    size_t block_size = group_size * 2;
+    return (value_count + block_size - 1) / block_size;
+}
+
+void GPUSort::ReserveCountingBuffers(size_t entry_count, size_t key_count) {
+    size_t required_capacity = std::max(entry_count, key_count);
+    if (required_capacity <= counting_capacity) {
+        return;
+    }
+
+    // Grow with a margin, such that spawning particles does not reallocate each time
+    counting_capacity = required_capacity + required_capacity / 4;
+    key_counts.SetNewDataSize(sizeof(unsigned int), counting_capacity + 1);
+    key_starts.SetNewDataSize(sizeof(unsigned int), counting_capacity + 1);
+    scratch_entries.SetNewDataSize(sizeof(SpatialIndex), counting_capacity);
+    large_buckets.SetNewDataSize(sizeof(unsigned int), SORT_LARGE_BUCKET_KEYS + counting_capacity / (SORT_SERIAL_BUCKET_LIMIT + 1));
+
+    size_t level = 0;
+    size_t block_count = GetScanBlockCount(counting_capacity + 1);
+    while (true) {
+        if (level == scan_block_sums.size()) {
+            scan_block_sums.push_back(StructuredBuffer(sizeof(unsigned int), block_count));
+        }
+        else {
+            scan_block_sums[level].SetNewDataSize(sizeof(unsigned int), block_count);
+        }
+        if (block_count == 1) {
+            break;
+        }
+        block_count = GetScanBlockCount(block_count);
+        level++;
+    }
+}
+
+void GPUSort::ReserveIncrementalBuffers(size_t entry_count) {
+    if (entry_count <= incremental_capacity) {
+        return;
+    }
+
+    incremental_capacity = entry_count + entry_count / 4;
+    previous_entries.SetNewDataSize(sizeof(SpatialIndex), incremental_capacity);
+    // The network of the changed entries is at most the power of two of the entry count
+    changed_entries.SetNewDataSize(sizeof(SpatialIndex), NextPowerOfTwo(incremental_capacity));
+    changed_offsets.SetNewDataSize(sizeof(unsigned int), incremental_capacity + 1);
+    previous_count = 0;
+}
+
+void GPUSort::SelectShaders()
+{
+    std::vector<ShaderDefine> defines = { { "COMPACT_SPATIAL_INDEX", compact_entries ? "1" : "0" } };
+    sort_compute = shader_variants.Get(SHADER_LOCATION(sort.comp), group_size, 1, 1, defines);
+    // Each variant has its own settings block, it is created the first time the variant is used
+    if (sort_compute->GetUniformBlockIndex("Settings") == (size_t)-1) {
+        sort_compute->CreateUniformBlock("Settings", sizeof(Settings));
+    }
+    offsets_compute = shader_variants.Get(SHADER_LOCATION(sort_calculate_offsets.comp), group_size, 1, 1, defines);
+
+    count_compute = shader_variants.Get(SHADER_LOCATION(sort_count.comp), group_size, 1, 1, defines);
+    scan_compute = shader_variants.Get(SHADER_LOCATION(sort_scan.comp), group_size, 1, 1, {});
+    scan_add_compute = shader_variants.Get(SHADER_LOCATION(sort_scan_add.comp), group_size, 1, 1, {});
+    scatter_compute = shader_variants.Get(SHADER_LOCATION(sort_scatter.comp), group_size, 1, 1, defines);
+    bucket_order_compute = shader_variants.Get(SHADER_LOCATION(sort_bucket_order.comp), group_size, 1, 1, defines);
+    bucket_network_compute = shader_variants.Get(SHADER_LOCATION(sort_bucket_network.comp), group_size, 1, 1, defines);
+
+    incremental_mark_compute = shader_variants.Get(SHADER_LOCATION(sort_incremental_mark.comp), group_size, 1, 1, defines);
+    incremental_split_compute = shader_variants.Get(SHADER_LOCATION(sort_incremental_split.comp), group_size, 1, 1, defines);
+    incremental_merge_compute = shader_variants.Get(SHADER_LOCATION(sort_incremental_merge.comp), group_size, 1, 1, defines);
+}
+
+void GPUSort::SetSettings(size_t entry_count, unsigned int group_width, unsigned int group_height, unsigned int step_index) {
+    Settings settings;
+    settings.num_entries = entry_count;
+    settings.group_width = group_width;
+    settings.group_height = group_height;
+    settings.step_index = step_index;
+    sort_compute->SetUniformBlock("Settings", &settings);
+    sort_compute->BindUniformBlock(0);
 }
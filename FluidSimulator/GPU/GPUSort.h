@@ -1,14 +1,236 @@
 #pragma once
 #include "ComputeShader.h"
 #include "Buffers.h"
+#include "GPUProfiler.h"
+#include "GPUReadback.h"
+#include <vector>
+
+enum class GPUSortMode : unsigned char {
+    // Bitonic merge sort network, log2(n) * (log2(n) + 1) / 2 dispatches
+    Bitonic,
+    // Counting sort over the keys. It uses a constant number of dispatches,
+    // Apart from the prefix sum which is logarithmic in base 256
+    Counting,
+    // Starts from the order of the previous sort. Only the entries whose key changed are sorted, with a
+    // Small bitonic network, and they are merged with the unchanged ones. When too many keys changed,
+    // The GPU runs a counting sort instead, without waiting for the CPU
+    Incremental
+};
+
+enum class GPUSortOffsets : unsigned char {
+    // For each key the index of its first entry, or the entry count if it has no entries
+    FirstEntry,
+    // The exclusive prefix sum of the key counts, with an additional entry at the end,
+    // Such that the entries of key k are exactly in the range [offsets[k], offsets[k + 1])
+    KeyRanges
+};
+
+// The lowercase names that the command lines use
+const char* GetGPUSortModeName(GPUSortMode mode);
+
+// Bitonic for a name that is not one of the modes
+GPUSortMode GetGPUSortModeFromName(const char* name);
+
+// What the last incremental sort that was read back went through
+struct GPUSortIncrementalStats {
+    size_t entry_count;
+    size_t changed_count;
+    // The entries of the network of the changed entries
+    size_t capacity;
+    // The changed entries did not fit the network, the fallback counting sort sorted the entries
+    bool fell_back;
+};
 
 class GPUSort {
 public:
+    inline GPUSortMode GetMode() const {
+        return mode;
+    }
+
     void Initialize();
 
-    void Execute(StructuredBuffer spatial_indices_buffer, StructuredBuffer offset_buffer, size_t entry_count);
+    // The keys of the entries must be smaller than the key count. The offset buffer must have
+    // Key count entries for FirstEntry offsets and key count + 1 entries for KeyRanges offsets
+    void Execute(
+        StructuredBuffer spatial_indices_buffer,
+        StructuredBuffer offset_buffer,
+        size_t entry_count,
+        size_t key_count,
+        GPUSortOffsets offsets_type = GPUSortOffsets::FirstEntry
+    );
+
+    inline void SetMode(GPUSortMode _mode) {
+        mode = _mode;
+    }
+
+    // The largest fraction of the entries that the network of the changed entries holds. The network is
+    // Sized from the changed count of a previous frame, with a margin, up to this fraction. The GPU compares
+    // The changed count of the current sort with the size, and when it doesn't fit, the indirect dispatches
+    // Of the fallback counting sort get their groups and sort all the entries instead
+    inline float* GetIncrementalThresholdPtr() {
+        return &incremental_threshold;
+    }
+
+    inline const GPUSortIncrementalStats& GetIncrementalStats() const {
+        return incremental_stats;
+    }
+
+    // The changed counts are read back with it. Without it, and until the first count is read, the network
+    // Is sized for the threshold. It can be nullptr
+    inline void SetReadback(GPUReadback* _readback) {
+        readback = _readback;
+    }
+
+    // The next incremental sort sorts all the entries, for when their previous order is not meaningful anymore.
+    // The changed count of the previous order is dropped as well
+    void ResetIncrementalOrder();
+
+    // Waits for the changed count of the last incremental sort, for the callers that don't update the readback
+    void WaitForIncrementalStats();
+
+    // The sorted entries were changed outside of the sort, like when the particles are reordered and the
+    // Entries point to their new locations. The next incremental sort starts from them
+    void SetIncrementalOrder(StructuredBuffer spatial_indices_buffer, size_t entry_count);
+
+    inline unsigned int GetGroupSize() const {
+        return group_size;
+    }
+
+    // Runs only the bitonic network on the entries, which orders them by their keys without the offsets.
+    // The kernel benchmark times it separately from the offsets
+    void ExecuteNetwork(StructuredBuffer spatial_indices_buffer, size_t entry_count);
+
+    // Writes the offsets of the sorted entries, the same ones that Execute writes
+    void CalculateOffsets(
+        StructuredBuffer spatial_indices_buffer,
+        StructuredBuffer offset_buffer,
+        size_t entry_count,
+        size_t key_count,
+        GPUSortOffsets offsets_type = GPUSortOffsets::FirstEntry
+    );
+
+    // The group size of all the sort shaders, the sizes that were not used before are compiled when they
+    // Are set. It must be a power of two, for the prefix sum
+    void SetGroupSize(unsigned int _group_size);
+
+    inline bool HasCompactEntries() const {
+        return compact_entries;
+    }
+
+    // The compact entries have only the index and the key, without the hash. The shaders of the layout
+    // That was not used before are compiled when it is set
+    void SetCompactEntries(bool _compact_entries);
+
+    // The bytes of an entry with the current layout
+    inline size_t GetEntrySize() const {
+        return sizeof(unsigned int) * (compact_entries ? 2 : 3);
+    }
+
+    // The dispatches are timed with this profiler, it can be nullptr
+    inline void SetProfiler(GPUProfiler* _profiler) {
+        profiler = _profiler;
+    }
 
 private:
-    ComputeShader sort_compute;
-    ComputeShader offsets_compute;
+    void ExecuteBitonic(
+        StructuredBuffer spatial_indices_buffer,
+        StructuredBuffer offset_buffer,
+        size_t entry_count,
+        size_t key_count,
+        GPUSortOffsets offsets_type
+    );
+
+    void ExecuteIncremental(
+        StructuredBuffer spatial_indices_buffer,
+        StructuredBuffer offset_buffer,
+        size_t entry_count,
+        size_t key_count,
+        GPUSortOffsets offsets_type
+    );
+
+    // A counting sort with indirect dispatches, whose group counts the split pass writes. It sorts the
+    // Entries only when the changed ones did not fit their network, otherwise its dispatches are empty.
+    // Unlike the bitonic network, its dispatch count does not grow with the entries
+    void ExecuteIncrementalFallback(StructuredBuffer spatial_indices_buffer, StructuredBuffer offset_buffer, size_t entry_count, size_t key_count);
+
+    // The entries of the network of the changed entries, for this many entries
+    size_t GetIncrementalCapacity(size_t entry_count) const;
+
+    void ExecuteCounting(
+        StructuredBuffer spatial_indices_buffer,
+        StructuredBuffer offset_buffer,
+        size_t entry_count,
+        size_t key_count,
+        GPUSortOffsets offsets_type
+    );
+
+    // Orders the entries of each key range that the scatter has left in the scratch entries by their index,
+    // And copies them to the entries. The ranges and the entries must already be bound. The indirect bucket
+    // Order takes its group count from the incremental state
+    void OrderBuckets(size_t key_count, bool write_offsets, bool indirect);
+
+    // Writes the start of each key range, including the end of the last key, into the buffer.
+    // The key counts buffer is left with the number of entries of each key
+    void CalculateKeyStarts(StructuredBuffer spatial_indices_buffer, StructuredBuffer key_starts_buffer, size_t entry_count, size_t key_count);
+
+    // Exclusive prefix sum of the first values of the buffer, done in place. The indirect dispatches
+    // Take their group counts from the incremental state
+    void ExclusiveScan(StructuredBuffer values, size_t value_count, size_t level = 0, bool indirect = false);
+
+    // The number of workgroups of the prefix sum for this many values
+    size_t GetScanBlockCount(size_t value_count) const;
+
+    // Grows the buffers used by the counting sort, if necessary
+    void ReserveCountingBuffers(size_t entry_count, size_t key_count);
+
+    // Grows the buffers used by the incremental sort, if necessary. The previous order is lost when they grow
+    void ReserveIncrementalBuffers(size_t entry_count);
+
+    void SetSettings(size_t entry_count, unsigned int group_width, unsigned int group_height, unsigned int step_index);
+
+    // Points the shaders to the variants of the group size
+    void SelectShaders();
+
+    GPUSortMode mode;
+    unsigned int group_size;
+    bool compact_entries;
+    GPUProfiler* profiler;
+    ComputeShaderVariants shader_variants;
+    ComputeShader* sort_compute;
+    ComputeShader* offsets_compute;
+
+    ComputeShader* count_compute;
+    ComputeShader* scan_compute;
+    ComputeShader* scan_add_compute;
+    ComputeShader* scatter_compute;
+    ComputeShader* bucket_order_compute;
+    ComputeShader* bucket_network_compute;
+
+    ComputeShader* incremental_mark_compute;
+    ComputeShader* incremental_split_compute;
+    ComputeShader* incremental_merge_compute;
+
+    size_t counting_capacity;
+    StructuredBuffer key_counts;
+    StructuredBuffer key_starts;
+    StructuredBuffer scratch_entries;
+    // The key ranges that are too large for the serial sort of the bucket order
+    StructuredBuffer large_buckets;
+    // One buffer for each level of the prefix sum
+    std::vector<StructuredBuffer> scan_block_sums;
+
+    float incremental_threshold;
+    size_t incremental_capacity;
+    // The entries of the previous incremental sort, in their sorted order. It is empty when the count is 0
+    size_t previous_count;
+    StructuredBuffer previous_entries;
+    StructuredBuffer changed_entries;
+    // The offsets of the changed entries in their network, with the changed count at the end
+    StructuredBuffer changed_offsets;
+    // The changed count, followed by the group counts of the fallback counting sort
+    StructuredBuffer incremental_state;
+    GPUReadback* readback;
+    // A single changed count is read back at a time
+    ReadbackTicket incremental_ticket;
+    GPUSortIncrementalStats incremental_stats;
 };
@@ -0,0 +1,157 @@
+#include "GPUUploadRing.h"
+#include "GPUBarriers.h"
+#include "glad.h"
+#include <string.h>
+
+static unsigned int ring_buffer = 0;
+// Only when the buffer is persistently mapped
+static unsigned char* mapped_data = nullptr;
+static GLsync region_fences[GPU_UPLOAD_RING_REGION_COUNT] = {};
+// Increases each time the writes move to the next region, the current region is generation % count
+static size_t generation = 0;
+// The first free byte of the current region
+static size_t region_offset = 0;
+static size_t uniform_alignment = 256;
+static GPUUploadStatistics statistics = { 0, 0, 0 };
+
+static void InitializeRing() {
+    size_t byte_size = (size_t)GPU_UPLOAD_RING_REGION_COUNT * GPU_UPLOAD_RING_REGION_SIZE;
+    glGenBuffers(1, &ring_buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ring_buffer);
+    if (GLAD_GL_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, byte_size, nullptr, flags);
+        mapped_data = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, byte_size, flags);
+    }
+    else {
+        glBufferData(GL_COPY_WRITE_BUFFER, byte_size, nullptr, GL_STREAM_DRAW);
+    }
+
+    GLint alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    if (alignment > 0) {
+        uniform_alignment = alignment;
+    }
+    // The generation 0 is reserved for the ranges that were never written
+    generation = 1;
+    region_offset = 0;
+}
+
+static void AdvanceRegion() {
+    region_fences[generation % GPU_UPLOAD_RING_REGION_COUNT] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    generation++;
+    region_offset = 0;
+
+    GLsync& fence = region_fences[generation % GPU_UPLOAD_RING_REGION_COUNT];
+    if (fence != nullptr) {
+        // Normally the fence signaled a couple of frames ago. Only a frame that fills more
+        // Than the other regions has to wait
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            statistics.wait_count++;
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+}
+
+void GPUUploadRing::NextFrame()
+{
+    // A region that wasn't written can be kept for the next frame
+    if (ring_buffer != 0 && region_offset > 0) {
+        AdvanceRegion();
+    }
+}
+
+bool GPUUploadRing::Write(const void* data, size_t byte_size, size_t alignment, GPUUploadRange& range)
+{
+    if (ring_buffer == 0) {
+        InitializeRing();
+    }
+    if (byte_size > GPU_UPLOAD_RING_REGION_SIZE) {
+        return false;
+    }
+
+    size_t offset = (region_offset + alignment - 1) / alignment * alignment;
+    if (offset + byte_size > GPU_UPLOAD_RING_REGION_SIZE) {
+        AdvanceRegion();
+        offset = 0;
+    }
+    // The regions start at multiples of their size, which keeps the alignment
+    size_t buffer_offset = (generation % GPU_UPLOAD_RING_REGION_COUNT) * GPU_UPLOAD_RING_REGION_SIZE + offset;
+    if (mapped_data != nullptr) {
+        memcpy(mapped_data + buffer_offset, data, byte_size);
+    }
+    else {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ring_buffer);
+        void* destination = glMapBufferRange(
+            GL_COPY_WRITE_BUFFER,
+            buffer_offset,
+            byte_size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT
+        );
+        memcpy(destination, data, byte_size);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    region_offset = offset + byte_size;
+
+    range.buffer = ring_buffer;
+    range.offset = buffer_offset;
+    range.generation = generation;
+    statistics.upload_count++;
+    statistics.byte_count += byte_size;
+    return true;
+}
+
+bool GPUUploadRing::IsValid(const GPUUploadRange& range)
+{
+    // The region of the range is written again once the writes went through all the other regions
+    return range.generation != 0 && generation - range.generation < GPU_UPLOAD_RING_REGION_COUNT;
+}
+
+bool GPUUploadRing::UploadToBuffer(unsigned int buffer, size_t offset, const void* data, size_t byte_size)
+{
+    if (ring_buffer == 0) {
+        InitializeRing();
+    }
+    // The unsynchronized map of each write is not cheaper than a direct update
+    if (mapped_data == nullptr || byte_size == 0 || byte_size > GPU_UPLOAD_RING_MAX_COPY_SIZE) {
+        return false;
+    }
+
+    GPUUploadRange range;
+    // The copies need only the alignment of the elements
+    Write(data, byte_size, 16, range);
+    GPUBarriers::PrepareBufferOperation(buffer);
+    glBindBuffer(GL_COPY_READ_BUFFER, range.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, range.offset, offset, byte_size);
+    return true;
+}
+
+bool GPUUploadRing::IsPersistent()
+{
+    if (ring_buffer == 0) {
+        InitializeRing();
+    }
+    return mapped_data != nullptr;
+}
+
+size_t GPUUploadRing::GetUniformAlignment()
+{
+    if (ring_buffer == 0) {
+        InitializeRing();
+    }
+    return uniform_alignment;
+}
+
+GPUUploadStatistics GPUUploadRing::GetStatistics()
+{
+    return statistics;
+}
+
+void GPUUploadRing::ResetStatistics()
+{
+    statistics = { 0, 0, 0 };
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+
+// The ring is split into regions, a region is written during a frame and it is reused only after
+// The fence inserted at the end of that frame has signaled
+#define GPU_UPLOAD_RING_REGION_COUNT 3
+#define GPU_UPLOAD_RING_REGION_SIZE (4 * 1024 * 1024)
+// The larger buffer uploads are done directly, such that they don't use up the region of the frame
+#define GPU_UPLOAD_RING_MAX_COPY_SIZE (GPU_UPLOAD_RING_REGION_SIZE / 2)
+
+// The place where some data was written in the ring
+struct GPUUploadRange {
+    unsigned int buffer;
+    size_t offset;
+    // The region in which it was written, 0 if it was never written
+    size_t generation;
+};
+
+struct GPUUploadStatistics {
+    size_t upload_count;
+    size_t byte_count;
+    // How many times a region was still used by the GPU when it had to be written again
+    size_t wait_count;
+};
+
+// A single buffer through which the small per frame uploads go, like the uniform blocks and the
+// Spawned particles, instead of reallocating or updating the buffers that the GPU might still use.
+// When GL_ARB_buffer_storage is available, the buffer is mapped once, persistently and coherently,
+// And the writes are plain copies. Otherwise each write maps its range unsynchronized, which is safe
+// Because the fences already guarantee that the GPU doesn't read it anymore
+struct GPUUploadRing {
+    // Must be called once per frame, it fences the region of the frame and moves to the next one
+    static void NextFrame();
+
+    // Copies the data into the ring, at an offset which is a multiple of the alignment. Returns false
+    // If the data doesn't fit in a region. The buffer is created the first time it is used
+    static bool Write(const void* data, size_t byte_size, size_t alignment, GPUUploadRange& range);
+
+    // If the data of the range was not overwritten yet. Each range stays valid for a couple of frames
+    static bool IsValid(const GPUUploadRange& range);
+
+    // Writes the data into the ring and copies it into the buffer on the GPU. Returns false if the
+    // Upload should be done directly, when the ring is not persistently mapped or the data is too large
+    static bool UploadToBuffer(unsigned int buffer, size_t offset, const void* data, size_t byte_size);
+
+    static bool IsPersistent();
+
+    static size_t GetUniformAlignment();
+
+    static GPUUploadStatistics GetStatistics();
+
+    static void ResetStatistics();
+};
@@ -1,6 +1,15 @@
 #pragma once
 #include "../Vec2.h"
 
+#define POSITION_FACTOR 500.0f
+
+enum class NeighbourSearchMode : unsigned int {
+    // The cells are hashed into a table with as many entries as particles, or with hash_table_size entries
+    SpatialHash,
+    // The cells of a grid that covers the window are indexed directly
+    DenseGrid
+};
+
 struct GeneralSettings {
     unsigned int num_particles;
     float gravity;
@@ -22,4 +31,28 @@ struct GeneralSettings {
     float interaction_input_radius;
     Float2 obstacle_size;
     Float2 obstacle_centre;
+    // The dense grid covers the window plus a cell margin. The cell size is at least the smoothing
+    // Radius, such that the neighbours are always in the 3x3 cells around a particle
+    Float2 grid_origin;
+    unsigned int grid_width;
+    unsigned int grid_height;
+    float grid_cell_size;
+    NeighbourSearchMode neighbour_search_mode;
+    // When the capacity is not 0, the neighbours inside the smoothing radius are gathered once per step
+    // Into lists with this capacity, which are iterated by the density, pressure and viscosity passes
+    unsigned int neighbour_list_capacity;
+    // If not 0, the lists store the distances as well, such that the passes don't recompute them
+    unsigned int neighbour_list_distances;
+    // The entries of the spatial hash table. A power of two, such that the key is the hash masked with the
+    // Size minus one and the table doesn't change when particles are added. 0 uses a table with as many
+    // Entries as particles
+    unsigned int hash_table_size;
+    // Every this many steps the particle buffers are permuted into cell order, 0 disables it.
+    // The shaders don't use it, it is here such that the recordings replay with the same order
+    unsigned int reorder_interval;
 };
+
+// The key of a cell hash in the spatial hash table, the same as the shaders
+inline unsigned int GetHashTableKey(const GeneralSettings& settings, unsigned int hash, unsigned int particle_count) {
+    return settings.hash_table_size != 0 ? hash & (settings.hash_table_size - 1) : hash % particle_count;
+}
@@ -0,0 +1,57 @@
+#include "HeadlessContext.h"
+#include "glad.h"
+
+#ifdef _WIN32
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifdef _WIN32
+
+bool CreateHeadlessContext() {
+    if (!glfwInit()) {
+        return false;
+    }
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    GLFWwindow* window = glfwCreateWindow(1, 1, "FluidSimulator headless", nullptr, nullptr);
+    if (window == nullptr) {
+        return false;
+    }
+    glfwMakeContextCurrent(window);
+    return gladLoadGLLoader((GLADloadproc)glfwGetProcAddress) != 0;
+}
+
+#else
+
+bool CreateHeadlessContext() {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display == nullptr) {
+        return false;
+    }
+    EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    EGLint major_version, minor_version;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major_version, &minor_version) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+
+    // The context is used without any surface, it only needs the compute shaders
+    const EGLint context_attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        return false;
+    }
+    return gladLoadGLLoader((GLADloadproc)eglGetProcAddress) != 0;
+}
+
+#endif
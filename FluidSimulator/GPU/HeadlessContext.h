@@ -0,0 +1,6 @@
+#pragma once
+
+// Creates an OpenGL 4.3 core context without a visible window and makes it current, for the headless runner
+// And the benchmarks. On Windows it comes from a hidden GLFW window (which also works with the Mesa llvmpipe
+// Opengl32.dll), elsewhere from a surfaceless EGL display. Returns false if it couldn't be created
+bool CreateHeadlessContext();
@@ -0,0 +1,323 @@
+#include "KernelBenchmark.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+
+// The same constants as the hash of the shaders
+#define HASH_K1 15823u
+#define HASH_K2 9737333u
+// The clusters have half of the spacing of the fluid
+#define CLUSTER_COUNT 16
+#define CLUSTER_SPACING_FACTOR 0.5f
+// The sheets are bent by a wave with this many periods over the width
+#define SHEET_WAVE_PERIODS 3.0f
+
+static const char* KERNEL_NAMES[] = {
+    "simulation_early",
+    "sort",
+    "sort_calculate_offsets",
+    "calculate_density",
+    "calculate_pressure",
+    "calculate_viscosity_update_pos"
+};
+
+static const char* DISTRIBUTION_NAMES[] = {
+    "uniform",
+    "clustered",
+    "splash_sheet",
+    "near_empty"
+};
+
+static_assert(std::size(KERNEL_NAMES) == (size_t)BenchmarkKernel::Count, "Each kernel needs a name");
+static_assert(std::size(DISTRIBUTION_NAMES) == (size_t)KernelDistribution::Count, "Each distribution needs a name");
+
+// Xorshift, such that the layouts are reproducible. Returns a value in [0, 1)
+static float NextRandom(unsigned int& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (float)(state >> 8) / (float)(1 << 24);
+}
+
+static int GetCellCoordinate(float value, float cell_size) {
+    return (int)floorf(value / cell_size);
+}
+
+const char* GetBenchmarkKernelName(BenchmarkKernel kernel)
+{
+    return KERNEL_NAMES[(size_t)kernel];
+}
+
+const char* GetKernelDistributionName(KernelDistribution distribution)
+{
+    return DISTRIBUTION_NAMES[(size_t)distribution];
+}
+
+std::vector<Float2> GenerateKernelDistribution(
+    KernelDistribution distribution,
+    size_t particle_count,
+    float half_width,
+    float half_height,
+    float spacing,
+    unsigned int seed
+) {
+    std::vector<Float2> positions;
+    positions.reserve(particle_count);
+    // The state of xorshift must not be 0
+    unsigned int state = seed != 0 ? seed : 1;
+    // The particles stay a spacing away from the borders
+    float min_x = -half_width + spacing;
+    float max_x = half_width - spacing;
+    float min_y = -half_height + spacing;
+    float max_y = half_height - spacing;
+    float width = max_x - min_x;
+    float height = max_y - min_y;
+
+    switch (distribution) {
+    case KernelDistribution::Uniform:
+    {
+        // The pool has the area that the particles take at rest, up to the whole domain
+        float pool_height = std::min((float)particle_count * spacing * spacing / width, height);
+        for (size_t index = 0; index < particle_count; index++) {
+            float x = min_x + NextRandom(state) * width;
+            float y = min_y + NextRandom(state) * pool_height;
+            positions.push_back({ x, y });
+        }
+        break;
+    }
+    case KernelDistribution::Clustered:
+    {
+        size_t cluster_count = std::min((size_t)CLUSTER_COUNT, particle_count);
+        size_t per_cluster_count = (particle_count + cluster_count - 1) / cluster_count;
+        float cluster_spacing = spacing * CLUSTER_SPACING_FACTOR;
+        float radius = sqrtf((float)per_cluster_count / (float)M_PI) * cluster_spacing;
+        // A cluster that is larger than the domain is clamped to its borders
+        float center_margin = std::min(radius, std::min(width, height) * 0.5f);
+        Float2 center;
+        for (size_t index = 0; index < particle_count; index++) {
+            if (index % per_cluster_count == 0) {
+                center.x = min_x + center_margin + NextRandom(state) * (width - 2.0f * center_margin);
+                center.y = min_y + center_margin + NextRandom(state) * (height - 2.0f * center_margin);
+            }
+            // The square root of the radius fraction spreads the particles evenly over the disc
+            float distance = sqrtf(NextRandom(state)) * radius;
+            float angle = NextRandom(state) * 2.0f * (float)M_PI;
+            float x = std::clamp(center.x + cosf(angle) * distance, min_x, max_x);
+            float y = std::clamp(center.y + sinf(angle) * distance, min_y, max_y);
+            positions.push_back({ x, y });
+        }
+        break;
+    }
+    case KernelDistribution::SplashSheet:
+    {
+        // Each sheet is two rows of particles with the spacing of the fluid over the whole width
+        size_t per_sheet_count = std::max((size_t)(width / spacing), (size_t)1) * 2;
+        size_t sheet_count = (particle_count + per_sheet_count - 1) / per_sheet_count;
+        float sheet_distance = height / (float)sheet_count;
+        // The wave stays inside the space between the sheets
+        float amplitude = std::max(sheet_distance * 0.5f - spacing, 0.0f) * 0.5f;
+        for (size_t index = 0; index < particle_count; index++) {
+            size_t sheet = index / per_sheet_count;
+            size_t row = (index % per_sheet_count) % 2;
+            size_t column = (index % per_sheet_count) / 2;
+            float x = min_x + ((float)column + 0.5f * (float)row) * spacing;
+            float wave = sinf((x - min_x) / width * SHEET_WAVE_PERIODS * 2.0f * (float)M_PI + (float)sheet);
+            float y = min_y + ((float)sheet + 0.5f) * sheet_distance + wave * amplitude + (float)row * spacing;
+            positions.push_back({ x, std::clamp(y, min_y, max_y) });
+        }
+        break;
+    }
+    case KernelDistribution::NearEmpty:
+        for (size_t index = 0; index < particle_count; index++) {
+            float x = min_x + NextRandom(state) * width;
+            float y = min_y + NextRandom(state) * height;
+            positions.push_back({ x, y });
+        }
+        break;
+    case KernelDistribution::Count:
+        // Only the parsed names reach here, Count is not a distribution
+        assert(false);
+        break;
+    }
+    return positions;
+}
+
+NeighbourSearchStats AnalyzeNeighbourSearch(const std::vector<Float2>& predicted_positions, const GeneralSettings& settings, bool compact_entries)
+{
+    NeighbourSearchStats stats = {};
+    size_t particle_count = predicted_positions.size();
+    stats.is_dense_grid = settings.neighbour_search_mode == NeighbourSearchMode::DenseGrid;
+    stats.entry_size = sizeof(unsigned int) * (compact_entries ? 2 : 3);
+    stats.entry_count = particle_count;
+    if (stats.is_dense_grid) {
+        stats.key_count = (size_t)settings.grid_width * (size_t)settings.grid_height;
+    }
+    else {
+        stats.key_count = settings.hash_table_size != 0 ? settings.hash_table_size : particle_count;
+    }
+    if (particle_count == 0) {
+        return stats;
+    }
+
+    std::vector<unsigned int> key_entries(stats.key_count, 0);
+    // The entries of a key with a different hash are walked, but their positions are not read
+    std::unordered_map<unsigned int, unsigned int> hash_entries;
+    auto get_hash_entries = [&](unsigned int hash) {
+        auto iterator = hash_entries.find(hash);
+        return iterator != hash_entries.end() ? iterator->second : 0;
+    };
+    auto get_grid_cell = [&](Float2 position, int& x, int& y) {
+        x = std::clamp(GetCellCoordinate(position.x - settings.grid_origin.x, settings.grid_cell_size), 0, (int)settings.grid_width - 1);
+        y = std::clamp(GetCellCoordinate(position.y - settings.grid_origin.y, settings.grid_cell_size), 0, (int)settings.grid_height - 1);
+    };
+    auto get_hash = [&](int x, int y) {
+        // The shaders multiply the cell coordinates as unsigned integers, which wrap around
+        return (unsigned int)x * HASH_K1 + (unsigned int)y * HASH_K2;
+    };
+
+    for (size_t index = 0; index < particle_count; index++) {
+        int x, y;
+        unsigned int hash;
+        unsigned int key;
+        if (stats.is_dense_grid) {
+            get_grid_cell(predicted_positions[index], x, y);
+            // The cell index is the key, there are no collisions
+            key = (unsigned int)y * settings.grid_width + (unsigned int)x;
+            hash = key;
+        }
+        else {
+            x = GetCellCoordinate(predicted_positions[index].x, settings.smoothing_radius);
+            y = GetCellCoordinate(predicted_positions[index].y, settings.smoothing_radius);
+            hash = get_hash(x, y);
+            key = GetHashTableKey(settings, hash, (unsigned int)particle_count);
+        }
+        key_entries[key]++;
+        hash_entries[hash]++;
+    }
+
+    for (size_t index = 0; index < stats.key_count; index++) {
+        stats.used_key_count += key_entries[index] > 0 ? 1 : 0;
+        stats.max_key_entries = std::max(stats.max_key_entries, (size_t)key_entries[index]);
+        size_t bin = 0;
+        while (bin < KEY_LENGTH_HISTOGRAM_SIZE - 1 && key_entries[index] >= (1u << bin)) {
+            bin++;
+        }
+        stats.key_length_histogram[bin]++;
+    }
+    if (!stats.is_dense_grid) {
+        // Each distinct hash is a cell, a key with entries of several cells is a collision
+        std::vector<unsigned char> key_cells(stats.key_count, 0);
+        for (auto iterator = hash_entries.begin(); iterator != hash_entries.end(); iterator++) {
+            unsigned int key = GetHashTableKey(settings, iterator->first, (unsigned int)particle_count);
+            if (key_cells[key] == 1) {
+                stats.collided_key_count++;
+            }
+            key_cells[key] = std::min(key_cells[key] + 1, 2);
+        }
+    }
+
+    for (size_t index = 0; index < particle_count; index++) {
+        int origin_x, origin_y;
+        if (stats.is_dense_grid) {
+            get_grid_cell(predicted_positions[index], origin_x, origin_y);
+        }
+        else {
+            origin_x = GetCellCoordinate(predicted_positions[index].x, settings.smoothing_radius);
+            origin_y = GetCellCoordinate(predicted_positions[index].y, settings.smoothing_radius);
+        }
+
+        unsigned int walked_keys[9];
+        size_t walked_key_count = 0;
+        for (int offset_y = -1; offset_y <= 1; offset_y++) {
+            for (int offset_x = -1; offset_x <= 1; offset_x++) {
+                int x = origin_x + offset_x;
+                int y = origin_y + offset_y;
+                if (stats.is_dense_grid) {
+                    if (x < 0 || y < 0 || x >= (int)settings.grid_width || y >= (int)settings.grid_height) {
+                        continue;
+                    }
+                    unsigned int key = (unsigned int)y * settings.grid_width + (unsigned int)x;
+                    stats.walked_entries += key_entries[key];
+                    stats.matched_entries += key_entries[key];
+                }
+                else if (compact_entries) {
+                    unsigned int hash = get_hash(x, y);
+                    unsigned int key = GetHashTableKey(settings, hash, (unsigned int)particle_count);
+                    if (std::find(walked_keys, walked_keys + walked_key_count, key) == walked_keys + walked_key_count) {
+                        walked_keys[walked_key_count++] = key;
+                        stats.walked_entries += key_entries[key];
+                        stats.matched_entries += key_entries[key];
+                    }
+                    // The entries of the cell are walked with its key, the rest of the key are foreign
+                    stats.foreign_entries -= get_hash_entries(hash);
+                }
+                else {
+                    unsigned int hash = get_hash(x, y);
+                    unsigned int key = GetHashTableKey(settings, hash, (unsigned int)particle_count);
+                    stats.walked_entries += key_entries[key];
+                    stats.matched_entries += get_hash_entries(hash);
+                    stats.foreign_entries += key_entries[key] - get_hash_entries(hash);
+                }
+            }
+        }
+    }
+    if (compact_entries && !stats.is_dense_grid) {
+        stats.foreign_entries += stats.walked_entries;
+    }
+    return stats;
+}
+
+double GetKernelBytes(BenchmarkKernel kernel, size_t particle_count, const NeighbourSearchStats& stats)
+{
+    double particles = (double)particle_count;
+    double entry_size = (double)stats.entry_size;
+    // The spatial hash reads the first entry of each of the 9 keys, the dense grid reads the range
+    double offsets_bytes = particles * 9.0 * (stats.is_dense_grid ? 8.0 : 4.0);
+    // Each walked entry is read, the position of a matched one is read as well
+    double neighbour_bytes = stats.walked_entries * entry_size + stats.matched_entries * sizeof(Float2);
+
+    switch (kernel) {
+    case BenchmarkKernel::SimulationEarly:
+    {
+        // Reads the position and the velocity, writes the velocity, the predicted position and the entry.
+        // The offsets of the whole hash table are reset
+        double reset_count = stats.is_dense_grid ? 0.0 : (double)stats.key_count;
+        return particles * (4.0 * sizeof(Float2) + entry_size) + reset_count * sizeof(unsigned int);
+    }
+    case BenchmarkKernel::Sort:
+    {
+        // Each step compares pairs of entries over the power of two, which are read and written
+        double padded_count = 1.0;
+        double stage_count = 0.0;
+        while (padded_count < particles) {
+            padded_count *= 2.0;
+            stage_count += 1.0;
+        }
+        double step_count = stage_count * (stage_count + 1.0) / 2.0;
+        return step_count * padded_count * entry_size * 2.0;
+    }
+    case BenchmarkKernel::SortCalculateOffsets:
+        if (stats.is_dense_grid) {
+            // The counts are read for the prefix sum, which reads and writes each start
+            return particles * 2.0 * sizeof(unsigned int) + (double)(stats.key_count + 1) * 4.0 * sizeof(unsigned int);
+        }
+        // The key of each entry, and an offset for each key that has entries
+        return particles * 2.0 * sizeof(unsigned int) + (double)stats.used_key_count * sizeof(unsigned int);
+    case BenchmarkKernel::Density:
+        // Reads the predicted position and writes the densities
+        return particles * 2.0 * sizeof(Float2) + offsets_bytes + neighbour_bytes;
+    case BenchmarkKernel::Pressure:
+        // Reads the predicted position and the densities, reads and writes the velocity. The densities
+        // Of the matched neighbours are read as well
+        return particles * 4.0 * sizeof(Float2) + offsets_bytes + neighbour_bytes + stats.matched_entries * sizeof(Float2);
+    case BenchmarkKernel::ViscosityUpdatePos:
+        // Reads the predicted position, reads and writes the velocity and the position. The velocities
+        // Of the matched neighbours are read as well
+        return particles * 5.0 * sizeof(Float2) + offsets_bytes + neighbour_bytes + stats.matched_entries * sizeof(Float2);
+    default:
+        return 0.0;
+    }
+}
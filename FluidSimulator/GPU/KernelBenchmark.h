@@ -0,0 +1,113 @@
+#pragma once
+#include "GeneralSettings.h"
+#include <vector>
+
+// The keys are counted by their entries in power of two bins. The first bin has the empty keys, bin i
+// The keys with [2^(i - 1), 2^i) entries, and the last one all the longer keys
+#define KEY_LENGTH_HISTOGRAM_SIZE 12
+
+// The kernels of a step that the kernel benchmark times on their own
+enum class BenchmarkKernel : unsigned char {
+    SimulationEarly,
+    // Only the bitonic network, without the offsets
+    Sort,
+    SortCalculateOffsets,
+    Density,
+    Pressure,
+    ViscosityUpdatePos,
+    Count
+};
+
+// The particle layouts that the kernels are timed on. Each one gives the neighbour search a different
+// Number of neighbours and of entries for each key
+enum class KernelDistribution : unsigned char {
+    // Random positions in a pool at the bottom, with the density of the fluid
+    Uniform,
+    // Small discs with four times the density of the fluid, with long key runs and many neighbours
+    Clustered,
+    // Horizontal sheets that are two particles thick, the neighbours are along a line and most cells are empty
+    SplashSheet,
+    // Random positions over the whole domain, with few neighbours
+    NearEmpty,
+    Count
+};
+
+// What the neighbour search of the kernels goes through for a layout, read from the predicted positions
+struct NeighbourSearchStats {
+    bool is_dense_grid;
+    // The bytes of a spatial index
+    size_t entry_size;
+    size_t entry_count;
+    size_t key_count;
+    // The keys that have at least an entry
+    size_t used_key_count;
+    // The keys that have the entries of more than one cell. The dense grid has none
+    size_t collided_key_count;
+    // The longest run of entries with the same key
+    size_t max_key_entries;
+    size_t key_length_histogram[KEY_LENGTH_HISTOGRAM_SIZE];
+    // Summed over all the particles. The walked entries are all the entries with the keys of the 3x3
+    // Cells, the matched ones are those whose positions are read. With the full entries, those are the
+    // Entries of the cells themselves. The compact entries don't have the hash, all the walked entries
+    // Are matched, and a key that two of the cells share is walked once
+    double walked_entries;
+    double matched_entries;
+    // The walked entries that belong to other cells than the 3x3 ones, which come from the collisions
+    double foreign_entries;
+
+    // The entries for each key of the table
+    inline double GetLoadFactor() const {
+        return key_count > 0 ? (double)entry_count / (double)key_count : 0.0;
+    }
+
+    // The fraction of the used keys that are shared by several cells
+    inline double GetCollisionRate() const {
+        return used_key_count > 0 ? (double)collided_key_count / (double)used_key_count : 0.0;
+    }
+
+    // The fraction of the walked entries that are not in the 3x3 cells
+    inline double GetForeignEntryRate() const {
+        return walked_entries > 0.0 ? foreign_entries / walked_entries : 0.0;
+    }
+};
+
+struct KernelBenchmarkResult {
+    BenchmarkKernel kernel;
+    size_t particle_count;
+    size_t iteration_count;
+    // The GPU times of a dispatch, in milliseconds
+    double average_time;
+    double min_time;
+    // An estimate of the bytes that a dispatch reads and writes, from the sizes of the buffers
+    // And the neighbour search stats. The caches can make the real traffic smaller
+    double bytes;
+
+    inline double GetParticlesPerSecond() const {
+        return (double)particle_count * 1000.0 / average_time;
+    }
+
+    inline double GetGigabytesPerSecond() const {
+        return bytes / (average_time * 1'000'000.0);
+    }
+};
+
+const char* GetBenchmarkKernelName(BenchmarkKernel kernel);
+
+const char* GetKernelDistributionName(KernelDistribution distribution);
+
+// The positions of the layout inside the domain, which extends by the half sizes around the origin. The
+// Spacing is the one of the fluid at rest. The same seed gives the same positions
+std::vector<Float2> GenerateKernelDistribution(
+    KernelDistribution distribution,
+    size_t particle_count,
+    float half_width,
+    float half_height,
+    float spacing,
+    unsigned int seed
+);
+
+// Finds the keys of the particles like the shaders do, with the grid, the hash table size and the smoothing
+// Radius of the settings
+NeighbourSearchStats AnalyzeNeighbourSearch(const std::vector<Float2>& predicted_positions, const GeneralSettings& settings, bool compact_entries);
+
+double GetKernelBytes(BenchmarkKernel kernel, size_t particle_count, const NeighbourSearchStats& stats);
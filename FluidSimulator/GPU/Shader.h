@@ -1,11 +1,17 @@
 #pragma once
+#include "GPUBarriers.h"
+#include "ShaderCache.h"
 
 class Shader {
 public:
     Shader() { ID = -1; }
+    // The compile is only started, it is waited for when the shader is first used
     Shader(const char* vertex_path, const char* pixel_path);
 
-    void Use() const;
+    void Use();
+
+    // Waits for the compile of the program, the errors are printed and the program is left invalid
+    void WaitForCompile();
 
     void SetBool(const char* name, bool value) const;
 
@@ -21,4 +27,8 @@ public:
 
 private:
     unsigned int ID;
+    // The storage blocks of both stages that the program uses
+    std::vector<GPUStorageBinding> storage_bindings;
+    // While the program is compiled
+    std::shared_ptr<ShaderProgramBuild> build;
 };
@@ -0,0 +1,273 @@
+#include "ShaderCache.h"
+#include "glad.h"
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#define SHADER_CACHE_MAGIC 0x48435346
+#define SHADER_CACHE_VERSION 1
+
+struct ShaderCacheHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int binary_format;
+    unsigned int byte_size;
+    unsigned long long key;
+};
+
+static std::string cache_directory = SHADER_CACHE_DEFAULT_DIRECTORY;
+static bool cache_enabled = true;
+// If the driver has a binary format, to save the programs
+static bool binary_supported = false;
+static bool initialized = false;
+static ShaderCacheStatistics statistics = { 0, 0, 0 };
+// The programs that are compiled from the sources and were not finished yet
+static std::vector<std::weak_ptr<ShaderProgramBuild>> pending_builds;
+
+static void Initialize() {
+    initialized = true;
+    // Without a binary format the driver can't save the programs
+    GLint format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    binary_supported = format_count > 0;
+    if (GLAD_GL_KHR_parallel_shader_compile) {
+        // Let the driver use as many threads as it wants
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    }
+}
+
+static unsigned long long HashBytes(const void* data, size_t byte_size, unsigned long long hash) {
+    // 64 bit FNV-1a
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t index = 0; index < byte_size; index++) {
+        hash ^= bytes[index];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static unsigned long long HashString(const char* string, unsigned long long hash) {
+    // The terminator separates the strings
+    return HashBytes(string, string != nullptr ? strlen(string) + 1 : 0, hash);
+}
+
+static unsigned long long GetProgramKey(const std::vector<ShaderStage>& stages) {
+    unsigned long long hash = ShaderCache::GetDriverKey();
+    for (size_t index = 0; index < stages.size(); index++) {
+        hash = HashBytes(&stages[index].type, sizeof(stages[index].type), hash);
+        hash = HashString(stages[index].source.text.c_str(), hash);
+    }
+    return hash;
+}
+
+static std::string GetCachePath(unsigned long long key) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", key);
+    return cache_directory + name;
+}
+
+static bool LoadProgramBinary(unsigned int program_id, unsigned long long key) {
+    FILE* file = fopen(GetCachePath(key).c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    ShaderCacheHeader header;
+    std::vector<char> binary;
+    bool success = fread(&header, sizeof(header), 1, file) == 1 && header.magic == SHADER_CACHE_MAGIC
+        && header.version == SHADER_CACHE_VERSION && header.key == key;
+    if (success) {
+        binary.resize(header.byte_size);
+        success = fread(binary.data(), 1, binary.size(), file) == binary.size();
+    }
+    fclose(file);
+    if (!success) {
+        return false;
+    }
+
+    glProgramBinary(program_id, header.binary_format, binary.data(), binary.size());
+    GLint link_status = 0;
+    glGetProgramiv(program_id, GL_LINK_STATUS, &link_status);
+    if (!link_status) {
+        statistics.rejected_count++;
+    }
+    return link_status != 0;
+}
+
+static void SaveProgramBinary(unsigned int program_id, unsigned long long key) {
+    GLint byte_size = 0;
+    glGetProgramiv(program_id, GL_PROGRAM_BINARY_LENGTH, &byte_size);
+    if (byte_size <= 0) {
+        return;
+    }
+
+    ShaderCacheHeader header;
+    std::vector<char> binary(byte_size);
+    GLsizei written_size = 0;
+    GLenum binary_format = 0;
+    glGetProgramBinary(program_id, byte_size, &written_size, &binary_format, binary.data());
+    header.magic = SHADER_CACHE_MAGIC;
+    header.version = SHADER_CACHE_VERSION;
+    header.binary_format = binary_format;
+    header.byte_size = written_size;
+    header.key = key;
+
+#ifdef _WIN32
+    _mkdir(cache_directory.c_str());
+#else
+    mkdir(cache_directory.c_str(), 0755);
+#endif
+    // A different file is written first, such that a process that runs at the same time never
+    // Reads a partial binary
+    std::string path = GetCachePath(key);
+    std::string temporary_path = path + ".tmp";
+    FILE* file = fopen(temporary_path.c_str(), "wb");
+    if (file == nullptr) {
+        return;
+    }
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, written_size, file) == (size_t)written_size;
+    fclose(file);
+    if (success) {
+        // The rename of the C runtime doesn't replace a file on Windows
+        remove(path.c_str());
+        success = rename(temporary_path.c_str(), path.c_str()) == 0;
+    }
+    if (!success) {
+        remove(temporary_path.c_str());
+    }
+}
+
+static const char* GetStageName(unsigned int type) {
+    switch (type) {
+    case GL_VERTEX_SHADER:
+        return "Vertex";
+    case GL_FRAGMENT_SHADER:
+        return "Pixel";
+    default:
+        return "Compute";
+    }
+}
+
+void ShaderCache::SetDirectory(const char* directory)
+{
+    cache_enabled = directory != nullptr;
+    if (directory != nullptr) {
+        cache_directory = directory;
+    }
+}
+
+std::shared_ptr<ShaderProgramBuild> ShaderCache::BeginProgram(const std::vector<ShaderStage>& stages)
+{
+    if (!initialized) {
+        Initialize();
+    }
+
+    std::shared_ptr<ShaderProgramBuild> build = std::make_shared<ShaderProgramBuild>();
+    build->stages = stages;
+    build->key = GetProgramKey(stages);
+    build->loaded_from_cache = false;
+    build->finished = false;
+    build->success = false;
+    build->program_id = glCreateProgram();
+    bool use_cache = cache_enabled && binary_supported;
+    if (use_cache) {
+        if (LoadProgramBinary(build->program_id, build->key)) {
+            build->loaded_from_cache = true;
+            build->finished = true;
+            build->success = true;
+            statistics.hit_count++;
+            return build;
+        }
+        // A program whose binary was rejected is not reused
+        glDeleteProgram(build->program_id);
+        build->program_id = glCreateProgram();
+        glProgramParameteri(build->program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    statistics.miss_count++;
+
+    // None of the statuses is asked here, that would wait for the compile
+    for (size_t index = 0; index < stages.size(); index++) {
+        unsigned int shader_id = glCreateShader(stages[index].type);
+        const char* shader_text = stages[index].source.text.c_str();
+        int shader_size = stages[index].source.text.size();
+        glShaderSource(shader_id, 1, &shader_text, &shader_size);
+        glCompileShader(shader_id);
+        glAttachShader(build->program_id, shader_id);
+        build->shader_ids.push_back(shader_id);
+    }
+    glLinkProgram(build->program_id);
+    pending_builds.push_back(build);
+    return build;
+}
+
+bool ShaderCache::FinishProgram(ShaderProgramBuild& build)
+{
+    if (build.finished) {
+        return build.success;
+    }
+    build.finished = true;
+
+    int success = 1;
+    char info_log[2048];
+    for (size_t index = 0; index < build.shader_ids.size() && success; index++) {
+        glGetShaderiv(build.shader_ids[index], GL_COMPILE_STATUS, &success);
+        if (!success) {
+            glGetShaderInfoLog(build.shader_ids[index], sizeof(info_log), NULL, info_log);
+            std::cout << GetStageName(build.stages[index].type) << " shader compilation error\n" << info_log << "\n-------------------------------------------------------\n";
+            PrintShaderSourceFiles(build.stages[index].source);
+        }
+    }
+    if (success) {
+        glGetProgramiv(build.program_id, GL_LINK_STATUS, &success);
+        if (!success) {
+            glGetProgramInfoLog(build.program_id, sizeof(info_log), NULL, info_log);
+            std::cout << "Program link error\n" << info_log << "\n -------------------------------------------------------\n";
+        }
+    }
+
+    for (size_t index = 0; index < build.shader_ids.size(); index++) {
+        glDetachShader(build.program_id, build.shader_ids[index]);
+        glDeleteShader(build.shader_ids[index]);
+    }
+    build.shader_ids.clear();
+
+    if (success && cache_enabled && binary_supported) {
+        SaveProgramBinary(build.program_id, build.key);
+    }
+    build.success = success != 0;
+    return build.success;
+}
+
+void ShaderCache::FinishPrograms()
+{
+    for (size_t index = 0; index < pending_builds.size(); index++) {
+        std::shared_ptr<ShaderProgramBuild> build = pending_builds[index].lock();
+        if (build != nullptr) {
+            FinishProgram(*build);
+        }
+    }
+    pending_builds.clear();
+}
+
+unsigned long long ShaderCache::GetDriverKey()
+{
+    // The strings don't change while the context exists
+    static unsigned long long driver_key = 0;
+    if (driver_key == 0) {
+        driver_key = 0xCBF29CE484222325ULL;
+        driver_key = HashString((const char*)glGetString(GL_VENDOR), driver_key);
+        driver_key = HashString((const char*)glGetString(GL_RENDERER), driver_key);
+        driver_key = HashString((const char*)glGetString(GL_VERSION), driver_key);
+    }
+    return driver_key;
+}
+
+ShaderCacheStatistics ShaderCache::GetStatistics()
+{
+    return statistics;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include "ShaderPreprocessor.h"
+
+#define SHADER_CACHE_DEFAULT_DIRECTORY "shader_cache"
+
+// A preprocessed stage of a program, with the GL shader type
+struct ShaderStage {
+    unsigned int type;
+    ShaderSource source;
+};
+
+// A program whose compile and link were started but not waited for, such that the driver can compile
+// The other programs in the meantime
+struct ShaderProgramBuild {
+    unsigned int program_id;
+    // Only for the programs that are compiled from the sources
+    std::vector<unsigned int> shader_ids;
+    std::vector<ShaderStage> stages;
+    // The hash of the driver and of the sources, which names the cache file
+    unsigned long long key;
+    bool loaded_from_cache;
+    bool finished;
+    bool success;
+};
+
+struct ShaderCacheStatistics {
+    // The programs that were loaded from their binary
+    size_t hit_count;
+    // The programs that were compiled from the sources
+    size_t miss_count;
+    // The programs whose binary was rejected by the driver, after an update for example
+    size_t rejected_count;
+};
+
+// The linked programs are saved with glGetProgramBinary, in a file named after the hash of the driver
+// Strings and of the preprocessed sources, such that a changed shader or driver doesn't load an old
+// Binary. With GL_KHR_parallel_shader_compile the driver compiles on its own threads, the programs
+// That are started one after the other are compiled in parallel until each is first used
+struct ShaderCache {
+    // The directory in which the binaries are saved, nullptr disables the cache. It is created when
+    // The first binary is written
+    static void SetDirectory(const char* directory);
+
+    // Loads the binary of the program or starts compiling it
+    static std::shared_ptr<ShaderProgramBuild> BeginProgram(const std::vector<ShaderStage>& stages);
+
+    // Waits for the program, and prints the errors if it failed. The binary of a program that was
+    // Compiled is saved. Calling it again returns the same result
+    static bool FinishProgram(ShaderProgramBuild& build);
+
+    // Finishes all the programs that were started, such that the ones which are not used right
+    // Away are saved as well
+    static void FinishPrograms();
+
+    // The hash of the vendor, renderer and version strings, it identifies the device and its driver
+    static unsigned long long GetDriverKey();
+
+    static ShaderCacheStatistics GetStatistics();
+};
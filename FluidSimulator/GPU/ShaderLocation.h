@@ -1,4 +1,8 @@
 #pragma once
 
+// The shaders are read from here only when they are not embedded (the projects embed them before each build).
+// It can be given on the command line, for the builds that don't run from this machine
+#ifndef SHADER_BASE_LOCATION
 #define SHADER_BASE_LOCATION "C:\\Users\\Andrei\\Documents\\Facultate\\Parallel and Distributed Programming\\FluidSimulator\\FluidSimulator\\FluidSimulator\\GPU\\Shaders\\"
+#endif
 #define SHADER_LOCATION(name) SHADER_BASE_LOCATION #name
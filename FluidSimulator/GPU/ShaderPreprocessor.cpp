@@ -0,0 +1,145 @@
+#include "ShaderPreprocessor.h"
+#include "GeneralSettings.h"
+#include "EmbeddedShaders.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+
+#define SHADER_STRINGIFY_VALUE(value) #value
+#define SHADER_STRINGIFY(value) SHADER_STRINGIFY_VALUE(value)
+
+static bool ReadShaderFile(const std::string& path, std::string& text) {
+    // The embedded shaders don't depend on the location of the files
+    const char* embedded_text = GetEmbeddedShader(path.c_str());
+    if (embedded_text != nullptr) {
+        text = embedded_text;
+        return true;
+    }
+
+    std::ifstream file_stream(path);
+    if (!file_stream) {
+        return false;
+    }
+    std::stringstream string_stream;
+    string_stream << file_stream.rdbuf();
+    text = string_stream.str();
+    return true;
+}
+
+// Returns the rest of the line if it is the directive, nullptr otherwise
+static const char* MatchDirective(const std::string& line, const char* directive) {
+    const char* characters = line.c_str();
+    while (*characters == ' ' || *characters == '\t') {
+        characters++;
+    }
+    size_t directive_size = strlen(directive);
+    if (strncmp(characters, directive, directive_size) != 0) {
+        return nullptr;
+    }
+    return characters + directive_size;
+}
+
+static void AppendLineDirective(size_t line_number, size_t file_index, std::string& text) {
+    text += "#line " + std::to_string(line_number) + " " + std::to_string(file_index) + "\n";
+}
+
+static void AppendDefines(const std::vector<ShaderDefine>& defines, std::string& text) {
+    text += "#define POSITION_FACTOR " SHADER_STRINGIFY(POSITION_FACTOR) "\n";
+    for (size_t index = 0; index < defines.size(); index++) {
+        text += "#define " + defines[index].name + " " + defines[index].value + "\n";
+    }
+}
+
+// The defines are given only for the file that was asked for, the included ones don't have a #version
+static bool ExpandShaderFile(const std::string& path, const std::vector<ShaderDefine>* defines, ShaderSource& source) {
+    std::string text;
+    if (!ReadShaderFile(path, text)) {
+        std::cout << "Failed to read the shader file " << path << "\n";
+        return false;
+    }
+
+    size_t file_index = source.files.size();
+    source.files.push_back(path);
+    std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+    if (file_index > 0) {
+        AppendLineDirective(1, file_index, source.text);
+    }
+
+    bool inserted_defines = defines == nullptr;
+    size_t line_number = 1;
+    size_t offset = 0;
+    while (offset < text.size()) {
+        size_t line_end = text.find('\n', offset);
+        if (line_end == std::string::npos) {
+            line_end = text.size();
+        }
+        std::string line = text.substr(offset, line_end - offset);
+        offset = line_end + 1;
+
+        const char* include = MatchDirective(line, "#include");
+        if (include != nullptr) {
+            const char* name_start = strchr(include, '"');
+            const char* name_end = name_start != nullptr ? strchr(name_start + 1, '"') : nullptr;
+            if (name_end == nullptr) {
+                std::cout << "Invalid include in " << path << " at line " << line_number << "\n";
+                return false;
+            }
+
+            std::string include_path = directory + std::string(name_start + 1, name_end);
+            if (std::find(source.files.begin(), source.files.end(), include_path) == source.files.end()) {
+                if (!ExpandShaderFile(include_path, nullptr, source)) {
+                    return false;
+                }
+                AppendLineDirective(line_number + 1, file_index, source.text);
+            }
+            else {
+                // Keep the line, such that the line numbers stay the same
+                source.text += "\n";
+            }
+        }
+        else {
+            source.text += line;
+            source.text += "\n";
+            if (!inserted_defines && MatchDirective(line, "#version") != nullptr) {
+                AppendDefines(*defines, source.text);
+                AppendLineDirective(line_number + 1, file_index, source.text);
+                inserted_defines = true;
+            }
+        }
+        line_number++;
+    }
+
+    if (!inserted_defines) {
+        // Without a #version line, the defines can be at the start
+        std::string defines_text;
+        AppendDefines(*defines, defines_text);
+        AppendLineDirective(1, file_index, defines_text);
+        source.text = defines_text + source.text;
+    }
+    return true;
+}
+
+bool PreprocessShader(const char* path, const std::vector<ShaderDefine>& defines, ShaderSource& source)
+{
+    source.text.clear();
+    source.files.clear();
+    return ExpandShaderFile(path, &defines, source);
+}
+
+void PrintShaderSourceFiles(const ShaderSource& source)
+{
+    for (size_t index = 0; index < source.files.size(); index++) {
+        std::cout << "Source " << index << ": " << source.files[index] << "\n";
+    }
+}
+
+std::string GetShaderDefinesKey(const std::vector<ShaderDefine>& defines)
+{
+    std::string key;
+    for (size_t index = 0; index < defines.size(); index++) {
+        key += defines[index].name + "=" + defines[index].value + ";";
+    }
+    return key;
+}
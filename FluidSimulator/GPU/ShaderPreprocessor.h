@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// A #define that is inserted at the start of a shader
+struct ShaderDefine {
+    std::string name;
+    std::string value;
+};
+
+// The text after the includes were expanded, and the files it came from. The index
+// Of a file is the source number of its #line directives
+struct ShaderSource {
+    std::string text;
+    std::vector<std::string> files;
+};
+
+// Replaces each #include "name" with the file, relative to the one that includes it. A file is included
+// Only once, and the embedded shaders are used instead of the files when the build has them. The defines
+// Are inserted after the #version line, after the ones that the shaders share with the CPU side, like
+// POSITION_FACTOR. The #line directives keep the line numbers of the compile errors. Returns false if a
+// File can't be read
+bool PreprocessShader(const char* path, const std::vector<ShaderDefine>& defines, ShaderSource& source);
+
+// Prints the file of each source number, after a compile error
+void PrintShaderSourceFiles(const ShaderSource& source);
+
+// Identifies the combination of the defines, in their order
+std::string GetShaderDefinesKey(const std::vector<ShaderDefine>& defines);
@@ -0,0 +1,85 @@
+// The smoothing kernels, they use the scaling factors of the settings
+float SmoothingKernelPoly6(float dst, float radius)
+{
+	if (dst < radius)
+	{
+		float v = radius * radius - dst * dst;
+		return v * v * v * poly6_scaling_factor;
+	}
+	return 0;
+}
+
+float SpikyKernelPow3(float dst, float radius)
+{
+	if (dst < radius)
+	{
+		float v = radius - dst;
+		return v * v * v * spiky_pow3_scaling_factor;
+	}
+	return 0;
+}
+
+float SpikyKernelPow2(float dst, float radius)
+{
+	if (dst < radius)
+	{
+		float v = radius - dst;
+		return v * v * spiky_pow2_scaling_factor;
+	}
+	return 0;
+}
+
+float DerivativeSpikyPow3(float dst, float radius)
+{
+	if (dst <= radius)
+	{
+		float v = radius - dst;
+		return -v * v * spiky_pow3_derivative_scaling_factor;
+	}
+	return 0;
+}
+
+float DerivativeSpikyPow2(float dst, float radius)
+{
+	if (dst <= radius)
+	{
+		float v = radius - dst;
+		return -v * spiky_pow2_derivative_scaling_factor;
+	}
+	return 0;
+}
+
+float DensityKernel(float dst, float radius)
+{
+	return SpikyKernelPow2(dst, radius);
+}
+
+float NearDensityKernel(float dst, float radius)
+{
+	return SpikyKernelPow3(dst, radius);
+}
+
+float DensityDerivative(float dst, float radius)
+{
+	return DerivativeSpikyPow2(dst, radius);
+}
+
+float NearDensityDerivative(float dst, float radius)
+{
+	return DerivativeSpikyPow3(dst, radius);
+}
+
+float PressureFromDensity(float density)
+{
+	return (density - target_density) * pressure_multiplier;
+}
+
+float NearPressureFromDensity(float near_density)
+{
+	return near_pressure_multiplier * near_density;
+}
+
+float ViscosityKernel(float dst, float radius)
+{
+	return SmoothingKernelPoly6(dst, smoothing_radius);
+}
@@ -0,0 +1,76 @@
+#include "spatial_index.glsl"
+
+// Constants used for hashing
+const uint hashK1 = 15823;
+const uint hashK2 = 9737333;
+
+// Convert floating point position into an integer cell coordinate
+ivec2 GetCell2D(vec2 position, float radius)
+{
+	return ivec2(floor(position / radius));
+}
+
+// Hash cell coordinate to a single unsigned integer
+uint HashCell2D(ivec2 cell)
+{
+	uvec2 unsigned_cell = uvec2(cell);
+	uint a = unsigned_cell.x * hashK1;
+	uint b = unsigned_cell.y * hashK2;
+	return (a + b);
+}
+
+uint KeyFromHash(uint hash, uint tableSize)
+{
+	return hash % tableSize;
+}
+
+// The key of a cell hash. A table with a power of two size masks the hash, which is cheaper than the
+// Modulo, and its keys don't change with the particle count
+uint HashTableKey(uint hash)
+{
+	return hash_table_size != 0 ? hash & (hash_table_size - 1) : KeyFromHash(hash, num_particles);
+}
+
+// Convert a position into a cell of the dense grid. Positions outside the grid are clamped
+// To the border cells, which keeps the neighbouring cells of close positions adjacent
+ivec2 GetGridCell(vec2 position)
+{
+	ivec2 cell = ivec2(floor((position - grid_origin) / grid_cell_size));
+	return clamp(cell, ivec2(0), ivec2(grid_width, grid_height) - ivec2(1));
+}
+
+bool IsGridCellInside(ivec2 cell)
+{
+	return cell.x >= 0 && cell.y >= 0 && cell.x < int(grid_width) && cell.y < int(grid_height);
+}
+
+uint GridCellKey(ivec2 cell)
+{
+	return uint(cell.y) * grid_width + uint(cell.x);
+}
+
+const ivec2 offsets2D[9] =
+{
+	ivec2(-1, 1),
+	ivec2(0, 1),
+	ivec2(1, 1),
+	ivec2(-1, 0),
+	ivec2(0, 0),
+	ivec2(1, 0),
+	ivec2(-1, -1),
+	ivec2(0, -1),
+	ivec2(1, -1),
+};
+
+#if COMPACT_SPATIAL_INDEX
+// The compact entries don't have the hash, a key is walked with the entries of all the cells that share
+// It. A key that an earlier cell of the 3x3 block has was already walked, it must not be visited again
+bool IsKeyWalked(ivec2 origin_cell, int cell_index, uint key)
+{
+	for (int i = 0; i < cell_index; i++)
+	{
+		if (HashTableKey(HashCell2D(origin_cell + offsets2D[i])) == key) return true;
+	}
+	return false;
+}
+#endif
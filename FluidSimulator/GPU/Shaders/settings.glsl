@@ -0,0 +1,51 @@
+// The general settings, with the same layout as GeneralSettings
+layout(std140, binding = 0) uniform Settings {
+    uint num_particles;
+    float gravity;
+    float delta_time;
+    float collision_damping;
+    float smoothing_radius;
+    float target_density;
+    float pressure_multiplier;
+    float near_pressure_multiplier;
+    float viscosity_strength;
+    float poly6_scaling_factor;
+    float spiky_pow3_scaling_factor;
+    float spiky_pow2_scaling_factor;
+    float spiky_pow3_derivative_scaling_factor;
+    float spiky_pow2_derivative_scaling_factor;
+    vec2 interaction_input_point;
+    float interaction_input_strength;
+    float interaction_input_radius;
+    vec2 obstacle_size;
+    vec2 obstacle_centre;
+    vec2 grid_origin;
+    uint grid_width;
+    uint grid_height;
+    float grid_cell_size;
+    uint neighbour_search_mode;
+    uint neighbour_list_capacity;
+    uint neighbour_list_distances;
+    uint hash_table_size;
+};
+
+// The values of neighbour_search_mode
+#define NEIGHBOUR_SEARCH_SPATIAL_HASH 0
+#define NEIGHBOUR_SEARCH_DENSE_GRID 1
+
+// The simulation passes are compiled in variants for the settings that choose between code paths,
+// Such that the paths that are not taken are removed. The defaults are the initial settings
+#ifndef NEIGHBOUR_SEARCH_MODE
+#define NEIGHBOUR_SEARCH_MODE NEIGHBOUR_SEARCH_SPATIAL_HASH
+#endif
+// If neighbour_list_capacity is not 0
+#ifndef NEIGHBOUR_LISTS
+#define NEIGHBOUR_LISTS 0
+#endif
+// If neighbour_list_distances is not 0
+#ifndef NEIGHBOUR_LIST_DISTANCES
+#define NEIGHBOUR_LIST_DISTANCES 0
+#endif
+
+// POSITION_FACTOR is defined by the loader, with the value of the CPU side
+#define POSITION_FACTOR_INVERSE (1.0f / POSITION_FACTOR)
@@ -0,0 +1,13 @@
+// The compact entries leave out the hash of the cell, such that an entry is 8 bytes instead of 12.
+// The dense grid never reads the hash, the spatial hash filters the entries of a key by their distance
+#ifndef COMPACT_SPATIAL_INDEX
+#define COMPACT_SPATIAL_INDEX 0
+#endif
+
+struct SpatialIndex {
+    uint index;
+#if !COMPACT_SPATIAL_INDEX
+    uint hash;
+#endif
+    uint key;
+};
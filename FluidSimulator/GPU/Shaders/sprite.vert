@@ -9,8 +9,6 @@ layout(std430, binding = 1) buffer _Velocities
     vec2 Velocities[];
 };
 
-#define POSITION_FACTOR 500.0f
-
 uniform float scale;
 uniform float aspect_ratio;
 uniform float max_speed;
@@ -9,8 +9,6 @@ layout(std430, binding = 1) readonly buffer _TextureUvs
     vec2 TextureUvs[];
 };
 
-#define POSITION_FACTOR 500.0f
-
 uniform float scale;
 uniform float aspect_ratio;
   
@@ -4,19 +4,34 @@
 #include "../Vec2.h"
 #include "ShaderLocation.h"
 #include "GeneralSettings.h"
+#include "Trace.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
-#include <GLFW\glfw3.h>
 #include "std_image.h"
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <GLFW/glfw3.h>
 #include <intrin.h>
 
+// Asks the drivers of the laptops with two GPUs for the discrete one
 extern "C" {
     _declspec(dllexport) unsigned int NvOptimusEnablement = 1;
     _declspec(dllexport) int AmdPowerXpressRequestHighPerformance = 1;
 }
+#endif
 
 #define PARTICLE_SIZE 0.008f
+// The dense grid cell size is increased for very small smoothing radii, such that the grid stays bounded
+#define MAX_DENSE_GRID_CELLS (1 << 22)
 #define SIMULATION_FILE ".sim"
+#define AUTOSAVE_FILE "autosave.snap"
+// The adaptive time step can simulate up to this much time in a frame, the rest is dropped
+#define ADAPTIVE_MAX_FRAME_TIME (1.0f / 30.0f)
 
 static void DebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam) {
     std::cout << "Source: ";
@@ -93,73 +108,70 @@ static void DebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity
 
 void Simulation::ChangeParticleCount(size_t _particle_count)
 {
+    // The contents are not preserved, the buffers only need to be large enough
+    if (_particle_count > particle_capacity) {
+        GrowParticleBuffers(GetGrowthCapacity(_particle_count), 0);
+    }
     particle_count = _particle_count;
-    position_buffer.SetNewDataSize(sizeof(Float2), particle_count);
-    predicted_position_buffer.SetNewDataSize(sizeof(Float2), particle_count);
-    velocity_buffer.SetNewDataSize(sizeof(Float2), particle_count);
-    density_buffer.SetNewDataSize(sizeof(Float2), particle_count);
-    spatial_indices.SetNewDataSize(sizeof(unsigned int) * 3, particle_count);
-    spatial_offsets.SetNewDataSize(sizeof(unsigned int), particle_count);
+    ResetParticleIds();
+    if (backend == SimulationBackend::CPU) {
+        cpu_simulation.SetParticleCount(particle_count);
+    }
 }
 
 void Simulation::ChangeParticleCountPreserve(size_t new_particle_count, const Float2* add_positions, const Float2* add_velocities)
 {
-    // Retrieve the data for all buffers
-    std::vector<Float2> position_data(new_particle_count);
-    std::vector<Float2> predicted_position_data(new_particle_count);
-    std::vector<Float2> velocity_data(new_particle_count);
-    std::vector<Float2> density_data(new_particle_count);
-    struct SpatialIndex {
-        unsigned int values[3];
-    };
-    std::vector<SpatialIndex> spatial_indices_data(new_particle_count);
-    std::vector<unsigned int> spatial_offsets_data(new_particle_count);
-
-    position_buffer.RetrieveData(sizeof(Float2), particle_count, position_data.data());
-    predicted_position_buffer.RetrieveData(sizeof(Float2), particle_count, predicted_position_data.data());
-    velocity_buffer.RetrieveData(sizeof(Float2), particle_count, velocity_data.data());
-    density_buffer.RetrieveData(sizeof(Float2), particle_count, density_data.data());
-    spatial_indices.RetrieveData(sizeof(SpatialIndex), particle_count, spatial_indices_data.data());
-    spatial_offsets.RetrieveData(sizeof(unsigned int), particle_count, spatial_offsets_data.data());
-
-    if (new_particle_count > particle_count) {
-        size_t difference = new_particle_count - particle_count;
-        memset(density_data.data() + particle_count, 0, sizeof(Float2) * difference);
-        memset(spatial_indices_data.data() + particle_count, 0, sizeof(SpatialIndex) * difference);
-        memset(spatial_offsets_data.data() + particle_count, 0, sizeof(unsigned int) * difference);
-        if (add_positions != nullptr) {
-            memcpy(position_data.data() + particle_count, add_positions, sizeof(Float2) * difference);
-            memcpy(predicted_position_data.data() + particle_count, add_positions, sizeof(Float2) * difference);
-        }
-        else {
-            memset(position_data.data() + particle_count, 0, sizeof(Float2) * difference);
-            memset(predicted_position_data.data() + particle_count, 0, sizeof(Float2) * difference);
-        }
-
-        if (add_velocities != nullptr) {
-            memcpy(velocity_data.data() + particle_count, add_velocities, sizeof(Float2) * difference);
+    TraceScope trace_scope("ChangeParticleCount");
+    if (new_particle_count > particle_capacity) {
+        GrowParticleBuffers(GetGrowthCapacity(new_particle_count), particle_count);
+    }
+    ResizeParticleIds(new_particle_count);
+
+    if (backend == SimulationBackend::CPU) {
+        // The CPU state is the reference, the positions and the velocities are uploaded before rendering
+        if (new_particle_count > particle_count) {
+            size_t difference = new_particle_count - particle_count;
+            if (add_positions != nullptr) {
+                cpu_simulation.AppendParticles(difference, add_positions, add_velocities);
+            }
+            else {
+                std::vector<Float2> zero_positions(difference, Float2(0.0f));
+                cpu_simulation.AppendParticles(difference, zero_positions.data(), add_velocities);
+            }
         }
         else {
-            memset(velocity_data.data() + particle_count, 0, sizeof(Float2) * difference);
+            cpu_simulation.Trim(new_particle_count);
         }
+        particle_count = new_particle_count;
+        return;
     }
 
+    // The existing particles stay in place, only the new ones are uploaded after them. When the
+    // Count is smaller, the particles past it are simply ignored
+    if (new_particle_count > particle_count) {
+        size_t difference = new_particle_count - particle_count;
+        std::vector<Float2> zero_data(difference, Float2(0.0f));
+        const Float2* positions = add_positions != nullptr ? add_positions : zero_data.data();
+        const Float2* velocities = add_velocities != nullptr ? add_velocities : zero_data.data();
+        position_buffer.UpdateData(sizeof(Float2), difference, positions, particle_count);
+        predicted_position_buffer.UpdateData(sizeof(Float2), difference, positions, particle_count);
+        velocity_buffer.UpdateData(sizeof(Float2), difference, velocities, particle_count);
+        density_buffer.UpdateData(sizeof(Float2), difference, zero_data.data(), particle_count);
+    }
     particle_count = new_particle_count;
-    position_buffer.SetNewData(sizeof(Float2), new_particle_count, position_data.data());
-    predicted_position_buffer.SetNewData(sizeof(Float2), new_particle_count, predicted_position_data.data());
-    velocity_buffer.SetNewData(sizeof(Float2), new_particle_count, velocity_data.data());
-    density_buffer.SetNewData(sizeof(Float2), new_particle_count, density_data.data());
-    spatial_indices.SetNewData(sizeof(unsigned int) * 3, new_particle_count, spatial_indices_data.data());
-    spatial_offsets.SetNewData(sizeof(unsigned int), new_particle_count, spatial_offsets_data.data());
 }
 
 void Simulation::DoFrame(Float2 normalized_mouse_pos, bool is_left_mouse_pressed, bool is_right_mouse_pressed, float delta_time)
 {
+    TraceScope trace_scope("DoFrame");
+    // The readbacks that have finished give their data before the time step is chosen
+    gpu_readback.Update();
+    // The uploads of the previous frame are fenced, before this frame writes the ring again
+    GPUUploadRing::NextFrame();
     if (!pause_simulation) {
-        delta_time = std::min(0.007f, delta_time);
+        delta_time = ChooseTimeStep(delta_time);
         if (image_mode) {
-            if (image_mode_delta_time_index < image_mode_delta_time.size()) {
-                delta_time = image_mode_delta_time[image_mode_delta_time_index];
+            if (replay_file.NextDeltaTime(delta_time)) {
                 image_mode_delta_time_index++;
             }
             else {
@@ -189,7 +201,12 @@ void Simulation::DoFrame(Float2 normalized_mouse_pos, bool is_left_mouse_pressed
         }
 
         SetFrameParameters(normalized_mouse_pos, is_left_mouse_pressed, is_right_mouse_pressed, delta_time);
+        gpu_profiler.BeginScope("Simulation");
         FrameCompute();
+        gpu_profiler.EndScope();
+        if (trajectory_writer.IsOpen()) {
+            trajectory_writer.Capture(position_buffer, particle_ids, particle_count, delta_time);
+        }
 
         if (image_mode) {
             //if (image_mode_delta_time_index < image_mode_delta_time.size()) {
@@ -338,6 +355,15 @@ void Simulation::DoFrame(Float2 normalized_mouse_pos, bool is_left_mouse_pressed
 
         HandleRecordSimulation(delta_time);
     }
+
+    snapshot_saver.Update();
+    if (autosave_interval > 0.0f && !pause_simulation) {
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        // When the previous snapshot is still pending, try again the next frame
+        if (time - last_autosave_time >= autosave_interval && SaveSnapshot(AUTOSAVE_FILE)) {
+            last_autosave_time = time;
+        }
+    }
 }
 
 void Simulation::Initialize()
@@ -347,10 +373,20 @@ void Simulation::Initialize()
     glDisable(GL_CULL_FACE);
 
     // Use the simulation early compute to hold the general settings
-    simulation_early_compute = ComputeShader(SHADER_LOCATION(simulation_early.comp), 128, 1, 1);
-    calculate_density_compute = ComputeShader(SHADER_LOCATION(calculate_density.comp), 128, 1, 1);
-    calculate_pressure_compute = ComputeShader(SHADER_LOCATION(calculate_pressure.comp), 128, 1, 1);
-    calculate_viscosity_update_pos_compute = ComputeShader(SHADER_LOCATION(calculate_viscosity_update_pos.comp), 128, 1, 1);
+    simulation_early_compute = ComputeShader(SHADER_LOCATION(simulation_early.comp), WORKGROUP_DEFAULT_SIZE, 1, 1);
+    // The other passes are compiled for the settings and the group sizes they are used with
+    external_forces_compute = nullptr;
+    calculate_density_compute = nullptr;
+    calculate_pressure_compute = nullptr;
+    calculate_viscosity_update_pos_compute = nullptr;
+    build_neighbour_lists_compute = nullptr;
+    reorder_particles_compute = nullptr;
+    reduce_motion_compute = nullptr;
+    collision_map_empty = true;
+    // The sizes found by previous runs of the autotuner, if there are any
+    WorkgroupTuner::Load(WORKGROUP_SIZES_FILE);
+    workgroup_sizes = WorkgroupTuner::GetDefaultSizes();
+    autotuning_workgroups = false;
 
     simulation_early_compute.CreateUniformBlock("Settings", sizeof(GeneralSettings));
 
@@ -386,31 +422,118 @@ void Simulation::Initialize()
     aspect_ratio_change = 1.0f;
     image_mode_delta_time_index = 0;
 
-    position_buffer = StructuredBuffer(sizeof(Float2), particle_count);
-    predicted_position_buffer = StructuredBuffer(sizeof(Float2), particle_count);
-    velocity_buffer = StructuredBuffer(sizeof(Float2), particle_count);
-    density_buffer = StructuredBuffer(sizeof(Float2), particle_count);
-    spatial_indices = StructuredBuffer(sizeof(unsigned int) * 3, particle_count);
-    spatial_offsets = StructuredBuffer(sizeof(unsigned int), particle_count);
+    backend = SimulationBackend::GPU;
+    // The spawner can reach the max particle count without reallocating
+    particle_capacity = GetGrowthCapacity(particle_count);
+    position_buffer = StructuredBuffer(sizeof(Float2), particle_capacity);
+    predicted_position_buffer = StructuredBuffer(sizeof(Float2), particle_capacity);
+    velocity_buffer = StructuredBuffer(sizeof(Float2), particle_capacity);
+    density_buffer = StructuredBuffer(sizeof(Float2), particle_capacity);
+    spatial_indices = StructuredBuffer(sizeof(unsigned int) * 3, particle_capacity);
+    spatial_offsets = StructuredBuffer(sizeof(unsigned int), particle_capacity);
+    spatial_offsets_count = particle_capacity;
+    particle_ids = StructuredBuffer(sizeof(unsigned int), particle_capacity);
+    ResetParticleIds();
+    // The reorder buffers are allocated the first time they are used
+    reorder_position_buffer = StructuredBuffer(sizeof(Float2), 1);
+    reorder_predicted_position_buffer = StructuredBuffer(sizeof(Float2), 1);
+    reorder_velocity_buffer = StructuredBuffer(sizeof(Float2), 1);
+    reorder_particle_ids = StructuredBuffer(sizeof(unsigned int), 1);
+    reorder_copy_buffer = StructuredBuffer(sizeof(Float2), 1);
+    reorder_capacity = 0;
+    reorder_step_counter = 0;
+    // The neighbour list buffers are allocated the first time they are used
+    neighbour_lists = StructuredBuffer(sizeof(unsigned int), 1);
+    neighbour_distances = StructuredBuffer(sizeof(float), 1);
+    neighbour_list_stats = StructuredBuffer(sizeof(NeighbourListStats), 1);
+    read_neighbour_list_stats = {};
+    neighbour_list_stats_in_flight = false;
+    measure_hash_table = false;
+    read_hash_table_stats = {};
+    hash_table_stats_in_flight = false;
+    neighbour_lists_count = 1;
+    neighbour_distances_count = 1;
+    // The adaptive time step buffers, the previous velocities are allocated the first time they are used
+    previous_velocity_buffer = StructuredBuffer(sizeof(Float2), 1);
+    previous_velocity_capacity = 0;
+    motion_stats = StructuredBuffer(sizeof(unsigned int), 2);
+    motion_stats_in_flight = 0;
+    measured_max_speed = 0.0f;
+    measured_max_acceleration = 0.0f;
+    substep_count = 1;
+    substep_delta_time = 0.0f;
+    measure_motion = false;
     SetInitialBufferData(particle_count);
     SetInitialSettingsData();
 
+    gpu_profiler.Initialize();
+    gpu_readback.Initialize();
+    snapshot_saver.Initialize(&gpu_readback);
+    trajectory_writer.Initialize(&gpu_readback);
+    last_autosave_time = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
     gpu_sort.Initialize();
+    gpu_sort.SetProfiler(&gpu_profiler);
+    gpu_sort.SetReadback(&gpu_readback);
+    cpu_simulation.Initialize();
     pause_simulation = false;
     image_mode = false;
     record_simulation = false;
+    record_wait_count = 0;
+    record_finishing = false;
     particle_spawner.spawn_point = Float2(0.0f, POSITION_FACTOR - 50.0f);
     particle_spawner.spawn_delta = FLT_MAX;
     particle_spawner.initial_velocity = -7.5f;
     particle_spawner.spawn_count = 60;
     particle_spawner.direction = Float2(0.0f, -1.0f);
 
+    // The programs were compiled in parallel since they were created, such that
+    // Waiting for all of them costs about as much as the slowest one
+    ShaderCache::FinishPrograms();
+
     //SetRecordMode();
     //SetImageDisplayMode("ancient_rome.jpg");
 }
 
+bool Simulation::LoadCollisionMap(const char* image_path)
+{
+    int image_width, image_height;
+    int channel_count;
+    unsigned char* image_data = stbi_load(image_path, &image_width, &image_height, &channel_count, 0);
+    if (image_data == NULL) {
+        std::cout << "Failed to load the collision map\n";
+        return false;
+    }
+
+    size_t reduced_width = (window_width + 7) / 8;
+    memset(collision_map_data, 0, sizeof(unsigned char) * reduced_width * window_height);
+    // The alpha channel is the last one, for the grey-alpha and the RGBA images
+    bool has_alpha = channel_count == 2 || channel_count == 4;
+    size_t color_channel_count = has_alpha ? channel_count - 1 : channel_count;
+    for (size_t row = 0; row < window_height; row++) {
+        // The image rows go from the top to the bottom, the OpenGL texture layout is the other way around
+        size_t image_row = (window_height - 1 - row) * image_height / window_height;
+        for (size_t column = 0; column < window_width; column++) {
+            size_t image_column = column * image_width / window_width;
+            const unsigned char* pixel = image_data + (image_row * image_width + image_column) * channel_count;
+            unsigned int color_sum = 0;
+            for (size_t channel = 0; channel < color_channel_count; channel++) {
+                color_sum += pixel[channel];
+            }
+            bool is_opaque = !has_alpha || pixel[channel_count - 1] > 127;
+            if (is_opaque && color_sum > 127 * color_channel_count) {
+                SetCollisionPixel(Int2(column, row), true);
+            }
+        }
+    }
+    stbi_image_free(image_data);
+    // The CPU backend reads the collision map data directly
+    ReuploadCollisionData();
+    return true;
+}
+
 void Simulation::PaintCollision(Int2 center, Int2 rectangle_size, bool is_set)
 {
+    TraceScope trace_scope("PaintCollision");
     center.x -= rectangle_size.x * 0.5f;
     center.y += rectangle_size.y * 0.5f;
 
@@ -458,52 +581,26 @@ void Simulation::SetImageDisplayMode(const char* texture_path)
         image_mode_texture.SetData(data_type, texture_x, texture_y, image_data, TextureSampling::Bilinear);
         stbi_image_free(image_data);
 
-        // Load the simulation file
-        FILE* simulation_file = fopen(SIMULATION_FILE, "rb");
-        if (simulation_file != NULL) {
-            // Read the parameters
-            GeneralSettings* general_settings = (GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
-            if (fread(general_settings, sizeof(*general_settings), 1, simulation_file) != 1) {
-                std::cout << "Failed to read the simulation file\n";
-            }
-            else {
-                // Read the spawner data
-                if (fread(&particle_spawner, sizeof(particle_spawner), 1, simulation_file) != 1) {
-                    std::cout << "Failed to read the simulation file\n";
-                }
-                else {
-                    // Allocate a very large buffer to read the entire file. We can take advantage of virtual
-                    // Memory for not having the entire buffer be physically paged
-                    const size_t ALLOCATION_SIZE = 1024 * 1024 * 50;
-                    void* simulation_file_allocation = malloc(ALLOCATION_SIZE); // 50MB
-                    size_t read_amount = fread(simulation_file_allocation, sizeof(char), ALLOCATION_SIZE, simulation_file);
-                    if (read_amount == 0) {
-                        std::cout << "Failed to read the simulation file\n";
-                    }
-                    else {
-                        // Count how many delta times there are
-                        float* delta_times = (float*)simulation_file_allocation;
-                        size_t delta_time_count = 0;
-                        while (delta_times[delta_time_count] != 0.0f) {
-                            delta_time_count++;
-                        }
-                        image_mode_delta_time.resize(delta_time_count);
-                        memcpy(image_mode_delta_time.data(), delta_times, sizeof(float) * delta_time_count);
-
-                        // Create the UVs structured buffer
-                        delta_times += delta_time_count + 1;
-                        void* current_data_ptr = delta_times;
-                        size_t uv_entry_count = *(size_t*)current_data_ptr;
-                        current_data_ptr = (size_t*)current_data_ptr + 1;
-                        image_mode_uvs = StructuredBuffer(sizeof(Float2), uv_entry_count, current_data_ptr);
-
-                        image_mode_delta_time_index = 0;
-                        image_mode = true;
-                    }
-                    fclose(simulation_file);
-                    free(simulation_file_allocation);
+        // Open the simulation file, the delta times are read from it while replaying
+        GeneralSettings* general_settings = (GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
+        if (replay_file.Open(SIMULATION_FILE, *general_settings, particle_spawner)) {
+            // The UVs are stored by particle id, the existing particles can be in a different order
+            size_t uv_entry_count = replay_file.GetUVCount();
+            std::vector<Float2> id_uvs(uv_entry_count);
+            replay_file.ReadUVs(id_uvs.data());
+            std::vector<Float2> uvs = id_uvs;
+            std::vector<unsigned int> ids(particle_count);
+            particle_ids.RetrieveData(sizeof(unsigned int), particle_count, ids.data());
+            for (size_t index = 0; index < particle_count && index < uv_entry_count; index++) {
+                if (ids[index] < uv_entry_count) {
+                    uvs[index] = id_uvs[ids[index]];
                 }
             }
+            image_mode_uvs = StructuredBuffer(sizeof(Float2), uv_entry_count, uvs.data());
+
+            image_mode_delta_time_index = 0;
+            reorder_step_counter = 0;
+            image_mode = true;
         }
         else {
             std::cout << "Failed to read the simulation file\n";
@@ -514,24 +611,41 @@ void Simulation::SetImageDisplayMode(const char* texture_path)
 void Simulation::SetRecordMode()
 {
     record_simulation = true;
-    record_file = fopen(SIMULATION_FILE, "wb");
-    if (record_file == NULL) {
+    reorder_step_counter = 0;
+    record_wait_count = 0;
+    record_finishing = false;
+
+    // The simulation parameters and the spawner are written firstly
+    const GeneralSettings* general_settings = (const GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
+    if (!record_writer.Open(SIMULATION_FILE, *general_settings, particle_spawner)) {
         std::cout << "Failed to open record file\n";
         abort();
     }
+}
 
-    // Write the simulation parameters firstly
-    const GeneralSettings* general_settings = (const GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
-    if (fwrite(general_settings, sizeof(*general_settings), 1, record_file) != 1) {
-        std::cout << "Failed to write record file\n";
-        abort();
+void Simulation::SetBackend(SimulationBackend new_backend)
+{
+    if (new_backend == backend) {
+        return;
     }
 
-    // Write into the record file the spawner parameters
-    if (fwrite(&particle_spawner, sizeof(particle_spawner), 1, record_file) != 1) {
-        std::cout << "Failed to write record file\n";
-        abort();
+    if (new_backend == SimulationBackend::CPU) {
+        std::vector<Float2> positions(particle_count);
+        std::vector<Float2> predicted_positions(particle_count);
+        std::vector<Float2> velocities(particle_count);
+        std::vector<Float2> densities(particle_count);
+        position_buffer.RetrieveData(sizeof(Float2), particle_count, positions.data());
+        predicted_position_buffer.RetrieveData(sizeof(Float2), particle_count, predicted_positions.data());
+        velocity_buffer.RetrieveData(sizeof(Float2), particle_count, velocities.data());
+        density_buffer.RetrieveData(sizeof(Float2), particle_count, densities.data());
+        cpu_simulation.SetParticleData(particle_count, positions.data(), predicted_positions.data(), velocities.data(), densities.data());
     }
+    else {
+        // The positions and the velocities are already up to date
+        predicted_position_buffer.UpdateData(sizeof(Float2), particle_count, cpu_simulation.GetPredictedPositions());
+        density_buffer.UpdateData(sizeof(Float2), particle_count, cpu_simulation.GetDensities());
+    }
+    backend = new_backend;
 }
 
 void Simulation::SetWindowSize(size_t width, size_t height)
@@ -540,6 +654,7 @@ void Simulation::SetWindowSize(size_t width, size_t height)
     if (width != window_width || height != window_height) {
         size_t reduced_width = (width + 7) / 8;
         collision_map_data = (unsigned char*)calloc(sizeof(unsigned char), reduced_width * height);
+        collision_map_empty = true;
         collision_map.SetData(DataType::UByte, reduced_width, height, nullptr, TextureSampling::Point);
         collision_map.Bind(2);
         aspect_ratio_change = ((float)width / (float)height) / aspect_ratio;
@@ -569,175 +684,887 @@ void Simulation::SetInitialSettingsData()
     settings->obstacle_centre = Float2(1.0f * POSITION_FACTOR, -0.3f * POSITION_FACTOR);
     //settings->obstacle_size = Float2(0.0f, 0.0f);
     settings->obstacle_size = Float2(0.2f * POSITION_FACTOR, 0.4f * POSITION_FACTOR);
+    settings->neighbour_search_mode = NeighbourSearchMode::SpatialHash;
+    settings->hash_table_size = 0;
 
     simulation_early_compute.SetUniformBlockDirty("Settings");
 
     use_mouse_pull = true;
     paint_collision = false;
+    use_neighbour_lists = false;
+    store_neighbour_distances = false;
+    neighbour_list_capacity = 32;
+    compact_spatial_indices = false;
+    settings->reorder_interval = 0;
+    adaptive_time_step = false;
+    autosave_interval = 0.0f;
+    trajectory_error_bound = TRAJECTORY_DEFAULT_ERROR_BOUND;
+    cfl_factor = 0.4f;
+    max_substep_count = 4;
     paint_collision_size = Int2(30, 30);
 }
 
+float Simulation::ChooseTimeStep(float delta_time)
+{
+    substep_count = 1;
+    // The recordings and the image mode must replay the same steps
+    measure_motion = adaptive_time_step && !image_mode && !record_simulation;
+    if (!measure_motion) {
+        return std::min(0.007f, delta_time);
+    }
+
+    float frame_time = std::min(delta_time, ADAPTIVE_MAX_FRAME_TIME);
+    float smoothing_radius = GetGeneralSettings()->smoothing_radius;
+    // A particle should not move more than a fraction of the smoothing radius in a substep. The speed
+    // Bounds the step, and the acceleration bounds it for the particles that are about to speed up
+    float stable_time_step = frame_time;
+    if (measured_max_speed > 0.0f) {
+        stable_time_step = std::min(stable_time_step, cfl_factor * smoothing_radius / measured_max_speed);
+    }
+    if (measured_max_acceleration > 0.0f) {
+        stable_time_step = std::min(stable_time_step, cfl_factor * sqrtf(smoothing_radius / measured_max_acceleration));
+    }
+
+    size_t required_substeps = (size_t)ceilf(frame_time / stable_time_step);
+    substep_count = std::clamp(required_substeps, (size_t)1, (size_t)std::max(max_substep_count, 1));
+    // When more substeps are needed than allowed, the simulation slows down instead of becoming unstable
+    return std::min(frame_time, stable_time_step * substep_count);
+}
+
+void Simulation::MeasureMotion(float delta_time)
+{
+    reduce_motion_compute->Bind(false);
+    reduce_motion_compute->SetUInt("particle_count", particle_count);
+    reduce_motion_compute->SetFloat("delta_time", delta_time);
+    motion_stats.Bind(0);
+    velocity_buffer.Bind(1);
+    previous_velocity_buffer.Bind(2);
+    reduce_motion_compute->Dispatch(particle_count, 1, 1);
+}
+
+void Simulation::ReadMotionStats()
+{
+    // The reduction of this frame is dropped when the GPU is too far behind
+    if (motion_stats_in_flight >= MOTION_STATS_LATENCY) {
+        return;
+    }
+
+    motion_stats_in_flight++;
+    // The readbacks finish in order, the newest one that has finished gives the values
+    gpu_readback.Request(motion_stats, sizeof(unsigned int) * 2, [this](const void* data, size_t byte_size) {
+        motion_stats_in_flight--;
+        float max_speed, max_acceleration;
+        memcpy(&max_speed, data, sizeof(max_speed));
+        memcpy(&max_acceleration, (const unsigned int*)data + 1, sizeof(max_acceleration));
+        // The simulation already blew up when these are not finite, keep the last good values
+        if (isfinite(max_speed) && isfinite(max_acceleration)) {
+            measured_max_speed = max_speed;
+            measured_max_acceleration = max_acceleration;
+        }
+    });
+}
+
+AdaptiveTimeStepStats Simulation::GetAdaptiveTimeStepStats() const
+{
+    AdaptiveTimeStepStats stats;
+    stats.substep_count = substep_count;
+    stats.substep_delta_time = substep_delta_time;
+    stats.max_speed = measured_max_speed;
+    stats.max_acceleration = measured_max_acceleration;
+    return stats;
+}
+
 void Simulation::FrameCompute()
 {
-    const size_t ITERATION_COUNT = 1;
+    TraceScope trace_scope("FrameCompute");
     GeneralSettings* general_settings = (GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
-    general_settings->delta_time /= ITERATION_COUNT;
+    general_settings->delta_time /= substep_count;
     simulation_early_compute.SetUniformBlockDirty("Settings");
+    substep_delta_time = general_settings->delta_time;
+    SelectShaderVariants();
+
+    if (measure_motion) {
+        if (previous_velocity_capacity < particle_count) {
+            // Grow with a margin, such that spawning particles does not reallocate each time
+            previous_velocity_capacity = particle_count + particle_count / 4;
+            previous_velocity_buffer.SetNewDataSize(sizeof(Float2), previous_velocity_capacity);
+        }
 
-    for (size_t index = 0; index < ITERATION_COUNT; index++) {
-        // Early dispatch
-        simulation_early_compute.BindUniformBlock(0);
-        position_buffer.Bind(0);
-        velocity_buffer.Bind(1);
-        predicted_position_buffer.Bind(2);
-        spatial_offsets.Bind(3);
-        spatial_indices.Bind(4);
-        simulation_early_compute.Bind(false);
-        simulation_early_compute.SetFloat("aspect_ratio", aspect_ratio);
-        simulation_early_compute.Dispatch(particle_count, 1, 1);
+        // The readback of the previous frame has already copied the values
+        motion_stats.ClearData();
+    }
+
+    if (backend == SimulationBackend::CPU) {
+        CPUCollisionParameters collision_parameters;
+        collision_parameters.window_width = window_width;
+        collision_parameters.window_height = window_height;
+        collision_parameters.aspect_ratio_change = aspect_ratio_change;
+        collision_parameters.collision_map = collision_map_data;
+        if (measure_motion) {
+            // The velocity buffer still has the uploaded velocities of the last frame
+            previous_velocity_buffer.CopyData(velocity_buffer, sizeof(Float2) * particle_count);
+        }
+        for (size_t index = 0; index < substep_count; index++) {
+            TraceScope step_scope("CPU step");
+            cpu_simulation.Step(*general_settings, collision_parameters);
+            collision_parameters.aspect_ratio_change = 1.0f;
+        }
+        aspect_ratio_change = 1.0f;
+        UploadCPURenderData();
+        if (measure_motion) {
+            // The whole frame is measured at once, the acceleration is averaged over the substeps
+            MeasureMotion(general_settings->delta_time * substep_count);
+            ReadMotionStats();
+        }
+        return;
+    }
+
+    for (size_t index = 0; index < substep_count; index++) {
+        if (measure_motion) {
+            previous_velocity_buffer.CopyData(velocity_buffer, sizeof(Float2) * particle_count);
+        }
 
-        // GPU spatial sorting
-        gpu_sort.Execute(spatial_indices, spatial_offsets, particle_count);
+        gpu_profiler.BeginScope("External forces");
+        DispatchExternalForces();
+        gpu_profiler.EndScope();
+
+        DispatchSort();
+
+        if (general_settings->reorder_interval > 0) {
+            reorder_step_counter++;
+            if (reorder_step_counter >= general_settings->reorder_interval) {
+                gpu_profiler.BeginScope("Reorder");
+                ReorderParticles();
+                // The sorted entries now point to the new particle locations
+                gpu_sort.SetIncrementalOrder(spatial_indices, particle_count);
+                gpu_profiler.EndScope();
+                reorder_step_counter = 0;
+            }
+        }
 
         // We need to rebing the uniform block with the general settings for the rest of the pipeline
         simulation_early_compute.BindUniformBlock(0);
-        // The density dispatch
-        density_buffer.Bind(0);
-        predicted_position_buffer.Bind(1);
-        spatial_offsets.Bind(2);
-        spatial_indices.Bind(3);
-        calculate_density_compute.BindAndDispatch(particle_count, 1, 1);
-
-        // The bindings for the pressure include those from the density
-        velocity_buffer.Bind(4);
-        calculate_pressure_compute.BindAndDispatch(particle_count, 1, 1);
-
-        // The bindings for the final dispatch include those from the pressure dispatch
-        calculate_viscosity_update_pos_compute.Bind(false);
-        position_buffer.Bind(5);
-        calculate_viscosity_update_pos_compute.SetUInt("window_width", window_width);
-        calculate_viscosity_update_pos_compute.SetUInt("window_height", window_height);
-        calculate_viscosity_update_pos_compute.SetFloat("aspect_ratio_change", aspect_ratio_change);
-        if (aspect_ratio_change != 1.0f) {
-            aspect_ratio_change = 1.0f;
+        if (use_neighbour_lists) {
+            // Gather the neighbours once, for the density, pressure and viscosity passes
+            ReserveNeighbourLists();
+            neighbour_list_stats.ClearData();
+            neighbour_list_stats.Bind(0);
+            predicted_position_buffer.Bind(1);
+            spatial_offsets.Bind(2);
+            spatial_indices.Bind(3);
+            neighbour_lists.Bind(6);
+            neighbour_distances.Bind(7);
+            gpu_profiler.BeginScope("Neighbour lists");
+            build_neighbour_lists_compute->BindAndDispatch(particle_count, 1, 1, false);
+            gpu_profiler.EndScope();
+            // Only one readback of the counters is in flight, the steps in between are not read
+            if (!neighbour_list_stats_in_flight) {
+                neighbour_list_stats_in_flight = true;
+                gpu_readback.Request(neighbour_list_stats, sizeof(NeighbourListStats), [this](const void* data, size_t byte_size) {
+                    memcpy(&read_neighbour_list_stats, data, sizeof(read_neighbour_list_stats));
+                    neighbour_list_stats_in_flight = false;
+                });
+            }
+        }
+        else {
+            // The passes declare the lists even when they are not used
+            neighbour_lists.Bind(6);
+            neighbour_distances.Bind(7);
         }
-        collision_map.Bind(2);
-        calculate_viscosity_update_pos_compute.SetTexture("CollisionMap", 2);
-        calculate_viscosity_update_pos_compute.Dispatch(particle_count, 1, 1);
-   }
-}
 
-void Simulation::HandleRecordSimulation(float delta_time)
-{
-    if (record_simulation) {
-        if (record_file != NULL) {
-            // Write the delta time
-            if (fwrite(&delta_time, sizeof(delta_time), 1, record_file) != 1) {
-                std::cout << "Failed to write delta time\n";
-                abort();
-            }
+        gpu_profiler.BeginScope("Density");
+        DispatchDensity();
+        gpu_profiler.EndScope();
+
+        gpu_profiler.BeginScope("Pressure");
+        DispatchPressure();
+        gpu_profiler.EndScope();
+
+        gpu_profiler.BeginScope("Viscosity and collisions");
+        DispatchViscosity();
+        gpu_profiler.EndScope();
+
+        if (measure_motion) {
+            gpu_profiler.BeginScope("Motion reduction");
+            MeasureMotion(general_settings->delta_time);
+            gpu_profiler.EndScope();
         }
-        if (particle_count >= max_particle_count && record_file != NULL) {
-            static int wait_count = 0;
-            const int threshold = 3000;
+   }
 
-            if (wait_count > threshold) {
-                // The recording is finished, read the positions buffer and
-                // And assign the UV values for each particle
-                std::vector<Float2> final_positions(particle_count);
-                position_buffer.RetrieveData(sizeof(Float2), particle_count, final_positions.data());
+    // Only one readback is in flight, the steps in between are not counted
+    if (measure_hash_table && !hash_table_stats_in_flight) {
+        hash_table_stats_in_flight = true;
+        GeneralSettings settings = *general_settings;
+        bool compact_entries = compact_spatial_indices;
+        size_t count = particle_count;
+        gpu_readback.Request(predicted_position_buffer, sizeof(Float2) * count, [this, settings, compact_entries, count](const void* data, size_t byte_size) {
+            std::vector<Float2> predicted_positions((const Float2*)data, (const Float2*)data + count);
+            read_hash_table_stats = AnalyzeNeighbourSearch(predicted_positions, settings, compact_entries);
+            hash_table_stats_in_flight = false;
+        });
+    }
 
-                FILE* pos_file = fopen(".pos", "wb");
-                fwrite(final_positions.data(), sizeof(Float2), final_positions.size(), pos_file);
-                fclose(pos_file);
+    if (measure_motion) {
+        ReadMotionStats();
+    }
+}
 
-                // Map the positions to the texture values
-                std::vector<Float2> texture_uvs(particle_count);
-                for (size_t index = 0; index < particle_count; index++) {
-                    // Transform into ndc coordinates, and then into UV, and then into texel indices
-                    Float2 ndc = final_positions[index] / POSITION_FACTOR;
-                    // The x component needs to be adjusted to the aspect ratio
-                    ndc.x /= aspect_ratio;
+void Simulation::DispatchExternalForces()
+{
+    simulation_early_compute.BindUniformBlock(0);
+    position_buffer.Bind(0);
+    velocity_buffer.Bind(1);
+    predicted_position_buffer.Bind(2);
+    spatial_offsets.Bind(3);
+    spatial_indices.Bind(4);
+    external_forces_compute->Bind(false);
+    external_forces_compute->SetFloat("aspect_ratio", aspect_ratio);
+    external_forces_compute->Dispatch(particle_count, 1, 1);
+}
 
-                    Float2 uv = (ndc + 1.0f) * 0.5f;
-                    texture_uvs[index] = uv;
-                }
+void Simulation::DispatchSort()
+{
+    // GPU spatial sorting. The dense grid needs the exact range of each cell, while the
+    // Spatial hash walks from the first entry of a key until the key changes
+    const GeneralSettings* general_settings = (const GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
+    if (general_settings->neighbour_search_mode == NeighbourSearchMode::DenseGrid) {
+        size_t cell_count = (size_t)general_settings->grid_width * (size_t)general_settings->grid_height;
+        ReserveSpatialOffsets(cell_count + 1);
+        gpu_sort.Execute(spatial_indices, spatial_offsets, particle_count, cell_count, GPUSortOffsets::KeyRanges);
+    }
+    else {
+        gpu_sort.Execute(spatial_indices, spatial_offsets, particle_count, GetHashKeyCount());
+    }
+}
 
-                // Write a delta time of 0.0f to indicate that the simulation has ended
-                float delta_zero = 0.0f;
-                if (fwrite(&delta_zero, sizeof(delta_zero), 1, record_file) != 1) {
-                    std::cout << "Failed to write record file\n";
-                    abort();
-                }
+void Simulation::DispatchDensity()
+{
+    density_buffer.Bind(0);
+    predicted_position_buffer.Bind(1);
+    spatial_offsets.Bind(2);
+    spatial_indices.Bind(3);
+    calculate_density_compute->BindAndDispatch(particle_count, 1, 1);
+}
 
-                // Write the number of particles
-                if (fwrite(&particle_count, sizeof(particle_count), 1, record_file) != 1) {
-                    std::cout << "Failed to write record file\n";
-                    abort();
-                }
+void Simulation::DispatchPressure()
+{
+    // The bindings of the density, and the velocities
+    density_buffer.Bind(0);
+    predicted_position_buffer.Bind(1);
+    spatial_offsets.Bind(2);
+    spatial_indices.Bind(3);
+    velocity_buffer.Bind(4);
+    calculate_pressure_compute->BindAndDispatch(particle_count, 1, 1);
+}
 
-                // Write the uvs now
-                if (fwrite(texture_uvs.data(), sizeof(Float2), texture_uvs.size(), record_file) != texture_uvs.size()) {
-                    std::cout << "Failed to write record file\n";
-                    abort();
-                }
+void Simulation::DispatchViscosity()
+{
+    // The bindings of the pressure, and the positions
+    density_buffer.Bind(0);
+    predicted_position_buffer.Bind(1);
+    spatial_offsets.Bind(2);
+    spatial_indices.Bind(3);
+    velocity_buffer.Bind(4);
+    calculate_viscosity_update_pos_compute->Bind(false);
+    position_buffer.Bind(5);
+    calculate_viscosity_update_pos_compute->SetUInt("window_width", window_width);
+    calculate_viscosity_update_pos_compute->SetUInt("window_height", window_height);
+    calculate_viscosity_update_pos_compute->SetFloat("aspect_ratio_change", aspect_ratio_change);
+    if (aspect_ratio_change != 1.0f) {
+        aspect_ratio_change = 1.0f;
+    }
+    collision_map.Bind(2);
+    calculate_viscosity_update_pos_compute->SetTexture("CollisionMap", 2);
+    calculate_viscosity_update_pos_compute->Dispatch(particle_count, 1, 1);
+}
 
-                // It can be closed now
-                fclose(record_file);
-                record_file = NULL;
+void Simulation::HandleRecordSimulation(float delta_time)
+{
+    TraceScope trace_scope("Record");
+    // After the final positions were requested, no more delta times are written
+    if (record_simulation && record_writer.IsOpen() && !record_finishing) {
+        // Write the delta time
+        if (!record_writer.AppendDeltaTime(delta_time)) {
+            std::cout << "Failed to write delta time\n";
+            abort();
+        }
+        if (particle_count >= max_particle_count) {
+            const size_t threshold = 3000;
+
+            if (record_wait_count > threshold) {
+                // The recording is finished, the positions and the ids of this frame are read back
+                // A few frames later and the UV values are assigned from them
+                record_finishing = true;
+                size_t count = particle_count;
+                gpu_readback.Request(position_buffer, sizeof(Float2) * count, [this, count](const void* data, size_t byte_size) {
+                    record_final_positions.assign((const Float2*)data, (const Float2*)data + count);
+                });
+                // The readbacks finish in order, the positions are there when the ids are
+                gpu_readback.Request(particle_ids, sizeof(unsigned int) * count, [this, count](const void* data, size_t byte_size) {
+                    FinishRecording(record_final_positions.data(), (const unsigned int*)data, count);
+                    record_final_positions = std::vector<Float2>();
+                });
             }
             else {
-                // Write the delta time
-                if (fwrite(&delta_time, sizeof(delta_time), 1, record_file) != 1) {
-                    std::cout << "Failed to write delta time\n";
-                    abort();
-                }
-                wait_count++;
+                record_wait_count++;
             }
         }
     }
 }
 
+void Simulation::FinishRecording(const Float2* positions, const unsigned int* ids, size_t count)
+{
+    TraceScope trace_scope("FinishRecording");
+    FILE* pos_file = fopen(".pos", "wb");
+    fwrite(positions, sizeof(Float2), count, pos_file);
+    fclose(pos_file);
+
+    // Map the positions to the texture values. The particles can be reordered,
+    // The UVs are written in the order of the particle ids
+    std::vector<Float2> texture_uvs(next_particle_id, Float2(0.0f));
+    for (size_t index = 0; index < count; index++) {
+        // Transform into ndc coordinates, and then into UV, and then into texel indices
+        Float2 ndc = positions[index] / POSITION_FACTOR;
+        // The x component needs to be adjusted to the aspect ratio
+        ndc.x /= aspect_ratio;
+
+        Float2 uv = (ndc + 1.0f) * 0.5f;
+        texture_uvs[ids[index]] = uv;
+    }
+
+    // The remaining delta times, the UVs and the end of the file. It is closed afterwards
+    if (!record_writer.Finish(texture_uvs.data(), texture_uvs.size())) {
+        std::cout << "Failed to write record file\n";
+        abort();
+    }
+}
+
 void Simulation::SetInitialBufferData(size_t particle_count)
 {
     if (particle_count > 0) {
-        const float center_x = 0.0f;
-        const float center_y = 0.0f;
+        std::vector<Float2> positions = GetInitialBlockPositions(particle_count);
+        UploadParticleData(particle_count, positions.data(), nullptr);
+    }
+}
+
+std::vector<Float2> Simulation::GetInitialBlockPositions(size_t particle_count, float spacing_scale)
+{
+    std::vector<Float2> data;
+    if (particle_count == 0) {
+        return data;
+    }
+
+    const float center_x = 0.0f;
+    const float center_y = 0.0f;
+
+    const float REDUCE_FACTOR = 0.65f;
+    float particle_size = PARTICLE_SIZE * spacing_scale;
+
+    size_t rows = sqrt(particle_count);
+    size_t per_row_count = particle_count / rows;
+
+    float row_x_start = (center_x - ((float)per_row_count / 2) * particle_size * REDUCE_FACTOR) * POSITION_FACTOR;
+    float row_y = (center_y - ((float)rows / 2) * particle_size) * POSITION_FACTOR;
+
+    data.reserve(particle_count);
+    for (size_t index = 0; index < rows; index++) {
+        for (size_t column = 0; column < per_row_count; column++) {
+            data.push_back({ row_x_start + (float)column * particle_size * REDUCE_FACTOR * POSITION_FACTOR, row_y });
+        }
+        row_y += particle_size * POSITION_FACTOR;
+    }
+    for (size_t index = rows * per_row_count; index < particle_count; index++) {
+        data.push_back({ row_x_start + (float)(index - rows * per_row_count) * particle_size * REDUCE_FACTOR * POSITION_FACTOR, row_y });
+    }
+    return data;
+}
+
+void Simulation::SetParticles(size_t _particle_count, const Float2* positions, const Float2* velocities)
+{
+    ChangeParticleCount(_particle_count);
+    if (_particle_count > 0) {
+        UploadParticleData(_particle_count, positions, velocities);
+    }
+}
+
+void Simulation::UploadParticleData(size_t count, const Float2* positions, const Float2* velocities)
+{
+    // The predicted positions start at the positions
+    position_buffer.UpdateData(sizeof(Float2), count, positions);
+    predicted_position_buffer.UpdateData(sizeof(Float2), count, positions);
+    if (backend == SimulationBackend::CPU) {
+        cpu_simulation.SetParticleData(count, positions, nullptr, velocities, nullptr);
+    }
+
+    if (velocities != nullptr) {
+        velocity_buffer.UpdateData(sizeof(Float2), count, velocities);
+    }
+    else {
+        std::vector<Float2> zero_velocities(count, Float2(0.0f));
+        velocity_buffer.UpdateData(sizeof(Float2), count, zero_velocities.data());
+    }
+}
+
+void Simulation::ResetParticleIds()
+{
+    std::vector<unsigned int> ids(particle_count);
+    for (size_t index = 0; index < particle_count; index++) {
+        ids[index] = index;
+    }
+    particle_ids.UpdateData(sizeof(unsigned int), particle_count, ids.data());
+    next_particle_id = particle_count;
+}
+
+void Simulation::ResizeParticleIds(size_t new_particle_count)
+{
+    // The ids of the existing particles stay in place, only the new ones are written
+    if (new_particle_count > particle_count) {
+        std::vector<unsigned int> ids(new_particle_count - particle_count);
+        for (size_t index = 0; index < ids.size(); index++) {
+            ids[index] = next_particle_id++;
+        }
+        particle_ids.UpdateData(sizeof(unsigned int), ids.size(), ids.data(), particle_count);
+    }
+}
+
+void Simulation::ReserveParticleCapacity(size_t capacity)
+{
+    if (capacity > particle_capacity) {
+        GrowParticleBuffers(capacity, particle_count);
+    }
+}
+
+void Simulation::GrowParticleBuffers(size_t capacity, size_t preserved_count)
+{
+    auto grow = [&](StructuredBuffer& buffer, size_t element_byte_size) {
+        StructuredBuffer new_buffer(element_byte_size, capacity);
+        if (preserved_count > 0) {
+            new_buffer.CopyData(buffer, element_byte_size * preserved_count);
+        }
+        buffer.Release();
+        buffer = new_buffer;
+    };
+
+    grow(position_buffer, sizeof(Float2));
+    grow(predicted_position_buffer, sizeof(Float2));
+    grow(velocity_buffer, sizeof(Float2));
+    grow(density_buffer, sizeof(Float2));
+    grow(particle_ids, sizeof(unsigned int));
+    // The spatial entries are recalculated each step, they don't need to be preserved
+    spatial_indices.SetNewDataSize(sizeof(unsigned int) * 3, capacity);
+    ReserveSpatialOffsets(capacity);
+    particle_capacity = capacity;
+}
+
+size_t Simulation::GetGrowthCapacity(size_t count) const
+{
+    // The spawner stops at the max particle count, such that it fits from the start. Past
+    // It, grow with a margin, such that adding particles does not reallocate each time
+    if (count <= max_particle_count) {
+        return max_particle_count;
+    }
+    return count + count / 4;
+}
+
+void Simulation::ReorderParticles()
+{
+    if (reorder_capacity < particle_capacity) {
+        // The buffers are swapped with the particle buffers, they must have the same capacity
+        reorder_capacity = particle_capacity;
+        reorder_position_buffer.SetNewDataSize(sizeof(Float2), reorder_capacity);
+        reorder_predicted_position_buffer.SetNewDataSize(sizeof(Float2), reorder_capacity);
+        reorder_velocity_buffer.SetNewDataSize(sizeof(Float2), reorder_capacity);
+        reorder_particle_ids.SetNewDataSize(sizeof(unsigned int), reorder_capacity);
+        // This one is not swapped, it stays at least as large as the capacity. The buffers that have another
+        // Capacity are permuted into it and copied back
+        reorder_copy_buffer.SetNewDataSize(sizeof(Float2), reorder_capacity);
+    }
+
+    reorder_particles_compute->Bind(false);
+    reorder_particles_compute->SetUInt("entry_count", particle_count);
+    auto permute = [&](const StructuredBuffer& source, const StructuredBuffer& destination, unsigned int element_size, bool update_indices) {
+        source.Bind(0);
+        destination.Bind(1);
+        // The permutations that don't update the indices are independent of each other
+        spatial_indices.Bind(2, update_indices ? GPUAccess::ReadWrite : GPUAccess::Read);
+        reorder_particles_compute->SetUInt("element_size", element_size);
+        reorder_particles_compute->SetBool("update_indices", update_indices);
+        reorder_particles_compute->Dispatch(particle_count, 1, 1);
+    };
+
+    // The densities are not permuted, they are recalculated before they are read
+    permute(position_buffer, reorder_position_buffer, 2, false);
+    permute(predicted_position_buffer, reorder_predicted_position_buffer, 2, false);
+    permute(velocity_buffer, reorder_velocity_buffer, 2, false);
+    if (image_mode) {
+        // The UVs past the particle count are indexed by id, for the particles that are not spawned yet.
+        // Only the first part is permuted, and then copied back
+        permute(image_mode_uvs, reorder_copy_buffer, 2, false);
+        image_mode_uvs.CopyData(reorder_copy_buffer, sizeof(Float2) * particle_count);
+    }
+    if (measure_motion) {
+        // The velocities of the start of the step must stay with their particles, the motion reduction
+        // Subtracts them from the new velocities of the same slots
+        permute(previous_velocity_buffer, reorder_copy_buffer, 2, false);
+        previous_velocity_buffer.CopyData(reorder_copy_buffer, sizeof(Float2) * particle_count);
+    }
+    permute(particle_ids, reorder_particle_ids, 1, true);
+
+    std::swap(position_buffer, reorder_position_buffer);
+    std::swap(predicted_position_buffer, reorder_predicted_position_buffer);
+    std::swap(velocity_buffer, reorder_velocity_buffer);
+    std::swap(particle_ids, reorder_particle_ids);
+
+    // The spare buffers are now the previous particle buffers, which have the particle capacity
+    reorder_capacity = particle_capacity;
+}
+
+void Simulation::ReserveSpatialOffsets(size_t count)
+{
+    // The contents are recalculated each frame, they don't need to be preserved
+    if (count > spatial_offsets_count) {
+        spatial_offsets.SetNewDataSize(sizeof(unsigned int), count);
+        spatial_offsets_count = count;
+    }
+}
+
+void Simulation::ReserveNeighbourLists()
+{
+    size_t list_count = particle_count * ((size_t)neighbour_list_capacity + 1);
+    if (list_count > neighbour_lists_count) {
+        neighbour_lists.SetNewDataSize(sizeof(unsigned int), list_count);
+        neighbour_lists_count = list_count;
+    }
+    if (store_neighbour_distances) {
+        size_t distance_count = particle_count * (size_t)neighbour_list_capacity;
+        if (distance_count > neighbour_distances_count) {
+            neighbour_distances.SetNewDataSize(sizeof(float), distance_count);
+            neighbour_distances_count = distance_count;
+        }
+    }
+}
+
+NeighbourListStats Simulation::GetNeighbourListStats() const
+{
+    return read_neighbour_list_stats;
+}
+
+NeighbourSearchStats Simulation::GetHashTableStats() const
+{
+    return read_hash_table_stats;
+}
+
+unsigned int Simulation::GetHashTableSize(size_t particle_count, float load_factor)
+{
+    size_t key_count = (size_t)ceilf((float)particle_count / load_factor);
+    unsigned int table_size = 1;
+    while (table_size < key_count && table_size < MAX_HASH_TABLE_SIZE) {
+        table_size *= 2;
+    }
+    return table_size;
+}
+
+size_t Simulation::GetHashKeyCount()
+{
+    const GeneralSettings* settings = (const GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
+    return settings->hash_table_size != 0 ? settings->hash_table_size : particle_count;
+}
+
+void Simulation::SelectShaderVariants()
+{
+    if (!autotuning_workgroups) {
+        WorkgroupTuner::GetSizes(particle_count, workgroup_sizes);
+    }
+    // The motion reduction is the only pass that the CPU backend uses
+    if (measure_motion) {
+        reduce_motion_compute = shader_variants.Get(SHADER_LOCATION(reduce_motion.comp), workgroup_sizes[TunedKernel::MotionReduction], 1, 1, {});
+    }
+    if (backend == SimulationBackend::CPU) {
+        return;
+    }
+
+    const GeneralSettings* settings = GetGeneralSettings();
+    // All the passes that access the spatial indices must agree on their layout
+    ShaderDefine layout_define = { "COMPACT_SPATIAL_INDEX", compact_spatial_indices ? "1" : "0" };
+    // The program that holds the settings is used directly when it has the right size and the full layout
+    if (workgroup_sizes[TunedKernel::ExternalForces] == WORKGROUP_DEFAULT_SIZE && !compact_spatial_indices) {
+        external_forces_compute = &simulation_early_compute;
+    }
+    else {
+        external_forces_compute = shader_variants.Get(SHADER_LOCATION(simulation_early.comp), workgroup_sizes[TunedKernel::ExternalForces], 1, 1, { layout_define });
+    }
+    if (settings->reorder_interval > 0) {
+        reorder_particles_compute = shader_variants.Get(SHADER_LOCATION(reorder_particles.comp), workgroup_sizes[TunedKernel::Reorder], 1, 1, { layout_define });
+    }
+    gpu_sort.SetGroupSize(workgroup_sizes[TunedKernel::Sort]);
+    gpu_sort.SetCompactEntries(compact_spatial_indices);
+
+    std::vector<ShaderDefine> defines = {
+        layout_define,
+        { "NEIGHBOUR_SEARCH_MODE", settings->neighbour_search_mode == NeighbourSearchMode::DenseGrid ? "1" : "0" },
+        { "NEIGHBOUR_LISTS", settings->neighbour_list_capacity != 0 ? "1" : "0" },
+        { "NEIGHBOUR_LIST_DISTANCES", settings->neighbour_list_distances != 0 ? "1" : "0" }
+    };
+    calculate_density_compute = shader_variants.Get(SHADER_LOCATION(calculate_density.comp), workgroup_sizes[TunedKernel::Density], 1, 1, defines);
+    calculate_pressure_compute = shader_variants.Get(SHADER_LOCATION(calculate_pressure.comp), workgroup_sizes[TunedKernel::Pressure], 1, 1, defines);
+    // The lists are built only when they are enabled
+    if (settings->neighbour_list_capacity != 0) {
+        build_neighbour_lists_compute = shader_variants.Get(
+            SHADER_LOCATION(build_neighbour_lists.comp),
+            workgroup_sizes[TunedKernel::NeighbourLists],
+            1,
+            1,
+            defines
+        );
+    }
 
-        const float REDUCE_FACTOR = 0.65f;
+    // The last pass skips the terms that have no effect
+    bool has_obstacle = settings->obstacle_size.x > 0.0f && settings->obstacle_size.y > 0.0f;
+    defines.push_back({ "VISCOSITY", settings->viscosity_strength != 0.0f ? "1" : "0" });
+    defines.push_back({ "OBSTACLE", has_obstacle ? "1" : "0" });
+    defines.push_back({ "COLLISION_MAP", collision_map_empty ? "0" : "1" });
+    calculate_viscosity_update_pos_compute = shader_variants.Get(
+        SHADER_LOCATION(calculate_viscosity_update_pos.comp),
+        workgroup_sizes[TunedKernel::Viscosity],
+        1,
+        1,
+        defines
+    );
+}
 
-        size_t rows = sqrt(particle_count);
-        size_t per_row_count = particle_count / rows;
+// The profiler scope of each tuned kernel, all of them are directly inside the simulation scope
+static const char* TUNED_KERNEL_SCOPES[] = {
+    "External forces",
+    "Sort",
+    "Reorder",
+    "Neighbour lists",
+    "Density",
+    "Pressure",
+    "Viscosity and collisions",
+    "Motion reduction"
+};
+
+static_assert(std::size(TUNED_KERNEL_SCOPES) == (size_t)TunedKernel::Count, "Each tuned kernel needs a scope");
+
+WorkgroupSizes Simulation::AutotuneWorkgroupSizes(float delta_time, size_t step_count)
+{
+    // The kernels that don't run with the current settings keep their previous sizes
+    WorkgroupSizes best_sizes;
+    WorkgroupTuner::GetSizes(particle_count, best_sizes);
+    if (backend == SimulationBackend::CPU || particle_count == 0) {
+        return best_sizes;
+    }
 
-        float row_x_start = (center_x - ((float)per_row_count / 2) * PARTICLE_SIZE * REDUCE_FACTOR) * POSITION_FACTOR;
-        float row_y = (center_y - ((float)rows / 2) * PARTICLE_SIZE) * POSITION_FACTOR;
+    // Each size starts from the same particles, such that all of them run the same steps
+    StructuredBuffer saved_positions(sizeof(Float2), particle_count);
+    StructuredBuffer saved_predicted_positions(sizeof(Float2), particle_count);
+    StructuredBuffer saved_velocities(sizeof(Float2), particle_count);
+    StructuredBuffer saved_particle_ids(sizeof(unsigned int), particle_count);
+    StructuredBuffer saved_image_mode_uvs(sizeof(Float2), image_mode ? particle_count : 1);
+    saved_positions.CopyData(position_buffer, sizeof(Float2) * particle_count);
+    saved_predicted_positions.CopyData(predicted_position_buffer, sizeof(Float2) * particle_count);
+    saved_velocities.CopyData(velocity_buffer, sizeof(Float2) * particle_count);
+    saved_particle_ids.CopyData(particle_ids, sizeof(unsigned int) * particle_count);
+    if (image_mode) {
+        // The reorder permutes the UVs as well
+        saved_image_mode_uvs.CopyData(image_mode_uvs, sizeof(Float2) * particle_count);
+    }
+    size_t saved_reorder_step_counter = reorder_step_counter;
+    size_t saved_substep_count = substep_count;
+    float saved_aspect_ratio_change = aspect_ratio_change;
+    bool profiler_enabled = gpu_profiler.IsEnabled();
+    auto restore_particles = [&]() {
+        position_buffer.CopyData(saved_positions, sizeof(Float2) * particle_count);
+        predicted_position_buffer.CopyData(saved_predicted_positions, sizeof(Float2) * particle_count);
+        velocity_buffer.CopyData(saved_velocities, sizeof(Float2) * particle_count);
+        particle_ids.CopyData(saved_particle_ids, sizeof(unsigned int) * particle_count);
+        if (image_mode) {
+            image_mode_uvs.CopyData(saved_image_mode_uvs, sizeof(Float2) * particle_count);
+        }
+        reorder_step_counter = saved_reorder_step_counter;
+        aspect_ratio_change = saved_aspect_ratio_change;
+    };
 
-        // At first, initialize the positions. The predicted positions will be the same as these positions
-        std::vector<Float2> data;
-        data.reserve(particle_count);
-        for (size_t index = 0; index < rows; index++) {
-            for (size_t column = 0; column < per_row_count; column++) {
-                data.push_back({ row_x_start + (float)column * PARTICLE_SIZE * REDUCE_FACTOR * POSITION_FACTOR, row_y });
+    autotuning_workgroups = true;
+    substep_count = 1;
+    gpu_profiler.SetEnabled(true);
+    unsigned int candidates[] = WORKGROUP_CANDIDATE_SIZES;
+    float best_times[(size_t)TunedKernel::Count];
+    for (size_t index = 0; index < (size_t)TunedKernel::Count; index++) {
+        best_times[index] = FLT_MAX;
+    }
+    // The first steps of each size wait for its programs to be compiled, they are not timed
+    const size_t warmup_step_count = 2;
+    for (size_t candidate_index = 0; candidate_index < std::size(candidates); candidate_index++) {
+        for (size_t index = 0; index < (size_t)TunedKernel::Count; index++) {
+            workgroup_sizes.sizes[index] = candidates[candidate_index];
+        }
+        restore_particles();
+        for (size_t step_index = 0; step_index < warmup_step_count + step_count; step_index++) {
+            if (step_index == warmup_step_count) {
+                gpu_profiler.ResetStatistics();
             }
-            row_y += PARTICLE_SIZE * POSITION_FACTOR;
+            gpu_readback.Update();
+            GPUUploadRing::NextFrame();
+            gpu_profiler.BeginFrame();
+            SetFrameParameters(Float2(0.0f, 0.0f), false, false, delta_time);
+            gpu_profiler.BeginScope("Simulation");
+            FrameCompute();
+            gpu_profiler.EndScope();
+            gpu_profiler.EndFrame();
+            // Waiting for each step doesn't change the GPU times, and none of them is dropped
+            gpu_profiler.ResolvePendingFrames();
         }
-        for (size_t index = rows * per_row_count; index < particle_count; index++) {
-            data.push_back({ row_x_start + (float)(index - rows * per_row_count) * PARTICLE_SIZE * REDUCE_FACTOR * POSITION_FACTOR, row_y });
+
+        std::vector<GPUProfilerScopeStatistics> statistics = gpu_profiler.GetStatistics();
+        for (size_t index = 0; index < statistics.size(); index++) {
+            for (size_t kernel_index = 0; kernel_index < (size_t)TunedKernel::Count; kernel_index++) {
+                bool is_kernel = statistics[index].depth == 1 && strcmp(statistics[index].name, TUNED_KERNEL_SCOPES[kernel_index]) == 0;
+                if (is_kernel && statistics[index].average < best_times[kernel_index]) {
+                    best_times[kernel_index] = statistics[index].average;
+                    best_sizes.sizes[kernel_index] = candidates[candidate_index];
+                }
+            }
         }
-        position_buffer.SetNewData(sizeof(Float2), particle_count, data.data());
-        predicted_position_buffer.SetNewData(sizeof(Float2), particle_count, data.data());
+    }
+
+    autotuning_workgroups = false;
+    substep_count = saved_substep_count;
+    restore_particles();
+    gpu_profiler.ResetStatistics();
+    gpu_profiler.SetEnabled(profiler_enabled);
+    saved_positions.Release();
+    saved_predicted_positions.Release();
+    saved_velocities.Release();
+    saved_particle_ids.Release();
+    saved_image_mode_uvs.Release();
+
+    WorkgroupTuner::SetSizes(particle_count, best_sizes);
+    if (!WorkgroupTuner::Save(WORKGROUP_SIZES_FILE)) {
+        std::cout << "Failed to write the workgroup sizes file\n";
+    }
+    return best_sizes;
+}
+
+std::vector<KernelBenchmarkResult> Simulation::BenchmarkKernels(float delta_time, size_t iteration_count, NeighbourSearchStats& stats)
+{
+    std::vector<KernelBenchmarkResult> results;
+    stats = {};
+    if (backend == SimulationBackend::CPU || particle_count == 0 || iteration_count == 0) {
+        return results;
+    }
+
+    StructuredBuffer saved_positions(sizeof(Float2), particle_count);
+    StructuredBuffer saved_predicted_positions(sizeof(Float2), particle_count);
+    StructuredBuffer saved_velocities(sizeof(Float2), particle_count);
+    StructuredBuffer unsorted_indices(sizeof(unsigned int) * 3, particle_count);
+    size_t entry_size = gpu_sort.GetEntrySize();
+    saved_positions.CopyData(position_buffer, sizeof(Float2) * particle_count);
+    saved_predicted_positions.CopyData(predicted_position_buffer, sizeof(Float2) * particle_count);
+    saved_velocities.CopyData(velocity_buffer, sizeof(Float2) * particle_count);
+    bool saved_use_neighbour_lists = use_neighbour_lists;
+    float saved_aspect_ratio_change = aspect_ratio_change;
+
+    use_neighbour_lists = false;
+    SetFrameParameters(Float2(0.0f, 0.0f), false, false, delta_time);
+    SelectShaderVariants();
+    const GeneralSettings* general_settings = (const GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
+    bool is_dense_grid = general_settings->neighbour_search_mode == NeighbourSearchMode::DenseGrid;
+    size_t key_count = is_dense_grid ? (size_t)general_settings->grid_width * (size_t)general_settings->grid_height : GetHashKeyCount();
+    GPUSortOffsets offsets_type = is_dense_grid ? GPUSortOffsets::KeyRanges : GPUSortOffsets::FirstEntry;
+    if (is_dense_grid) {
+        ReserveSpatialOffsets(key_count + 1);
+    }
 
-        // Set the initial velocities to 0.0f
-        // We can reuse the buffer from the positions
-        for (size_t index = 0; index < particle_count; index++) {
-            data[index] = { 0.0f };
+    // Timestamps like the profiler, which some drivers resolve better than elapsed time queries
+    unsigned int queries[2];
+    glGenQueries(2, queries);
+    // The first iteration is a warm up. The preparation of an iteration is not timed
+    auto time_kernel = [&](BenchmarkKernel kernel, auto prepare, auto dispatch) {
+        KernelBenchmarkResult result;
+        result.kernel = kernel;
+        result.particle_count = particle_count;
+        result.iteration_count = iteration_count;
+        result.average_time = 0.0;
+        result.min_time = DBL_MAX;
+        for (size_t iteration = 0; iteration <= iteration_count; iteration++) {
+            prepare();
+            glFinish();
+            glQueryCounter(queries[0], GL_TIMESTAMP);
+            dispatch();
+            glQueryCounter(queries[1], GL_TIMESTAMP);
+
+            GLuint64 begin_time;
+            GLuint64 end_time;
+            glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &begin_time);
+            glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end_time);
+            if (iteration > 0) {
+                double milliseconds = (double)(end_time - begin_time) / 1'000'000.0;
+                result.average_time += milliseconds;
+                result.min_time = std::min(result.min_time, milliseconds);
+            }
         }
-        velocity_buffer.SetNewData(sizeof(Float2), particle_count, data.data());
+        result.average_time /= (double)iteration_count;
+        results.push_back(result);
+    };
+    auto no_preparation = []() {};
+    auto restore_velocities = [&]() {
+        velocity_buffer.CopyData(saved_velocities, sizeof(Float2) * particle_count);
+    };
+
+    // Each iteration starts from the same velocities, such that gravity doesn't accumulate
+    time_kernel(BenchmarkKernel::SimulationEarly, restore_velocities, [&]() { DispatchExternalForces(); });
+    restore_velocities();
+    DispatchExternalForces();
+    unsorted_indices.CopyData(spatial_indices, entry_size * particle_count);
+
+    time_kernel(BenchmarkKernel::Sort, [&]() {
+        spatial_indices.CopyData(unsorted_indices, entry_size * particle_count);
+    }, [&]() {
+        gpu_sort.ExecuteNetwork(spatial_indices, particle_count);
+    });
+    time_kernel(BenchmarkKernel::SortCalculateOffsets, no_preparation, [&]() {
+        gpu_sort.CalculateOffsets(spatial_indices, spatial_offsets, particle_count, key_count, offsets_type);
+    });
+
+    // The uniform block of the sort was bound over the one of the settings
+    simulation_early_compute.BindUniformBlock(0);
+    // The passes declare the lists even when they are not used
+    neighbour_lists.Bind(6);
+    neighbour_distances.Bind(7);
+    time_kernel(BenchmarkKernel::Density, no_preparation, [&]() { DispatchDensity(); });
+    time_kernel(BenchmarkKernel::Pressure, no_preparation, [&]() { DispatchPressure(); });
+    time_kernel(BenchmarkKernel::ViscosityUpdatePos, no_preparation, [&]() { DispatchViscosity(); });
+    glDeleteQueries(2, queries);
+
+    std::vector<Float2> predicted_positions(particle_count);
+    predicted_position_buffer.RetrieveData(sizeof(Float2), particle_count, predicted_positions.data());
+    stats = AnalyzeNeighbourSearch(predicted_positions, *general_settings, compact_spatial_indices);
+    for (size_t index = 0; index < results.size(); index++) {
+        results[index].bytes = GetKernelBytes(results[index].kernel, particle_count, stats);
     }
+
+    position_buffer.CopyData(saved_positions, sizeof(Float2) * particle_count);
+    predicted_position_buffer.CopyData(saved_predicted_positions, sizeof(Float2) * particle_count);
+    velocity_buffer.CopyData(saved_velocities, sizeof(Float2) * particle_count);
+    use_neighbour_lists = saved_use_neighbour_lists;
+    aspect_ratio_change = saved_aspect_ratio_change;
+    saved_positions.Release();
+    saved_predicted_positions.Release();
+    saved_velocities.Release();
+    unsorted_indices.Release();
+    return results;
+}
+
+void Simulation::UploadCPURenderData()
+{
+    position_buffer.UpdateData(sizeof(Float2), particle_count, cpu_simulation.GetPositions());
+    velocity_buffer.UpdateData(sizeof(Float2), particle_count, cpu_simulation.GetVelocities());
 }
 
 void Simulation::SetFrameParameters(Float2 normalized_mouse_pos, bool is_left_mouse_pressed, bool is_right_mouse_pressed, float delta_time)
 {
+    TraceScope trace_scope("SetFrameParameters");
     GeneralSettings* settings = (GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
     float smoothing_radius = settings->smoothing_radius;
     settings->poly6_scaling_factor = 4 / (M_PI * pow(smoothing_radius, 8));
@@ -748,6 +1575,38 @@ void Simulation::SetFrameParameters(Float2 normalized_mouse_pos, bool is_left_mo
     settings->delta_time = delta_time;
     settings->num_particles = particle_count;
 
+    // The particles are kept inside the window, such that a grid that covers it, with a margin of a cell
+    // For the predicted positions, can index the cells directly
+    float grid_cell_size = smoothing_radius;
+    float grid_half_width = POSITION_FACTOR * aspect_ratio;
+    float grid_half_height = POSITION_FACTOR;
+    size_t grid_width = 0;
+    size_t grid_height = 0;
+    while (true) {
+        grid_width = (size_t)ceilf(2.0f * grid_half_width / grid_cell_size) + 2;
+        grid_height = (size_t)ceilf(2.0f * grid_half_height / grid_cell_size) + 2;
+        if (grid_width * grid_height <= MAX_DENSE_GRID_CELLS) {
+            break;
+        }
+        // Larger cells still contain all the neighbours inside the smoothing radius
+        grid_cell_size *= 2.0f;
+    }
+    settings->grid_origin = Float2(-grid_half_width - grid_cell_size, -grid_half_height - grid_cell_size);
+    settings->grid_width = grid_width;
+    settings->grid_height = grid_height;
+    settings->grid_cell_size = grid_cell_size;
+    // The CPU backend always uses the neighbour search
+    bool neighbour_lists_active = use_neighbour_lists && backend == SimulationBackend::GPU;
+    settings->neighbour_list_capacity = neighbour_lists_active ? neighbour_list_capacity : 0;
+    settings->neighbour_list_distances = store_neighbour_distances ? 1 : 0;
+    if (settings->hash_table_size != 0) {
+        // The sizes that are not a power of two, from the files or the command line, are rounded up
+        settings->hash_table_size = GetHashTableSize(settings->hash_table_size, 1.0f);
+        if (backend == SimulationBackend::GPU) {
+            ReserveSpatialOffsets(settings->hash_table_size);
+        }
+    }
+
     float interaction_strength = 0;
     if (paint_collision) {
         Int2 mouse_pixel_position = (normalized_mouse_pos + Float2(1.0f, 1.0f)) * Float2(0.5f, 0.5f) * Float2(window_width, window_height);
@@ -803,14 +1662,116 @@ void Simulation::RenderCollisionObjects() {
 
 void Simulation::ReuploadCollisionData()
 {
+    TraceScope trace_scope("ReuploadCollisionData");
     size_t reduced_width = (window_width + 7) / 8;
-    collision_map.SetData(DataType::UByte, reduced_width, window_height, collision_map_data, TextureSampling::Point);
+    // The texture was allocated with this size when the window was resized
+    collision_map.UpdateData(DataType::UByte, reduced_width, window_height, collision_map_data);
     collision_map.Bind(2);
+
+    size_t byte_count = reduced_width * window_height;
+    collision_map_empty = std::all_of(collision_map_data, collision_map_data + byte_count, [](unsigned char value) {
+        return value == 0;
+    });
+}
+
+bool Simulation::SaveSnapshot(const char* path)
+{
+    if (snapshot_saver.IsPending()) {
+        return false;
+    }
+
+    SnapshotState state;
+    state.settings = *GetGeneralSettings();
+    state.spawner = particle_spawner;
+    state.particle_count = particle_count;
+    state.next_particle_id = next_particle_id;
+    state.reorder_step_counter = reorder_step_counter;
+    state.window_width = window_width;
+    state.window_height = window_height;
+    size_t reduced_width = (window_width + 7) / 8;
+    state.collision_map.assign(collision_map_data, collision_map_data + reduced_width * window_height);
+    if (backend == SimulationBackend::CPU) {
+        // The positions and the velocities are already uploaded for rendering
+        predicted_position_buffer.UpdateData(sizeof(Float2), particle_count, cpu_simulation.GetPredictedPositions());
+    }
+    return snapshot_saver.Begin(path, std::move(state), position_buffer, predicted_position_buffer, velocity_buffer, particle_ids);
+}
+
+bool Simulation::LoadSnapshot(const char* path)
+{
+    SnapshotReader reader;
+    if (!reader.Open(path) || !reader.ReadSettings(*GetGeneralSettings(), particle_spawner)) {
+        std::cout << "Failed to load the snapshot " << path << "\n";
+        return false;
+    }
+
+    // The arrays are uploaded straight from the mapped file
+    size_t count = reader.GetParticleCount();
+    ChangeParticleCount(count);
+    position_buffer.UpdateData(sizeof(Float2), count, reader.GetPositions());
+    predicted_position_buffer.UpdateData(sizeof(Float2), count, reader.GetPredictedPositions());
+    velocity_buffer.UpdateData(sizeof(Float2), count, reader.GetVelocities());
+    particle_ids.UpdateData(sizeof(unsigned int), count, reader.GetIds());
+    next_particle_id = reader.GetNextParticleId();
+    if (backend == SimulationBackend::CPU) {
+        cpu_simulation.SetParticleData(count, reader.GetPositions(), reader.GetPredictedPositions(), reader.GetVelocities(), nullptr);
+    }
+    reorder_step_counter = reader.GetReorderStepCounter();
+    simulation_early_compute.SetUniformBlockDirty("Settings");
+
+    if (reader.GetCollisionMap() != nullptr) {
+        if (reader.GetWindowWidth() == window_width && reader.GetWindowHeight() == window_height) {
+            size_t reduced_width = (window_width + 7) / 8;
+            memcpy(collision_map_data, reader.GetCollisionMap(), reduced_width * window_height);
+            ReuploadCollisionData();
+        }
+        else {
+            std::cout << "The snapshot was taken with a different window size, the collision map is kept\n";
+        }
+    }
+    return true;
+}
+
+void Simulation::FlushSnapshots()
+{
+    snapshot_saver.Flush();
+}
+
+bool Simulation::StartTrajectory(const char* path)
+{
+    // The particles are ordered by the cells of the smoothing radius, which is where their motion is similar
+    if (!trajectory_writer.Open(path, trajectory_error_bound, GetGeneralSettings()->smoothing_radius)) {
+        std::cout << "Failed to open the trajectory file " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool Simulation::StopTrajectory()
+{
+    return trajectory_writer.Close();
+}
+
+void Simulation::RetrieveParticleState(std::vector<unsigned int>& ids, std::vector<Float2>& positions, std::vector<Float2>& velocities) const
+{
+    // The GPU buffers are kept up to date by the CPU backend as well
+    ids.resize(particle_count);
+    positions.resize(particle_count);
+    velocities.resize(particle_count);
+    particle_ids.RetrieveData(sizeof(unsigned int), particle_count, ids.data());
+    position_buffer.RetrieveData(sizeof(Float2), particle_count, positions.data());
+    velocity_buffer.RetrieveData(sizeof(Float2), particle_count, velocities.data());
 }
 
 void Simulation::Render() {
+    TraceScope trace_scope("Render");
+    GPUProfilerScope render_scope(&gpu_profiler, "Render");
+    gpu_profiler.BeginScope("Particles");
     RenderParticles();
+    gpu_profiler.EndScope();
+    gpu_profiler.BeginScope("Collision objects");
     RenderCollisionObjects();
+    gpu_profiler.EndScope();
 }
 
 void Simulation::RenderParticles()
@@ -5,10 +5,45 @@
 #include "VertexBuffer.h"
 #include "Texture.h"
 #include "GPUSort.h"
+#include "GPUProfiler.h"
+#include "GPUReadback.h"
 #include "GeneralSettings.h"
 #include "ParticleSpawner.h"
+#include "SimulationFile.h"
+#include "Snapshot.h"
+#include "Trajectory.h"
+#include "WorkgroupTuner.h"
+#include "KernelBenchmark.h"
+#include "../CPU/CPUSimulation.h"
+
+// How many motion reductions can be read back at the same time. When the GPU is further behind, the
+// Reductions are not read, such that the readbacks don't wait for it
+#define MOTION_STATS_LATENCY 3
+// The largest spatial hash table, in entries
+#define MAX_HASH_TABLE_SIZE (1 << 24)
+
+enum class SimulationBackend : unsigned char {
+    GPU,
+    CPU
+};
 
-#define POSITION_FACTOR 500.0f
+// The counters of the neighbour list stage for the last step
+struct NeighbourListStats {
+    unsigned int total_neighbours;
+    unsigned int max_neighbours;
+    // The particles that have more neighbours than the capacity, which use the neighbour search
+    unsigned int overflow_count;
+    unsigned int particle_count;
+};
+
+// The values used by the adaptive time step for the last frame
+struct AdaptiveTimeStepStats {
+    size_t substep_count;
+    float substep_delta_time;
+    // The latest values read back from the GPU, they can be a few frames old
+    float max_speed;
+    float max_acceleration;
+};
 
 class Simulation {
 public:
@@ -19,12 +54,40 @@ public:
     // Is smaller. If you add particles, you can specify their initial positions and/or velocities
     void ChangeParticleCountPreserve(size_t particle_count, const Float2* add_positions = nullptr, const Float2* add_velocities = nullptr);
 
+    // Grows the particle buffers such that they can hold this many particles without reallocating.
+    // The existing particles are copied on the GPU
+    void ReserveParticleCapacity(size_t capacity);
+
+    inline size_t GetParticleCapacity() const {
+        return particle_capacity;
+    }
+
     void DoFrame(Float2 normalized_mouse_pos, bool is_left_mouse_pressed, bool is_right_mouse_pressed, float delta_time);
 
+    inline size_t GetParticleCount() const {
+        return particle_count;
+    }
+
+    inline SimulationBackend GetBackend() const {
+        return backend;
+    }
+
     inline GeneralSettings* GetGeneralSettings() {
         return (GeneralSettings*)simulation_early_compute.GetUniformBlockData("Settings");
     }
 
+    inline GPUSort* GetGPUSort() {
+        return &gpu_sort;
+    }
+
+    inline GPUProfiler* GetGPUProfiler() {
+        return &gpu_profiler;
+    }
+
+    inline GPUReadback* GetGPUReadback() {
+        return &gpu_readback;
+    }
+
     inline float* GetMouseClickStrength() {
         return &mouse_click_strength;
     }
@@ -45,8 +108,86 @@ public:
         return &paint_collision_size;
     }
 
+    inline ParticleSpawner* GetParticleSpawnerPtr() {
+        return &particle_spawner;
+    }
+
+    // The spawner stops at this count
+    inline size_t* GetMaxParticleCountPtr() {
+        return &max_particle_count;
+    }
+
+    inline bool* GetUseNeighbourListsPtr() {
+        return &use_neighbour_lists;
+    }
+
+    inline int* GetNeighbourListCapacityPtr() {
+        return &neighbour_list_capacity;
+    }
+
+    inline bool* GetStoreNeighbourDistancesPtr() {
+        return &store_neighbour_distances;
+    }
+
+    // The spatial indices leave out the hash, which the sort moves and the neighbour search reads
+    inline bool* GetCompactSpatialIndicesPtr() {
+        return &compact_spatial_indices;
+    }
+
+    // While it is set, the keys of the spatial hash are counted from the predicted positions that are
+    // Read back, for the stats of the hash table
+    inline bool* GetMeasureHashTablePtr() {
+        return &measure_hash_table;
+    }
+
+    // The power of two table size that has at most this many entries for each key, for the particle
+    // Count. It is clamped to the max table size
+    static unsigned int GetHashTableSize(size_t particle_count, float load_factor);
+
+    inline bool* GetAdaptiveTimeStepPtr() {
+        return &adaptive_time_step;
+    }
+
+    inline float* GetCFLFactorPtr() {
+        return &cfl_factor;
+    }
+
+    inline int* GetMaxSubstepCountPtr() {
+        return &max_substep_count;
+    }
+
+    AdaptiveTimeStepStats GetAdaptiveTimeStepStats() const;
+
+    // The counters are read back without waiting for the GPU, they can be a few frames old
+    NeighbourListStats GetNeighbourListStats() const;
+
+    // The stats are counted on the CPU after a readback, they can be a few frames old
+    NeighbourSearchStats GetHashTableStats() const;
+
     void Initialize();
 
+    // Times each kernel at the candidate group sizes, for a couple of steps of this delta time from the
+    // Current particles, and keeps the fastest size of each one for the bucket of the particle count. The
+    // Particles are restored afterwards and the sizes are saved to the workgroup sizes file. It must be
+    // Called outside a profiler frame. Returns the chosen sizes
+    WorkgroupSizes AutotuneWorkgroupSizes(float delta_time, size_t step_count);
+
+    // Times each kernel of a step on its own over the current particles, with a timer query around each
+    // Dispatch. The sort restores the unsorted entries before each iteration, the other kernels run
+    // Again on their own output. The neighbour lists are not used, such that the kernels do the neighbour
+    // Search. The particles are restored afterwards and the stats of the search are written. It must be
+    // Called outside a profiler frame
+    std::vector<KernelBenchmarkResult> BenchmarkKernels(float delta_time, size_t iteration_count, NeighbourSearchStats& stats);
+
+    // The group sizes of the last frame
+    inline const WorkgroupSizes& GetWorkgroupSizes() const {
+        return workgroup_sizes;
+    }
+
+    // Replaces the collision map with the bright pixels of the image, which is stretched over the
+    // Window. The transparent pixels are empty. Returns false if the image could not be loaded
+    bool LoadCollisionMap(const char* image_path);
+
     inline void InvertPauseStatus() {
         pause_simulation = !pause_simulation;
     }
@@ -64,11 +205,65 @@ public:
 
     void ReuploadCollisionData();
 
+    // Starts writing the particles, the settings, the spawner and the collision map to the file. It doesn't
+    // Wait for the GPU, the file is finished a few frames later. Returns false if a snapshot is still pending
+    bool SaveSnapshot(const char* path);
+
+    // Replaces the state of the simulation with the one of the snapshot. The collision map is kept
+    // When the snapshot was taken with a different window size
+    bool LoadSnapshot(const char* path);
+
+    // Waits for the pending snapshot to be written
+    void FlushSnapshots();
+
+    inline bool IsSnapshotPending() const {
+        return snapshot_saver.IsPending();
+    }
+
+    // In seconds of wall time, 0 disables the autosave
+    inline float* GetAutosaveIntervalPtr() {
+        return &autosave_interval;
+    }
+
+    // Writes the positions of every frame to the file, quantized to the trajectory error bound
+    bool StartTrajectory(const char* path);
+
+    // Waits for the remaining frames to be written
+    bool StopTrajectory();
+
+    inline bool IsWritingTrajectory() const {
+        return trajectory_writer.IsOpen();
+    }
+
+    inline size_t GetTrajectoryFrameCount() const {
+        return trajectory_writer.GetFrameCount();
+    }
+
+    // Relative to POSITION_FACTOR
+    inline float* GetTrajectoryErrorBoundPtr() {
+        return &trajectory_error_bound;
+    }
+
+    // Reads back the particles, it waits for the GPU to finish. The ids are stable across the reorders
+    void RetrieveParticleState(std::vector<unsigned int>& ids, std::vector<Float2>& positions, std::vector<Float2>& velocities) const;
+
     inline void Reset() {
         ChangeParticleCount(particle_count);
         SetInitialBufferData(particle_count);
     }
 
+    // Replaces the particles with these ones, the ids start again from 0. The velocities can be nullptr,
+    // In which case they are 0
+    void SetParticles(size_t particle_count, const Float2* positions, const Float2* velocities);
+
+    // The positions of the block that Reset places in the middle, with the spacing of the particles scaled
+    // By this factor, such that larger counts can keep the same size of the block
+    static std::vector<Float2> GetInitialBlockPositions(size_t particle_count, float spacing_scale = 1.0f);
+
+    // Transfers the particle state to the new backend. The GPU buffers for the positions and
+    // Velocities are kept up to date in both modes, since they are used for rendering
+    void SetBackend(SimulationBackend backend);
+
     void SetImageDisplayMode(const char* texture_path);
 
     void SetRecordMode();
@@ -83,12 +278,67 @@ public:
     void SetCollisionPixel(Int2 position, bool is_set);
 
 private:
+    // Chooses the number of substeps for the frame, and returns the simulated time of the frame
+    float ChooseTimeStep(float delta_time);
+
     void FrameCompute();
 
+    // The passes of a step, each one binds all of its buffers such that they can be dispatched on their own.
+    // The sort also calculates the offsets
+    void DispatchExternalForces();
+    void DispatchSort();
+    void DispatchDensity();
+    void DispatchPressure();
+    void DispatchViscosity();
+
+    // Reduces the maximum speed and acceleration of the last step into the motion stats of the frame
+    void MeasureMotion(float delta_time);
+
+    // Requests the readback of the motion stats of the frame, the measured values are updated when it finishes
+    void ReadMotionStats();
+
     void HandleRecordSimulation(float delta_time);
 
+    // Assigns the UVs from the final positions and closes the record file
+    void FinishRecording(const Float2* positions, const unsigned int* ids, size_t count);
+
     void SetInitialBufferData(size_t particle_count);
 
+    // Writes the positions, which are also the predicted positions, and the velocities of the first particles
+    void UploadParticleData(size_t count, const Float2* positions, const Float2* velocities);
+
+    // Permutes the particle buffers into the order of the sorted spatial indices
+    void ReorderParticles();
+
+    // Assigns to each particle its index as id
+    void ResetParticleIds();
+
+    // Keeps the ids of the first particles, the new particles receive new ids. It must be called
+    // Before the particle count is changed, and the capacity must already be large enough
+    void ResizeParticleIds(size_t new_particle_count);
+
+    // Reallocates the particle buffers with the new capacity, and copies the first particles on the GPU
+    void GrowParticleBuffers(size_t capacity, size_t preserved_count);
+
+    // The capacity to allocate when the particle count doesn't fit anymore
+    size_t GetGrowthCapacity(size_t count) const;
+
+    // Grows the spatial offsets buffer, if it has fewer entries
+    void ReserveSpatialOffsets(size_t count);
+
+    // The keys of the spatial hash table
+    size_t GetHashKeyCount();
+
+    // Grows the neighbour list buffers for the current particle count and capacity, if needed
+    void ReserveNeighbourLists();
+
+    // Chooses the shader variants of the passes from the settings, the ones that were not used
+    // Before are compiled now
+    void SelectShaderVariants();
+
+    // Uploads the positions and the velocities of the CPU backend such that they can be rendered
+    void UploadCPURenderData();
+
     std::vector<HeatmapEntry> heatmap_entries;
 
     Shader render_shader;
@@ -102,12 +352,24 @@ private:
     Texture1D heatmap_texture;
     Texture2D collision_map;
     unsigned char* collision_map_data;
+    // When no pixel is set, the collision map sampling is compiled out of the shader
+    bool collision_map_empty;
     Texture2D image_mode_texture;
 
+    // It holds the general settings, and it is dispatched when the external forces have the default group size
     ComputeShader simulation_early_compute;
-    ComputeShader calculate_density_compute;
-    ComputeShader calculate_pressure_compute;
-    ComputeShader calculate_viscosity_update_pos_compute;
+    // These are the variants that match the current settings and group sizes, they are selected before each frame
+    ComputeShader* external_forces_compute;
+    ComputeShader* calculate_density_compute;
+    ComputeShader* calculate_pressure_compute;
+    ComputeShader* calculate_viscosity_update_pos_compute;
+    ComputeShader* build_neighbour_lists_compute;
+    ComputeShader* reorder_particles_compute;
+    ComputeShader* reduce_motion_compute;
+    ComputeShaderVariants shader_variants;
+    WorkgroupSizes workgroup_sizes;
+    // While the autotuner runs, the sizes it sets are not replaced by the tuned ones
+    bool autotuning_workgroups;
 
     StructuredBuffer position_buffer;
     StructuredBuffer predicted_position_buffer;
@@ -115,12 +377,60 @@ private:
     StructuredBuffer density_buffer;
     StructuredBuffer spatial_indices;
     StructuredBuffer spatial_offsets;
+    // The spatial offsets can have more entries than particles, for the dense grid cells
+    size_t spatial_offsets_count;
     StructuredBuffer image_mode_uvs;
+    // For each particle the neighbour count followed by the capacity worth of indices
+    StructuredBuffer neighbour_lists;
+    StructuredBuffer neighbour_distances;
+    StructuredBuffer neighbour_list_stats;
+    // The counters of the last readback that finished
+    NeighbourListStats read_neighbour_list_stats;
+    bool neighbour_list_stats_in_flight;
+    bool measure_hash_table;
+    // The stats of the last readback that finished
+    NeighbourSearchStats read_hash_table_stats;
+    bool hash_table_stats_in_flight;
+    size_t neighbour_lists_count;
+    size_t neighbour_distances_count;
+    // The particles are permuted into cell order from time to time. The ids are stable,
+    // Such that the image mode UVs and the recordings can refer to a particle
+    StructuredBuffer particle_ids;
+    StructuredBuffer reorder_position_buffer;
+    StructuredBuffer reorder_predicted_position_buffer;
+    StructuredBuffer reorder_velocity_buffer;
+    StructuredBuffer reorder_particle_ids;
+    StructuredBuffer reorder_copy_buffer;
+    size_t reorder_capacity;
+    size_t reorder_step_counter;
+    size_t next_particle_id;
+    // The velocities at the start of the step, for the accelerations of the adaptive time step
+    StructuredBuffer previous_velocity_buffer;
+    size_t previous_velocity_capacity;
+    StructuredBuffer motion_stats;
+    // The readbacks of the reductions that have not finished yet
+    size_t motion_stats_in_flight;
+    float measured_max_speed;
+    float measured_max_acceleration;
 
     GPUSort gpu_sort;
+    GPUProfiler gpu_profiler;
+    GPUReadback gpu_readback;
+    SnapshotSaver snapshot_saver;
+    float autosave_interval;
+    // The wall time in seconds when the last autosave was started
+    double last_autosave_time;
+    TrajectoryWriter trajectory_writer;
+    float trajectory_error_bound;
+
+    SimulationBackend backend;
+    CPUSimulation cpu_simulation;
 
     size_t particle_count;
     size_t max_particle_count;
+    // The number of particles that the particle buffers can hold. Spawning appends into
+    // This storage, and the buffers are reallocated only when it runs out
+    size_t particle_capacity;
     size_t window_width;
     size_t window_height;
     float aspect_ratio;
@@ -131,15 +441,31 @@ private:
     bool pause_simulation;
     bool record_simulation;
     bool image_mode;
+    bool use_neighbour_lists;
+    bool store_neighbour_distances;
+    int neighbour_list_capacity;
+    bool compact_spatial_indices;
+    bool adaptive_time_step;
+    // If the frame uses the adaptive time step, and the motion is measured
+    bool measure_motion;
+    // The fraction of the smoothing radius that a particle can move in a substep
+    float cfl_factor;
+    int max_substep_count;
+    size_t substep_count;
+    float substep_delta_time;
     Int2 paint_collision_size;
 
     ParticleSpawner particle_spawner;
 
     // Data used by the record feature
-    struct {
-        FILE* record_file;
-    };
-
-    std::vector<float> image_mode_delta_time;
+    SimulationFileWriter record_writer;
+    // The frames recorded after the max particle count was reached
+    size_t record_wait_count;
+    // The final positions were requested, the recording ends when they are read back
+    bool record_finishing;
+    std::vector<Float2> record_final_positions;
+
+    // The recording that the image mode replays, the delta times are streamed from it
+    SimulationFileReader replay_file;
     size_t image_mode_delta_time_index;
 };
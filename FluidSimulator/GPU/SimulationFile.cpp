@@ -0,0 +1,536 @@
+#include "SimulationFile.h"
+#include <iostream>
+#include <string.h>
+#include <stddef.h>
+#include <iterator>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const unsigned int SIMULATION_FILE_MAGIC = FILE_TAG('F', 'S', 'I', 'M');
+static const unsigned int SETTINGS_TAG = FILE_TAG('S', 'E', 'T', 'T');
+static const unsigned int SPAWNER_TAG = FILE_TAG('S', 'P', 'W', 'N');
+static const unsigned int DELTA_TIMES_TAG = FILE_TAG('D', 'E', 'L', 'T');
+static const unsigned int UVS_TAG = FILE_TAG('U', 'V', 'S', ' ');
+static const unsigned int END_TAG = FILE_TAG('E', 'N', 'D', ' ');
+
+// The magic and the version
+#define FILE_HEADER_SIZE 8
+// The tag, the CRC32 and the 64 bit payload size
+#define CHUNK_HEADER_SIZE 16
+#define CHUNK_ALIGNMENT 8
+
+enum class FieldType : unsigned char {
+    Float,
+    UInt,
+    Float2
+};
+
+struct NamedField {
+    const char* name;
+    size_t offset;
+    FieldType type;
+};
+
+// The fields are written with these names. The names must never change, new fields can be added
+static const NamedField SETTINGS_FIELDS[] = {
+    { "num_particles", offsetof(GeneralSettings, num_particles), FieldType::UInt },
+    { "gravity", offsetof(GeneralSettings, gravity), FieldType::Float },
+    { "delta_time", offsetof(GeneralSettings, delta_time), FieldType::Float },
+    { "collision_damping", offsetof(GeneralSettings, collision_damping), FieldType::Float },
+    { "smoothing_radius", offsetof(GeneralSettings, smoothing_radius), FieldType::Float },
+    { "target_density", offsetof(GeneralSettings, target_density), FieldType::Float },
+    { "pressure_multiplier", offsetof(GeneralSettings, pressure_multiplier), FieldType::Float },
+    { "near_pressure_multiplier", offsetof(GeneralSettings, near_pressure_multiplier), FieldType::Float },
+    { "viscosity_strength", offsetof(GeneralSettings, viscosity_strength), FieldType::Float },
+    { "poly6_scaling_factor", offsetof(GeneralSettings, poly6_scaling_factor), FieldType::Float },
+    { "spiky_pow3_scaling_factor", offsetof(GeneralSettings, spiky_pow3_scaling_factor), FieldType::Float },
+    { "spiky_pow2_scaling_factor", offsetof(GeneralSettings, spiky_pow2_scaling_factor), FieldType::Float },
+    { "spiky_pow3_derivative_scaling_factor", offsetof(GeneralSettings, spiky_pow3_derivative_scaling_factor), FieldType::Float },
+    { "spiky_pow2_derivative_scaling_factor", offsetof(GeneralSettings, spiky_pow2_derivative_scaling_factor), FieldType::Float },
+    { "interaction_input_point", offsetof(GeneralSettings, interaction_input_point), FieldType::Float2 },
+    { "interaction_input_strength", offsetof(GeneralSettings, interaction_input_strength), FieldType::Float },
+    { "interaction_input_radius", offsetof(GeneralSettings, interaction_input_radius), FieldType::Float },
+    { "obstacle_size", offsetof(GeneralSettings, obstacle_size), FieldType::Float2 },
+    { "obstacle_centre", offsetof(GeneralSettings, obstacle_centre), FieldType::Float2 },
+    { "grid_origin", offsetof(GeneralSettings, grid_origin), FieldType::Float2 },
+    { "grid_width", offsetof(GeneralSettings, grid_width), FieldType::UInt },
+    { "grid_height", offsetof(GeneralSettings, grid_height), FieldType::UInt },
+    { "grid_cell_size", offsetof(GeneralSettings, grid_cell_size), FieldType::Float },
+    { "neighbour_search_mode", offsetof(GeneralSettings, neighbour_search_mode), FieldType::UInt },
+    { "neighbour_list_capacity", offsetof(GeneralSettings, neighbour_list_capacity), FieldType::UInt },
+    { "neighbour_list_distances", offsetof(GeneralSettings, neighbour_list_distances), FieldType::UInt },
+    { "hash_table_size", offsetof(GeneralSettings, hash_table_size), FieldType::UInt },
+    { "reorder_interval", offsetof(GeneralSettings, reorder_interval), FieldType::UInt }
+};
+
+static const NamedField SPAWNER_FIELDS[] = {
+    { "direction", offsetof(ParticleSpawner, direction), FieldType::Float2 },
+    { "spawn_point", offsetof(ParticleSpawner, spawn_point), FieldType::Float2 },
+    { "spawn_delta", offsetof(ParticleSpawner, spawn_delta), FieldType::Float },
+    { "spawn_count", offsetof(ParticleSpawner, spawn_count), FieldType::UInt },
+    { "initial_velocity", offsetof(ParticleSpawner, initial_velocity), FieldType::Float },
+    { "last_spawn_delta", offsetof(ParticleSpawner, last_spawn_delta), FieldType::Float }
+};
+
+static size_t GetFieldSize(FieldType type) {
+    return type == FieldType::Float2 ? 8 : 4;
+}
+
+struct CRC32Table {
+    unsigned int values[256];
+};
+
+static CRC32Table CreateCRC32Table() {
+    CRC32Table table;
+    for (unsigned int index = 0; index < 256; index++) {
+        unsigned int value = index;
+        for (size_t bit = 0; bit < 8; bit++) {
+            value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+        }
+        table.values[index] = value;
+    }
+    return table;
+}
+
+// The snapshot and trajectory writer threads call it as well
+static unsigned int ComputeCRC32(const void* data, size_t size) {
+    // The initialization of a local static happens once, even when several threads get here first
+    static const CRC32Table table = CreateCRC32Table();
+
+    const unsigned char* bytes = (const unsigned char*)data;
+    unsigned int crc = 0xFFFFFFFFu;
+    for (size_t index = 0; index < size; index++) {
+        crc = table.values[(crc ^ bytes[index]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Each field is the length of the name, the name, the type and the value
+static void WriteFields(std::vector<unsigned char>& payload, const void* object, const NamedField* fields, size_t field_count) {
+    for (size_t index = 0; index < field_count; index++) {
+        size_t name_size = strlen(fields[index].name);
+        size_t value_size = GetFieldSize(fields[index].type);
+        payload.push_back((unsigned char)name_size);
+        payload.insert(payload.end(), fields[index].name, fields[index].name + name_size);
+        payload.push_back((unsigned char)fields[index].type);
+        const unsigned char* value = (const unsigned char*)object + fields[index].offset;
+        payload.insert(payload.end(), value, value + value_size);
+    }
+}
+
+// The unknown fields are skipped, such that the files written by newer versions can be read
+static bool ReadFields(const unsigned char* payload, size_t payload_size, void* object, const NamedField* fields, size_t field_count) {
+    size_t offset = 0;
+    while (offset < payload_size) {
+        size_t name_size = payload[offset];
+        if (offset + 1 + name_size + 1 > payload_size) {
+            return false;
+        }
+        const char* name = (const char*)payload + offset + 1;
+        FieldType type = (FieldType)payload[offset + 1 + name_size];
+        if (type != FieldType::Float && type != FieldType::UInt && type != FieldType::Float2) {
+            return false;
+        }
+        size_t value_size = GetFieldSize(type);
+        size_t value_offset = offset + 1 + name_size + 1;
+        if (value_offset + value_size > payload_size) {
+            return false;
+        }
+
+        for (size_t index = 0; index < field_count; index++) {
+            if (fields[index].type == type && strlen(fields[index].name) == name_size && memcmp(fields[index].name, name, name_size) == 0) {
+                memcpy((unsigned char*)object + fields[index].offset, payload + value_offset, value_size);
+                break;
+            }
+        }
+        offset = value_offset + value_size;
+    }
+    return true;
+}
+
+static size_t AlignChunkSize(size_t size) {
+    return (size + CHUNK_ALIGNMENT - 1) & ~(size_t)(CHUNK_ALIGNMENT - 1);
+}
+
+ChunkFileWriter::~ChunkFileWriter()
+{
+    Close();
+}
+
+bool ChunkFileWriter::Open(const char* path, unsigned int magic, unsigned int version)
+{
+    Close();
+    file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    unsigned int header[2] = { magic, version };
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool ChunkFileWriter::WriteChunk(unsigned int tag, const void* payload, size_t payload_size)
+{
+    unsigned int header[2] = { tag, ComputeCRC32(payload, payload_size) };
+    unsigned long long size = payload_size;
+    if (fwrite(header, sizeof(header), 1, file) != 1 || fwrite(&size, sizeof(size), 1, file) != 1) {
+        return false;
+    }
+    if (payload_size > 0 && fwrite(payload, payload_size, 1, file) != 1) {
+        return false;
+    }
+
+    const unsigned char padding[CHUNK_ALIGNMENT] = { 0 };
+    size_t padding_size = AlignChunkSize(payload_size) - payload_size;
+    return padding_size == 0 || fwrite(padding, padding_size, 1, file) == 1;
+}
+
+bool ChunkFileWriter::Finish()
+{
+    if (!WriteChunk(END_TAG, nullptr, 0)) {
+        Close();
+        return false;
+    }
+    bool success = fclose(file) == 0;
+    file = nullptr;
+    return success;
+}
+
+void ChunkFileWriter::Close()
+{
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+ChunkFileReader::~ChunkFileReader()
+{
+    Close();
+}
+
+bool ChunkFileReader::Open(const char* path, unsigned int magic, unsigned int max_version, unsigned int first_padded_version)
+{
+    Close();
+    if (!MapFile(path)) {
+        std::cout << "Failed to open the file " << path << "\n";
+        return false;
+    }
+
+    unsigned int header[2] = { 0, 0 };
+    if (data_size >= FILE_HEADER_SIZE) {
+        memcpy(header, data, sizeof(header));
+    }
+    if (header[0] != magic) {
+        std::cout << "The file " << path << " has an unknown format\n";
+        Close();
+        return false;
+    }
+    if (header[1] > max_version) {
+        std::cout << "The file " << path << " has version " << header[1] << ", the newest supported is " << max_version << "\n";
+        Close();
+        return false;
+    }
+    version = header[1];
+
+    // Only the chunk headers are visited, the payloads are paged in when they are used
+    bool has_end = false;
+    size_t offset = FILE_HEADER_SIZE;
+    while (!has_end && offset + CHUNK_HEADER_SIZE <= data_size) {
+        FileChunk chunk;
+        unsigned long long chunk_size;
+        memcpy(&chunk.tag, data + offset, sizeof(chunk.tag));
+        memcpy(&chunk.crc, data + offset + sizeof(chunk.tag), sizeof(chunk.crc));
+        memcpy(&chunk_size, data + offset + sizeof(chunk.tag) + sizeof(chunk.crc), sizeof(chunk_size));
+        chunk.offset = offset + CHUNK_HEADER_SIZE;
+        if (chunk_size > data_size - chunk.offset) {
+            break;
+        }
+        chunk.size = (size_t)chunk_size;
+
+        if (chunk.tag == END_TAG) {
+            has_end = true;
+        }
+        else {
+            chunks.push_back(chunk);
+        }
+        offset = chunk.offset + (version >= first_padded_version ? AlignChunkSize(chunk.size) : chunk.size);
+    }
+
+    if (!has_end) {
+        std::cout << "The file " << path << " is truncated\n";
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void ChunkFileReader::Close()
+{
+    UnmapFile();
+    chunks.clear();
+    version = 0;
+}
+
+const FileChunk* ChunkFileReader::FindChunk(unsigned int tag) const
+{
+    for (size_t index = 0; index < chunks.size(); index++) {
+        if (chunks[index].tag == tag) {
+            return &chunks[index];
+        }
+    }
+    return nullptr;
+}
+
+bool ChunkFileReader::VerifyChunk(const FileChunk& chunk) const
+{
+    return ComputeCRC32(data + chunk.offset, chunk.size) == chunk.crc;
+}
+
+bool WriteSettingsChunks(ChunkFileWriter& writer, const GeneralSettings& settings, const ParticleSpawner& spawner)
+{
+    std::vector<unsigned char> payload;
+    WriteFields(payload, &settings, SETTINGS_FIELDS, std::size(SETTINGS_FIELDS));
+    if (!writer.WriteChunk(SETTINGS_TAG, payload.data(), payload.size())) {
+        return false;
+    }
+    payload.clear();
+    WriteFields(payload, &spawner, SPAWNER_FIELDS, std::size(SPAWNER_FIELDS));
+    return writer.WriteChunk(SPAWNER_TAG, payload.data(), payload.size());
+}
+
+bool ReadSettingsChunks(const ChunkFileReader& reader, GeneralSettings& settings, ParticleSpawner& spawner)
+{
+    const FileChunk* settings_chunk = reader.FindChunk(SETTINGS_TAG);
+    const FileChunk* spawner_chunk = reader.FindChunk(SPAWNER_TAG);
+    if (settings_chunk == nullptr || spawner_chunk == nullptr || !reader.VerifyChunk(*settings_chunk) || !reader.VerifyChunk(*spawner_chunk)) {
+        return false;
+    }
+
+    GeneralSettings read_settings = settings;
+    ParticleSpawner read_spawner = spawner;
+    if (!ReadFields(reader.GetPayload(*settings_chunk), settings_chunk->size, &read_settings, SETTINGS_FIELDS, std::size(SETTINGS_FIELDS))) {
+        return false;
+    }
+    if (!ReadFields(reader.GetPayload(*spawner_chunk), spawner_chunk->size, &read_spawner, SPAWNER_FIELDS, std::size(SPAWNER_FIELDS))) {
+        return false;
+    }
+    settings = read_settings;
+    spawner = read_spawner;
+    return true;
+}
+
+bool SimulationFileWriter::Open(const char* path, const GeneralSettings& settings, const ParticleSpawner& spawner)
+{
+    delta_times.clear();
+    delta_times.reserve(SIMULATION_FILE_DELTA_TIME_CHUNK);
+    if (!writer.Open(path, SIMULATION_FILE_MAGIC, SIMULATION_FILE_VERSION)) {
+        return false;
+    }
+    if (!WriteSettingsChunks(writer, settings, spawner)) {
+        writer.Close();
+        return false;
+    }
+    return true;
+}
+
+bool SimulationFileWriter::AppendDeltaTime(float delta_time)
+{
+    delta_times.push_back(delta_time);
+    if (delta_times.size() >= SIMULATION_FILE_DELTA_TIME_CHUNK) {
+        return FlushDeltaTimes();
+    }
+    return true;
+}
+
+bool SimulationFileWriter::Finish(const Float2* uvs, size_t uv_count)
+{
+    if (!FlushDeltaTimes()) {
+        writer.Close();
+        return false;
+    }
+
+    // The count is followed by the UVs
+    std::vector<unsigned char> payload(sizeof(unsigned long long) + sizeof(Float2) * uv_count);
+    unsigned long long count = uv_count;
+    memcpy(payload.data(), &count, sizeof(count));
+    memcpy(payload.data() + sizeof(count), uvs, sizeof(Float2) * uv_count);
+    if (!writer.WriteChunk(UVS_TAG, payload.data(), payload.size())) {
+        writer.Close();
+        return false;
+    }
+    return writer.Finish();
+}
+
+bool SimulationFileWriter::FlushDeltaTimes()
+{
+    if (delta_times.size() == 0) {
+        return true;
+    }
+    bool success = writer.WriteChunk(DELTA_TIMES_TAG, delta_times.data(), sizeof(float) * delta_times.size());
+    delta_times.clear();
+    return success;
+}
+
+bool SimulationFileReader::Open(const char* path, GeneralSettings& settings, ParticleSpawner& spawner)
+{
+    Close();
+    if (!reader.Open(path, SIMULATION_FILE_MAGIC, SIMULATION_FILE_VERSION, 2)) {
+        return false;
+    }
+    if (!ReadSettingsChunks(reader, settings, spawner)) {
+        std::cout << "The simulation file " << path << " has missing or corrupted settings\n";
+        Close();
+        return false;
+    }
+
+    const std::vector<FileChunk>& chunks = reader.GetChunks();
+    for (size_t index = 0; index < chunks.size(); index++) {
+        if (chunks[index].tag == DELTA_TIMES_TAG) {
+            delta_time_chunks.push_back(chunks[index]);
+            delta_time_count += chunks[index].size / sizeof(float);
+        }
+    }
+
+    const FileChunk* uvs_chunk = reader.FindChunk(UVS_TAG);
+    if (uvs_chunk != nullptr && uvs_chunk->size >= sizeof(unsigned long long) && reader.VerifyChunk(*uvs_chunk)) {
+        unsigned long long count;
+        memcpy(&count, reader.GetPayload(*uvs_chunk), sizeof(count));
+        if (count <= (uvs_chunk->size - sizeof(count)) / sizeof(Float2)) {
+            uv_data = reader.GetPayload(*uvs_chunk) + sizeof(count);
+            uv_count = count;
+        }
+    }
+    return true;
+}
+
+void SimulationFileReader::Close()
+{
+    reader.Close();
+    delta_time_chunks.clear();
+    delta_time_count = 0;
+    next_chunk = 0;
+    next_chunk_entry = 0;
+    uv_data = nullptr;
+    uv_count = 0;
+}
+
+bool SimulationFileReader::NextDeltaTime(float& delta_time)
+{
+    while (next_chunk < delta_time_chunks.size()) {
+        const FileChunk& chunk = delta_time_chunks[next_chunk];
+        if (next_chunk_entry == 0 && !reader.VerifyChunk(chunk)) {
+            std::cout << "The simulation file has a corrupted delta time chunk, the replay stops\n";
+            next_chunk = delta_time_chunks.size();
+            return false;
+        }
+
+        if (next_chunk_entry < chunk.size / sizeof(float)) {
+            memcpy(&delta_time, reader.GetPayload(chunk) + next_chunk_entry * sizeof(float), sizeof(float));
+            next_chunk_entry++;
+            return true;
+        }
+        next_chunk++;
+        next_chunk_entry = 0;
+    }
+    return false;
+}
+
+void SimulationFileReader::ReadUVs(Float2* uvs) const
+{
+    memcpy(uvs, uv_data, sizeof(Float2) * uv_count);
+}
+
+#ifdef _WIN32
+
+bool ChunkFileReader::MapFile(const char* path)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        CloseHandle(file);
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == nullptr) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+    data = (const unsigned char*)view;
+    data_size = (size_t)file_size.QuadPart;
+    return true;
+}
+
+void ChunkFileReader::UnmapFile()
+{
+    if (data != nullptr) {
+        UnmapViewOfFile(data);
+        CloseHandle((HANDLE)mapping_handle);
+        CloseHandle((HANDLE)file_handle);
+    }
+    data = nullptr;
+    data_size = 0;
+    file_handle = nullptr;
+    mapping_handle = nullptr;
+}
+
+#else
+
+bool ChunkFileReader::MapFile(const char* path)
+{
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(file);
+        return false;
+    }
+    void* view = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    // The mapping keeps its own reference to the file
+    close(file);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    madvise(view, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+
+    data = (const unsigned char*)view;
+    data_size = (size_t)file_stat.st_size;
+    return true;
+}
+
+void ChunkFileReader::UnmapFile()
+{
+    if (data != nullptr) {
+        munmap((void*)data, data_size);
+    }
+    data = nullptr;
+    data_size = 0;
+}
+
+#endif
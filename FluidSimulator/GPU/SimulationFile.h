@@ -0,0 +1,156 @@
+#pragma once
+#include "GeneralSettings.h"
+#include "ParticleSpawner.h"
+#include <stdio.h>
+#include <vector>
+
+// The files start with a header (the magic and the version), followed by chunks. Each chunk has a
+// Tag, the CRC32 and the size of its payload, such that a truncated or corrupted file is detected
+// Instead of being used. The payloads are padded to 8 bytes, such that the arrays inside them can
+// Be used directly from the mapped file
+#define FILE_TAG(a, b, c, d) ((unsigned int)(a) | ((unsigned int)(b) << 8) | ((unsigned int)(c) << 16) | ((unsigned int)(d) << 24))
+
+// Version 1 didn't pad the payloads
+#define SIMULATION_FILE_VERSION 2
+// How many delta times are buffered before they are written as a chunk
+#define SIMULATION_FILE_DELTA_TIME_CHUNK 4096
+
+struct FileChunk {
+    unsigned int tag;
+    unsigned int crc;
+    // The offset of the payload in the file
+    size_t offset;
+    size_t size;
+};
+
+class ChunkFileWriter {
+public:
+    ChunkFileWriter() = default;
+    ChunkFileWriter(const ChunkFileWriter& other) = delete;
+    ChunkFileWriter& operator = (const ChunkFileWriter& other) = delete;
+    ~ChunkFileWriter();
+
+    bool Open(const char* path, unsigned int magic, unsigned int version);
+
+    bool WriteChunk(unsigned int tag, const void* payload, size_t payload_size);
+
+    // Writes the end chunk and closes the file
+    bool Finish();
+
+    // Closes the file without the end chunk, which makes it invalid
+    void Close();
+
+    inline bool IsOpen() const {
+        return file != nullptr;
+    }
+
+private:
+    FILE* file = nullptr;
+};
+
+// Maps the file into memory, such that only the chunks that are read are paged in
+class ChunkFileReader {
+public:
+    ChunkFileReader() = default;
+    ChunkFileReader(const ChunkFileReader& other) = delete;
+    ChunkFileReader& operator = (const ChunkFileReader& other) = delete;
+    ~ChunkFileReader();
+
+    // Checks the magic and the version and visits the chunk headers. It fails if the end chunk
+    // Is missing. The checksums are not verified, only the chunks that are used need to be.
+    // The files older than the first padded version have unpadded payloads
+    bool Open(const char* path, unsigned int magic, unsigned int max_version, unsigned int first_padded_version = 0);
+
+    void Close();
+
+    // Returns the first chunk with the tag, or nullptr if there is none
+    const FileChunk* FindChunk(unsigned int tag) const;
+
+    bool VerifyChunk(const FileChunk& chunk) const;
+
+    inline const unsigned char* GetPayload(const FileChunk& chunk) const {
+        return data + chunk.offset;
+    }
+
+    inline const std::vector<FileChunk>& GetChunks() const {
+        return chunks;
+    }
+
+    inline unsigned int GetVersion() const {
+        return version;
+    }
+
+private:
+    bool MapFile(const char* path);
+
+    void UnmapFile();
+
+    const unsigned char* data = nullptr;
+    size_t data_size = 0;
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+    unsigned int version = 0;
+    std::vector<FileChunk> chunks;
+};
+
+// The settings and the spawner are stored field by field with their names, such that adding
+// Or reordering the struct members doesn't break the older files
+bool WriteSettingsChunks(ChunkFileWriter& writer, const GeneralSettings& settings, const ParticleSpawner& spawner);
+
+// The fields that are missing from the file keep their current values. Both are left
+// Unchanged if the chunks are missing or corrupted
+bool ReadSettingsChunks(const ChunkFileReader& reader, GeneralSettings& settings, ParticleSpawner& spawner);
+
+class SimulationFileWriter {
+public:
+    // Creates the file and writes the header, the settings and the spawner chunks
+    bool Open(const char* path, const GeneralSettings& settings, const ParticleSpawner& spawner);
+
+    // The delta times are written in chunks, as they are recorded
+    bool AppendDeltaTime(float delta_time);
+
+    // Writes the remaining delta times, the UVs indexed by particle id and the end chunk, and closes the file
+    bool Finish(const Float2* uvs, size_t uv_count);
+
+    inline bool IsOpen() const {
+        return writer.IsOpen();
+    }
+
+private:
+    bool FlushDeltaTimes();
+
+    ChunkFileWriter writer;
+    std::vector<float> delta_times;
+};
+
+// The delta times are streamed out of the mapping, which keeps the memory constant for any recording length
+class SimulationFileReader {
+public:
+    // Reads the settings and the spawner. The checksums of the delta time chunks are verified when they are reached
+    bool Open(const char* path, GeneralSettings& settings, ParticleSpawner& spawner);
+
+    void Close();
+
+    // Returns false when all the delta times were read, or if the next chunk is corrupted
+    bool NextDeltaTime(float& delta_time);
+
+    inline size_t GetDeltaTimeCount() const {
+        return delta_time_count;
+    }
+
+    inline size_t GetUVCount() const {
+        return uv_count;
+    }
+
+    // The UVs are indexed by particle id
+    void ReadUVs(Float2* uvs) const;
+
+private:
+    ChunkFileReader reader;
+    std::vector<FileChunk> delta_time_chunks;
+    size_t delta_time_count = 0;
+    size_t next_chunk = 0;
+    size_t next_chunk_entry = 0;
+    const unsigned char* uv_data = nullptr;
+    size_t uv_count = 0;
+};
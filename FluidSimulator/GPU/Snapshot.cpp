@@ -0,0 +1,234 @@
+#include "Snapshot.h"
+#include "Trace.h"
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+
+static const unsigned int SNAPSHOT_MAGIC = FILE_TAG('F', 'S', 'N', 'P');
+static const unsigned int PARTICLES_TAG = FILE_TAG('P', 'A', 'R', 'T');
+static const unsigned int POSITIONS_TAG = FILE_TAG('P', 'O', 'S', 'I');
+static const unsigned int PREDICTED_POSITIONS_TAG = FILE_TAG('P', 'R', 'E', 'D');
+static const unsigned int VELOCITIES_TAG = FILE_TAG('V', 'E', 'L', 'O');
+static const unsigned int IDS_TAG = FILE_TAG('I', 'D', 'S', ' ');
+static const unsigned int COLLISION_MAP_TAG = FILE_TAG('C', 'O', 'L', 'L');
+
+// The particle count, the next particle id, the window size and the reorder step counter
+struct SnapshotHeader {
+    unsigned long long particle_count;
+    unsigned long long next_particle_id;
+    unsigned long long window_width;
+    unsigned long long window_height;
+    // Added after the first snapshots, which end before it
+    unsigned long long reorder_step_counter;
+};
+
+// The header of the snapshots that were written before the reorder step counter
+#define SNAPSHOT_HEADER_MIN_SIZE offsetof(SnapshotHeader, reorder_step_counter)
+
+static size_t GetCollisionMapSize(size_t window_width, size_t window_height) {
+    return (window_width + 7) / 8 * window_height;
+}
+
+bool WriteSnapshot(const char* path, const SnapshotState& state)
+{
+    std::string temporary_path = std::string(path) + ".tmp";
+    ChunkFileWriter writer;
+    if (!writer.Open(temporary_path.c_str(), SNAPSHOT_MAGIC, SNAPSHOT_VERSION)) {
+        return false;
+    }
+
+    SnapshotHeader header = {
+        state.particle_count,
+        state.next_particle_id,
+        state.window_width,
+        state.window_height,
+        state.reorder_step_counter
+    };
+    size_t count = state.particle_count;
+    bool success = WriteSettingsChunks(writer, state.settings, state.spawner)
+        && writer.WriteChunk(PARTICLES_TAG, &header, sizeof(header))
+        && writer.WriteChunk(POSITIONS_TAG, state.positions.data(), sizeof(Float2) * count)
+        && writer.WriteChunk(PREDICTED_POSITIONS_TAG, state.predicted_positions.data(), sizeof(Float2) * count)
+        && writer.WriteChunk(VELOCITIES_TAG, state.velocities.data(), sizeof(Float2) * count)
+        && writer.WriteChunk(IDS_TAG, state.ids.data(), sizeof(unsigned int) * count)
+        && writer.WriteChunk(COLLISION_MAP_TAG, state.collision_map.data(), state.collision_map.size())
+        && writer.Finish();
+    if (!success) {
+        writer.Close();
+        std::filesystem::remove(temporary_path);
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary_path, path, error);
+    return !error;
+}
+
+bool SnapshotReader::Open(const char* path)
+{
+    Close();
+    if (!reader.Open(path, SNAPSHOT_MAGIC, SNAPSHOT_VERSION)) {
+        return false;
+    }
+
+    const std::vector<FileChunk>& chunks = reader.GetChunks();
+    for (size_t index = 0; index < chunks.size(); index++) {
+        if (!reader.VerifyChunk(chunks[index])) {
+            std::cout << "The snapshot " << path << " is corrupted\n";
+            Close();
+            return false;
+        }
+    }
+
+    const FileChunk* header_chunk = reader.FindChunk(PARTICLES_TAG);
+    if (header_chunk == nullptr || header_chunk->size < SNAPSHOT_HEADER_MIN_SIZE) {
+        std::cout << "The snapshot " << path << " has no particles\n";
+        Close();
+        return false;
+    }
+    // The older snapshots restart the reorder interval
+    SnapshotHeader header = {};
+    memcpy(&header, reader.GetPayload(*header_chunk), std::min(header_chunk->size, sizeof(header)));
+    particle_count = header.particle_count;
+    next_particle_id = header.next_particle_id;
+    reorder_step_counter = header.reorder_step_counter;
+    window_width = header.window_width;
+    window_height = header.window_height;
+
+    // Each array must have an entry for every particle
+    auto get_array = [&](unsigned int tag, size_t element_size) -> const void* {
+        const FileChunk* chunk = reader.FindChunk(tag);
+        if (chunk == nullptr || chunk->size != element_size * particle_count) {
+            return nullptr;
+        }
+        return reader.GetPayload(*chunk);
+    };
+    positions = (const Float2*)get_array(POSITIONS_TAG, sizeof(Float2));
+    predicted_positions = (const Float2*)get_array(PREDICTED_POSITIONS_TAG, sizeof(Float2));
+    velocities = (const Float2*)get_array(VELOCITIES_TAG, sizeof(Float2));
+    ids = (const unsigned int*)get_array(IDS_TAG, sizeof(unsigned int));
+    if (particle_count > 0 && (positions == nullptr || predicted_positions == nullptr || velocities == nullptr || ids == nullptr)) {
+        std::cout << "The snapshot " << path << " has incomplete particle data\n";
+        Close();
+        return false;
+    }
+
+    // The collision map is optional
+    const FileChunk* collision_chunk = reader.FindChunk(COLLISION_MAP_TAG);
+    if (collision_chunk != nullptr && collision_chunk->size == GetCollisionMapSize(window_width, window_height)) {
+        collision_map = reader.GetPayload(*collision_chunk);
+    }
+    return true;
+}
+
+void SnapshotReader::Close()
+{
+    reader.Close();
+    particle_count = 0;
+    next_particle_id = 0;
+    reorder_step_counter = 0;
+    window_width = 0;
+    window_height = 0;
+    collision_map = nullptr;
+    positions = nullptr;
+    predicted_positions = nullptr;
+    velocities = nullptr;
+    ids = nullptr;
+}
+
+bool SnapshotReader::ReadSettings(GeneralSettings& settings, ParticleSpawner& spawner) const
+{
+    return ReadSettingsChunks(reader, settings, spawner);
+}
+
+SnapshotSaver::~SnapshotSaver()
+{
+    // The context can be gone already, only the file is finished
+    if (write_thread.joinable()) {
+        write_thread.join();
+    }
+}
+
+void SnapshotSaver::Initialize(GPUReadback* _readback)
+{
+    readback = _readback;
+    last_ticket = INVALID_READBACK_TICKET;
+    remaining_copy_count = 0;
+    stage = Stage::Idle;
+    write_done = false;
+    write_success = true;
+    last_success = true;
+}
+
+bool SnapshotSaver::Begin(
+    const char* _path,
+    SnapshotState&& _state,
+    const StructuredBuffer& positions,
+    const StructuredBuffer& predicted_positions,
+    const StructuredBuffer& velocities,
+    const StructuredBuffer& ids
+)
+{
+    if (stage != Stage::Idle) {
+        return false;
+    }
+
+    path = _path;
+    state = std::move(_state);
+
+    // The copies are queued after the commands of the frame, the particle buffers can change right after
+    remaining_copy_count = 4;
+    RequestArray(positions, state.positions);
+    RequestArray(predicted_positions, state.predicted_positions);
+    RequestArray(velocities, state.velocities);
+    last_ticket = RequestArray(ids, state.ids);
+    stage = Stage::Copying;
+    return true;
+}
+
+void SnapshotSaver::Update()
+{
+    if (stage == Stage::Copying && remaining_copy_count == 0) {
+        StartWriting();
+    }
+    else if (stage == Stage::Writing && write_done) {
+        FinishWriting();
+    }
+}
+
+void SnapshotSaver::Flush()
+{
+    if (stage == Stage::Copying) {
+        readback->Wait(last_ticket);
+        StartWriting();
+    }
+    if (stage == Stage::Writing) {
+        FinishWriting();
+    }
+}
+
+void SnapshotSaver::StartWriting()
+{
+    write_done = false;
+    write_thread = std::thread([this]() {
+        Trace::SetThreadName("Snapshot writer");
+        TraceScope trace_scope("Write snapshot");
+        write_success = WriteSnapshot(path.c_str(), state);
+        write_done = true;
+    });
+    stage = Stage::Writing;
+}
+
+void SnapshotSaver::FinishWriting()
+{
+    write_thread.join();
+    last_success = write_success;
+    if (!last_success) {
+        std::cout << "Failed to write the snapshot " << path << "\n";
+    }
+    // Don't keep the particle data around until the next snapshot
+    state = SnapshotState();
+    stage = Stage::Idle;
+}
@@ -0,0 +1,171 @@
+#pragma once
+#include "SimulationFile.h"
+#include "GPUReadback.h"
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#define SNAPSHOT_VERSION 1
+
+// Everything that is needed to resume a simulation. The particle arrays have particle_count entries
+struct SnapshotState {
+    GeneralSettings settings;
+    ParticleSpawner spawner;
+    size_t particle_count;
+    size_t next_particle_id;
+    size_t window_width;
+    size_t window_height;
+    // The steps since the last reorder, such that the restored run reorders on the same steps
+    size_t reorder_step_counter;
+    // One bit per pixel, the rows are padded to bytes
+    std::vector<unsigned char> collision_map;
+    std::vector<Float2> positions;
+    std::vector<Float2> predicted_positions;
+    std::vector<Float2> velocities;
+    std::vector<unsigned int> ids;
+};
+
+// The file is written next to the path and then renamed over it, such that a crash while
+// Writing never destroys the previous snapshot
+bool WriteSnapshot(const char* path, const SnapshotState& state);
+
+// The arrays point into the mapped file, such that they can be uploaded without copies
+class SnapshotReader {
+public:
+    // Verifies the checksums of all the chunks
+    bool Open(const char* path);
+
+    void Close();
+
+    // The fields that are missing from the file keep their current values
+    bool ReadSettings(GeneralSettings& settings, ParticleSpawner& spawner) const;
+
+    inline size_t GetParticleCount() const {
+        return particle_count;
+    }
+
+    inline size_t GetNextParticleId() const {
+        return next_particle_id;
+    }
+
+    inline size_t GetReorderStepCounter() const {
+        return reorder_step_counter;
+    }
+
+    inline size_t GetWindowWidth() const {
+        return window_width;
+    }
+
+    inline size_t GetWindowHeight() const {
+        return window_height;
+    }
+
+    inline const unsigned char* GetCollisionMap() const {
+        return collision_map;
+    }
+
+    inline const Float2* GetPositions() const {
+        return positions;
+    }
+
+    inline const Float2* GetPredictedPositions() const {
+        return predicted_positions;
+    }
+
+    inline const Float2* GetVelocities() const {
+        return velocities;
+    }
+
+    inline const unsigned int* GetIds() const {
+        return ids;
+    }
+
+private:
+    ChunkFileReader reader;
+    size_t particle_count = 0;
+    size_t next_particle_id = 0;
+    size_t reorder_step_counter = 0;
+    size_t window_width = 0;
+    size_t window_height = 0;
+    const unsigned char* collision_map = nullptr;
+    const Float2* positions = nullptr;
+    const Float2* predicted_positions = nullptr;
+    const Float2* velocities = nullptr;
+    const unsigned int* ids = nullptr;
+};
+
+// Writes the snapshots without stalling the simulation. The particle buffers are read back asynchronously,
+// And the file is written on a background thread
+class SnapshotSaver {
+public:
+    SnapshotSaver() = default;
+    SnapshotSaver(const SnapshotSaver& other) = delete;
+    SnapshotSaver& operator = (const SnapshotSaver& other) = delete;
+    ~SnapshotSaver();
+
+    void Initialize(GPUReadback* readback);
+
+    // The state must have everything except the particle arrays, which are taken from the buffers.
+    // Returns false if the previous snapshot is still pending
+    bool Begin(
+        const char* path,
+        SnapshotState&& state,
+        const StructuredBuffer& positions,
+        const StructuredBuffer& predicted_positions,
+        const StructuredBuffer& velocities,
+        const StructuredBuffer& ids
+    );
+
+    // Must be called once per frame, after the readbacks were updated. It never waits for the GPU or for the file
+    void Update();
+
+    // Waits until the pending snapshot is written
+    void Flush();
+
+    inline bool IsPending() const {
+        return stage != Stage::Idle;
+    }
+
+    // The result of the last snapshot that was written
+    inline bool LastSucceeded() const {
+        return last_success;
+    }
+
+private:
+    enum class Stage : unsigned char {
+        Idle,
+        // Waiting for the readbacks
+        Copying,
+        // The background thread writes the file
+        Writing
+    };
+
+    // The array receives the first particle count elements of the buffer
+    template<typename Element>
+    ReadbackTicket RequestArray(const StructuredBuffer& buffer, std::vector<Element>& destination) {
+        size_t count = state.particle_count;
+        return readback->Request(buffer, sizeof(Element) * count, [this, &destination, count](const void* data, size_t byte_size) {
+            destination.assign((const Element*)data, (const Element*)data + count);
+            remaining_copy_count--;
+        });
+    }
+
+    void StartWriting();
+
+    void FinishWriting();
+
+    GPUReadback* readback;
+    // The last readback of the snapshot, the others finish before it
+    ReadbackTicket last_ticket;
+    // The readbacks that have not finished yet
+    size_t remaining_copy_count;
+    Stage stage;
+    std::string path;
+    SnapshotState state;
+    std::thread write_thread;
+    std::atomic<bool> write_done;
+    // Written by the background thread
+    bool write_success;
+    bool last_success;
+};
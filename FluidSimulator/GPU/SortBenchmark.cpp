@@ -0,0 +1,188 @@
+#include "SortBenchmark.h"
+#include "glad.h"
+#include <iostream>
+#include <stdio.h>
+#include <chrono>
+
+#define SORT_BENCHMARK_CHANGED_KEY_PERIOD 100
+
+// The entries are generated like the simulation does it, from random cells, with the layout of the sort.
+// The index is the first word of an entry and the key the last one, the full entries have the hash between
+static std::vector<unsigned int> GenerateEntries(size_t entry_count, size_t entry_words, unsigned int seed) {
+    std::vector<unsigned int> entries(entry_count * entry_words);
+    unsigned int state = seed;
+    for (size_t index = 0; index < entry_count; index++) {
+        // Xorshift, such that the benchmark is reproducible
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        unsigned int hash = state;
+        unsigned int* entry = entries.data() + index * entry_words;
+        entry[0] = (unsigned int)index;
+        if (entry_words == 3) {
+            entry[1] = hash;
+        }
+        entry[entry_words - 1] = (unsigned int)(hash % entry_count);
+    }
+    return entries;
+}
+
+// Changes the keys of about 1 in SORT_BENCHMARK_CHANGED_KEY_PERIOD entries, like the particles that move to another cell
+static void ChangeKeys(std::vector<unsigned int>& entries, size_t entry_words, unsigned int seed) {
+    size_t entry_count = entries.size() / entry_words;
+    unsigned int state = seed * 0x9E3779B9 + 1;
+    for (size_t index = 0; index < entry_count; index++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        if (state % SORT_BENCHMARK_CHANGED_KEY_PERIOD != 0) {
+            continue;
+        }
+        unsigned int hash = state / SORT_BENCHMARK_CHANGED_KEY_PERIOD;
+        unsigned int* entry = entries.data() + index * entry_words;
+        if (entry_words == 3) {
+            entry[1] = hash;
+        }
+        entry[entry_words - 1] = (unsigned int)(hash % entry_count);
+    }
+}
+
+static bool VerifySort(StructuredBuffer entries_buffer, StructuredBuffer offsets_buffer, size_t entry_count, size_t entry_words) {
+    std::vector<unsigned int> entries(entry_count * entry_words);
+    std::vector<unsigned int> offsets(entry_count);
+    entries_buffer.RetrieveData(sizeof(unsigned int) * entry_words, entry_count, entries.data());
+    offsets_buffer.RetrieveData(sizeof(unsigned int), entry_count, offsets.data());
+    auto get_index = [&](size_t index) {
+        return entries[index * entry_words];
+    };
+    auto get_key = [&](size_t index) {
+        return entries[index * entry_words + entry_words - 1];
+    };
+
+    std::vector<bool> seen_index(entry_count, false);
+    for (size_t index = 0; index < entry_count; index++) {
+        if (get_index(index) >= entry_count || seen_index[get_index(index)]) {
+            return false;
+        }
+        seen_index[get_index(index)] = true;
+        if (index > 0 && get_key(index - 1) > get_key(index)) {
+            return false;
+        }
+        bool is_first = index == 0 || get_key(index - 1) != get_key(index);
+        if (is_first && offsets[get_key(index)] != index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static double TimeSort(GPUSort& gpu_sort, GPUSortMode mode, const std::vector<unsigned int>& entries, size_t iteration_count, double& wall_time, bool& is_valid) {
+    size_t entry_words = gpu_sort.GetEntrySize() / sizeof(unsigned int);
+    size_t entry_count = entries.size() / entry_words;
+    StructuredBuffer entries_buffer(gpu_sort.GetEntrySize(), entry_count);
+    StructuredBuffer offsets_buffer(sizeof(unsigned int), entry_count);
+    std::vector<unsigned int> null_offsets(entry_count, (unsigned int)entry_count);
+    std::vector<unsigned int> iteration_entries = entries;
+
+    // Timestamps instead of GL_TIME_ELAPSED, which some drivers, like llvmpipe, report as 0. The same
+    // Queries as the kernel benchmark, such that the two agree
+    unsigned int queries[2];
+    glGenQueries(2, queries);
+    gpu_sort.SetMode(mode);
+    gpu_sort.ResetIncrementalOrder();
+    if (mode == GPUSortMode::Incremental) {
+        // The full sort that the iterations start from
+        entries_buffer.SetNewData(gpu_sort.GetEntrySize(), entry_count, entries.data());
+        gpu_sort.Execute(entries_buffer, offsets_buffer, entry_count, entry_count);
+    }
+
+    // The first iteration is a warm up, it allocates the buffers of the counting sort
+    double total_time = 0.0;
+    double total_wall_time = 0.0;
+    for (size_t iteration = 0; iteration <= iteration_count; iteration++) {
+        if (mode == GPUSortMode::Incremental) {
+            ChangeKeys(iteration_entries, entry_words, (unsigned int)iteration);
+            // Nothing else updates the readback here, the network is sized from the count of the previous iteration
+            gpu_sort.WaitForIncrementalStats();
+        }
+        // The simulation resets the offsets before each sort, do the same
+        entries_buffer.SetNewData(gpu_sort.GetEntrySize(), entry_count, iteration_entries.data());
+        offsets_buffer.SetNewData(sizeof(unsigned int), entry_count, null_offsets.data());
+
+        glFinish();
+        auto start = std::chrono::high_resolution_clock::now();
+        glQueryCounter(queries[0], GL_TIMESTAMP);
+        gpu_sort.Execute(entries_buffer, offsets_buffer, entry_count, entry_count);
+        glQueryCounter(queries[1], GL_TIMESTAMP);
+        glFinish();
+        std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - start;
+
+        GLuint64 begin_time;
+        GLuint64 end_time;
+        glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &begin_time);
+        glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end_time);
+        if (iteration > 0) {
+            total_time += (double)(end_time - begin_time) / 1'000'000.0;
+            total_wall_time += duration.count();
+        }
+    }
+
+    is_valid = VerifySort(entries_buffer, offsets_buffer, entry_count, entry_words);
+    glDeleteQueries(2, queries);
+    entries_buffer.Release();
+    offsets_buffer.Release();
+    wall_time = total_wall_time / iteration_count;
+    return total_time / iteration_count;
+}
+
+std::vector<SortBenchmarkResult> BenchmarkGPUSort(GPUSort& gpu_sort, const size_t* entry_counts, size_t entry_count_size, size_t iteration_count)
+{
+    GPUSortMode previous_mode = gpu_sort.GetMode();
+    std::vector<SortBenchmarkResult> results;
+    for (size_t index = 0; index < entry_count_size; index++) {
+        std::vector<unsigned int> entries = GenerateEntries(entry_counts[index], gpu_sort.GetEntrySize() / sizeof(unsigned int), 0x9E3779B9);
+
+        SortBenchmarkResult result;
+        result.entry_count = entry_counts[index];
+        result.bitonic_time = TimeSort(gpu_sort, GPUSortMode::Bitonic, entries, iteration_count, result.bitonic_wall_time, result.bitonic_valid);
+        result.counting_time = TimeSort(gpu_sort, GPUSortMode::Counting, entries, iteration_count, result.counting_wall_time, result.counting_valid);
+        result.incremental_time = TimeSort(gpu_sort, GPUSortMode::Incremental, entries, iteration_count, result.incremental_wall_time, result.incremental_valid);
+        results.push_back(result);
+    }
+    gpu_sort.SetMode(previous_mode);
+    // The order is the one of the benchmark entries, not of the particles
+    gpu_sort.ResetIncrementalOrder();
+    return results;
+}
+
+void PrintSortBenchmark(const std::vector<SortBenchmarkResult>& results)
+{
+    printf(
+        "%12s | %14s | %14s | %17s | %18s | %18s | %21s | %16s | %19s\n",
+        "Entries",
+        "Bitonic (ms)",
+        "Counting (ms)",
+        "Incremental (ms)",
+        "Bitonic wall (ms)",
+        "Counting wall (ms)",
+        "Incremental wall (ms)",
+        "Counting speedup",
+        "Incremental speedup"
+    );
+    for (size_t index = 0; index < results.size(); index++) {
+        const SortBenchmarkResult& result = results[index];
+        printf(
+            "%12zu | %14.3f | %14.3f | %17.3f | %18.3f | %18.3f | %21.3f | %15.2fx | %18.2fx%s\n",
+            result.entry_count,
+            result.bitonic_time,
+            result.counting_time,
+            result.incremental_time,
+            result.bitonic_wall_time,
+            result.counting_wall_time,
+            result.incremental_wall_time,
+            result.bitonic_wall_time / result.counting_wall_time,
+            result.bitonic_wall_time / result.incremental_wall_time,
+            result.bitonic_valid && result.counting_valid && result.incremental_valid ? "" : " (INVALID SORT)"
+        );
+    }
+}
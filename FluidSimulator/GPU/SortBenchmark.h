@@ -0,0 +1,26 @@
+#pragma once
+#include "GPUSort.h"
+
+struct SortBenchmarkResult {
+    size_t entry_count;
+    // The average GPU time of a sort, in milliseconds
+    double bitonic_time;
+    double counting_time;
+    double incremental_time;
+    // The average wall time of a sort, including the driver overhead of the dispatches, in milliseconds
+    double bitonic_wall_time;
+    double counting_wall_time;
+    double incremental_wall_time;
+    // If the sorted entries and the offsets were verified to be correct
+    bool bitonic_valid;
+    bool counting_valid;
+    bool incremental_valid;
+};
+
+// Sorts random keys with all the sort modes, for each entry count, and measures the GPU time
+// Of each sort with timestamp queries, and the wall time. The incremental sort is timed on keys of which
+// About 1% change between the iterations. The entries have the current layout of the sort. The sort
+// Mode is restored at the end, and the incremental sort starts again from a full sort
+std::vector<SortBenchmarkResult> BenchmarkGPUSort(GPUSort& gpu_sort, const size_t* entry_counts, size_t entry_count_size, size_t iteration_count);
+
+void PrintSortBenchmark(const std::vector<SortBenchmarkResult>& results);
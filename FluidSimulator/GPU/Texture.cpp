@@ -1,6 +1,9 @@
 #include "Texture.h"
 #include "glad.h"
+#include "GPUBarriers.h"
+#include "GPUUploadRing.h"
 #include <vector>
+#include <stdio.h>
 
 static void SetTextureSampling(int texture_type, int filter_type, TextureSampling sampling) {
     int native_sampling = 0;
@@ -25,6 +28,7 @@ Texture1D::Texture1D() : ID(-1) {}
 
 void Texture1D::Bind(unsigned int texture_unit) const
 {
+    GPUBarriers::SetTextureBinding(texture_unit, ID);
     glActiveTexture(GL_TEXTURE0 + texture_unit);
     glBindTexture(GL_TEXTURE_1D, ID);
 }
@@ -52,6 +56,7 @@ Texture2D::Texture2D() : ID(-1) {}
 
 void Texture2D::Bind(unsigned int texture_unit) const
 {
+    GPUBarriers::SetTextureBinding(texture_unit, ID);
     glActiveTexture(GL_TEXTURE0 + texture_unit);
     glBindTexture(GL_TEXTURE_2D, ID);
 }
@@ -75,6 +80,31 @@ void Texture2D::SetData(DataType data_type, size_t width, size_t height, const v
     glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, data);
 }
 
+void Texture2D::UpdateData(DataType data_type, size_t width, size_t height, const void* data)
+{
+    int internal_format, format, type;
+    GetDataTypeInts(data_type, internal_format, format, type);
+    size_t component_byte_size = type == GL_UNSIGNED_BYTE || type == GL_BYTE ? 1 : 4;
+    size_t byte_size = width * height * GetDataTypeElemCount(data_type) * component_byte_size;
+
+    glBindTexture(GL_TEXTURE_2D, ID);
+    GLint unpack_alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // When the ring is persistently mapped, the texture is filled from it on the GPU,
+    // Otherwise the driver copies the data
+    GPUUploadRange range;
+    if (GPUUploadRing::IsPersistent() && byte_size <= GPU_UPLOAD_RING_MAX_COPY_SIZE && GPUUploadRing::Write(data, byte_size, 16, range)) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, range.buffer);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, (const void*)range.offset);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, data);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+}
+
 Texture2D CreateCircleAlphaTexture(size_t width, size_t height, float radius)
 {
     Texture2D texture;
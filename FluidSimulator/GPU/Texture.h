@@ -29,6 +29,10 @@ public:
 
     void SetData(DataType data_type, size_t width, size_t height, const void* data, TextureSampling sampling_mode);
 
+    // Overwrites the whole texture without reallocating it, the size must be the one given to SetData.
+    // The rows of the data are tightly packed
+    void UpdateData(DataType data_type, size_t width, size_t height, const void* data);
+
 private:
     unsigned int ID;
 };
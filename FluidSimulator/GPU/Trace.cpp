@@ -0,0 +1,213 @@
+#include "Trace.h"
+#include "glad.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <type_traits>
+#include <stdio.h>
+#include <string.h>
+
+struct TraceEvent {
+    const char* name;
+    long long begin_time;
+    long long end_time;
+};
+
+struct TraceThreadBuffer {
+    std::vector<TraceEvent> events;
+    // The events before this count are written, they are published with a release store
+    std::atomic<size_t> count;
+    // The recording that the events belong to, a buffer from a previous recording is cleared by its thread
+    std::atomic<unsigned int> generation;
+    std::atomic<size_t> dropped_count;
+    const char* name;
+    // The buffer of a thread that has exited is given to the next thread with the same name
+    bool in_use;
+};
+
+static_assert(std::is_trivially_copyable<TraceEvent>::value, "The events are copied without a lock");
+
+std::atomic<bool> Trace::recording(false);
+static std::atomic<unsigned int> recording_generation(0);
+static std::chrono::steady_clock::time_point start_time;
+// Added to a GL timestamp to move it onto the CPU clock
+static long long gpu_time_offset = 0;
+// The lock is taken only when a thread gets its buffer and when the recording stops
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<TraceThreadBuffer>> buffers;
+// Written only by the thread with the GL context
+static TraceThreadBuffer gpu_buffer;
+
+struct TraceThreadHandle {
+    ~TraceThreadHandle() {
+        if (buffer != nullptr) {
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            buffer->in_use = false;
+        }
+    }
+
+    TraceThreadBuffer* buffer = nullptr;
+};
+
+static void InitializeBuffer(TraceThreadBuffer* buffer, const char* name) {
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->generation.store(recording_generation.load(std::memory_order_acquire), std::memory_order_relaxed);
+    buffer->dropped_count.store(0, std::memory_order_relaxed);
+    buffer->name = name;
+    buffer->in_use = true;
+}
+
+static bool IsSameName(const char* first, const char* second) {
+    if (first == nullptr || second == nullptr) {
+        return first == second;
+    }
+    return strcmp(first, second) == 0;
+}
+
+// The name is used only when the thread doesn't have a buffer yet
+static TraceThreadBuffer* GetThreadBuffer(const char* name) {
+    thread_local TraceThreadHandle handle;
+    if (handle.buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        // The threads that are started for each write, like the snapshot writer, share a single track
+        for (size_t index = 0; index < buffers.size() && handle.buffer == nullptr; index++) {
+            if (!buffers[index]->in_use && IsSameName(buffers[index]->name, name)) {
+                handle.buffer = buffers[index].get();
+                // The events of the previous thread are kept, they were written before it exited
+                handle.buffer->in_use = true;
+            }
+        }
+        if (handle.buffer == nullptr) {
+            buffers.push_back(std::make_unique<TraceThreadBuffer>());
+            handle.buffer = buffers.back().get();
+            InitializeBuffer(handle.buffer, name);
+        }
+    }
+    return handle.buffer;
+}
+
+static void AppendEvent(TraceThreadBuffer* buffer, const char* name, long long begin_time, long long end_time) {
+    unsigned int generation = recording_generation.load(std::memory_order_acquire);
+    if (buffer->generation.load(std::memory_order_relaxed) != generation) {
+        buffer->count.store(0, std::memory_order_relaxed);
+        buffer->dropped_count.store(0, std::memory_order_relaxed);
+        buffer->generation.store(generation, std::memory_order_release);
+    }
+
+    // The threads that never record, like the workers of the CPU backend, don't allocate the events
+    if (buffer->events.size() == 0) {
+        buffer->events.resize(TRACE_THREAD_EVENT_CAPACITY);
+    }
+    size_t count = buffer->count.load(std::memory_order_relaxed);
+    if (count == buffer->events.size()) {
+        buffer->dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer->events[count] = { name, begin_time, end_time };
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+static void WriteBufferEvents(FILE* file, const TraceThreadBuffer& buffer, size_t thread_id, const char* default_name, bool& first_event) {
+    unsigned int generation = recording_generation.load(std::memory_order_acquire);
+    if (buffer.generation.load(std::memory_order_acquire) != generation) {
+        return;
+    }
+    size_t count = buffer.count.load(std::memory_order_acquire);
+    if (count == 0) {
+        return;
+    }
+
+    const char* name = buffer.name != nullptr ? buffer.name : default_name;
+    fprintf(
+        file,
+        "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+        first_event ? "" : ",",
+        thread_id,
+        name
+    );
+    first_event = false;
+    for (size_t index = 0; index < count; index++) {
+        const TraceEvent& event = buffer.events[index];
+        // The trace times are in microseconds
+        fprintf(
+            file,
+            ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+            event.name,
+            thread_id,
+            (double)event.begin_time / 1000.0,
+            (double)(event.end_time - event.begin_time) / 1000.0
+        );
+    }
+    size_t dropped_count = buffer.dropped_count.load(std::memory_order_relaxed);
+    if (dropped_count > 0) {
+        printf("The trace dropped %zu events of the %s track\n", dropped_count, name);
+    }
+}
+
+void Trace::Start()
+{
+    // The buffers clear themselves when they see the new generation
+    recording_generation.fetch_add(1, std::memory_order_acq_rel);
+    start_time = std::chrono::steady_clock::now();
+    if (gpu_buffer.name == nullptr) {
+        InitializeBuffer(&gpu_buffer, "GPU");
+    }
+
+    GLint64 gpu_time = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_time);
+    gpu_time_offset = GetTime() - gpu_time;
+    recording.store(true, std::memory_order_release);
+}
+
+bool Trace::Stop(const char* path)
+{
+    recording.store(false, std::memory_order_release);
+
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first_event = true;
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        for (size_t index = 0; index < buffers.size(); index++) {
+            char default_name[32];
+            snprintf(default_name, sizeof(default_name), "Thread %zu", index + 1);
+            WriteBufferEvents(file, *buffers[index], index + 1, default_name, first_event);
+        }
+    }
+    // The GPU track comes after all the threads
+    WriteBufferEvents(file, gpu_buffer, 0, "GPU", first_event);
+    fprintf(file, "\n]}\n");
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+long long Trace::GetTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void Trace::AddEvent(const char* name, long long begin_time, long long end_time)
+{
+    AppendEvent(GetThreadBuffer(nullptr), name, begin_time, end_time);
+}
+
+void Trace::AddGPUEvent(const char* name, unsigned long long begin_timestamp, unsigned long long end_timestamp)
+{
+    // The frames that were issued before the start are left out
+    long long begin_time = (long long)begin_timestamp + gpu_time_offset;
+    if (begin_time < 0) {
+        return;
+    }
+    AppendEvent(&gpu_buffer, name, begin_time, (long long)end_timestamp + gpu_time_offset);
+}
+
+void Trace::SetThreadName(const char* name)
+{
+    GetThreadBuffer(name)->name = name;
+}
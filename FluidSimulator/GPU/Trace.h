@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+
+// How many events each thread can record, the later ones are dropped
+#define TRACE_THREAD_EVENT_CAPACITY (1 << 16)
+#define TRACE_DEFAULT_FILE "trace.json"
+
+// Records named scopes into a buffer of each thread, and writes them as a Chrome trace JSON file
+// That chrome://tracing and ui.perfetto.dev can open. A thread only appends to its own buffer, without
+// A lock, the buffers are read when the recording stops. The GPU profiler scopes are added on a
+// Separate GPU track, such that the trace shows the overlap of the CPU and of the GPU
+struct Trace {
+    // Starts a new recording, the events of the previous one are discarded. It must be called on the
+    // Thread with the GL context, the GPU timestamps are related to the CPU clock at this point
+    static void Start();
+
+    // Stops the recording and writes the events since the start. The GPU scopes of the frames that
+    // The profiler has not resolved yet are not included. Returns false if the file can't be written
+    static bool Stop(const char* path);
+
+    static inline bool IsRecording() {
+        return recording.load(std::memory_order_relaxed);
+    }
+
+    // Nanoseconds on the clock of the CPU events
+    static long long GetTime();
+
+    static void AddEvent(const char* name, long long begin_time, long long end_time);
+
+    // The times are GL_TIMESTAMP values, it must be called on the thread with the GL context
+    static void AddGPUEvent(const char* name, unsigned long long begin_timestamp, unsigned long long end_timestamp);
+
+    // The name of the track of the calling thread, called before its first event. The threads with the
+    // Same name that run one after the other share a track
+    static void SetThreadName(const char* name);
+
+    static std::atomic<bool> recording;
+};
+
+// Records the time between its construction and its destruction. The name must be a string literal.
+// When there is no recording, it costs a single load
+struct TraceScope {
+    TraceScope(const char* _name) : name(_name), begin_time(Trace::IsRecording() ? Trace::GetTime() : -1) {}
+
+    ~TraceScope() {
+        if (begin_time >= 0) {
+            Trace::AddEvent(name, begin_time, Trace::GetTime());
+        }
+    }
+
+    const char* name;
+    long long begin_time;
+};
@@ -0,0 +1,501 @@
+#include "Trajectory.h"
+#include "GeneralSettings.h"
+#include "Trace.h"
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <math.h>
+#include <string.h>
+
+static const unsigned int TRAJECTORY_MAGIC = FILE_TAG('F', 'T', 'R', 'J');
+static const unsigned int TRAJECTORY_HEADER_TAG = FILE_TAG('H', 'E', 'A', 'D');
+static const unsigned int KEY_FRAME_TAG = FILE_TAG('K', 'E', 'Y', 'F');
+static const unsigned int DELTA_FRAME_TAG = FILE_TAG('D', 'E', 'L', 'T');
+
+// The values of a block share the same bit width
+#define PACK_BLOCK_SIZE 32
+// The quantized coordinates are clamped to this, such that the differences fit in 32 bits
+#define MAX_QUANTIZED_COORDINATE (1 << 29)
+
+struct TrajectoryHeader {
+    float error_bound;
+    float quantization_step;
+    int order_cell_size;
+    unsigned int key_frame_interval;
+};
+
+struct TrajectoryFrameHeader {
+    unsigned int particle_count;
+    // The particles that were not in the previous frame, they are stored after the others.
+    // For a key frame these are all the particles
+    unsigned int new_particle_count;
+    float delta_time;
+    unsigned int padding;
+};
+
+static unsigned int ZigZagEncode(int value) {
+    return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+static int ZigZagDecode(unsigned int value) {
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+// Each block of values starts with a byte that has the bit width, followed by the values packed with that width
+static void PackValues(std::vector<unsigned char>& output, const unsigned int* values, size_t count) {
+    for (size_t block_start = 0; block_start < count; block_start += PACK_BLOCK_SIZE) {
+        size_t block_count = std::min((size_t)PACK_BLOCK_SIZE, count - block_start);
+        unsigned int combined = 0;
+        for (size_t index = 0; index < block_count; index++) {
+            combined |= values[block_start + index];
+        }
+        unsigned int bit_width = 0;
+        while (bit_width < 32 && (combined >> bit_width) != 0) {
+            bit_width++;
+        }
+        output.push_back((unsigned char)bit_width);
+
+        unsigned long long accumulator = 0;
+        unsigned int accumulated_bits = 0;
+        for (size_t index = 0; index < block_count; index++) {
+            accumulator |= (unsigned long long)values[block_start + index] << accumulated_bits;
+            accumulated_bits += bit_width;
+            while (accumulated_bits >= 8) {
+                output.push_back((unsigned char)accumulator);
+                accumulator >>= 8;
+                accumulated_bits -= 8;
+            }
+        }
+        if (accumulated_bits > 0) {
+            output.push_back((unsigned char)accumulator);
+        }
+    }
+}
+
+// Returns false if the payload ends before all the values
+static bool UnpackValues(const unsigned char*& data, const unsigned char* data_end, unsigned int* values, size_t count) {
+    for (size_t block_start = 0; block_start < count; block_start += PACK_BLOCK_SIZE) {
+        size_t block_count = std::min((size_t)PACK_BLOCK_SIZE, count - block_start);
+        if (data >= data_end) {
+            return false;
+        }
+        unsigned int bit_width = *data++;
+        if (bit_width > 32 || (size_t)(data_end - data) < (block_count * bit_width + 7) / 8) {
+            return false;
+        }
+
+        unsigned long long accumulator = 0;
+        unsigned int accumulated_bits = 0;
+        unsigned long long mask = (1ull << bit_width) - 1;
+        for (size_t index = 0; index < block_count; index++) {
+            while (accumulated_bits < bit_width) {
+                accumulator |= (unsigned long long)*data++ << accumulated_bits;
+                accumulated_bits += 8;
+            }
+            values[block_start + index] = (unsigned int)(accumulator & mask);
+            accumulator >>= bit_width;
+            accumulated_bits -= bit_width;
+        }
+    }
+    return true;
+}
+
+static int QuantizeCoordinate(float value, float quantization_step) {
+    // NaN is the only value that is not equal to itself
+    if (value != value) {
+        return 0;
+    }
+    float quantized = roundf(value / quantization_step);
+    return (int)std::clamp(quantized, (float)-MAX_QUANTIZED_COORDINATE, (float)MAX_QUANTIZED_COORDINATE);
+}
+
+// Interleaves the bits of the cell coordinates, such that the cells that are close in space are close in the order
+static unsigned int GetCellOrderKey(QuantizedPosition position, int cell_size) {
+    unsigned int cell_x = (unsigned int)(position.x / cell_size + 0x8000) & 0xFFFF;
+    unsigned int cell_y = (unsigned int)(position.y / cell_size + 0x8000) & 0xFFFF;
+    unsigned int key = 0;
+    for (unsigned int bit = 0; bit < 16; bit++) {
+        key |= ((cell_x >> bit) & 1) << (2 * bit);
+        key |= ((cell_y >> bit) & 1) << (2 * bit + 1);
+    }
+    return key;
+}
+
+// The indices of the particles sorted by their cells. Equal cells keep their order, such that
+// The writer and the reader compute the same order
+static std::vector<unsigned int> GetCellOrder(const std::vector<QuantizedPosition>& positions, int cell_size) {
+    std::vector<unsigned int> keys(positions.size());
+    for (size_t index = 0; index < positions.size(); index++) {
+        keys[index] = GetCellOrderKey(positions[index], cell_size);
+    }
+    std::vector<unsigned int> order(positions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](unsigned int left, unsigned int right) {
+        return keys[left] < keys[right];
+    });
+    return order;
+}
+
+// The particles without a previous position store their ids and the difference to the previous particle
+// In the list, which is small since the list is in cell order
+static void PackParticleList(std::vector<unsigned char>& output, const unsigned int* ids, const QuantizedPosition* positions, size_t count) {
+    std::vector<unsigned int> values(count);
+    PackValues(output, ids, count);
+    for (size_t index = 0; index < count; index++) {
+        values[index] = ZigZagEncode(positions[index].x - (index > 0 ? positions[index - 1].x : 0));
+    }
+    PackValues(output, values.data(), count);
+    for (size_t index = 0; index < count; index++) {
+        values[index] = ZigZagEncode(positions[index].y - (index > 0 ? positions[index - 1].y : 0));
+    }
+    PackValues(output, values.data(), count);
+}
+
+static bool UnpackParticleList(const unsigned char*& data, const unsigned char* data_end, unsigned int* ids, QuantizedPosition* positions, size_t count) {
+    std::vector<unsigned int> x_values(count);
+    std::vector<unsigned int> y_values(count);
+    if (!UnpackValues(data, data_end, ids, count) || !UnpackValues(data, data_end, x_values.data(), count) || !UnpackValues(data, data_end, y_values.data(), count)) {
+        return false;
+    }
+    for (size_t index = 0; index < count; index++) {
+        positions[index].x = ZigZagDecode(x_values[index]) + (index > 0 ? positions[index - 1].x : 0);
+        positions[index].y = ZigZagDecode(y_values[index]) + (index > 0 ? positions[index - 1].y : 0);
+    }
+    return true;
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    // The context can be gone already, only the frames that were read back are written
+    if (write_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stop_writing = true;
+        }
+        queue_condition.notify_all();
+        write_thread.join();
+    }
+}
+
+void TrajectoryWriter::Initialize(GPUReadback* _readback)
+{
+    readback = _readback;
+    last_ticket = INVALID_READBACK_TICKET;
+}
+
+bool TrajectoryWriter::Open(const char* path, float error_bound, float cell_size)
+{
+    if (is_open) {
+        Close();
+    }
+    if (!writer.Open(path, TRAJECTORY_MAGIC, TRAJECTORY_VERSION)) {
+        return false;
+    }
+
+    // Rounding to the closest step makes the error at most half of the step
+    quantization_step = 2.0f * error_bound * POSITION_FACTOR;
+    order_cell_size = std::max((int)(cell_size / quantization_step), 1);
+    TrajectoryHeader header = { error_bound, quantization_step, order_cell_size, TRAJECTORY_KEY_FRAME_INTERVAL };
+    if (!writer.WriteChunk(TRAJECTORY_HEADER_TAG, &header, sizeof(header))) {
+        writer.Close();
+        return false;
+    }
+
+    reading_frames.clear();
+    captured_frame_count = 0;
+    written_frame_count = 0;
+    previous_ids.clear();
+    previous_positions.clear();
+
+    stop_writing = false;
+    write_success = true;
+    write_thread = std::thread([this]() {
+        WriteFrames();
+    });
+    is_open = true;
+    return true;
+}
+
+void TrajectoryWriter::Capture(const StructuredBuffer& positions, const StructuredBuffer& ids, size_t particle_count, float delta_time)
+{
+    // Every frame must be written, the readbacks wait for the oldest one when the ring is full.
+    // The references to the elements of the deque stay valid while it grows at the back
+    reading_frames.emplace_back();
+    TrajectoryFrame* frame = &reading_frames.back();
+    frame->delta_time = delta_time;
+    readback->Request(positions, sizeof(Float2) * particle_count, [frame, particle_count](const void* data, size_t byte_size) {
+        frame->positions.assign((const Float2*)data, (const Float2*)data + particle_count);
+    });
+    // The readbacks finish in order, the positions are there when the ids are
+    last_ticket = readback->Request(ids, sizeof(unsigned int) * particle_count, [this, frame, particle_count](const void* data, size_t byte_size) {
+        frame->ids.assign((const unsigned int*)data, (const unsigned int*)data + particle_count);
+        QueueFrame(std::move(*frame));
+        reading_frames.pop_front();
+    });
+    captured_frame_count++;
+}
+
+bool TrajectoryWriter::Close()
+{
+    if (!is_open) {
+        return false;
+    }
+
+    readback->Wait(last_ticket);
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stop_writing = true;
+    }
+    queue_condition.notify_all();
+    write_thread.join();
+    is_open = false;
+
+    bool success = write_success && writer.Finish();
+    if (!success) {
+        std::cout << "Failed to write the trajectory\n";
+    }
+    return success;
+}
+
+void TrajectoryWriter::QueueFrame(TrajectoryFrame&& frame)
+{
+    // Shows when the simulation waits for the disk
+    TraceScope trace_scope("Queue trajectory frame");
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    // When the disk is slower than the simulation, the simulation waits instead of filling the memory
+    queue_condition.wait(lock, [this]() {
+        return queued_frames.size() < TRAJECTORY_MAX_QUEUED_FRAMES;
+    });
+    queued_frames.push_back(std::move(frame));
+    lock.unlock();
+    queue_condition.notify_all();
+}
+
+void TrajectoryWriter::WriteFrames()
+{
+    Trace::SetThreadName("Trajectory writer");
+    while (true) {
+        TrajectoryFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_condition.wait(lock, [this]() {
+                return stop_writing || queued_frames.size() > 0;
+            });
+            if (queued_frames.size() == 0) {
+                return;
+            }
+            frame = std::move(queued_frames.front());
+            queued_frames.pop_front();
+        }
+        queue_condition.notify_all();
+
+        // After a failure the frames are still consumed, such that the simulation doesn't wait for them
+        if (write_success) {
+            TraceScope trace_scope("Write trajectory frame");
+            write_success = WriteFrame(frame);
+        }
+    }
+}
+
+bool TrajectoryWriter::WriteFrame(const TrajectoryFrame& frame)
+{
+    size_t count = frame.ids.size();
+    std::vector<QuantizedPosition> positions(count);
+    unsigned int max_id = 0;
+    for (size_t index = 0; index < count; index++) {
+        positions[index].x = QuantizeCoordinate(frame.positions[index].x, quantization_step);
+        positions[index].y = QuantizeCoordinate(frame.positions[index].y, quantization_step);
+        max_id = std::max(max_id, frame.ids[index]);
+    }
+
+    // Where each id is in this frame, the particles of the previous frame must all still be there
+    const unsigned int MISSING = (unsigned int)-1;
+    std::vector<unsigned int> id_to_index(count > 0 ? (size_t)max_id + 1 : 0, MISSING);
+    for (size_t index = 0; index < count; index++) {
+        id_to_index[frame.ids[index]] = (unsigned int)index;
+    }
+    bool is_key_frame = written_frame_count % TRAJECTORY_KEY_FRAME_INTERVAL == 0;
+    for (size_t index = 0; index < previous_ids.size() && !is_key_frame; index++) {
+        is_key_frame = previous_ids[index] > max_id || id_to_index[previous_ids[index]] == MISSING;
+    }
+
+    std::vector<unsigned int> ids;
+    std::vector<QuantizedPosition> ordered_positions;
+    ids.reserve(count);
+    ordered_positions.reserve(count);
+    std::vector<unsigned char> payload;
+    TrajectoryFrameHeader header = { (unsigned int)count, (unsigned int)count, frame.delta_time, 0 };
+    payload.resize(sizeof(header));
+
+    std::vector<bool> is_stored(count, false);
+    if (!is_key_frame) {
+        // The order comes from the previous frame, which the reader has already decoded
+        std::vector<unsigned int> order = GetCellOrder(previous_positions, order_cell_size);
+        std::vector<unsigned int> x_values(order.size());
+        std::vector<unsigned int> y_values(order.size());
+        for (size_t index = 0; index < order.size(); index++) {
+            unsigned int id = previous_ids[order[index]];
+            unsigned int current_index = id_to_index[id];
+            QuantizedPosition previous = previous_positions[order[index]];
+            x_values[index] = ZigZagEncode(positions[current_index].x - previous.x);
+            y_values[index] = ZigZagEncode(positions[current_index].y - previous.y);
+            ids.push_back(id);
+            ordered_positions.push_back(positions[current_index]);
+            is_stored[current_index] = true;
+        }
+        PackValues(payload, x_values.data(), x_values.size());
+        PackValues(payload, y_values.data(), y_values.size());
+        header.new_particle_count = (unsigned int)(count - order.size());
+    }
+
+    // The new particles, or all of them for a key frame, in their own cell order
+    std::vector<QuantizedPosition> new_positions;
+    std::vector<unsigned int> new_indices;
+    for (size_t index = 0; index < count; index++) {
+        if (!is_stored[index]) {
+            new_positions.push_back(positions[index]);
+            new_indices.push_back((unsigned int)index);
+        }
+    }
+    std::vector<unsigned int> new_order = GetCellOrder(new_positions, order_cell_size);
+    size_t new_start = ids.size();
+    for (size_t index = 0; index < new_order.size(); index++) {
+        ids.push_back(frame.ids[new_indices[new_order[index]]]);
+        ordered_positions.push_back(new_positions[new_order[index]]);
+    }
+    PackParticleList(payload, ids.data() + new_start, ordered_positions.data() + new_start, new_order.size());
+
+    memcpy(payload.data(), &header, sizeof(header));
+    if (!writer.WriteChunk(is_key_frame ? KEY_FRAME_TAG : DELTA_FRAME_TAG, payload.data(), payload.size())) {
+        return false;
+    }
+    previous_ids = std::move(ids);
+    previous_positions = std::move(ordered_positions);
+    written_frame_count++;
+    return true;
+}
+
+bool TrajectoryReader::Open(const char* path)
+{
+    Close();
+    if (!reader.Open(path, TRAJECTORY_MAGIC, TRAJECTORY_VERSION)) {
+        return false;
+    }
+
+    const FileChunk* header_chunk = reader.FindChunk(TRAJECTORY_HEADER_TAG);
+    if (header_chunk == nullptr || header_chunk->size < sizeof(TrajectoryHeader) || !reader.VerifyChunk(*header_chunk)) {
+        std::cout << "The trajectory " << path << " has no valid header\n";
+        Close();
+        return false;
+    }
+    TrajectoryHeader header;
+    memcpy(&header, reader.GetPayload(*header_chunk), sizeof(header));
+    error_bound = header.error_bound;
+    quantization_step = header.quantization_step;
+    order_cell_size = std::max(header.order_cell_size, 1);
+
+    // The frames are chunks in order, the index is the position in this list
+    const std::vector<FileChunk>& chunks = reader.GetChunks();
+    for (size_t index = 0; index < chunks.size(); index++) {
+        if (chunks[index].tag == KEY_FRAME_TAG || chunks[index].tag == DELTA_FRAME_TAG) {
+            frames.push_back(&chunks[index]);
+        }
+    }
+    if (frames.size() > 0 && frames[0]->tag != KEY_FRAME_TAG) {
+        std::cout << "The trajectory " << path << " doesn't start with a key frame\n";
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void TrajectoryReader::Close()
+{
+    reader.Close();
+    frames.clear();
+    decoded_frame = (size_t)-1;
+    decoded_ids.clear();
+    decoded_positions.clear();
+}
+
+bool TrajectoryReader::ReadFrame(size_t frame_index, std::vector<unsigned int>& ids, std::vector<Float2>& positions, float* delta_time)
+{
+    if (frame_index >= frames.size()) {
+        return false;
+    }
+
+    // Continue from the decoded frame when there is no key frame in between, otherwise from the closest key
+    // Frame. The first frame is always a key frame
+    size_t start_frame = frame_index + 1;
+    if (decoded_frame != frame_index) {
+        start_frame = frame_index;
+        while (frames[start_frame]->tag != KEY_FRAME_TAG && start_frame != decoded_frame + 1) {
+            start_frame--;
+        }
+    }
+    for (size_t index = start_frame; index <= frame_index; index++) {
+        if (!DecodeFrame(index)) {
+            decoded_frame = (size_t)-1;
+            return false;
+        }
+    }
+
+    ids = decoded_ids;
+    positions.resize(decoded_positions.size());
+    for (size_t index = 0; index < decoded_positions.size(); index++) {
+        positions[index] = Float2(decoded_positions[index].x * quantization_step, decoded_positions[index].y * quantization_step);
+    }
+    if (delta_time != nullptr) {
+        *delta_time = decoded_delta_time;
+    }
+    return true;
+}
+
+bool TrajectoryReader::DecodeFrame(size_t frame_index)
+{
+    const FileChunk& chunk = *frames[frame_index];
+    if (chunk.size < sizeof(TrajectoryFrameHeader) || !reader.VerifyChunk(chunk)) {
+        std::cout << "The trajectory frame " << frame_index << " is corrupted\n";
+        return false;
+    }
+    const unsigned char* data = reader.GetPayload(chunk);
+    const unsigned char* data_end = data + chunk.size;
+    TrajectoryFrameHeader header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+
+    bool is_key_frame = chunk.tag == KEY_FRAME_TAG;
+    size_t previous_count = is_key_frame ? 0 : decoded_ids.size();
+    if (header.new_particle_count > header.particle_count || header.particle_count - header.new_particle_count != previous_count) {
+        std::cout << "The trajectory frame " << frame_index << " is corrupted\n";
+        return false;
+    }
+
+    std::vector<unsigned int> ids(header.particle_count);
+    std::vector<QuantizedPosition> positions(header.particle_count);
+    if (!is_key_frame) {
+        std::vector<unsigned int> order = GetCellOrder(decoded_positions, order_cell_size);
+        std::vector<unsigned int> x_values(previous_count);
+        std::vector<unsigned int> y_values(previous_count);
+        if (!UnpackValues(data, data_end, x_values.data(), previous_count) || !UnpackValues(data, data_end, y_values.data(), previous_count)) {
+            std::cout << "The trajectory frame " << frame_index << " is corrupted\n";
+            return false;
+        }
+        for (size_t index = 0; index < previous_count; index++) {
+            QuantizedPosition previous = decoded_positions[order[index]];
+            ids[index] = decoded_ids[order[index]];
+            positions[index].x = previous.x + ZigZagDecode(x_values[index]);
+            positions[index].y = previous.y + ZigZagDecode(y_values[index]);
+        }
+    }
+    if (!UnpackParticleList(data, data_end, ids.data() + previous_count, positions.data() + previous_count, header.new_particle_count)) {
+        std::cout << "The trajectory frame " << frame_index << " is corrupted\n";
+        return false;
+    }
+
+    decoded_ids = std::move(ids);
+    decoded_positions = std::move(positions);
+    decoded_delta_time = header.delta_time;
+    decoded_frame = frame_index;
+    return true;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "SimulationFile.h"
+#include "GPUReadback.h"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define TRAJECTORY_VERSION 1
+// How many frames can wait for the background thread before the simulation waits for it
+#define TRAJECTORY_MAX_QUEUED_FRAMES 8
+// A frame that doesn't depend on the previous ones is written at this interval, such that seeking
+// Only has to decode from the closest key frame
+#define TRAJECTORY_KEY_FRAME_INTERVAL 64
+// The default largest position error, relative to POSITION_FACTOR
+#define TRAJECTORY_DEFAULT_ERROR_BOUND 0.0001f
+
+// The positions are quantized to integers on a grid, which keeps the error below the bound
+struct QuantizedPosition {
+    int x;
+    int y;
+};
+
+// One frame as it is read back from the GPU, in the order of the particle buffers
+struct TrajectoryFrame {
+    float delta_time;
+    std::vector<unsigned int> ids;
+    std::vector<Float2> positions;
+};
+
+// The positions are quantized, such that the error stays below the error bound, and each particle
+// Is stored as the difference to its position in the previous frame. The particles are visited in
+// The cell order of the previous frame, which the reader can compute as well, such that neighbours
+// With similar motion end up next to each other. The differences are bit packed in blocks, with the
+// Smallest width that fits the block. Every frame is a chunk, which makes the file seekable by frame
+class TrajectoryWriter {
+public:
+    TrajectoryWriter() = default;
+    TrajectoryWriter(const TrajectoryWriter& other) = delete;
+    TrajectoryWriter& operator = (const TrajectoryWriter& other) = delete;
+    ~TrajectoryWriter();
+
+    void Initialize(GPUReadback* readback);
+
+    // The error bound is relative to POSITION_FACTOR, the cell size orders the particles
+    bool Open(const char* path, float error_bound, float cell_size);
+
+    // Requests the readback of the particles of the frame. The frames are handed to the background
+    // Thread as their readbacks finish
+    void Capture(const StructuredBuffer& positions, const StructuredBuffer& ids, size_t particle_count, float delta_time);
+
+    // Writes the remaining frames and closes the file
+    bool Close();
+
+    inline bool IsOpen() const {
+        return is_open;
+    }
+
+    inline size_t GetFrameCount() const {
+        return captured_frame_count;
+    }
+
+private:
+    // Waits for the background thread if too many frames are queued
+    void QueueFrame(TrajectoryFrame&& frame);
+
+    void WriteFrames();
+
+    bool WriteFrame(const TrajectoryFrame& frame);
+
+    ChunkFileWriter writer;
+    bool is_open = false;
+    float quantization_step;
+    int order_cell_size;
+    size_t captured_frame_count;
+    size_t written_frame_count;
+
+    GPUReadback* readback;
+    // The frames whose readbacks have not finished, in the order of the requests
+    std::deque<TrajectoryFrame> reading_frames;
+    ReadbackTicket last_ticket;
+
+    std::thread write_thread;
+    std::mutex queue_mutex;
+    std::condition_variable queue_condition;
+    std::deque<TrajectoryFrame> queued_frames;
+    bool stop_writing;
+    // Written by the background thread
+    bool write_success;
+
+    // The frame that the next one is encoded against, in the order it was stored
+    std::vector<unsigned int> previous_ids;
+    std::vector<QuantizedPosition> previous_positions;
+};
+
+// Decodes the frames in any order. Reading the frames one after the other decodes each frame once,
+// Jumping decodes from the closest key frame before it
+class TrajectoryReader {
+public:
+    // The checksums are verified as the frames are decoded
+    bool Open(const char* path);
+
+    void Close();
+
+    inline size_t GetFrameCount() const {
+        return frames.size();
+    }
+
+    // The largest position error, relative to POSITION_FACTOR
+    inline float GetErrorBound() const {
+        return error_bound;
+    }
+
+    // The particles are in the order they were stored in, not in the order of the ids
+    bool ReadFrame(size_t frame_index, std::vector<unsigned int>& ids, std::vector<Float2>& positions, float* delta_time = nullptr);
+
+private:
+    bool DecodeFrame(size_t frame_index);
+
+    ChunkFileReader reader;
+    std::vector<const FileChunk*> frames;
+    float error_bound = 0.0f;
+    float quantization_step = 0.0f;
+    int order_cell_size = 1;
+
+    // The last frame that was decoded
+    size_t decoded_frame = (size_t)-1;
+    float decoded_delta_time = 0.0f;
+    std::vector<unsigned int> decoded_ids;
+    std::vector<QuantizedPosition> decoded_positions;
+};
@@ -1,5 +1,6 @@
 #include "VertexBuffer.h"
 #include "glad.h"
+#include "GPUBarriers.h"
 
 VertexBuffer::VertexBuffer() : VAO_ID(-1), VBO_ID(-1), element_count(-1) {}
 
@@ -33,6 +34,7 @@ void VertexBuffer::Bind() const
 
 void VertexBuffer::Draw(size_t count) const
 {
+    GPUBarriers::PrepareDraw(VBO_ID);
     if (count == 1) {
         glDrawArrays(GL_TRIANGLES, 0, element_count);
     }
@@ -0,0 +1,165 @@
+#include "WorkgroupTuner.h"
+#include "ShaderCache.h"
+#include <vector>
+#include <iterator>
+#include <stdio.h>
+#include <string.h>
+
+struct WorkgroupEntry {
+    unsigned long long device_key;
+    size_t bucket;
+    WorkgroupSizes sizes;
+};
+
+static const char* KERNEL_NAMES[] = {
+    "external_forces",
+    "sort",
+    "reorder",
+    "neighbour_lists",
+    "density",
+    "pressure",
+    "viscosity",
+    "motion_reduction"
+};
+
+static_assert(std::size(KERNEL_NAMES) == (size_t)TunedKernel::Count, "Each tuned kernel needs a name");
+
+static std::vector<WorkgroupEntry> entries;
+
+static WorkgroupEntry* FindEntry(unsigned long long device_key, size_t bucket) {
+    for (size_t index = 0; index < entries.size(); index++) {
+        if (entries[index].device_key == device_key && entries[index].bucket == bucket) {
+            return &entries[index];
+        }
+    }
+    return nullptr;
+}
+
+static WorkgroupEntry* AddEntry(unsigned long long device_key, size_t bucket) {
+    WorkgroupEntry* entry = FindEntry(device_key, bucket);
+    if (entry == nullptr) {
+        entries.push_back({ device_key, bucket, WorkgroupTuner::GetDefaultSizes() });
+        entry = &entries.back();
+    }
+    return entry;
+}
+
+static bool IsValidSize(unsigned int size) {
+    unsigned int candidates[] = WORKGROUP_CANDIDATE_SIZES;
+    for (size_t index = 0; index < std::size(candidates); index++) {
+        if (candidates[index] == size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* WorkgroupTuner::GetKernelName(TunedKernel kernel)
+{
+    return KERNEL_NAMES[(size_t)kernel];
+}
+
+size_t WorkgroupTuner::GetParticleBucket(size_t particle_count)
+{
+    size_t bucket = 1;
+    while (bucket * 2 <= particle_count) {
+        bucket *= 2;
+    }
+    return bucket;
+}
+
+WorkgroupSizes WorkgroupTuner::GetDefaultSizes()
+{
+    WorkgroupSizes sizes;
+    for (size_t index = 0; index < (size_t)TunedKernel::Count; index++) {
+        sizes.sizes[index] = WORKGROUP_DEFAULT_SIZE;
+    }
+    return sizes;
+}
+
+bool WorkgroupTuner::Load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        return false;
+    }
+
+    char line[256];
+    size_t line_index = 0;
+    bool success = true;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        line_index++;
+        char* comment = strchr(line, '#');
+        if (comment != nullptr) {
+            *comment = '\0';
+        }
+
+        unsigned long long device_key;
+        size_t bucket;
+        char name[64];
+        unsigned int size;
+        int match_count = sscanf(line, "%llx %zu %63s %u", &device_key, &bucket, name, &size);
+        if (match_count <= 0) {
+            // Empty line
+            continue;
+        }
+
+        size_t kernel_index = 0;
+        while (kernel_index < std::size(KERNEL_NAMES) && strcmp(KERNEL_NAMES[kernel_index], name) != 0) {
+            kernel_index++;
+        }
+        // A size that is not a candidate could break the prefix sum of the sort
+        if (match_count != 4 || kernel_index == std::size(KERNEL_NAMES) || !IsValidSize(size)) {
+            printf("Invalid workgroup size in %s at line %zu\n", path, line_index);
+            success = false;
+            break;
+        }
+        AddEntry(device_key, bucket)->sizes.sizes[kernel_index] = size;
+    }
+    fclose(file);
+    return success;
+}
+
+bool WorkgroupTuner::Save(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "# The workgroup sizes found by the autotuner: device, particle count bucket, kernel, size\n");
+    for (size_t index = 0; index < entries.size(); index++) {
+        for (size_t kernel_index = 0; kernel_index < (size_t)TunedKernel::Count; kernel_index++) {
+            fprintf(
+                file,
+                "%016llx %zu %s %u\n",
+                entries[index].device_key,
+                entries[index].bucket,
+                KERNEL_NAMES[kernel_index],
+                entries[index].sizes.sizes[kernel_index]
+            );
+        }
+    }
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+bool WorkgroupTuner::GetSizes(size_t particle_count, WorkgroupSizes& sizes)
+{
+    // The lookup happens every frame, it stays cheap as long as there are few entries
+    if (entries.size() > 0) {
+        const WorkgroupEntry* entry = FindEntry(ShaderCache::GetDriverKey(), GetParticleBucket(particle_count));
+        if (entry != nullptr) {
+            sizes = entry->sizes;
+            return true;
+        }
+    }
+    sizes = GetDefaultSizes();
+    return false;
+}
+
+void WorkgroupTuner::SetSizes(size_t particle_count, const WorkgroupSizes& sizes)
+{
+    AddEntry(ShaderCache::GetDriverKey(), GetParticleBucket(particle_count))->sizes = sizes;
+}
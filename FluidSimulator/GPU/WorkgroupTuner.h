@@ -0,0 +1,59 @@
+#pragma once
+#include <stddef.h>
+
+#define WORKGROUP_SIZES_FILE "workgroup_sizes.txt"
+// The group size of the kernels that were not tuned for the device and particle count
+#define WORKGROUP_DEFAULT_SIZE 128
+// The sizes that the autotuner tries. The prefix sum of the sort needs a power of two, and
+// Every implementation supports groups of at least 1024 invocations
+#define WORKGROUP_CANDIDATE_SIZES { 32, 64, 128, 256, 512 }
+
+// The kernels whose group size is tuned. The sort shaders share a single size
+enum class TunedKernel : unsigned char {
+    ExternalForces,
+    Sort,
+    Reorder,
+    NeighbourLists,
+    Density,
+    Pressure,
+    Viscosity,
+    MotionReduction,
+    Count
+};
+
+struct WorkgroupSizes {
+    unsigned int sizes[(size_t)TunedKernel::Count];
+
+    inline unsigned int& operator [](TunedKernel kernel) {
+        return sizes[(size_t)kernel];
+    }
+
+    inline unsigned int operator [](TunedKernel kernel) const {
+        return sizes[(size_t)kernel];
+    }
+};
+
+// The best group sizes that the autotuner found, for each device and particle count bucket. The
+// Buckets are the powers of two, a particle count uses the sizes tuned for the largest power of two
+// That is not greater than it. The file has a "device bucket kernel size" line for each kernel
+struct WorkgroupTuner {
+    // The name of the kernel in the file
+    static const char* GetKernelName(TunedKernel kernel);
+
+    static size_t GetParticleBucket(size_t particle_count);
+
+    // All the kernels have the default size
+    static WorkgroupSizes GetDefaultSizes();
+
+    // The entries of the other devices are kept as well, such that saving doesn't lose them.
+    // Returns false if the file can't be read or is invalid
+    static bool Load(const char* path);
+
+    static bool Save(const char* path);
+
+    // Returns false if the bucket was not tuned on this device, in which case the sizes are the defaults
+    static bool GetSizes(size_t particle_count, WorkgroupSizes& sizes);
+
+    // Replaces the sizes of the bucket of the particle count, for this device
+    static void SetSizes(size_t particle_count, const WorkgroupSizes& sizes);
+};
@@ -7,16 +7,17 @@
     APIs: gl=4.3
     Profile: core
     Extensions:
-        
+        GL_ARB_buffer_storage,
+        GL_KHR_parallel_shader_compile
     Loader: True
     Local files: False
     Omit khrplatform: False
     Reproducible: False
 
     Commandline:
-        --profile="core" --api="gl=4.3" --generator="c" --spec="gl" --extensions=""
+        --profile="core" --api="gl=4.3" --generator="c" --spec="gl" --extensions="GL_ARB_buffer_storage,GL_KHR_parallel_shader_compile"
     Online:
-        https://glad.dav1d.de/#profile=core&language=c&specification=gl&loader=on&api=gl%3D4.3
+        https://glad.dav1d.de/#profile=core&language=c&specification=gl&loader=on&api=gl%3D4.3&extensions=GL_ARB_buffer_storage&extensions=GL_KHR_parallel_shader_compile
 */
 
 #include <stdio.h>
@@ -835,6 +836,10 @@ PFNGLVIEWPORTARRAYVPROC glad_glViewportArrayv = NULL;
 PFNGLVIEWPORTINDEXEDFPROC glad_glViewportIndexedf = NULL;
 PFNGLVIEWPORTINDEXEDFVPROC glad_glViewportIndexedfv = NULL;
 PFNGLWAITSYNCPROC glad_glWaitSync = NULL;
+int GLAD_GL_ARB_buffer_storage = 0;
+PFNGLBUFFERSTORAGEPROC glad_glBufferStorage = NULL;
+int GLAD_GL_KHR_parallel_shader_compile = 0;
+PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glad_glMaxShaderCompilerThreadsKHR = NULL;
 static void load_GL_VERSION_1_0(GLADloadproc load) {
 	if(!GLAD_GL_VERSION_1_0) return;
 	glad_glCullFace = (PFNGLCULLFACEPROC)load("glCullFace");
@@ -1451,9 +1456,18 @@ static void load_GL_VERSION_4_3(GLADloadproc load) {
 	glad_glGetObjectPtrLabel = (PFNGLGETOBJECTPTRLABELPROC)load("glGetObjectPtrLabel");
 	glad_glGetPointerv = (PFNGLGETPOINTERVPROC)load("glGetPointerv");
 }
+static void load_GL_ARB_buffer_storage(GLADloadproc load) {
+	if(!GLAD_GL_ARB_buffer_storage) return;
+	glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC)load("glBufferStorage");
+}
+static void load_GL_KHR_parallel_shader_compile(GLADloadproc load) {
+	if(!GLAD_GL_KHR_parallel_shader_compile) return;
+	glad_glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsKHR");
+}
 static int find_extensionsGL(void) {
 	if (!get_exts()) return 0;
-	(void)&has_ext;
+	GLAD_GL_ARB_buffer_storage = has_ext("GL_ARB_buffer_storage");
+	GLAD_GL_KHR_parallel_shader_compile = has_ext("GL_KHR_parallel_shader_compile");
 	free_exts();
 	return 1;
 }
@@ -1540,6 +1554,8 @@ int gladLoadGLLoader(GLADloadproc load) {
 	load_GL_VERSION_4_3(load);
 
 	if (!find_extensionsGL()) return 0;
+	load_GL_ARB_buffer_storage(load);
+	load_GL_KHR_parallel_shader_compile(load);
 	return GLVersion.major != 0 || GLVersion.minor != 0;
 }
 
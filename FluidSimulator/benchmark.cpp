@@ -0,0 +1,926 @@
+// Runs a set of canonical scenes over a sweep of particle counts, with a fixed delta time for each count,
+// And writes the throughput and the GPU time of each pass as JSON. With a baseline file from an earlier
+// Run, the results are compared and the regressions are reported through the exit code. With --kernels,
+// Each kernel of a step is timed on its own over synthetic particle layouts instead, and with --sorts the
+// Sort modes are timed on random entries
+
+#include "GPU/glad.h"
+#include "GPU/Simulation.h"
+#include "GPU/HeadlessContext.h"
+#include "GPU/SortBenchmark.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <assert.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+
+// The settings are tuned for this many particles. For the other counts the spacing of the particles
+// And the smoothing radius are scaled, such that the scenes keep their size and each particle has
+// About the same number of neighbours
+#define BENCHMARK_REFERENCE_PARTICLES 25'000
+// The spacing that gives a particle the same area as in the initial block of Reset, the scenes are
+// Filled with the density of the block
+#define BENCHMARK_PARTICLE_SPACING 3.2f
+#define BENCHMARK_SPAWN_COUNT 200
+// The steps for a turn of the mouse around the tank
+#define BENCHMARK_STIR_PERIOD 240
+// The passes faster than this are too noisy to be compared
+#define BENCHMARK_MIN_COMPARED_MS 0.05
+#define BENCHMARK_KERNEL_SEED 0x9E3779B9
+
+enum class BenchmarkScene : unsigned char {
+    Block,
+    DamBreak,
+    SpawnerFill,
+    Maze,
+    StirredTank,
+    Count
+};
+
+static const char* SCENE_NAMES[] = {
+    "block",
+    "dam_break",
+    "spawner_fill",
+    "maze",
+    "stirred_tank"
+};
+
+static_assert(std::size(SCENE_NAMES) == (size_t)BenchmarkScene::Count, "Each scene needs a name");
+
+struct BenchmarkOptions {
+    std::vector<BenchmarkScene> scenes;
+    std::vector<size_t> particle_counts;
+    size_t step_count = 256;
+    size_t warmup_step_count = 32;
+    // For the reference particle count, it is scaled with the spacing of the particles
+    float delta_time = 0.007f;
+    size_t window_width = 2500;
+    size_t window_height = 1200;
+    GPUSortMode sort_mode = GPUSortMode::Bitonic;
+    NeighbourSearchMode neighbour_search_mode = NeighbourSearchMode::SpatialHash;
+    bool compact_spatial_indices = false;
+    // The spatial hash table is sized for this many particles for each key, 0 uses a key for each particle
+    float hash_load_factor = 0.0f;
+    // nullptr disables the program binary cache
+    const char* shader_cache_directory = SHADER_CACHE_DEFAULT_DIRECTORY;
+    // The default depends on the mode
+    const char* output_path = nullptr;
+    const char* baseline_path = nullptr;
+    // The fraction by which a time can be slower than the baseline before it is a regression
+    double tolerance = 0.1;
+    // Times the kernels over the distributions instead of running the scenes
+    bool kernels = false;
+    // Times the sort modes on random entries instead of running the scenes
+    bool sorts = false;
+    std::vector<KernelDistribution> distributions;
+    size_t iteration_count = 20;
+};
+
+struct BenchmarkPass {
+    std::string name;
+    // The average GPU time of a step
+    double milliseconds;
+};
+
+struct BenchmarkResult {
+    std::string scene;
+    size_t particle_count;
+    size_t step_count;
+    float delta_time;
+    double elapsed_seconds;
+    // The sum of the particle counts of the timed steps, the spawner changes it while running
+    double particle_steps;
+    size_t nan_count;
+    std::vector<BenchmarkPass> passes;
+
+    inline double GetStepsPerSecond() const {
+        return (double)step_count / elapsed_seconds;
+    }
+
+    inline double GetNanosecondsPerParticleStep() const {
+        return elapsed_seconds * 1e9 / particle_steps;
+    }
+};
+
+struct KernelRun {
+    KernelDistribution distribution;
+    NeighbourSearchStats stats;
+    std::vector<KernelBenchmarkResult> results;
+};
+
+// The state that the scenes change, restored before each run
+struct SceneDefaults {
+    ParticleSpawner spawner;
+    size_t max_particle_count;
+};
+
+static void PrintUsage() {
+    printf(
+        "Usage: benchmark [options]\n"
+        "  --scenes NAME[,NAME...]    The scenes to run (default all):\n"
+    );
+    for (size_t index = 0; index < std::size(SCENE_NAMES); index++) {
+        printf("                               %s\n", SCENE_NAMES[index]);
+    }
+    printf(
+        "  --particles N[,N...]       The particle counts of the sweep (default 10000,50000,250000,1000000,4000000)\n"
+        "  --steps N                  Timed steps of each run (default 256), the pass times are averaged\n"
+        "                             over the last 256\n"
+        "  --warmup N                 Steps before the timed ones (default 32)\n"
+        "  --dt SECONDS               Delta time at 25000 particles, scaled with the particle spacing for\n"
+        "                             the other counts, at most 0.007 (default 0.007)\n"
+        "  --window W H               Window size in pixels, which sets the domain (default 2500 1200)\n"
+        "  --sort bitonic|counting|incremental\n"
+        "  --neighbour-search hash|dense\n"
+        "  --compact-indices          Sorts 8 byte spatial indices, without the hash of the cell\n"
+        "  --hash-load-factor F       Sizes the spatial hash table to a power of two with at most F particles\n"
+        "                             for each key (default 0, as many keys as particles)\n"
+        "  --shader-cache DIR|off     The directory of the compiled programs (default shader_cache)\n"
+        "  --output FILE              The results (default benchmark_results.json)\n"
+        "  --compare BASELINE         Compares with the results of an earlier run, and exits with 1 if\n"
+        "                             a run or a pass is slower than the tolerance allows\n"
+        "  --tolerance FRACTION       The allowed slowdown (default 0.1)\n"
+        "  --kernels                  Times each kernel on its own over the distributions, instead of\n"
+        "                             running the scenes (default output kernel_benchmark_results.json)\n"
+        "  --distributions NAME[,NAME...]  The particle layouts of --kernels (default all):\n"
+    );
+    for (size_t index = 0; index < (size_t)KernelDistribution::Count; index++) {
+        printf("                               %s\n", GetKernelDistributionName((KernelDistribution)index));
+    }
+    printf(
+        "  --iterations N             Timed dispatches of each kernel or sort (default 20)\n"
+        "  --sorts                    Times each sort mode on random entries, with the --particles counts\n"
+        "                             as the entry counts (default 16384,65536,262144,1048576,4194304),\n"
+        "                             instead of running the scenes (default output sort_benchmark_results.json).\n"
+        "                             Exits with 1 if a sort is not correct\n"
+    );
+}
+
+static bool FindScene(const char* name, size_t length, BenchmarkScene& scene) {
+    for (size_t index = 0; index < std::size(SCENE_NAMES); index++) {
+        if (strlen(SCENE_NAMES[index]) == length && strncmp(SCENE_NAMES[index], name, length) == 0) {
+            scene = (BenchmarkScene)index;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool FindDistribution(const char* name, size_t length, KernelDistribution& distribution) {
+    for (size_t index = 0; index < (size_t)KernelDistribution::Count; index++) {
+        const char* distribution_name = GetKernelDistributionName((KernelDistribution)index);
+        if (strlen(distribution_name) == length && strncmp(distribution_name, name, length) == 0) {
+            distribution = (KernelDistribution)index;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseOptions(int argc, char** argv, BenchmarkOptions& options) {
+    for (int index = 1; index < argc; index++) {
+        const char* option = argv[index];
+        // The number of values that follow the option
+        auto has_values = [&](int count) {
+            if (index + count >= argc) {
+                printf("Missing value for %s\n", option);
+                return false;
+            }
+            return true;
+        };
+
+        if (strcmp(option, "--help") == 0) {
+            PrintUsage();
+            exit(0);
+        }
+        else if (strcmp(option, "--kernels") == 0) {
+            options.kernels = true;
+        }
+        else if (strcmp(option, "--sorts") == 0) {
+            options.sorts = true;
+        }
+        else if (strcmp(option, "--compact-indices") == 0) {
+            options.compact_spatial_indices = true;
+        }
+        else if (strcmp(option, "--window") == 0) {
+            if (!has_values(2)) {
+                return false;
+            }
+            options.window_width = strtoull(argv[++index], nullptr, 10);
+            options.window_height = strtoull(argv[++index], nullptr, 10);
+        }
+        else {
+            if (strncmp(option, "--", 2) != 0) {
+                printf("Unknown option %s\n", option);
+                return false;
+            }
+            if (!has_values(1)) {
+                return false;
+            }
+
+            const char* value = argv[++index];
+            if (strcmp(option, "--scenes") == 0) {
+                options.scenes.clear();
+                while (*value != '\0') {
+                    const char* end = strchr(value, ',');
+                    size_t length = end != nullptr ? end - value : strlen(value);
+                    BenchmarkScene scene;
+                    if (!FindScene(value, length, scene)) {
+                        printf("Unknown scene %.*s\n", (int)length, value);
+                        return false;
+                    }
+                    options.scenes.push_back(scene);
+                    value += length + (end != nullptr ? 1 : 0);
+                }
+            }
+            else if (strcmp(option, "--distributions") == 0) {
+                options.distributions.clear();
+                while (*value != '\0') {
+                    const char* end = strchr(value, ',');
+                    size_t length = end != nullptr ? end - value : strlen(value);
+                    KernelDistribution distribution;
+                    if (!FindDistribution(value, length, distribution)) {
+                        printf("Unknown distribution %.*s\n", (int)length, value);
+                        return false;
+                    }
+                    options.distributions.push_back(distribution);
+                    value += length + (end != nullptr ? 1 : 0);
+                }
+            }
+            else if (strcmp(option, "--hash-load-factor") == 0) {
+                options.hash_load_factor = strtof(value, nullptr);
+            }
+            else if (strcmp(option, "--iterations") == 0) {
+                options.iteration_count = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--particles") == 0) {
+                options.particle_counts.clear();
+                char* end = nullptr;
+                do {
+                    options.particle_counts.push_back(strtoull(value, &end, 10));
+                    value = end + 1;
+                } while (*end == ',');
+            }
+            else if (strcmp(option, "--steps") == 0) {
+                options.step_count = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--warmup") == 0) {
+                options.warmup_step_count = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--dt") == 0) {
+                options.delta_time = strtof(value, nullptr);
+            }
+            else if (strcmp(option, "--sort") == 0) {
+                options.sort_mode = GetGPUSortModeFromName(value);
+                // The unknown names give the bitonic sort, which would be timed instead of the intended one
+                if (strcmp(GetGPUSortModeName(options.sort_mode), value) != 0) {
+                    printf("Unknown sort %s\n", value);
+                    return false;
+                }
+            }
+            else if (strcmp(option, "--neighbour-search") == 0) {
+                if (strcmp(value, "dense") == 0) {
+                    options.neighbour_search_mode = NeighbourSearchMode::DenseGrid;
+                }
+                else if (strcmp(value, "hash") == 0) {
+                    options.neighbour_search_mode = NeighbourSearchMode::SpatialHash;
+                }
+                else {
+                    printf("Unknown neighbour search %s\n", value);
+                    return false;
+                }
+            }
+            else if (strcmp(option, "--shader-cache") == 0) {
+                options.shader_cache_directory = strcmp(value, "off") == 0 ? nullptr : value;
+            }
+            else if (strcmp(option, "--output") == 0) {
+                options.output_path = value;
+            }
+            else if (strcmp(option, "--compare") == 0) {
+                options.baseline_path = value;
+            }
+            else if (strcmp(option, "--tolerance") == 0) {
+                options.tolerance = atof(value);
+            }
+            else {
+                printf("Unknown option %s\n", option);
+                return false;
+            }
+        }
+    }
+
+    if (options.scenes.size() == 0) {
+        for (size_t index = 0; index < (size_t)BenchmarkScene::Count; index++) {
+            options.scenes.push_back((BenchmarkScene)index);
+        }
+    }
+    if (options.distributions.size() == 0) {
+        for (size_t index = 0; index < (size_t)KernelDistribution::Count; index++) {
+            options.distributions.push_back((KernelDistribution)index);
+        }
+    }
+    if (options.kernels && options.sorts) {
+        printf("Only one of --kernels and --sorts can be used\n");
+        return false;
+    }
+    if (options.output_path == nullptr) {
+        if (options.kernels) {
+            options.output_path = "kernel_benchmark_results.json";
+        }
+        else if (options.sorts) {
+            options.output_path = "sort_benchmark_results.json";
+        }
+        else {
+            options.output_path = "benchmark_results.json";
+        }
+    }
+    if (options.particle_counts.size() == 0) {
+        if (options.sorts) {
+            // The powers of two of the sort button of the UI
+            options.particle_counts = { 16'384, 65'536, 262'144, 1'048'576, 4'194'304 };
+        }
+        else {
+            options.particle_counts = { 10'000, 50'000, 250'000, 1'000'000, 4'000'000 };
+        }
+    }
+    for (size_t index = 0; index < options.particle_counts.size(); index++) {
+        if (options.particle_counts[index] == 0) {
+            printf("The particle counts must not be 0\n");
+            return false;
+        }
+    }
+    if (options.step_count == 0 || options.iteration_count == 0 || options.window_width == 0 || options.window_height == 0) {
+        printf("The step count, the iteration count and the window size must not be 0\n");
+        return false;
+    }
+    if ((options.kernels || options.sorts) && options.baseline_path != nullptr) {
+        printf("Only the results of the scenes can be compared\n");
+        return false;
+    }
+    return true;
+}
+
+// Appends rows of particles from the start height, upwards or downwards, between the two horizontal bounds.
+// The odd rows are shifted by half of the spacing
+static void FillRows(std::vector<Float2>& positions, size_t count, float min_x, float max_x, float start_y, float direction, float spacing) {
+    size_t per_row_count = std::max((size_t)((max_x - min_x) / spacing), (size_t)1);
+    for (size_t index = 0; index < count; index++) {
+        size_t row = index / per_row_count;
+        size_t column = index % per_row_count;
+        float shift = (row % 2) * 0.5f;
+        positions.push_back({ min_x + ((float)column + 0.25f + shift) * spacing, start_y + direction * (float)row * spacing });
+    }
+}
+
+// The factor of the particle spacing and of the smoothing radius for the count
+static float GetSpacingScale(size_t particle_count) {
+    return sqrtf((float)BENCHMARK_REFERENCE_PARTICLES / (float)particle_count);
+}
+
+// Scales the settings for the particle count, and restores the state that the scenes change. The collision
+// Map is cleared. Returns the delta time
+static float SetupParticleCount(Simulation* simulation, size_t particle_count, const BenchmarkOptions& options, const SceneDefaults& defaults) {
+    float spacing_scale = GetSpacingScale(particle_count);
+    // The same step as the reference count, the smaller particles move over fewer smoothing radii
+    float delta_time = std::min(options.delta_time * spacing_scale, 0.007f);
+
+    simulation->SetInitialSettingsData();
+    GeneralSettings* settings = simulation->GetGeneralSettings();
+    // The densities count the particles, they grow with the inverse of the area of a particle, and the
+    // Viscosity sums over the neighbours. The pressure forces divide by the densities and stay the same
+    settings->smoothing_radius *= spacing_scale;
+    settings->target_density /= spacing_scale * spacing_scale;
+    settings->viscosity_strength *= spacing_scale * spacing_scale;
+    settings->neighbour_search_mode = options.neighbour_search_mode;
+    settings->hash_table_size = options.hash_load_factor > 0.0f ? Simulation::GetHashTableSize(particle_count, options.hash_load_factor) : 0;
+    simulation->GetGPUSort()->SetMode(options.sort_mode);
+    *simulation->GetCompactSpatialIndicesPtr() = options.compact_spatial_indices;
+    *simulation->GetParticleSpawnerPtr() = defaults.spawner;
+    *simulation->GetMaxParticleCountPtr() = std::max(defaults.max_particle_count, particle_count);
+    simulation->ReserveParticleCapacity(particle_count);
+
+    // The maze of a previous run is cleared
+    Int2 window_size((int)options.window_width, (int)options.window_height);
+    simulation->PaintCollision(Int2(window_size.x / 2, window_size.y / 2), window_size, false);
+    return delta_time;
+}
+
+// Replaces the particles, the collision map and the spawner with those of the scene. Returns the delta time
+static float SetupScene(
+    Simulation* simulation,
+    BenchmarkScene scene,
+    size_t particle_count,
+    const BenchmarkOptions& options,
+    const SceneDefaults& defaults
+) {
+    float delta_time = SetupParticleCount(simulation, particle_count, options, defaults);
+    float spacing_scale = GetSpacingScale(particle_count);
+    Int2 window_size((int)options.window_width, (int)options.window_height);
+    float half_width = POSITION_FACTOR * (float)options.window_width / (float)options.window_height;
+    float half_height = POSITION_FACTOR;
+    float spacing = BENCHMARK_PARTICLE_SPACING * spacing_scale;
+    std::vector<Float2> positions;
+    positions.reserve(particle_count);
+    switch (scene) {
+    case BenchmarkScene::Block:
+        positions = Simulation::GetInitialBlockPositions(particle_count, spacing_scale);
+        break;
+    case BenchmarkScene::DamBreak:
+        // A column of water against the left wall, over a third of the width
+        FillRows(positions, particle_count, -half_width, -half_width * 0.3f, -half_height + spacing, 1.0f, spacing);
+        break;
+    case BenchmarkScene::SpawnerFill:
+    {
+        // Half of the particles, or as many as the steps can spawn, come from the spawner into a pool
+        size_t step_count = options.warmup_step_count + options.step_count;
+        size_t spawn_count = std::min(particle_count / 2, step_count * BENCHMARK_SPAWN_COUNT);
+        size_t tick_count = spawn_count / BENCHMARK_SPAWN_COUNT;
+        spawn_count = tick_count * BENCHMARK_SPAWN_COUNT;
+        FillRows(positions, particle_count - spawn_count, -half_width, half_width, -half_height + spacing, 1.0f, spacing);
+
+        ParticleSpawner* spawner = simulation->GetParticleSpawnerPtr();
+        spawner->spawn_point = Float2(0.0f, half_height - 50.0f);
+        spawner->direction = Float2(0.0f, -1.0f);
+        spawner->initial_velocity = 50.0f;
+        spawner->spawn_count = BENCHMARK_SPAWN_COUNT;
+        spawner->last_spawn_delta = 0.0f;
+        if (tick_count > 0) {
+            // The spawns are spread over the steps, the ticks happen when the time goes over the delta
+            size_t tick_interval = step_count / tick_count;
+            spawner->spawn_delta = delta_time * ((float)tick_interval - 0.5f);
+        }
+        *simulation->GetMaxParticleCountPtr() = particle_count;
+        break;
+    }
+    case BenchmarkScene::Maze:
+    {
+        // Walls across three quarters of the width, open on alternating sides, below the particles
+        const float WALL_HEIGHTS[] = { 0.35f, 0.55f, 0.75f };
+        int wall_width = window_size.x * 3 / 4;
+        int wall_thickness = std::max(window_size.y / 60, 1);
+        for (size_t index = 0; index < std::size(WALL_HEIGHTS); index++) {
+            int center_x = index % 2 == 0 ? wall_width / 2 : window_size.x - wall_width / 2;
+            int center_y = (int)(WALL_HEIGHTS[index] * (float)window_size.y);
+            simulation->PaintCollision(Int2(center_x, center_y), Int2(wall_width, wall_thickness), true);
+        }
+        FillRows(positions, particle_count, -half_width, half_width, half_height - spacing, -1.0f, spacing);
+        break;
+    }
+    case BenchmarkScene::StirredTank:
+        FillRows(positions, particle_count, -half_width, half_width, -half_height + spacing, 1.0f, spacing);
+        break;
+    case BenchmarkScene::Count:
+        // The scenes come from the parsed names, Count is not a scene
+        assert(false);
+        break;
+    }
+    simulation->ReuploadCollisionData();
+    simulation->SetParticles(positions.size(), positions.data(), nullptr);
+    return delta_time;
+}
+
+// The mouse input of the scene for the step
+static void GetSceneInput(BenchmarkScene scene, size_t step_index, Float2& mouse_position, bool& is_left_mouse_pressed) {
+    mouse_position = Float2(0.0f, 0.0f);
+    is_left_mouse_pressed = false;
+    if (scene == BenchmarkScene::StirredTank) {
+        // The normalized position has y downwards, the circle goes through the lower part of the tank
+        float angle = 2.0f * 3.14159265f * (float)(step_index % BENCHMARK_STIR_PERIOD) / (float)BENCHMARK_STIR_PERIOD;
+        mouse_position = Float2(0.5f * cosf(angle), 0.75f + 0.15f * sinf(angle));
+        is_left_mouse_pressed = true;
+    }
+}
+
+static BenchmarkResult RunScene(Simulation* simulation, BenchmarkScene scene, size_t particle_count, const BenchmarkOptions& options, const SceneDefaults& defaults) {
+    BenchmarkResult result;
+    result.scene = SCENE_NAMES[(size_t)scene];
+    result.particle_count = particle_count;
+    result.step_count = options.step_count;
+    result.delta_time = SetupScene(simulation, scene, particle_count, options, defaults);
+    result.particle_steps = 0.0;
+
+    GPUProfiler* profiler = simulation->GetGPUProfiler();
+    auto do_step = [&](size_t step_index) {
+        Float2 mouse_position;
+        bool is_left_mouse_pressed;
+        GetSceneInput(scene, step_index, mouse_position, is_left_mouse_pressed);
+        profiler->BeginFrame();
+        simulation->DoFrame(mouse_position, is_left_mouse_pressed, false, result.delta_time);
+        profiler->EndFrame();
+    };
+
+    // The warmup compiles the variants of the count and lets the scene start moving
+    for (size_t index = 0; index < options.warmup_step_count; index++) {
+        do_step(index);
+    }
+    glFinish();
+    profiler->ResolvePendingFrames();
+    profiler->ResetStatistics();
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (size_t index = 0; index < options.step_count; index++) {
+        do_step(options.warmup_step_count + index);
+        result.particle_steps += (double)simulation->GetParticleCount();
+    }
+    // The dispatches are asynchronous, the time must include all of them
+    glFinish();
+    result.elapsed_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+    profiler->ResolvePendingFrames();
+    std::vector<GPUProfilerScopeStatistics> statistics = profiler->GetStatistics();
+    for (size_t index = 0; index < statistics.size(); index++) {
+        result.passes.push_back({ statistics[index].name, statistics[index].average });
+    }
+
+    std::vector<unsigned int> ids;
+    std::vector<Float2> positions;
+    std::vector<Float2> velocities;
+    simulation->RetrieveParticleState(ids, positions, velocities);
+    result.nan_count = 0;
+    for (size_t index = 0; index < positions.size(); index++) {
+        // NaN is the only value that is not equal to itself
+        if (positions[index].x != positions[index].x || positions[index].y != positions[index].y) {
+            result.nan_count++;
+        }
+    }
+    return result;
+}
+
+static KernelRun RunKernels(Simulation* simulation, KernelDistribution distribution, size_t particle_count, const BenchmarkOptions& options, const SceneDefaults& defaults) {
+    KernelRun run;
+    run.distribution = distribution;
+    float delta_time = SetupParticleCount(simulation, particle_count, options, defaults);
+    simulation->ReuploadCollisionData();
+
+    float half_width = POSITION_FACTOR * (float)options.window_width / (float)options.window_height;
+    float spacing = BENCHMARK_PARTICLE_SPACING * GetSpacingScale(particle_count);
+    std::vector<Float2> positions = GenerateKernelDistribution(distribution, particle_count, half_width, POSITION_FACTOR, spacing, BENCHMARK_KERNEL_SEED);
+    simulation->SetParticles(positions.size(), positions.data(), nullptr);
+    run.results = simulation->BenchmarkKernels(delta_time, options.iteration_count, run.stats);
+    return run;
+}
+
+static void PrintKernelRun(const KernelRun& run, size_t particle_count) {
+    double particles = (double)particle_count;
+    printf(
+        "%s %zu particles: %.1f walked and %.1f matched entries per particle, %zu of %zu keys used, longest key %zu\n",
+        GetKernelDistributionName(run.distribution),
+        particle_count,
+        run.stats.walked_entries / particles,
+        run.stats.matched_entries / particles,
+        run.stats.used_key_count,
+        run.stats.key_count,
+        run.stats.max_key_entries
+    );
+    if (!run.stats.is_dense_grid) {
+        printf(
+            "  Load factor %.2f, %.1f%% of the used keys collide, %.1f%% of the walked entries are of other cells\n",
+            run.stats.GetLoadFactor(),
+            run.stats.GetCollisionRate() * 100.0,
+            run.stats.GetForeignEntryRate() * 100.0
+        );
+    }
+    for (size_t index = 0; index < run.results.size(); index++) {
+        const KernelBenchmarkResult& result = run.results[index];
+        printf(
+            "  %-32s %9.4f ms (min %9.4f) %10.1f Mparticles/s %8.1f GB/s\n",
+            GetBenchmarkKernelName(result.kernel),
+            result.average_time,
+            result.min_time,
+            result.GetParticlesPerSecond() / 1'000'000.0,
+            result.GetGigabytesPerSecond()
+        );
+    }
+}
+
+// Each result is written on a single line, such that the baseline can be read back line by line
+static bool WriteResults(const char* path, const BenchmarkOptions& options, const std::vector<BenchmarkResult>& results) {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"renderer\": \"%s\",\n", (const char*)glGetString(GL_RENDERER));
+    fprintf(file, "  \"version\": \"%s\",\n", (const char*)glGetString(GL_VERSION));
+    fprintf(file, "  \"reference_particles\": %d,\n", BENCHMARK_REFERENCE_PARTICLES);
+    fprintf(file, "  \"warmup_steps\": %zu,\n", options.warmup_step_count);
+    fprintf(file, "  \"sort\": \"%s\",\n", GetGPUSortModeName(options.sort_mode));
+    fprintf(file, "  \"neighbour_search\": \"%s\",\n", options.neighbour_search_mode == NeighbourSearchMode::DenseGrid ? "dense" : "hash");
+    fprintf(file, "  \"compact_indices\": %s,\n", options.compact_spatial_indices ? "true" : "false");
+    fprintf(file, "  \"hash_load_factor\": %g,\n", options.hash_load_factor);
+    fprintf(file, "  \"results\": [\n");
+    for (size_t index = 0; index < results.size(); index++) {
+        const BenchmarkResult& result = results[index];
+        fprintf(
+            file,
+            "    { \"scene\": \"%s\", \"particles\": %zu, \"steps\": %zu, \"delta_time\": %.6f, \"elapsed_seconds\": %.6f, "
+            "\"steps_per_second\": %.3f, \"ns_per_particle_step\": %.4f, \"nan_count\": %zu, \"passes\": {",
+            result.scene.c_str(),
+            result.particle_count,
+            result.step_count,
+            result.delta_time,
+            result.elapsed_seconds,
+            result.GetStepsPerSecond(),
+            result.GetNanosecondsPerParticleStep(),
+            result.nan_count
+        );
+        for (size_t pass_index = 0; pass_index < result.passes.size(); pass_index++) {
+            fprintf(file, "%s\"%s\": %.4f", pass_index > 0 ? ", " : " ", result.passes[pass_index].name.c_str(), result.passes[pass_index].milliseconds);
+        }
+        fprintf(file, " } }%s\n", index + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+// A line for each kernel of each run, like the results of the scenes
+static bool WriteKernelResults(const char* path, const BenchmarkOptions& options, const std::vector<KernelRun>& runs) {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"renderer\": \"%s\",\n", (const char*)glGetString(GL_RENDERER));
+    fprintf(file, "  \"version\": \"%s\",\n", (const char*)glGetString(GL_VERSION));
+    fprintf(file, "  \"reference_particles\": %d,\n", BENCHMARK_REFERENCE_PARTICLES);
+    fprintf(file, "  \"iterations\": %zu,\n", options.iteration_count);
+    fprintf(file, "  \"neighbour_search\": \"%s\",\n", options.neighbour_search_mode == NeighbourSearchMode::DenseGrid ? "dense" : "hash");
+    fprintf(file, "  \"compact_indices\": %s,\n", options.compact_spatial_indices ? "true" : "false");
+    fprintf(file, "  \"hash_load_factor\": %g,\n", options.hash_load_factor);
+    fprintf(file, "  \"results\": [\n");
+    bool is_first = true;
+    for (size_t run_index = 0; run_index < runs.size(); run_index++) {
+        const KernelRun& run = runs[run_index];
+        for (size_t index = 0; index < run.results.size(); index++) {
+            const KernelBenchmarkResult& result = run.results[index];
+            double particles = (double)result.particle_count;
+            fprintf(
+                file,
+                "%s    { \"distribution\": \"%s\", \"particles\": %zu, \"kernel\": \"%s\", \"average_ms\": %.4f, \"min_ms\": %.4f, "
+                "\"particles_per_second\": %.0f, \"bytes\": %.0f, \"gb_per_second\": %.3f, \"walked_per_particle\": %.3f, "
+                "\"matched_per_particle\": %.3f, \"foreign_per_particle\": %.3f, \"keys\": %zu, \"used_keys\": %zu, "
+                "\"collided_keys\": %zu, \"max_key_entries\": %zu }",
+                is_first ? "" : ",\n",
+                GetKernelDistributionName(run.distribution),
+                result.particle_count,
+                GetBenchmarkKernelName(result.kernel),
+                result.average_time,
+                result.min_time,
+                result.GetParticlesPerSecond(),
+                result.bytes,
+                result.GetGigabytesPerSecond(),
+                run.stats.walked_entries / particles,
+                run.stats.matched_entries / particles,
+                run.stats.foreign_entries / particles,
+                run.stats.key_count,
+                run.stats.used_key_count,
+                run.stats.collided_key_count,
+                run.stats.max_key_entries
+            );
+            is_first = false;
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+// A line for each sort mode of each entry count
+static bool WriteSortResults(const char* path, const BenchmarkOptions& options, const std::vector<SortBenchmarkResult>& results) {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"renderer\": \"%s\",\n", (const char*)glGetString(GL_RENDERER));
+    fprintf(file, "  \"version\": \"%s\",\n", (const char*)glGetString(GL_VERSION));
+    fprintf(file, "  \"iterations\": %zu,\n", options.iteration_count);
+    fprintf(file, "  \"compact_indices\": %s,\n", options.compact_spatial_indices ? "true" : "false");
+    fprintf(file, "  \"results\": [\n");
+    bool is_first = true;
+    for (size_t index = 0; index < results.size(); index++) {
+        const SortBenchmarkResult& result = results[index];
+        auto write_mode = [&](const char* mode, double time, double wall_time, bool is_valid) {
+            fprintf(
+                file,
+                "%s    { \"entries\": %zu, \"mode\": \"%s\", \"average_ms\": %.4f, \"wall_ms\": %.4f, \"valid\": %s }",
+                is_first ? "" : ",\n",
+                result.entry_count,
+                mode,
+                time,
+                wall_time,
+                is_valid ? "true" : "false"
+            );
+            is_first = false;
+        };
+        write_mode("bitonic", result.bitonic_time, result.bitonic_wall_time, result.bitonic_valid);
+        write_mode("counting", result.counting_time, result.counting_wall_time, result.counting_valid);
+        write_mode("incremental", result.incremental_time, result.incremental_wall_time, result.incremental_valid);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+// Reads the number after "key": on the line
+static bool ReadNumber(const char* line, const char* key, double& value) {
+    std::string pattern = std::string("\"") + key + "\": ";
+    const char* position = strstr(line, pattern.c_str());
+    if (position == nullptr) {
+        return false;
+    }
+    value = strtod(position + pattern.size(), nullptr);
+    return true;
+}
+
+static bool ReadResults(const char* path, std::vector<BenchmarkResult>& results) {
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        return false;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        char scene[64];
+        const char* scene_start = strstr(line, "\"scene\": \"");
+        if (scene_start == nullptr || sscanf(scene_start, "\"scene\": \"%63[^\"]\"", scene) != 1) {
+            continue;
+        }
+
+        BenchmarkResult result = {};
+        result.scene = scene;
+        double particle_count = 0.0;
+        double nanoseconds = 0.0;
+        if (!ReadNumber(line, "particles", particle_count) || !ReadNumber(line, "ns_per_particle_step", nanoseconds)) {
+            continue;
+        }
+        result.particle_count = (size_t)particle_count;
+        // Only the ratio of the two is compared
+        result.elapsed_seconds = nanoseconds * 1e-9;
+        result.particle_steps = 1.0;
+
+        const char* pass = strstr(line, "\"passes\": {");
+        if (pass != nullptr) {
+            pass += strlen("\"passes\": {");
+            char name[128];
+            double milliseconds;
+            int read_count = 0;
+            while (sscanf(pass, " \"%127[^\"]\": %lf%n", name, &milliseconds, &read_count) == 2) {
+                result.passes.push_back({ name, milliseconds });
+                pass += read_count;
+                if (*pass == ',') {
+                    pass++;
+                }
+            }
+        }
+        results.push_back(result);
+    }
+    fclose(file);
+    return true;
+}
+
+// Prints the runs and the passes that are slower than the baseline allows. Returns the number of regressions
+static size_t CompareResults(const std::vector<BenchmarkResult>& results, const std::vector<BenchmarkResult>& baseline, double tolerance) {
+    size_t regression_count = 0;
+    auto compare = [&](const char* name, const char* unit, double value, double baseline_value) {
+        double change = baseline_value > 0.0 ? value / baseline_value - 1.0 : 0.0;
+        bool is_regression = change > tolerance;
+        printf("  %-28s %10.4f %s, baseline %10.4f (%+.1f%%)%s\n", name, value, unit, baseline_value, change * 100.0, is_regression ? " REGRESSION" : "");
+        regression_count += is_regression ? 1 : 0;
+    };
+
+    for (size_t index = 0; index < results.size(); index++) {
+        const BenchmarkResult& result = results[index];
+        const BenchmarkResult* baseline_result = nullptr;
+        for (size_t baseline_index = 0; baseline_index < baseline.size() && baseline_result == nullptr; baseline_index++) {
+            if (baseline[baseline_index].scene == result.scene && baseline[baseline_index].particle_count == result.particle_count) {
+                baseline_result = &baseline[baseline_index];
+            }
+        }
+        if (baseline_result == nullptr) {
+            printf("%s %zu: not in the baseline\n", result.scene.c_str(), result.particle_count);
+            continue;
+        }
+
+        printf("%s %zu:\n", result.scene.c_str(), result.particle_count);
+        compare("Particle step", "ns", result.GetNanosecondsPerParticleStep(), baseline_result->GetNanosecondsPerParticleStep());
+        for (size_t pass_index = 0; pass_index < result.passes.size(); pass_index++) {
+            const BenchmarkPass& pass = result.passes[pass_index];
+            for (size_t baseline_pass_index = 0; baseline_pass_index < baseline_result->passes.size(); baseline_pass_index++) {
+                const BenchmarkPass& baseline_pass = baseline_result->passes[baseline_pass_index];
+                if (baseline_pass.name == pass.name && baseline_pass.milliseconds >= BENCHMARK_MIN_COMPARED_MS) {
+                    compare(pass.name.c_str(), "ms", pass.milliseconds, baseline_pass.milliseconds);
+                }
+            }
+        }
+    }
+    return regression_count;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return 2;
+    }
+
+    std::vector<BenchmarkResult> baseline;
+    if (options.baseline_path != nullptr && !ReadResults(options.baseline_path, baseline)) {
+        printf("Failed to read the baseline %s\n", options.baseline_path);
+        return 1;
+    }
+
+    if (!CreateHeadlessContext()) {
+        printf("Failed to create an OpenGL 4.3 context\n");
+        return 1;
+    }
+
+    ShaderCache::SetDirectory(options.shader_cache_directory);
+    // The simulation is large, keep it off the stack. The same one is used for all the runs, such that
+    // The programs are compiled once
+    Simulation* simulation = new Simulation();
+    simulation->Initialize();
+    simulation->SetWindowSize(options.window_width, options.window_height);
+    simulation->GetGPUProfiler()->SetEnabled(true);
+    SceneDefaults defaults;
+    defaults.spawner = *simulation->GetParticleSpawnerPtr();
+    defaults.max_particle_count = *simulation->GetMaxParticleCountPtr();
+
+    if (options.kernels) {
+        std::vector<KernelRun> runs;
+        for (size_t distribution_index = 0; distribution_index < options.distributions.size(); distribution_index++) {
+            for (size_t count_index = 0; count_index < options.particle_counts.size(); count_index++) {
+                size_t particle_count = options.particle_counts[count_index];
+                KernelRun run = RunKernels(simulation, options.distributions[distribution_index], particle_count, options, defaults);
+                PrintKernelRun(run, particle_count);
+                runs.push_back(run);
+            }
+        }
+        if (!WriteKernelResults(options.output_path, options, runs)) {
+            printf("Failed to write the results file %s\n", options.output_path);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (options.sorts) {
+        GPUSort* gpu_sort = simulation->GetGPUSort();
+        gpu_sort->SetCompactEntries(options.compact_spatial_indices);
+        std::vector<SortBenchmarkResult> results = BenchmarkGPUSort(*gpu_sort, options.particle_counts.data(), options.particle_counts.size(), options.iteration_count);
+        PrintSortBenchmark(results);
+        if (!WriteSortResults(options.output_path, options, results)) {
+            printf("Failed to write the results file %s\n", options.output_path);
+            return 1;
+        }
+        for (size_t index = 0; index < results.size(); index++) {
+            if (!results[index].bitonic_valid || !results[index].counting_valid || !results[index].incremental_valid) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    std::vector<BenchmarkResult> results;
+    for (size_t scene_index = 0; scene_index < options.scenes.size(); scene_index++) {
+        for (size_t count_index = 0; count_index < options.particle_counts.size(); count_index++) {
+            BenchmarkResult result = RunScene(simulation, options.scenes[scene_index], options.particle_counts[count_index], options, defaults);
+            printf(
+                "%-14s %9zu particles: %9.2f steps/s, %8.3f ns per particle step%s\n",
+                result.scene.c_str(),
+                result.particle_count,
+                result.GetStepsPerSecond(),
+                result.GetNanosecondsPerParticleStep(),
+                result.nan_count > 0 ? ", NaN positions" : ""
+            );
+            results.push_back(result);
+        }
+    }
+
+    if (!WriteResults(options.output_path, options, results)) {
+        printf("Failed to write the results file %s\n", options.output_path);
+        return 1;
+    }
+
+    if (options.baseline_path != nullptr) {
+        size_t regression_count = CompareResults(results, baseline, options.tolerance);
+        printf("%zu regressions against %s with a tolerance of %.0f%%\n", regression_count, options.baseline_path, options.tolerance * 100.0);
+        if (regression_count > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -12,14 +12,33 @@ FluidSimulatorWindow::FluidSimulatorWindow()
         abort();
     }
     simulation.Initialize();
+    barrier_statistics = { 0, 0 };
+    upload_statistics = { 0, 0, 0 };
+    has_frame_start = false;
 }
 
 void FluidSimulatorWindow::Draw(bool is_left_mouse_pressed, bool is_right_mouse_pressed, ImGuiIO& io)
 {
     Float2 mouse_pos = { ImGui::GetMousePos().x , ImGui::GetMousePos().y };
     Float2 normalized_mouse_pos = { mouse_pos.x / width * 2.0f - 1.0f, mouse_pos.y / height * 2.0f - 1.0f };
+    auto frame_start = std::chrono::steady_clock::now();
+    if (has_frame_start) {
+        frame_time_stats.frame_times.Add(std::chrono::duration<float, std::milli>(frame_start - last_frame_start).count());
+    }
+    last_frame_start = frame_start;
+    has_frame_start = true;
+
+    GPUProfiler* gpu_profiler = simulation.GetGPUProfiler();
+    GPUBarriers::ResetStatistics();
+    GPUUploadRing::ResetStatistics();
+    gpu_profiler->BeginFrame();
+    auto step_start = std::chrono::steady_clock::now();
     simulation.DoFrame(normalized_mouse_pos, is_left_mouse_pressed, is_right_mouse_pressed, io.DeltaTime);
+    frame_time_stats.step_times.Add(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - step_start).count());
     simulation.Render();
+    gpu_profiler->EndFrame();
+    barrier_statistics = GPUBarriers::GetStatistics();
+    upload_statistics = GPUUploadRing::GetStatistics();
 }
 
 void FluidSimulatorWindow::SetWindowDimensions(size_t _width, size_t _height)
@@ -2,6 +2,8 @@
 #include "imgui.h"
 #include "particle.h"
 #include "GPU/Simulation.h"
+#include "GPU/FrameTimeStats.h"
+#include <chrono>
 
 class FluidSimulatorWindow {
 public:
@@ -15,4 +17,11 @@ public:
     Simulation simulation;
     size_t width;
     size_t height;
+    // The barriers of the last frame
+    GPUBarrierStatistics barrier_statistics;
+    // The uploads of the last frame
+    GPUUploadStatistics upload_statistics;
+    FrameTimeStats frame_time_stats;
+    std::chrono::steady_clock::time_point last_frame_start;
+    bool has_frame_start;
 };
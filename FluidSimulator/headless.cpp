@@ -0,0 +1,628 @@
+// Runs the simulation without a window or ImGui, for a fixed number of steps with a fixed delta time.
+// The throughput is written as JSON and the final particle state as CSV, such that the batch and
+// Regression runs can compare them
+
+#include "GPU/glad.h"
+#include "GPU/Simulation.h"
+#include "GPU/EmbeddedShaders.h"
+#include "GPU/FrameTimeStats.h"
+#include "GPU/Trace.h"
+#include "GPU/HeadlessContext.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+
+struct HeadlessOptions {
+    size_t particle_count = 25'000;
+    size_t particle_capacity = 0;
+    size_t step_count = 1'000;
+    float delta_time = 0.007f;
+    size_t window_width = 2500;
+    size_t window_height = 1200;
+    SimulationBackend backend = SimulationBackend::GPU;
+    GPUSortMode sort_mode = GPUSortMode::Bitonic;
+    NeighbourSearchMode neighbour_search_mode = NeighbourSearchMode::SpatialHash;
+    int neighbour_list_capacity = 0;
+    bool compact_spatial_indices = false;
+    // 0 uses a key for each particle. The load factor sizes the table for the particle count
+    unsigned int hash_table_size = 0;
+    float hash_load_factor = 0.0f;
+    bool hash_stats = false;
+    unsigned int reorder_interval = 0;
+    int max_substep_count = 0;
+    float cfl_factor = 0.4f;
+    // The steps for which each candidate group size is timed, 0 doesn't run the autotuner
+    size_t autotune_step_count = 0;
+    bool profile = false;
+    const char* collision_map_path = nullptr;
+    const char* load_snapshot_path = nullptr;
+    const char* save_snapshot_path = nullptr;
+    float autosave_interval = 0.0f;
+    const char* trajectory_path = nullptr;
+    const char* trace_path = nullptr;
+    float trajectory_error_bound = TRAJECTORY_DEFAULT_ERROR_BOUND;
+    // nullptr disables the program binary cache
+    const char* shader_cache_directory = SHADER_CACHE_DEFAULT_DIRECTORY;
+    const char* stats_path = "headless_stats.json";
+    const char* state_path = "headless_state.csv";
+    // The values of the general settings given by name, applied over the defaults in order
+    std::vector<std::pair<std::string, float>> settings;
+};
+
+struct NamedSetting {
+    const char* name;
+    size_t offset;
+};
+
+// The general settings that can be given by name, on the command line or in a settings file
+static const NamedSetting NAMED_SETTINGS[] = {
+    { "gravity", offsetof(GeneralSettings, gravity) },
+    { "collision_damping", offsetof(GeneralSettings, collision_damping) },
+    { "smoothing_radius", offsetof(GeneralSettings, smoothing_radius) },
+    { "target_density", offsetof(GeneralSettings, target_density) },
+    { "pressure_multiplier", offsetof(GeneralSettings, pressure_multiplier) },
+    { "near_pressure_multiplier", offsetof(GeneralSettings, near_pressure_multiplier) },
+    { "viscosity_strength", offsetof(GeneralSettings, viscosity_strength) }
+};
+
+static const NamedSetting* FindNamedSetting(const char* name) {
+    for (size_t index = 0; index < std::size(NAMED_SETTINGS); index++) {
+        if (strcmp(NAMED_SETTINGS[index].name, name) == 0) {
+            return &NAMED_SETTINGS[index];
+        }
+    }
+    return nullptr;
+}
+
+static void PrintUsage() {
+    printf(
+        "Usage: headless [options]\n"
+        "  --particles N              Particle count (default 25000)\n"
+        "  --capacity N               Particles that fit without reallocating (at least 32500)\n"
+        "  --steps N                  Step count (default 1000)\n"
+        "  --dt SECONDS               Delta time of each step, at most 0.007 without\n"
+        "                             --adaptive and 1/30 with it (default 0.007)\n"
+        "  --window W H               Window size in pixels, which sets the domain (default 2500 1200)\n"
+        "  --backend gpu|cpu\n"
+        "  --sort bitonic|counting|incremental\n"
+        "  --neighbour-search hash|dense\n"
+        "  --neighbour-lists CAPACITY Enables the neighbour lists (default 0, disabled)\n"
+        "  --compact-indices          Sorts 8 byte spatial indices, without the hash of the cell\n"
+        "  --hash-table-size N        The keys of the spatial hash, rounded up to a power of two\n"
+        "                             (default 0, as many keys as particles)\n"
+        "  --hash-load-factor F       Sizes the spatial hash table for at most F particles for each key\n"
+        "  --hash-stats               Adds the key collisions of the spatial hash to the stats\n"
+        "  --reorder-interval N       Reorders the particles into cell order every N steps\n"
+        "  --adaptive MAX_SUBSTEPS    Splits each step into up to this many CFL substeps\n"
+        "  --cfl FACTOR               The CFL factor of the adaptive substeps (default 0.4)\n"
+        "  --collision-map IMAGE      The bright pixels of the image are collisions\n"
+        "  --load-snapshot FILE       Starts from the snapshot, its settings come before the options\n"
+        "  --save-snapshot FILE       Writes a snapshot after the last step\n"
+        "  --autosave SECONDS         Writes autosave.snap every this many seconds\n"
+        "  --trajectory FILE          Writes the positions of every step, compressed\n"
+        "  --trajectory-error BOUND   The largest trajectory position error, relative to\n"
+        "                             the domain half height (default 0.0001)\n"
+        "  --trace FILE               Writes a Chrome trace of the steps, with the GPU passes on their own track\n"
+        "  --shader-cache DIR|off     The directory of the compiled programs (default shader_cache)\n"
+        "  --autotune STEPS           Times the kernels at each workgroup size for this many steps before\n"
+        "                             the run, and saves the fastest ones to " WORKGROUP_SIZES_FILE "\n"
+        "  --settings FILE            A \"name value\" pair on each line, # starts a comment\n"
+        "  --NAME VALUE               Sets a general setting, with NAME one of:\n"
+    );
+    for (size_t index = 0; index < std::size(NAMED_SETTINGS); index++) {
+        printf("                               %s\n", NAMED_SETTINGS[index].name);
+    }
+    printf(
+        "  --profile                  Adds the GPU profiler pass times to the stats\n"
+        "  --stats FILE               Throughput stats (default headless_stats.json)\n"
+        "  --state FILE               Final particle state (default headless_state.csv)\n"
+    );
+}
+
+static bool ReadSettingsFile(const char* path, HeadlessOptions& options) {
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        printf("Failed to open the settings file %s\n", path);
+        return false;
+    }
+
+    char line[512];
+    size_t line_index = 0;
+    bool success = true;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        line_index++;
+        char* comment = strchr(line, '#');
+        if (comment != nullptr) {
+            *comment = '\0';
+        }
+
+        char name[256];
+        float value;
+        int match_count = sscanf(line, "%255s %f", name, &value);
+        if (match_count <= 0) {
+            // Empty line
+            continue;
+        }
+        if (match_count != 2 || FindNamedSetting(name) == nullptr) {
+            printf("Invalid setting in %s at line %zu\n", path, line_index);
+            success = false;
+            break;
+        }
+        options.settings.push_back({ name, value });
+    }
+    fclose(file);
+    return success;
+}
+
+static bool ParseOptions(int argc, char** argv, HeadlessOptions& options) {
+    for (int index = 1; index < argc; index++) {
+        const char* option = argv[index];
+        // The number of values that follow the option
+        auto has_values = [&](int count) {
+            if (index + count >= argc) {
+                printf("Missing value for %s\n", option);
+                return false;
+            }
+            return true;
+        };
+
+        if (strcmp(option, "--help") == 0) {
+            PrintUsage();
+            exit(0);
+        }
+        else if (strcmp(option, "--profile") == 0) {
+            options.profile = true;
+        }
+        else if (strcmp(option, "--compact-indices") == 0) {
+            options.compact_spatial_indices = true;
+        }
+        else if (strcmp(option, "--hash-stats") == 0) {
+            options.hash_stats = true;
+        }
+        else if (strcmp(option, "--window") == 0) {
+            if (!has_values(2)) {
+                return false;
+            }
+            options.window_width = strtoull(argv[++index], nullptr, 10);
+            options.window_height = strtoull(argv[++index], nullptr, 10);
+        }
+        else {
+            if (strncmp(option, "--", 2) != 0) {
+                printf("Unknown option %s\n", option);
+                return false;
+            }
+            if (!has_values(1)) {
+                return false;
+            }
+
+            const char* value = argv[++index];
+            if (strcmp(option, "--particles") == 0) {
+                options.particle_count = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--capacity") == 0) {
+                options.particle_capacity = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--steps") == 0) {
+                options.step_count = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--dt") == 0) {
+                options.delta_time = strtof(value, nullptr);
+            }
+            else if (strcmp(option, "--backend") == 0) {
+                if (strcmp(value, "cpu") == 0) {
+                    options.backend = SimulationBackend::CPU;
+                }
+                else if (strcmp(value, "gpu") == 0) {
+                    options.backend = SimulationBackend::GPU;
+                }
+                else {
+                    printf("Unknown backend %s\n", value);
+                    return false;
+                }
+            }
+            else if (strcmp(option, "--sort") == 0) {
+                options.sort_mode = GetGPUSortModeFromName(value);
+                // The unknown names give the bitonic sort, which would run instead of the intended one
+                if (strcmp(GetGPUSortModeName(options.sort_mode), value) != 0) {
+                    printf("Unknown sort %s\n", value);
+                    return false;
+                }
+            }
+            else if (strcmp(option, "--neighbour-search") == 0) {
+                if (strcmp(value, "dense") == 0) {
+                    options.neighbour_search_mode = NeighbourSearchMode::DenseGrid;
+                }
+                else if (strcmp(value, "hash") == 0) {
+                    options.neighbour_search_mode = NeighbourSearchMode::SpatialHash;
+                }
+                else {
+                    printf("Unknown neighbour search %s\n", value);
+                    return false;
+                }
+            }
+            else if (strcmp(option, "--neighbour-lists") == 0) {
+                options.neighbour_list_capacity = atoi(value);
+            }
+            else if (strcmp(option, "--hash-table-size") == 0) {
+                options.hash_table_size = strtoul(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--hash-load-factor") == 0) {
+                options.hash_load_factor = strtof(value, nullptr);
+            }
+            else if (strcmp(option, "--reorder-interval") == 0) {
+                options.reorder_interval = strtoul(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--adaptive") == 0) {
+                options.max_substep_count = atoi(value);
+            }
+            else if (strcmp(option, "--cfl") == 0) {
+                options.cfl_factor = (float)atof(value);
+            }
+            else if (strcmp(option, "--collision-map") == 0) {
+                options.collision_map_path = value;
+            }
+            else if (strcmp(option, "--load-snapshot") == 0) {
+                options.load_snapshot_path = value;
+            }
+            else if (strcmp(option, "--save-snapshot") == 0) {
+                options.save_snapshot_path = value;
+            }
+            else if (strcmp(option, "--autosave") == 0) {
+                options.autosave_interval = (float)atof(value);
+            }
+            else if (strcmp(option, "--trajectory") == 0) {
+                options.trajectory_path = value;
+            }
+            else if (strcmp(option, "--trace") == 0) {
+                options.trace_path = value;
+            }
+            else if (strcmp(option, "--trajectory-error") == 0) {
+                options.trajectory_error_bound = (float)atof(value);
+            }
+            else if (strcmp(option, "--settings") == 0) {
+                if (!ReadSettingsFile(value, options)) {
+                    return false;
+                }
+            }
+            else if (strcmp(option, "--autotune") == 0) {
+                options.autotune_step_count = strtoull(value, nullptr, 10);
+            }
+            else if (strcmp(option, "--shader-cache") == 0) {
+                options.shader_cache_directory = strcmp(value, "off") == 0 ? nullptr : value;
+            }
+            else if (strcmp(option, "--stats") == 0) {
+                options.stats_path = value;
+            }
+            else if (strcmp(option, "--state") == 0) {
+                options.state_path = value;
+            }
+            else if (FindNamedSetting(option + 2) != nullptr) {
+                options.settings.push_back({ option + 2, strtof(value, nullptr) });
+            }
+            else {
+                printf("Unknown option %s\n", option);
+                return false;
+            }
+        }
+    }
+
+    if (options.particle_count == 0 || options.window_width == 0 || options.window_height == 0) {
+        printf("The particle count and the window size must not be 0\n");
+        return false;
+    }
+    return true;
+}
+
+static bool WriteStats(
+    const char* path,
+    const HeadlessOptions& options,
+    double startup_seconds,
+    double elapsed_seconds,
+    size_t substep_count,
+    size_t nan_count,
+    Float2 mean_position,
+    const FrameTimeSeries& step_times,
+    GPUProfiler* profiler,
+    const NeighbourSearchStats& hash_stats,
+    const GPUSortIncrementalStats& sort_stats
+) {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"particles\": %zu,\n", options.particle_count);
+    fprintf(file, "  \"steps\": %zu,\n", options.step_count);
+    fprintf(file, "  \"delta_time\": %g,\n", options.delta_time);
+    fprintf(file, "  \"backend\": \"%s\",\n", options.backend == SimulationBackend::CPU ? "cpu" : "gpu");
+    fprintf(file, "  \"sort\": \"%s\",\n", GetGPUSortModeName(options.sort_mode));
+    ShaderCacheStatistics shader_cache = ShaderCache::GetStatistics();
+    fprintf(file, "  \"startup_seconds\": %.6f,\n", startup_seconds);
+    fprintf(file, "  \"embedded_shaders\": %zu,\n", GetEmbeddedShaderCount());
+    fprintf(file, "  \"cached_programs\": %zu,\n", shader_cache.hit_count);
+    fprintf(file, "  \"compiled_programs\": %zu,\n", shader_cache.miss_count);
+    fprintf(file, "  \"elapsed_seconds\": %.6f,\n", elapsed_seconds);
+    fprintf(file, "  \"steps_per_second\": %.3f,\n", (double)options.step_count / elapsed_seconds);
+    fprintf(file, "  \"particle_steps_per_second\": %.1f,\n", (double)options.step_count * (double)options.particle_count / elapsed_seconds);
+    fprintf(file, "  \"milliseconds_per_step\": %.4f,\n", elapsed_seconds * 1000.0 / (double)options.step_count);
+    fprintf(file, "  \"substeps\": %zu,\n", substep_count);
+    fprintf(file, "  \"nan_count\": %zu,\n", nan_count);
+    fprintf(file, "  \"mean_position\": [%.6f, %.6f],\n", mean_position.x, mean_position.y);
+    // The CPU time of each step, the dispatches are not waited for
+    fprintf(file, "  \"step_times\": ");
+    step_times.WriteJSON(file, "  ");
+    if (options.profile) {
+        std::vector<GPUProfilerScopeStatistics> statistics = profiler->GetStatistics();
+        fprintf(file, ",\n  \"passes\": [\n");
+        for (size_t index = 0; index < statistics.size(); index++) {
+            const GPUProfilerScopeStatistics& scope = statistics[index];
+            fprintf(
+                file,
+                "    { \"name\": \"%s\", \"depth\": %u, \"average_ms\": %.4f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, \"samples\": %zu }%s\n",
+                scope.name,
+                scope.depth,
+                scope.average,
+                scope.p50,
+                scope.p95,
+                scope.p99,
+                scope.sample_count,
+                index + 1 < statistics.size() ? "," : ""
+            );
+        }
+        fprintf(file, "  ]");
+    }
+    if (options.hash_stats) {
+        // The keys of a step near the end, the readbacks of the last steps have not finished
+        fprintf(file, ",\n  \"hash_table\": {\n");
+        fprintf(file, "    \"keys\": %zu,\n", hash_stats.key_count);
+        fprintf(file, "    \"load_factor\": %.4f,\n", hash_stats.GetLoadFactor());
+        fprintf(file, "    \"used_keys\": %zu,\n", hash_stats.used_key_count);
+        fprintf(file, "    \"collided_keys\": %zu,\n", hash_stats.collided_key_count);
+        fprintf(file, "    \"collision_rate\": %.6f,\n", hash_stats.GetCollisionRate());
+        fprintf(file, "    \"foreign_entry_rate\": %.6f,\n", hash_stats.GetForeignEntryRate());
+        fprintf(file, "    \"max_key_entries\": %zu,\n", hash_stats.max_key_entries);
+        fprintf(file, "    \"key_length_histogram\": [");
+        for (size_t index = 0; index < KEY_LENGTH_HISTOGRAM_SIZE; index++) {
+            fprintf(file, "%s%zu", index > 0 ? ", " : "", hash_stats.key_length_histogram[index]);
+        }
+        fprintf(file, "]\n  }");
+    }
+    // The last changed count that was read back, a few steps before the end
+    if (options.sort_mode == GPUSortMode::Incremental && sort_stats.entry_count > 0) {
+        fprintf(file, ",\n  \"incremental_sort\": {\n");
+        fprintf(file, "    \"entries\": %zu,\n", sort_stats.entry_count);
+        fprintf(file, "    \"changed_entries\": %zu,\n", sort_stats.changed_count);
+        fprintf(file, "    \"capacity\": %zu,\n", sort_stats.capacity);
+        fprintf(file, "    \"fell_back\": %s\n  }", sort_stats.fell_back ? "true" : "false");
+    }
+    fprintf(file, "\n}\n");
+    fclose(file);
+    return true;
+}
+
+// The particles are written in the order of their ids, such that reordered runs can be compared
+static bool WriteState(const char* path, const Simulation& simulation, size_t& nan_count, Float2& mean_position) {
+    std::vector<unsigned int> ids;
+    std::vector<Float2> positions;
+    std::vector<Float2> velocities;
+    simulation.RetrieveParticleState(ids, positions, velocities);
+
+    std::vector<size_t> order(ids.size());
+    for (size_t index = 0; index < order.size(); index++) {
+        order[index] = index;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t left, size_t right) {
+        return ids[left] < ids[right];
+    });
+
+    nan_count = 0;
+    double sum_x = 0.0;
+    double sum_y = 0.0;
+    for (size_t index = 0; index < positions.size(); index++) {
+        // NaN is the only value that is not equal to itself
+        if (positions[index].x != positions[index].x || positions[index].y != positions[index].y) {
+            nan_count++;
+        }
+        else {
+            sum_x += positions[index].x;
+            sum_y += positions[index].y;
+        }
+    }
+    size_t valid_count = positions.size() - nan_count;
+    mean_position = valid_count > 0 ? Float2(sum_x / valid_count, sum_y / valid_count) : Float2(0.0f, 0.0f);
+
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+    fprintf(file, "id,position_x,position_y,velocity_x,velocity_y\n");
+    for (size_t index = 0; index < order.size(); index++) {
+        size_t particle = order[index];
+        fprintf(
+            file,
+            "%u,%.6f,%.6f,%.6f,%.6f\n",
+            ids[particle],
+            positions[particle].x,
+            positions[particle].y,
+            velocities[particle].x,
+            velocities[particle].y
+        );
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    // The startup includes the context, the shader compiles and the first step
+    auto process_start_time = std::chrono::high_resolution_clock::now();
+    HeadlessOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return 2;
+    }
+
+    if (!CreateHeadlessContext()) {
+        printf("Failed to create an OpenGL 4.3 context\n");
+        return 1;
+    }
+
+    ShaderCache::SetDirectory(options.shader_cache_directory);
+    // The simulation is large, keep it off the stack
+    Simulation* simulation = new Simulation();
+    simulation->Initialize();
+    simulation->SetWindowSize(options.window_width, options.window_height);
+    if (options.collision_map_path != nullptr && !simulation->LoadCollisionMap(options.collision_map_path)) {
+        return 1;
+    }
+
+    simulation->ReserveParticleCapacity(options.particle_capacity);
+    simulation->ChangeParticleCount(options.particle_count);
+    simulation->Reset();
+    if (options.load_snapshot_path != nullptr) {
+        if (!simulation->LoadSnapshot(options.load_snapshot_path)) {
+            return 1;
+        }
+        options.particle_count = simulation->GetParticleCount();
+    }
+
+    GeneralSettings* settings = simulation->GetGeneralSettings();
+    for (size_t index = 0; index < options.settings.size(); index++) {
+        const NamedSetting* setting = FindNamedSetting(options.settings[index].first.c_str());
+        *(float*)((char*)settings + setting->offset) = options.settings[index].second;
+    }
+    settings->neighbour_search_mode = options.neighbour_search_mode;
+    settings->reorder_interval = options.reorder_interval;
+    if (options.hash_load_factor > 0.0f) {
+        settings->hash_table_size = Simulation::GetHashTableSize(options.particle_count, options.hash_load_factor);
+    }
+    else {
+        settings->hash_table_size = options.hash_table_size;
+    }
+    *simulation->GetMeasureHashTablePtr() = options.hash_stats;
+    *simulation->GetUseNeighbourListsPtr() = options.neighbour_list_capacity > 0;
+    *simulation->GetNeighbourListCapacityPtr() = std::max(options.neighbour_list_capacity, 1);
+    *simulation->GetCompactSpatialIndicesPtr() = options.compact_spatial_indices;
+    *simulation->GetAdaptiveTimeStepPtr() = options.max_substep_count > 0;
+    *simulation->GetMaxSubstepCountPtr() = std::max(options.max_substep_count, 1);
+    *simulation->GetCFLFactorPtr() = options.cfl_factor;
+    simulation->GetGPUSort()->SetMode(options.sort_mode);
+    simulation->GetGPUProfiler()->SetEnabled(options.profile);
+    *simulation->GetAutosaveIntervalPtr() = options.autosave_interval;
+    *simulation->GetTrajectoryErrorBoundPtr() = options.trajectory_error_bound;
+    simulation->SetBackend(options.backend);
+    if (options.trajectory_path != nullptr && !simulation->StartTrajectory(options.trajectory_path)) {
+        return 1;
+    }
+
+    if (options.autotune_step_count > 0) {
+        // The smallest substep of the adaptive time step, such that a single step per frame stays stable
+        float autotune_delta_time = options.delta_time / (float)std::max(options.max_substep_count, 1);
+        WorkgroupSizes sizes = simulation->AutotuneWorkgroupSizes(autotune_delta_time, options.autotune_step_count);
+        printf("Workgroup sizes for %zu particles:", options.particle_count);
+        for (size_t index = 0; index < (size_t)TunedKernel::Count; index++) {
+            printf(" %s %u", WorkgroupTuner::GetKernelName((TunedKernel)index), sizes.sizes[index]);
+        }
+        printf("\n");
+    }
+
+    printf("Running %zu particles for %zu steps\n", options.particle_count, options.step_count);
+    GPUProfiler* profiler = simulation->GetGPUProfiler();
+    size_t substep_count = 0;
+    double startup_seconds = 0.0;
+    FrameTimeSeries step_times;
+    if (options.trace_path != nullptr) {
+        Trace::SetThreadName("Main");
+        Trace::Start();
+    }
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (size_t index = 0; index < options.step_count; index++) {
+        auto step_start_time = std::chrono::high_resolution_clock::now();
+        profiler->BeginFrame();
+        simulation->DoFrame(Float2(0.0f, 0.0f), false, false, options.delta_time);
+        profiler->EndFrame();
+        step_times.Add(std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - step_start_time).count());
+        substep_count += simulation->GetAdaptiveTimeStepStats().substep_count;
+        if (index == 0) {
+            // The programs are waited for when they are first used, in the first step
+            glFinish();
+            startup_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - process_start_time).count();
+            ShaderCacheStatistics shader_cache = ShaderCache::GetStatistics();
+            printf(
+                "Started in %.1f ms, %zu programs from the shader cache, %zu compiled, %zu embedded shaders\n",
+                startup_seconds * 1000.0,
+                shader_cache.hit_count,
+                shader_cache.miss_count,
+                GetEmbeddedShaderCount()
+            );
+        }
+    }
+    // The dispatches are asynchronous, the time must include all of them
+    glFinish();
+    double elapsed_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+    if (simulation->IsWritingTrajectory() && !simulation->StopTrajectory()) {
+        return 1;
+    }
+    if (options.save_snapshot_path != nullptr) {
+        simulation->FlushSnapshots();
+        simulation->SaveSnapshot(options.save_snapshot_path);
+    }
+    simulation->FlushSnapshots();
+    if (options.trace_path != nullptr) {
+        // After the writes, such that the writer threads are in the trace
+        profiler->ResolvePendingFrames();
+        if (!Trace::Stop(options.trace_path)) {
+            printf("Failed to write the trace file %s\n", options.trace_path);
+            return 1;
+        }
+    }
+
+    size_t nan_count = 0;
+    Float2 mean_position;
+    if (!WriteState(options.state_path, *simulation, nan_count, mean_position)) {
+        printf("Failed to write the state file %s\n", options.state_path);
+        return 1;
+    }
+    NeighbourSearchStats hash_stats = simulation->GetHashTableStats();
+    if (options.hash_stats) {
+        printf(
+            "Hash table of %zu keys: %.1f%% of the used keys collide, %.1f%% of the walked entries are of other cells, longest key %zu\n",
+            hash_stats.key_count,
+            hash_stats.GetCollisionRate() * 100.0,
+            hash_stats.GetForeignEntryRate() * 100.0,
+            hash_stats.max_key_entries
+        );
+    }
+    GPUSortIncrementalStats sort_stats = simulation->GetGPUSort()->GetIncrementalStats();
+    if (options.sort_mode == GPUSortMode::Incremental && sort_stats.entry_count > 0) {
+        printf(
+            "Incremental sort: %zu of %zu entries changed their key, network of %zu entries%s\n",
+            sort_stats.changed_count,
+            sort_stats.entry_count,
+            sort_stats.capacity,
+            sort_stats.fell_back ? ", fell back to the full network" : ""
+        );
+    }
+    if (!WriteStats(options.stats_path, options, startup_seconds, elapsed_seconds, substep_count, nan_count, mean_position, step_times, profiler, hash_stats, sort_stats)) {
+        printf("Failed to write the stats file %s\n", options.stats_path);
+        return 1;
+    }
+
+    printf(
+        "%.3f s, %.1f steps/s, %.1f particle steps/s, %zu NaN positions\n",
+        elapsed_seconds,
+        (double)options.step_count / elapsed_seconds,
+        (double)options.step_count * (double)options.particle_count / elapsed_seconds,
+        nan_count
+    );
+    // A run that blew up is a failure for the regression runs
+    return nan_count > 0 ? 1 : 0;
+}
@@ -9,10 +9,14 @@
 
 #include "fluidSimulatorWindow.h"
 #include "GPU/Simulation.h"
+#include "GPU/SortBenchmark.h"
+#include "GPU/Trace.h"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
 #include <stdio.h>
+#include <float.h>
+#include <algorithm>
 #define GL_SILENCE_DEPRECATION
 #if defined(IMGUI_IMPL_OPENGL_ES2)
 #include <GLES2/gl2.h>
@@ -115,6 +119,7 @@ int main(int, char**)
     ImVec4 clear_color = ImVec4(0.2f, 0.2f, 0.2f, 1.00f);
     FluidSimulatorWindow fluid_simulator_window;
     ButtonStates button_states{ 500 };
+    Trace::SetThreadName("Main");
 
     // Main loop
 #ifdef __EMSCRIPTEN__
@@ -143,7 +148,14 @@ int main(int, char**)
 
         ImGui::Begin("Fluid Simulator Main Window", nullptr, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse
             | ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoBackground);
-        ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
+        FrameTimeStatistics frame_statistics = fluid_simulator_window.frame_time_stats.frame_times.GetStatistics();
+        ImGui::Text(
+            "Application average %.3f ms/frame (%.1f FPS), p99 %.3f ms, max %.3f ms",
+            1000.0f / io.Framerate,
+            io.Framerate,
+            frame_statistics.p99,
+            frame_statistics.max
+        );
         static bool hide_ui = false;
         auto update_key_entry = [&button_states, window](int key) {
             button_states.UpdateEntry(key, glfwGetKey(window, key) == GLFW_RELEASE);
@@ -194,6 +206,310 @@ int main(int, char**)
             if (ImGui::Button("Set Default")) {
                 fluid_simulator_window.simulation.SetInitialSettingsData();
             }
+            bool use_cpu_backend = fluid_simulator_window.simulation.GetBackend() == SimulationBackend::CPU;
+            if (ImGui::Checkbox("CPU backend", &use_cpu_backend)) {
+                fluid_simulator_window.simulation.SetBackend(use_cpu_backend ? SimulationBackend::CPU : SimulationBackend::GPU);
+                interacting_with_ui = true;
+            }
+            GPUSort* gpu_sort = fluid_simulator_window.simulation.GetGPUSort();
+            int sort_mode = (int)gpu_sort->GetMode();
+            if (ImGui::Combo("GPU sort", &sort_mode, "Bitonic\0Counting\0Incremental\0")) {
+                gpu_sort->SetMode((GPUSortMode)sort_mode);
+                interacting_with_ui = true;
+            }
+            interacting_with_ui |= ImGui::IsItemActive();
+            ImGui::SameLine();
+            if (ImGui::Button("Benchmark sorts")) {
+                const size_t entry_counts[] = { 16'384, 65'536, 262'144, 1'048'576, 4'194'304 };
+                PrintSortBenchmark(BenchmarkGPUSort(*gpu_sort, entry_counts, std::size(entry_counts), 20));
+                interacting_with_ui = true;
+            }
+            if (gpu_sort->GetMode() == GPUSortMode::Incremental) {
+                interacting_with_ui |= ImGui::SliderFloat("Incremental threshold", gpu_sort->GetIncrementalThresholdPtr(), 0.01f, 0.5f);
+                const GPUSortIncrementalStats& incremental_stats = gpu_sort->GetIncrementalStats();
+                if (incremental_stats.entry_count > 0) {
+                    ImGui::Text(
+                        "Changed keys %.2f%%, network of %zu entries%s",
+                        (double)incremental_stats.changed_count * 100.0 / (double)incremental_stats.entry_count,
+                        incremental_stats.capacity,
+                        incremental_stats.fell_back ? ", fell back" : ""
+                    );
+                }
+            }
+            int neighbour_search_mode = (int)general_settings->neighbour_search_mode;
+            if (ImGui::Combo("Neighbour search", &neighbour_search_mode, "Spatial hash\0Dense grid\0")) {
+                general_settings->neighbour_search_mode = (NeighbourSearchMode)neighbour_search_mode;
+                interacting_with_ui = true;
+            }
+            interacting_with_ui |= ImGui::IsItemActive();
+            interacting_with_ui |= ImGui::Checkbox("Compact spatial indices", fluid_simulator_window.simulation.GetCompactSpatialIndicesPtr());
+            if (general_settings->neighbour_search_mode == NeighbourSearchMode::SpatialHash) {
+                // The power of two exponent of the table size, 0 keeps a key for each particle
+                int hash_table_exponent = 0;
+                while (general_settings->hash_table_size > (1u << hash_table_exponent)) {
+                    hash_table_exponent++;
+                }
+                size_t hash_key_count = general_settings->hash_table_size != 0 ? general_settings->hash_table_size : fluid_simulator_window.simulation.GetParticleCount();
+                char hash_table_label[64];
+                snprintf(
+                    hash_table_label,
+                    sizeof(hash_table_label),
+                    "%zu keys, load factor %.2f",
+                    hash_key_count,
+                    (double)fluid_simulator_window.simulation.GetParticleCount() / (double)std::max(hash_key_count, (size_t)1)
+                );
+                int max_hash_table_exponent = 0;
+                while ((1 << max_hash_table_exponent) < MAX_HASH_TABLE_SIZE) {
+                    max_hash_table_exponent++;
+                }
+                if (ImGui::SliderInt("Hash table size", &hash_table_exponent, 0, max_hash_table_exponent, hash_table_label)) {
+                    general_settings->hash_table_size = hash_table_exponent > 0 ? 1u << hash_table_exponent : 0;
+                    interacting_with_ui = true;
+                }
+                interacting_with_ui |= ImGui::IsItemActive();
+                // The keys are counted only while the node is open
+                bool show_hash_table_stats = ImGui::TreeNode("Hash table stats");
+                *fluid_simulator_window.simulation.GetMeasureHashTablePtr() = show_hash_table_stats;
+                if (show_hash_table_stats) {
+                    NeighbourSearchStats stats = fluid_simulator_window.simulation.GetHashTableStats();
+                    ImGui::Text(
+                        "%zu of %zu keys used, %zu collide (%.1f%%), longest key %zu",
+                        stats.used_key_count,
+                        stats.key_count,
+                        stats.collided_key_count,
+                        stats.GetCollisionRate() * 100.0,
+                        stats.max_key_entries
+                    );
+                    ImGui::Text("%.1f%% of the walked entries are of other cells", stats.GetForeignEntryRate() * 100.0);
+                    float histogram[KEY_LENGTH_HISTOGRAM_SIZE];
+                    for (size_t index = 0; index < KEY_LENGTH_HISTOGRAM_SIZE; index++) {
+                        histogram[index] = (float)stats.key_length_histogram[index];
+                    }
+                    // The first bar is the empty keys, each next one doubles the entries of a key
+                    ImGui::PlotHistogram("##key lengths", histogram, KEY_LENGTH_HISTOGRAM_SIZE, 0, "Entries for each key, 0, 1, 2-3, 4-7...", 0.0f, FLT_MAX, ImVec2(0.0f, 60.0f));
+                    ImGui::TreePop();
+                }
+            }
+            const unsigned int reorder_interval_min = 0;
+            const unsigned int reorder_interval_max = 100;
+            interacting_with_ui |= ImGui::SliderScalar("Reorder interval", ImGuiDataType_U32, &general_settings->reorder_interval, &reorder_interval_min, &reorder_interval_max);
+            interacting_with_ui |= ImGui::IsItemActive();
+            interacting_with_ui |= ImGui::Checkbox("Neighbour lists", fluid_simulator_window.simulation.GetUseNeighbourListsPtr());
+            if (*fluid_simulator_window.simulation.GetUseNeighbourListsPtr()) {
+                ImGui::SameLine();
+                interacting_with_ui |= ImGui::Checkbox("Store distances", fluid_simulator_window.simulation.GetStoreNeighbourDistancesPtr());
+                interacting_with_ui |= ImGui::SliderInt("List capacity", fluid_simulator_window.simulation.GetNeighbourListCapacityPtr(), 8, 256);
+                interacting_with_ui |= ImGui::IsItemActive();
+                if (ImGui::TreeNode("List occupancy")) {
+                    NeighbourListStats stats = fluid_simulator_window.simulation.GetNeighbourListStats();
+                    float average = stats.particle_count > 0 ? (float)stats.total_neighbours / (float)stats.particle_count : 0.0f;
+                    ImGui::Text("Average %.1f, max %u, overflows %u", average, stats.max_neighbours, stats.overflow_count);
+                    ImGui::TreePop();
+                }
+            }
+            interacting_with_ui |= ImGui::Checkbox("Adaptive time step", fluid_simulator_window.simulation.GetAdaptiveTimeStepPtr());
+            if (*fluid_simulator_window.simulation.GetAdaptiveTimeStepPtr()) {
+                interacting_with_ui |= ImGui::SliderFloat("CFL factor", fluid_simulator_window.simulation.GetCFLFactorPtr(), 0.05f, 1.0f);
+                interacting_with_ui |= ImGui::IsItemActive();
+                interacting_with_ui |= ImGui::SliderInt("Max substeps", fluid_simulator_window.simulation.GetMaxSubstepCountPtr(), 1, 16);
+                interacting_with_ui |= ImGui::IsItemActive();
+                AdaptiveTimeStepStats time_step_stats = fluid_simulator_window.simulation.GetAdaptiveTimeStepStats();
+                ImGui::Text(
+                    "Substeps %zu of %.2f ms, max speed %.1f, max acceleration %.1f",
+                    time_step_stats.substep_count,
+                    time_step_stats.substep_delta_time * 1000.0f,
+                    time_step_stats.max_speed,
+                    time_step_stats.max_acceleration
+                );
+            }
+            if (ImGui::TreeNode("Snapshots")) {
+                if (ImGui::Button("Save snapshot")) {
+                    if (!fluid_simulator_window.simulation.SaveSnapshot("simulation.snap")) {
+                        printf("The previous snapshot is still being written\n");
+                    }
+                    interacting_with_ui = true;
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Load snapshot")) {
+                    // The pending snapshot can be the one that is loaded
+                    fluid_simulator_window.simulation.FlushSnapshots();
+    if (Trace::IsRecording()) {
+        fluid_simulator_window.simulation.GetGPUProfiler()->ResolvePendingFrames();
+        if (!Trace::Stop(TRACE_DEFAULT_FILE)) {
+            printf("Failed to write the trace file\n");
+        }
+    }
+    fluid_simulator_window.simulation.StopTrajectory();
+                    fluid_simulator_window.simulation.LoadSnapshot("simulation.snap");
+                    interacting_with_ui = true;
+                }
+                ImGui::SameLine();
+                ImGui::Text(fluid_simulator_window.simulation.IsSnapshotPending() ? "Writing..." : "");
+                interacting_with_ui |= ImGui::SliderFloat("Autosave interval (s)", fluid_simulator_window.simulation.GetAutosaveIntervalPtr(), 0.0f, 600.0f);
+                interacting_with_ui |= ImGui::IsItemActive();
+                ImGui::TreePop();
+            }
+            if (ImGui::TreeNode("Trajectory")) {
+                bool write_trajectory = fluid_simulator_window.simulation.IsWritingTrajectory();
+                if (ImGui::Checkbox("Write trajectory", &write_trajectory)) {
+                    if (write_trajectory) {
+                        fluid_simulator_window.simulation.StartTrajectory("simulation.traj");
+                    }
+                    else {
+                        fluid_simulator_window.simulation.StopTrajectory();
+                    }
+                    interacting_with_ui = true;
+                }
+                if (write_trajectory) {
+                    ImGui::SameLine();
+                    ImGui::Text("%zu frames", fluid_simulator_window.simulation.GetTrajectoryFrameCount());
+                }
+                else {
+                    // The error bound is fixed for the whole file
+                    interacting_with_ui |= ImGui::SliderFloat("Error bound", fluid_simulator_window.simulation.GetTrajectoryErrorBoundPtr(), 0.00001f, 0.01f, "%.5f", ImGuiSliderFlags_Logarithmic);
+                    interacting_with_ui |= ImGui::IsItemActive();
+                }
+                ImGui::TreePop();
+            }
+            if (ImGui::TreeNode("Frame times")) {
+                FrameTimeStats& frame_time_stats = fluid_simulator_window.frame_time_stats;
+                const FrameTimeSeries* series[] = { &frame_time_stats.frame_times, &frame_time_stats.step_times };
+                const char* series_names[] = { "Frame", "Simulation step" };
+                if (ImGui::BeginTable("Frame times", 6)) {
+                    ImGui::TableSetupColumn("CPU (ms)");
+                    ImGui::TableSetupColumn("Average");
+                    ImGui::TableSetupColumn("p50");
+                    ImGui::TableSetupColumn("p95");
+                    ImGui::TableSetupColumn("p99");
+                    ImGui::TableSetupColumn("Max");
+                    ImGui::TableHeadersRow();
+                    for (size_t index = 0; index < std::size(series); index++) {
+                        FrameTimeStatistics statistics = series[index]->GetStatistics();
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%s", series_names[index]);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics.average);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics.p50);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics.p95);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics.p99);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics.max);
+                    }
+                    ImGui::EndTable();
+                }
+                for (size_t index = 0; index < std::size(series); index++) {
+                    FrameTimeStatistics statistics = series[index]->GetStatistics();
+                    if (statistics.sample_count == 0) {
+                        continue;
+                    }
+                    // The spikes stand out over the p99 line of the overlay text
+                    std::vector<float> history = series[index]->GetHistory();
+                    char overlay[64];
+                    snprintf(overlay, sizeof(overlay), "%s, p99 %.3f ms", series_names[index], statistics.p99);
+                    ImGui::PushID((int)index);
+                    ImGui::PlotLines("##history", history.data(), history.size(), 0, overlay, 0.0f, statistics.max, ImVec2(0.0f, 60.0f));
+                    const size_t bucket_count = 40;
+                    float bucket_width = std::max(statistics.max / (float)(bucket_count - 1), 0.001f);
+                    std::vector<float> histogram = series[index]->GetHistogram(bucket_width, bucket_count);
+                    snprintf(overlay, sizeof(overlay), "0 to %.3f ms", statistics.max);
+                    ImGui::PlotHistogram("##histogram", histogram.data(), histogram.size(), 0, overlay, 0.0f, FLT_MAX, ImVec2(0.0f, 60.0f));
+                    ImGui::PopID();
+                }
+                ImGui::TreePop();
+            }
+            GPUProfiler* gpu_profiler = fluid_simulator_window.simulation.GetGPUProfiler();
+            if (ImGui::TreeNode("GPU profiler")) {
+                bool profiler_enabled = gpu_profiler->IsEnabled();
+                if (ImGui::Checkbox("Enabled", &profiler_enabled)) {
+                    gpu_profiler->SetEnabled(profiler_enabled);
+                    interacting_with_ui = true;
+                }
+                ImGui::SameLine();
+                bool write_csv = gpu_profiler->IsWritingCSV();
+                if (ImGui::Checkbox("Write CSV", &write_csv)) {
+                    if (write_csv) {
+                        if (!gpu_profiler->OpenCSV("gpu_profile.csv")) {
+                            printf("Failed to open the GPU profile file\n");
+                        }
+                    }
+                    else {
+                        gpu_profiler->CloseCSV();
+                    }
+                    interacting_with_ui = true;
+                }
+                ImGui::SameLine();
+                bool record_trace = Trace::IsRecording();
+                if (ImGui::Checkbox("Record trace", &record_trace)) {
+                    if (record_trace) {
+                        Trace::Start();
+                    }
+                    else {
+                        // The GPU scopes of the frames in flight are added to the trace
+                        gpu_profiler->ResolvePendingFrames();
+                        if (!Trace::Stop(TRACE_DEFAULT_FILE)) {
+                            printf("Failed to write the trace file\n");
+                        }
+                    }
+                    interacting_with_ui = true;
+                }
+
+                std::vector<GPUProfilerScopeStatistics> statistics = gpu_profiler->GetStatistics();
+                if (statistics.size() > 0 && ImGui::BeginTable("GPU profiler scopes", 5)) {
+                    ImGui::TableSetupColumn("Pass (ms)");
+                    ImGui::TableSetupColumn("Average");
+                    ImGui::TableSetupColumn("p50");
+                    ImGui::TableSetupColumn("p95");
+                    ImGui::TableSetupColumn("p99");
+                    ImGui::TableHeadersRow();
+                    for (size_t index = 0; index < statistics.size(); index++) {
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%*s%s", (int)statistics[index].depth * 2, "", statistics[index].name);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics[index].average);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics[index].p50);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics[index].p95);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.3f", statistics[index].p99);
+                    }
+                    ImGui::EndTable();
+                }
+                ImGui::Text("Dropped frames %zu", gpu_profiler->GetDroppedFrameCount());
+                // The barriers are issued only between the dependent commands, this is used to compare with
+                // A barrier before every command, or to tell if a wrong result comes from a missing barrier
+                interacting_with_ui |= ImGui::Checkbox("Full memory barriers", GPUBarriers::GetFullBarriersPtr());
+                ImGui::SameLine();
+                GPUBarrierStatistics barrier_statistics = fluid_simulator_window.barrier_statistics;
+                ImGui::Text("%zu barriers for %zu commands", barrier_statistics.barrier_count, barrier_statistics.command_count);
+                GPUUploadStatistics upload_statistics = fluid_simulator_window.upload_statistics;
+                ImGui::Text(
+                    "%zu uploads, %.1f KB, %zu waits (%s)",
+                    upload_statistics.upload_count,
+                    upload_statistics.byte_count / 1024.0f,
+                    upload_statistics.wait_count,
+                    GPUUploadRing::IsPersistent() ? "persistent" : "unsynchronized maps"
+                );
+                if (ImGui::Button("Autotune workgroup sizes")) {
+                    // A single step per frame, with the substep of the last frame
+                    float autotune_delta_time = fluid_simulator_window.simulation.GetAdaptiveTimeStepStats().substep_delta_time;
+                    fluid_simulator_window.simulation.AutotuneWorkgroupSizes(autotune_delta_time > 0.0f ? autotune_delta_time : 0.007f, 16);
+                    interacting_with_ui = true;
+                }
+                const WorkgroupSizes& workgroup_sizes = fluid_simulator_window.simulation.GetWorkgroupSizes();
+                for (size_t index = 0; index < (size_t)TunedKernel::Count; index++) {
+                    ImGui::Text("%s %u", WorkgroupTuner::GetKernelName((TunedKernel)index), workgroup_sizes.sizes[index]);
+                    if (index % 4 != 3 && index + 1 < (size_t)TunedKernel::Count) {
+                        ImGui::SameLine();
+                    }
+                }
+                ImGui::TreePop();
+            }
             interacting_with_ui |= ImGui::Checkbox("Mouse pull", fluid_simulator_window.simulation.GetUseMousePullPtr());
             interacting_with_ui |= ImGui::IsItemActive();;
             interacting_with_ui |= ImGui::SliderFloat("Interaction Input Radius", &general_settings->interaction_input_radius, 0.0f, 1000.0f);
@@ -340,16 +656,27 @@ int main(int, char**)
         fluid_simulator_window.Draw(is_left_mouse_pressed, is_right_mouse_pressed, io);
 
         // Rendering
-        ImGui::Render();       
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        {
+            TraceScope trace_scope("ImGui render");
+            ImGui::Render();       
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
 
-        glfwSwapBuffers(window);
+        {
+            // The driver can block here when the GPU is behind
+            TraceScope trace_scope("SwapBuffers");
+            glfwSwapBuffers(window);
+        }
     }
 #ifdef __EMSCRIPTEN__
     EMSCRIPTEN_MAINLOOP_END;
 #endif
 
     // Cleanup
+    fluid_simulator_window.simulation.FlushSnapshots();
+    if (!fluid_simulator_window.frame_time_stats.WriteJSON(FRAME_TIMES_FILE)) {
+        printf("Failed to write the frame times file\n");
+    }
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
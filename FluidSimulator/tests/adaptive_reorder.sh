@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs the same adaptive steps without reordering and with a reorder on every step. The velocities of
+# The start of a substep must move with their particles, otherwise the measured accelerations are
+# Wrong and the CFL substeps grow. Both runs must take the same number of substeps.
+# Usage: adaptive_reorder.sh path/to/headless [work directory]
+HEADLESS=${1:?"Usage: adaptive_reorder.sh path/to/headless [work directory]"}
+WORK=${2:-adaptive_reorder_test}
+mkdir -p "$WORK" || exit 1
+
+COMMON="--steps 25 --adaptive 4 --shader-cache off"
+"$HEADLESS" $COMMON --stats "$WORK/straight.json" --state "$WORK/straight.csv" > /dev/null || exit 1
+"$HEADLESS" $COMMON --reorder-interval 1 --stats "$WORK/reordered.json" --state "$WORK/reordered.csv" > /dev/null || exit 1
+
+STRAIGHT=$(sed -n 's/.*"substeps": \([0-9]*\).*/\1/p' "$WORK/straight.json")
+REORDERED=$(sed -n 's/.*"substeps": \([0-9]*\).*/\1/p' "$WORK/reordered.json")
+if [ -n "$STRAIGHT" ] && [ "$STRAIGHT" = "$REORDERED" ]; then
+    echo "adaptive_reorder: passed, $STRAIGHT substeps"
+    exit 0
+fi
+echo "adaptive_reorder: $STRAIGHT substeps without reordering, $REORDERED with it"
+exit 1
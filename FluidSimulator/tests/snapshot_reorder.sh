@@ -0,0 +1,20 @@
+#!/bin/sh
+# Runs the same steps straight through, and with a snapshot that is saved and loaded in the middle
+# Of a reorder interval. The resumed run must end with exactly the same particles.
+# Usage: snapshot_reorder.sh path/to/headless [work directory]
+HEADLESS=${1:?"Usage: snapshot_reorder.sh path/to/headless [work directory]"}
+WORK=${2:-snapshot_reorder_test}
+mkdir -p "$WORK" || exit 1
+
+# 4 steps leave the counter at 1 with an interval of 3, the resumed run reorders after 2 more steps
+COMMON="--particles 5000 --reorder-interval 3 --shader-cache off"
+"$HEADLESS" $COMMON --steps 10 --state "$WORK/straight.csv" --stats "$WORK/straight.json" > /dev/null || exit 1
+"$HEADLESS" $COMMON --steps 4 --save-snapshot "$WORK/middle.snap" --state "$WORK/middle.csv" --stats "$WORK/middle.json" > /dev/null || exit 1
+"$HEADLESS" $COMMON --load-snapshot "$WORK/middle.snap" --steps 6 --state "$WORK/resumed.csv" --stats "$WORK/resumed.json" > /dev/null || exit 1
+
+if cmp -s "$WORK/straight.csv" "$WORK/resumed.csv"; then
+    echo "snapshot_reorder: passed"
+    exit 0
+fi
+echo "snapshot_reorder: the resumed run differs from the straight one"
+exit 1